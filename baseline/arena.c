@@ -0,0 +1,317 @@
+#include "arena.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Smallest size class: one block of vectors, rounded up to a power of 2. */
+#define ARENA_MIN_CLASS \
+        ((BLOCK_SIZE <= 1) ? 0 : 64 - __builtin_clzll(BLOCK_SIZE - 1ULL))
+#define ARENA_N_CLASSES 48
+/* Scratch memory comes in chunks of at least this many bytes. */
+#define ARENA_SCRATCH_CHUNK (64UL << 10)
+#define ARENA_PAGE 4096
+
+/* Free objects are linked through their first bytes. */
+struct arena_free {
+        struct arena_free *next;
+};
+
+struct scratch_chunk {
+        struct scratch_chunk *next;
+        size_t size;
+        size_t used;
+        __m256i data[] __attribute__((aligned(64)));
+};
+
+struct filter_arena {
+        struct arena_free *states;
+        struct arena_free *vecs[ARENA_N_CLASSES];
+        /*
+         * Every filter_state and bitmap we allocated, in use or not,
+         * to free them on destroy.
+         */
+        struct owned {
+                void *ptr;
+                size_t bytes;
+        } *owned;
+        size_t n_owned;
+        size_t cap_owned;
+        /* Most recent first. */
+        struct scratch_chunk *scratch;
+        struct filter_arena_stats stats;
+};
+
+struct filter_arena *
+filter_arena_create(void)
+{
+        struct filter_arena *ret;
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        return ret;
+}
+
+static void
+free_scratch(struct scratch_chunk *chunk)
+{
+
+        while (chunk != NULL) {
+                struct scratch_chunk *next = chunk->next;
+
+                free(chunk);
+                chunk = next;
+        }
+
+        return;
+}
+
+void
+filter_arena_destroy(struct filter_arena *arena)
+{
+
+        if (arena == NULL)
+                return;
+
+        for (size_t i = 0; i < arena->n_owned; i++) {
+                if (arena->owned[i].bytes >= FILTER_ARENA_HUGE)
+                        munmap(arena->owned[i].ptr, arena->owned[i].bytes);
+                else
+                        free(arena->owned[i].ptr);
+        }
+
+        free(arena->owned);
+        free_scratch(arena->scratch);
+        free(arena);
+        return;
+}
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static __thread struct filter_arena *thread_arena;
+
+static void
+destroy_thread_arena(void *arena)
+{
+
+        /* Other keys' destructors may still ask for a fresh one. */
+        thread_arena = NULL;
+        filter_arena_destroy(arena);
+        return;
+}
+
+static void
+init_thread_key(void)
+{
+        int r;
+
+        r = pthread_key_create(&thread_key, destroy_thread_arena);
+        assert(r == 0);
+        return;
+}
+
+struct filter_arena *
+filter_arena_thread(void)
+{
+
+        if (thread_arena == NULL) {
+                pthread_once(&thread_key_once, init_thread_key);
+                thread_arena = filter_arena_create();
+                pthread_setspecific(thread_key, thread_arena);
+        }
+
+        return thread_arena;
+}
+
+/**
+ * Remembers `ptr` to free it on destroy.
+ */
+static void
+own(struct filter_arena *arena, void *ptr, size_t bytes)
+{
+
+        if (arena->n_owned == arena->cap_owned) {
+                arena->cap_owned = 2 * arena->cap_owned + 16;
+                arena->owned = realloc(arena->owned,
+                    arena->cap_owned * sizeof(arena->owned[0]));
+                assert(arena->owned != NULL);
+        }
+
+        arena->owned[arena->n_owned++] = (struct owned) {
+                .ptr = ptr,
+                .bytes = bytes,
+        };
+        return;
+}
+
+struct filter_state *
+filter_arena_state(struct filter_arena *arena)
+{
+        struct filter_state *ret = (void *)arena->states;
+
+        if (ret != NULL) {
+                arena->states = arena->states->next;
+        } else {
+                int r;
+
+                r = posix_memalign((void **)&ret, 64, sizeof(*ret));
+                assert(r == 0);
+                own(arena, ret, sizeof(*ret));
+        }
+
+        /* Everything up to the scratch area, and what follows it. */
+        memset(ret, 0, offsetof(struct filter_state, scratch));
+        ret->popcount = 0;
+        ret->sink = NULL;
+        return ret;
+}
+
+void
+filter_arena_state_release(struct filter_arena *arena, struct filter_state *state)
+{
+        struct arena_free *node = (void *)state;
+
+        if (state == NULL)
+                return;
+
+        node->next = arena->states;
+        arena->states = node;
+        return;
+}
+
+static size_t
+size_class(size_t count)
+{
+        size_t ret = ARENA_MIN_CLASS;
+
+        while ((1UL << ret) < count)
+                ret++;
+
+        assert(ret < ARENA_N_CLASSES);
+        return ret;
+}
+
+/**
+ * Maps `bytes` aligned to FILTER_ARENA_HUGE, asks for huge pages, and
+ * faults everything in now rather than on the first query.
+ */
+static void *
+map_huge(size_t bytes)
+{
+        uint8_t *base, *ret;
+        size_t slack;
+
+        base = mmap(NULL, bytes + FILTER_ARENA_HUGE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(base != MAP_FAILED);
+
+        ret = (uint8_t *)(((uintptr_t)base + FILTER_ARENA_HUGE - 1) &
+            -FILTER_ARENA_HUGE);
+        slack = ret - base;
+        if (slack > 0)
+                munmap(base, slack);
+        munmap(ret + bytes, FILTER_ARENA_HUGE - slack);
+
+#ifdef MADV_HUGEPAGE
+        (void)madvise(ret, bytes, MADV_HUGEPAGE);
+#endif
+        for (size_t i = 0; i < bytes; i += ARENA_PAGE)
+                ((volatile uint8_t *)ret)[i] = 0;
+
+        return ret;
+}
+
+__m256i *
+filter_arena_vecs(struct filter_arena *arena, size_t count)
+{
+        size_t class = size_class(count);
+        size_t bytes = sizeof(__m256i) << class;
+        void *ret;
+
+        if (arena->vecs[class] != NULL) {
+                ret = arena->vecs[class];
+                arena->vecs[class] = arena->vecs[class]->next;
+                arena->stats.recycled++;
+                return ret;
+        }
+
+        if (bytes >= FILTER_ARENA_HUGE) {
+                ret = map_huge(bytes);
+        } else {
+                int r;
+
+                r = posix_memalign(&ret, 64, bytes);
+                assert(r == 0);
+        }
+
+        own(arena, ret, bytes);
+        arena->stats.fresh++;
+        return ret;
+}
+
+void
+filter_arena_vecs_release(struct filter_arena *arena, __m256i *vecs, size_t count)
+{
+        struct arena_free *node = (void *)vecs;
+        size_t class = size_class(count);
+
+        if (vecs == NULL)
+                return;
+
+        node->next = arena->vecs[class];
+        arena->vecs[class] = node;
+        return;
+}
+
+__m256i *
+filter_arena_scratch(struct filter_arena *arena, size_t n)
+{
+        struct scratch_chunk *chunk = arena->scratch;
+        __m256i *ret;
+
+        /* Keep every allocation 64-byte aligned. */
+        n += n % 2;
+        if (chunk == NULL || chunk->size - chunk->used < n) {
+                size_t size = ARENA_SCRATCH_CHUNK / sizeof(__m256i);
+                int r;
+
+                if (size < n)
+                        size = n;
+
+                r = posix_memalign((void **)&chunk, 64,
+                    sizeof(*chunk) + size * sizeof(__m256i));
+                assert(r == 0);
+                chunk->next = arena->scratch;
+                chunk->size = size;
+                chunk->used = 0;
+                arena->scratch = chunk;
+        }
+
+        ret = chunk->data + chunk->used;
+        chunk->used += n;
+        return ret;
+}
+
+void
+filter_arena_reset(struct filter_arena *arena)
+{
+
+        if (arena->scratch == NULL)
+                return;
+
+        /* Keep the most recent chunk, likely the largest. */
+        free_scratch(arena->scratch->next);
+        arena->scratch->next = NULL;
+        arena->scratch->used = 0;
+        return;
+}
+
+struct filter_arena_stats
+filter_arena_stats(const struct filter_arena *arena)
+{
+
+        return arena->stats;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "interface.h"
+
+/**
+ * Per-thread allocation for queries: filter_states, bitmaps and
+ * scratch memory are recycled instead of going back to malloc, so a
+ * steady stream of small queries doesn't pay for allocator calls or
+ * for faulting fresh pages in.
+ *
+ * An arena is not thread-safe; use filter_arena_thread() to get the
+ * calling thread's own.
+ */
+struct filter_arena;
+
+/* Bitmaps of at least this many bytes are huge-page backed. */
+#define FILTER_ARENA_HUGE (2UL << 20)
+
+struct filter_arena_stats {
+        /* Bitmaps allocated from the system, or taken from a free list. */
+        size_t fresh;
+        size_t recycled;
+};
+
+struct filter_arena *filter_arena_create(void);
+
+/**
+ * Frees everything the arena holds, including filter_states, bitmaps
+ * and scratch memory still in use: any pointer it handed out is
+ * invalid afterwards.
+ */
+void filter_arena_destroy(struct filter_arena *);
+
+/**
+ * The calling thread's arena, created on first use and destroyed
+ * when the thread exits.
+ */
+struct filter_arena *filter_arena_thread(void);
+
+/**
+ * A filter_state with a zero count and NULL ptrs.
+ */
+struct filter_state *filter_arena_state(struct filter_arena *);
+
+void filter_arena_state_release(struct filter_arena *, struct filter_state *);
+
+/**
+ * An uninitialised, 64-byte aligned bitmap of `count` vectors.
+ * Sizes are rounded up to a power of two, and released bitmaps are
+ * reused for later requests in the same size class.  Large bitmaps
+ * are 2 MiB aligned, advised for transparent huge pages, and
+ * pre-faulted when first mapped.
+ */
+__m256i *filter_arena_vecs(struct filter_arena *, size_t count);
+
+/**
+ * Returns a bitmap from filter_arena_vecs, with the same `count`.
+ */
+void filter_arena_vecs_release(struct filter_arena *, __m256i *, size_t count);
+
+/**
+ * `n` vectors of 64-byte aligned scratch memory, valid until the
+ * next filter_arena_reset.
+ */
+__m256i *filter_arena_scratch(struct filter_arena *, size_t n);
+
+/**
+ * Frees all scratch memory at once, e.g., at the end of a query.
+ */
+void filter_arena_reset(struct filter_arena *);
+
+struct filter_arena_stats filter_arena_stats(const struct filter_arena *);
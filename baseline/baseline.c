@@ -1,4 +1,7 @@
 #include "interface.h"
+#include "policy.h"
+#include "popcount.h"
+#include "sink.h"
 
 void
 baseline(struct filter_state *restrict state)
@@ -22,3 +25,103 @@ baseline(struct filter_state *restrict state)
 
         return;
 }
+
+void
+baseline_count(struct filter_state *restrict state)
+{
+        size_t count = state->count;
+        const __m256i *restrict x0 = state->x0;
+        const __m256i *restrict x1 = state->x1;
+        const __m256i *restrict neg_x = state->neg_x;
+        const __m256i *restrict y0 = state->y0;
+        const __m256i *restrict neg_y = state->neg_y;
+        struct popcount_acc acc = popcount_acc_init();
+
+        if ((count % BLOCK_SIZE) != 0)
+                __builtin_unreachable();
+
+        for (size_t i = 0; i < count; i += BLOCK_SIZE) {
+                __m256i block[BLOCK_SIZE];
+
+                for (size_t j = 0; j < BLOCK_SIZE; j++) {
+                        __m256i mask_x = neg_x[i + j] ^ (x0[i + j] | x1[i + j]);
+                        __m256i mask_y = neg_y[i + j] ^ y0[i + j];
+                        block[j] = mask_x & mask_y;
+                }
+
+                popcount_add_block(&acc, block);
+        }
+
+        state->popcount = popcount_acc_sum(&acc);
+        return;
+}
+
+void
+baseline_emit(struct filter_state *restrict state)
+{
+        size_t count = state->count;
+        const __m256i *restrict x0 = state->x0;
+        const __m256i *restrict x1 = state->x1;
+        const __m256i *restrict neg_x = state->neg_x;
+        const __m256i *restrict y0 = state->y0;
+        const __m256i *restrict neg_y = state->neg_y;
+
+        if ((count % BLOCK_SIZE) != 0)
+                __builtin_unreachable();
+
+        for (size_t i = 0; i < count; i += BLOCK_SIZE) {
+                __m256i block[BLOCK_SIZE];
+
+                for (size_t j = 0; j < BLOCK_SIZE; j++) {
+                        __m256i mask_x = neg_x[i + j] ^ (x0[i + j] | x1[i + j]);
+                        __m256i mask_y = neg_y[i + j] ^ y0[i + j];
+                        block[j] = mask_x & mask_y;
+                }
+
+                filter_sink_push(state->sink, block, BLOCK_SIZE, i);
+        }
+
+        filter_sink_flush(state->sink);
+        return;
+}
+
+void
+baseline_nt(struct filter_state *restrict state)
+{
+        size_t count = state->count;
+        size_t distance = filter_prefetch_distance(5);
+        __m256i *restrict dst = state->dst;
+        const __m256i *restrict x0 = state->x0;
+        const __m256i *restrict x1 = state->x1;
+        const __m256i *restrict neg_x = state->neg_x;
+        const __m256i *restrict y0 = state->y0;
+        const __m256i *restrict neg_y = state->neg_y;
+
+        if ((count % BLOCK_SIZE) != 0)
+                __builtin_unreachable();
+
+        for (size_t i = 0; i < count; i += BLOCK_SIZE) {
+                size_t ahead = i + distance;
+
+                /*
+                 * One prefetch per line, and none past the end: even
+                 * forming those addresses is undefined.
+                 */
+                for (size_t j = 0; j < BLOCK_SIZE && ahead + j < count; j += 2) {
+                        _mm_prefetch((const char *)&x0[ahead + j], _MM_HINT_T0);
+                        _mm_prefetch((const char *)&x1[ahead + j], _MM_HINT_T0);
+                        _mm_prefetch((const char *)&neg_x[ahead + j], _MM_HINT_T0);
+                        _mm_prefetch((const char *)&y0[ahead + j], _MM_HINT_T0);
+                        _mm_prefetch((const char *)&neg_y[ahead + j], _MM_HINT_T0);
+                }
+
+                for (size_t j = i; j < i + BLOCK_SIZE; j++) {
+                        __m256i mask_x = neg_x[j] ^ (x0[j] | x1[j]);
+                        __m256i mask_y = neg_y[j] ^ y0[j];
+                        _mm256_stream_si256(&dst[j], mask_x & mask_y);
+                }
+        }
+
+        _mm_sfence();
+        return;
+}
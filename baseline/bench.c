@@ -0,0 +1,595 @@
+#include "bench.h"
+
+#include <assert.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DEFAULT_REPS 1000
+/* Adds per iteration of the clock loop, each 1 cycle of latency. */
+#define CHAIN_ADDS 100
+#define CHAIN_ITERS 100000
+/* Warn when the core clock is this far from the TSC, or drifts. */
+#define CLOCK_TOLERANCE 0.05
+
+const char *const bench_cache_names[BENCH_N_CACHES] = {
+        [BENCH_COLD] = "cold",
+        [BENCH_WARM] = "warm",
+};
+
+const char *const bench_counter_names[BENCH_N_COUNTERS] = {
+        [BENCH_CYCLES] = "cycles",
+        [BENCH_INSTRUCTIONS] = "instructions",
+        [BENCH_BRANCH_MISSES] = "branch_misses",
+        [BENCH_L1D_MISSES] = "l1d_misses",
+        [BENCH_LLC_MISSES] = "llc_misses",
+        [BENCH_DTLB_MISSES] = "dtlb_misses",
+};
+
+#define HW_CACHE_MISS(cache)                                            \
+        ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                 \
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+        uint32_t type;
+        uint64_t config;
+} counter_events[BENCH_N_COUNTERS] = {
+        [BENCH_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        [BENCH_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        [BENCH_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        [BENCH_L1D_MISSES] = {
+                PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D),
+        },
+        [BENCH_LLC_MISSES] = {
+                PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_LL),
+        },
+        [BENCH_DTLB_MISSES] = {
+                PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB),
+        },
+};
+
+#undef HW_CACHE_MISS
+
+struct bench {
+        struct bench_options options;
+        struct bench_clock clock;
+        /* Counter group: the leader is the first one we opened. */
+        int fds[BENCH_N_COUNTERS];
+        /* Position of each counter in the group's reads, or -1. */
+        int slot[BENCH_N_COUNTERS];
+        size_t n_counters;
+        /* Ticks for `noop` in each scenario. */
+        double offset[BENCH_N_CACHES];
+        size_t n_results;
+        double *observations;
+};
+
+static inline uint64_t
+ticks_begin(void)
+{
+        uint32_t hi, lo;
+
+        asm volatile("cpuid\n\t"
+                     "rdtsc"
+                     : "=d" (hi), "=a" (lo)
+                     :: "%rbx", "%rcx");
+        return ((uint64_t)hi << 32) + lo;
+}
+
+static inline uint64_t
+ticks_end(void)
+{
+        uint32_t hi, lo;
+
+        asm volatile("rdtscp\n\t"
+                     "mov %%edx, %0\n\t"
+                     "mov %%eax, %1\n\t"
+                     "cpuid"
+                     : "=r" (hi), "=r" (lo)
+                     :: "%rax", "%rbx", "%rcx", "%rdx");
+        return ((uint64_t)hi << 32) + lo;
+}
+
+static double
+now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return 1e9 * ts.tv_sec + ts.tv_nsec;
+}
+
+/* sqrt without libm. */
+static double
+sqrt_double(double x)
+{
+
+        return _mm_cvtsd_f64(_mm_sqrt_sd(_mm_setzero_pd(), _mm_set_sd(x)));
+}
+
+static int
+cmp_double(const void *vx, const void *vy)
+{
+        const double *x = vx;
+        const double *y = vy;
+
+        if (*x == *y)
+                return 0;
+
+        return (*x < *y) ? -1 : 1;
+}
+
+static bool
+parse_format(const char *value, enum bench_format *format)
+{
+
+        if (strcmp(value, "table") == 0)
+                *format = BENCH_TABLE;
+        else if (strcmp(value, "csv") == 0)
+                *format = BENCH_CSV;
+        else if (strcmp(value, "json") == 0)
+                *format = BENCH_JSON;
+        else
+                return false;
+
+        return true;
+}
+
+struct bench_options
+bench_options_from_env(void)
+{
+        struct bench_options ret = {
+                .format = BENCH_TABLE,
+                .caches = 1U << BENCH_COLD,
+                .reps = BENCH_DEFAULT_REPS,
+                .out = stdout,
+        };
+        const char *value;
+
+        value = getenv("BENCH_FORMAT");
+        if (value != NULL && !parse_format(value, &ret.format))
+                fprintf(stderr, "BENCH_FORMAT=%s: expected table, csv or json\n", value);
+
+        value = getenv("BENCH_CACHE");
+        if (value != NULL) {
+                if (strcmp(value, "cold") == 0)
+                        ret.caches = 1U << BENCH_COLD;
+                else if (strcmp(value, "warm") == 0)
+                        ret.caches = 1U << BENCH_WARM;
+                else if (strcmp(value, "both") == 0)
+                        ret.caches = (1U << BENCH_COLD) | (1U << BENCH_WARM);
+                else
+                        fprintf(stderr, "BENCH_CACHE=%s: expected cold, warm or both\n", value);
+        }
+
+        value = getenv("BENCH_REPS");
+        if (value != NULL && atol(value) > 0)
+                ret.reps = atol(value);
+
+        return ret;
+}
+
+static int
+open_counter(enum bench_counter counter, int group)
+{
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_events[counter].type;
+        attr.config = counter_events[counter].config;
+        attr.disabled = (group == -1);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+            PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void
+open_counters(struct bench *bench)
+{
+        int leader = -1;
+
+        for (size_t i = 0; i < BENCH_N_COUNTERS; i++) {
+                bench->fds[i] = open_counter(i, leader);
+                bench->slot[i] = -1;
+                if (bench->fds[i] < 0)
+                        continue;
+
+                if (leader == -1)
+                        leader = bench->fds[i];
+                bench->slot[i] = bench->n_counters++;
+        }
+
+        return;
+}
+
+static int
+leader_fd(const struct bench *bench)
+{
+
+        for (size_t i = 0; i < BENCH_N_COUNTERS; i++) {
+                if (bench->slot[i] == 0)
+                        return bench->fds[i];
+        }
+
+        return -1;
+}
+
+/**
+ * Adds the counters' values to `sums`; returns false if the group
+ * wasn't scheduled on the PMU.
+ */
+static bool
+read_counters(const struct bench *bench, int leader, double *sums)
+{
+        uint64_t values[3 + BENCH_N_COUNTERS];
+        ssize_t r;
+
+        r = read(leader, values, sizeof(values));
+        if (r < (ssize_t)(3 * sizeof(uint64_t)) || values[2] == 0)
+                return false;
+
+        for (size_t i = 0; i < BENCH_N_COUNTERS; i++) {
+                if (bench->slot[i] >= 0 && (uint64_t)bench->slot[i] < values[0])
+                        sums[i] += values[3 + bench->slot[i]];
+        }
+
+        return true;
+}
+
+static NO_INLINE void
+add_chain(uint64_t iters)
+{
+        uint64_t x = 0, y = 1;
+
+        /* Not an immediate: newer cores fold chains of those at rename. */
+        asm volatile("1:\n\t"
+                     ".rept 100\n\t"
+                     "add %2, %0\n\t"
+                     ".endr\n\t"
+                     "dec %1\n\t"
+                     "jnz 1b"
+                     : "+r"(x), "+r"(iters)
+                     : "r"(y));
+        return;
+}
+
+_Static_assert(CHAIN_ADDS == 100, "add_chain's .rept count");
+
+struct bench_clock
+bench_clock(void)
+{
+        struct bench_clock ret = { 0 };
+        double begin_ns, ns;
+        uint64_t begin_ticks;
+
+        /* 10 ms of TSC ticks. */
+        begin_ns = now_ns();
+        begin_ticks = ticks_begin();
+        do {
+                ns = now_ns() - begin_ns;
+        } while (ns < 1e7);
+        ret.tsc_ghz = (ticks_end() - begin_ticks) / ns;
+
+        for (size_t i = 0; i < 3; i++) {
+                double ghz;
+
+                begin_ns = now_ns();
+                add_chain(CHAIN_ITERS);
+                ghz = (double)CHAIN_ADDS * CHAIN_ITERS / (now_ns() - begin_ns);
+                if (ghz > ret.core_ghz)
+                        ret.core_ghz = ghz;
+        }
+
+        return ret;
+}
+
+static void
+write_clock(const struct bench *bench, const char *when,
+    const struct bench_clock *clock)
+{
+        double ratio = clock->core_ghz / clock->tsc_ghz;
+
+        if (bench->options.format == BENCH_JSON) {
+                fprintf(bench->options.out,
+                    "\"%s\": {\"tsc_ghz\": %.4f, \"core_ghz\": %.4f, \"drift\": %.4f}",
+                    when, clock->tsc_ghz, clock->core_ghz, clock->drift);
+                return;
+        }
+
+        fprintf(stderr, "# %s: TSC %.3f GHz, core %.3f GHz (%.3f cycles/tick)\n",
+            when, clock->tsc_ghz, clock->core_ghz, ratio);
+        if (ratio < 1 - CLOCK_TOLERANCE || ratio > 1 + CLOCK_TOLERANCE)
+                fprintf(stderr, "# ticks aren't core cycles: turbo or frequency scaling\n");
+        if (clock->drift < -CLOCK_TOLERANCE || clock->drift > CLOCK_TOLERANCE)
+                fprintf(stderr, "# the core clock drifted by %.1f%% during the run\n",
+                    100 * clock->drift);
+        return;
+}
+
+struct bench *
+bench_create(const struct bench_options *options)
+{
+        struct bench *ret;
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->options = *options;
+        if (ret->options.out == NULL)
+                ret->options.out = stdout;
+        if (ret->options.reps == 0)
+                ret->options.reps = BENCH_DEFAULT_REPS;
+
+        ret->observations = calloc(ret->options.reps, sizeof(ret->observations[0]));
+        assert(ret->observations != NULL);
+        open_counters(ret);
+        ret->clock = bench_clock();
+
+        switch (ret->options.format) {
+        case BENCH_CSV:
+                fprintf(ret->options.out, "method,bytes,cache,p1,p50,p99,mean,stddev");
+                for (size_t i = 0; i < BENCH_N_COUNTERS; i++)
+                        fprintf(ret->options.out, ",%s", bench_counter_names[i]);
+                fprintf(ret->options.out, ",core_per_tick\n");
+                break;
+        case BENCH_JSON:
+                fprintf(ret->options.out, "{");
+                write_clock(ret, "clock_begin", &ret->clock);
+                fprintf(ret->options.out, ",\n\"results\": [");
+                break;
+        default:
+                write_clock(ret, "begin", &ret->clock);
+                break;
+        }
+
+        return ret;
+}
+
+void
+bench_destroy(struct bench *bench)
+{
+        struct bench_clock clock;
+
+        if (bench == NULL)
+                return;
+
+        clock = bench_clock();
+        clock.drift = (clock.core_ghz - bench->clock.core_ghz) / bench->clock.core_ghz;
+        if (bench->options.format == BENCH_JSON) {
+                fprintf(bench->options.out, "\n],\n");
+                write_clock(bench, "clock_end", &clock);
+                fprintf(bench->options.out, "}\n");
+        } else {
+                write_clock(bench, "end", &clock);
+        }
+
+        fflush(bench->options.out);
+        for (size_t i = 0; i < BENCH_N_COUNTERS; i++) {
+                if (bench->fds[i] >= 0)
+                        close(bench->fds[i]);
+        }
+
+        free(bench->observations);
+        free(bench);
+        return;
+}
+
+size_t
+bench_n_counters(const struct bench *bench)
+{
+
+        return bench->n_counters;
+}
+
+void
+bench_clear_caches(void)
+{
+        static const size_t bufsz = 32 * 1024 * 1024;
+        static uint8_t *buf;
+
+        if (buf == NULL) {
+                buf = malloc(bufsz);
+                memset(buf, 42, bufsz);
+        }
+
+        for (size_t i = 0; i < bufsz; i += 64)
+                asm volatile("" :: "r"(buf[i]) : "memory");
+
+        return;
+}
+
+/**
+ * Fills `bench->observations` with the ticks for each rep, and `sums`
+ * with the counters' totals.  Returns the number of reps counted.
+ */
+static size_t
+observe(struct bench *bench, enum bench_cache cache, filter_fn_t *fn,
+    struct filter_state *state, double sums[BENCH_N_COUNTERS])
+{
+        int leader = leader_fd(bench);
+        size_t ret = 0;
+
+        memset(sums, 0, BENCH_N_COUNTERS * sizeof(sums[0]));
+        if (cache == BENCH_WARM)
+                fn(state);
+
+        for (size_t i = 0; i < bench->options.reps; i++) {
+                uint64_t begin, end;
+
+                if (cache == BENCH_COLD)
+                        bench_clear_caches();
+
+                if (leader >= 0) {
+                        ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+                        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+                }
+
+                begin = ticks_begin();
+                fn(state);
+                end = ticks_end();
+
+                if (leader >= 0) {
+                        ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+                        ret += read_counters(bench, leader, sums);
+                }
+
+                bench->observations[i] = end - begin;
+        }
+
+        return ret;
+}
+
+void
+bench_calibrate(struct bench *bench, filter_fn_t *noop, struct filter_state *state)
+{
+        double sums[BENCH_N_COUNTERS];
+        size_t reps = bench->options.reps;
+
+        for (size_t i = 0; i < BENCH_N_CACHES; i++) {
+                observe(bench, i, noop, state, sums);
+                qsort(bench->observations, reps, sizeof(bench->observations[0]),
+                    cmp_double);
+                bench->offset[i] = bench->observations[reps / 100];
+        }
+
+        return;
+}
+
+struct bench_result
+bench_measure(struct bench *bench, enum bench_cache cache, filter_fn_t *fn,
+    struct filter_state *state)
+{
+        struct bench_result ret;
+        const double *obs = bench->observations;
+        double sums[BENCH_N_COUNTERS];
+        double scale = sizeof(__m256i) * state->count;
+        double offset = bench->offset[cache];
+        double mean = 0, var = 0;
+        size_t reps = bench->options.reps;
+        size_t counted;
+
+        counted = observe(bench, cache, fn, state, sums);
+        for (size_t i = 0; i < reps; i++)
+                mean += obs[i] / reps;
+        for (size_t i = 0; i < reps; i++)
+                var += (obs[i] - mean) * (obs[i] - mean) / reps;
+
+        qsort(bench->observations, reps, sizeof(obs[0]), cmp_double);
+        ret = (struct bench_result) {
+                .p1 = (obs[reps / 100] - offset) / scale,
+                .p50 = (obs[reps / 2] - offset) / scale,
+                .p99 = (obs[(99 * reps) / 100] - offset) / scale,
+                .mean = (mean - offset) / scale,
+                .stddev = sqrt_double(var) / scale,
+                .core_per_tick = NAN,
+        };
+
+        for (size_t i = 0; i < BENCH_N_COUNTERS; i++) {
+                ret.counters[i] = (bench->slot[i] >= 0 && counted > 0)
+                    ? sums[i] / counted : NAN;
+        }
+
+        if (!isnan(ret.counters[BENCH_CYCLES]))
+                ret.core_per_tick = ret.counters[BENCH_CYCLES] / mean;
+        return ret;
+}
+
+/* NaN as an empty CSV field, or a JSON null. */
+static void
+write_number(FILE *out, double value, const char *missing)
+{
+
+        if (isnan(value))
+                fputs(missing, out);
+        else
+                fprintf(out, "%.4f", value);
+        return;
+}
+
+static void
+write_result(struct bench *bench, const char *name, size_t bytes,
+    enum bench_cache cache, const struct bench_result *result)
+{
+        FILE *out = bench->options.out;
+        const double stats[] = {
+                result->p1, result->p50, result->p99, result->mean,
+                result->stddev,
+        };
+        static const char *const stat_names[] = {
+                "p1", "p50", "p99", "mean", "stddev",
+        };
+
+        switch (bench->options.format) {
+        case BENCH_TABLE:
+                if (cache == BENCH_COLD) {
+                        fprintf(out, "%32s\t%zu\t%.4f\n", name, bytes, result->p1);
+                } else {
+                        char warm[64];
+
+                        snprintf(warm, sizeof(warm), "%s@%s", name,
+                            bench_cache_names[cache]);
+                        fprintf(out, "%32s\t%zu\t%.4f\n", warm, bytes, result->p1);
+                }
+                break;
+        case BENCH_CSV:
+                fprintf(out, "%s,%zu,%s", name, bytes, bench_cache_names[cache]);
+                for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+                        fprintf(out, ",%.4f", stats[i]);
+                for (size_t i = 0; i < BENCH_N_COUNTERS; i++) {
+                        fputc(',', out);
+                        write_number(out, result->counters[i], "");
+                }
+
+                fputc(',', out);
+                write_number(out, result->core_per_tick, "");
+                fputc('\n', out);
+                break;
+        case BENCH_JSON:
+                fprintf(out, "%s\n  {\"method\": \"%s\", \"bytes\": %zu, \"cache\": \"%s\"",
+                    (bench->n_results > 0) ? "," : "", name, bytes,
+                    bench_cache_names[cache]);
+                for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+                        fprintf(out, ", \"%s\": %.4f", stat_names[i], stats[i]);
+                for (size_t i = 0; i < BENCH_N_COUNTERS; i++) {
+                        fprintf(out, ", \"%s\": ", bench_counter_names[i]);
+                        write_number(out, result->counters[i], "null");
+                }
+
+                fprintf(out, ", \"core_per_tick\": ");
+                write_number(out, result->core_per_tick, "null");
+                fputc('}', out);
+                break;
+        }
+
+        bench->n_results++;
+        return;
+}
+
+double
+bench_run(struct bench *bench, const char *name, filter_fn_t *fn,
+    struct filter_state *state)
+{
+        double ret = NAN;
+
+        for (size_t i = 0; i < BENCH_N_CACHES; i++) {
+                struct bench_result result;
+
+                if ((bench->options.caches & (1U << i)) == 0)
+                        continue;
+
+                result = bench_measure(bench, i, fn, state);
+                write_result(bench, name, sizeof(__m256i) * state->count, i, &result);
+                if (isnan(ret))
+                        ret = result.p1;
+        }
+
+        return ret;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "interface.h"
+
+/**
+ * The benchmark driver behind `validate`'s timings.
+ *
+ * Each method runs `reps` times per cache scenario: cold, after
+ * evicting everything with bench_clear_caches, and warm, right after
+ * a previous run.  We report TSC ticks per byte (p1, p50, p99, mean
+ * and standard deviation, net of the cost of timing `noop`), and the
+ * mean per call of each hardware counter perf_event_open gives us.
+ *
+ * The TSC ticks at a constant rate; bench_clock compares it with the
+ * core clock, so we can tell when turbo or frequency scaling skews
+ * the numbers.
+ */
+enum bench_format {
+        /* `name\tbytes\tp1` lines, as in results.tab. */
+        BENCH_TABLE,
+        BENCH_CSV,
+        BENCH_JSON,
+};
+
+enum bench_cache {
+        BENCH_COLD,
+        BENCH_WARM,
+        BENCH_N_CACHES
+};
+
+enum bench_counter {
+        BENCH_CYCLES,
+        BENCH_INSTRUCTIONS,
+        BENCH_BRANCH_MISSES,
+        BENCH_L1D_MISSES,
+        BENCH_LLC_MISSES,
+        BENCH_DTLB_MISSES,
+        BENCH_N_COUNTERS
+};
+
+extern const char *const bench_cache_names[BENCH_N_CACHES];
+extern const char *const bench_counter_names[BENCH_N_COUNTERS];
+
+struct bench_options {
+        enum bench_format format;
+        /* Bit mask of 1 << enum bench_cache. */
+        unsigned caches;
+        size_t reps;
+        FILE *out;
+};
+
+struct bench_result {
+        /* TSC ticks per byte. */
+        double p1, p50, p99, mean, stddev;
+        /* Mean per call; NaN for counters we can't read. */
+        double counters[BENCH_N_COUNTERS];
+        /* Core cycles per TSC tick during the calls, if we count cycles. */
+        double core_per_tick;
+};
+
+struct bench_clock {
+        double tsc_ghz;
+        double core_ghz;
+        /* The core clock's drift over the run, relative to its start. */
+        double drift;
+};
+
+struct bench;
+
+/**
+ * Defaults to the table format for cold caches, with 1000 reps, on
+ * stdout, overridden by $BENCH_FORMAT (table, csv, json), $BENCH_CACHE
+ * (cold, warm, both) and $BENCH_REPS.
+ */
+struct bench_options bench_options_from_env(void);
+
+/**
+ * Opens the counters and measures the clocks.  Counters that the
+ * kernel or the CPU won't give us are left out.
+ */
+struct bench *bench_create(const struct bench_options *);
+
+/**
+ * Measures the clocks again, and reports them and any drift.
+ */
+void bench_destroy(struct bench *);
+
+/**
+ * Number of counters we could open.
+ */
+size_t bench_n_counters(const struct bench *);
+
+/**
+ * Evicts the caches, by streaming through a buffer larger than the
+ * LLC.
+ */
+void bench_clear_caches(void);
+
+/**
+ * TSC and core clock rates, measured now; the latter by timing a
+ * chain of dependent adds, one cycle each.
+ */
+struct bench_clock bench_clock(void);
+
+/**
+ * Times `fn` to calibrate the overhead subtracted from later results.
+ */
+void bench_calibrate(struct bench *, filter_fn_t *noop, struct filter_state *);
+
+/**
+ * Measures `fn` on `state` with caches in `cache`'s state.
+ */
+struct bench_result bench_measure(struct bench *, enum bench_cache,
+    filter_fn_t *fn, struct filter_state *state);
+
+/**
+ * Measures `fn` for each of the options' cache scenarios, and writes
+ * the results.  Returns the first scenario's p1.
+ */
+double bench_run(struct bench *, const char *name, filter_fn_t *fn,
+    struct filter_state *state);
@@ -0,0 +1,455 @@
+#include "blocked.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "policy.h"
+#include "vector.h"
+
+/* Counts are only multiples of BLOCK_SIZE. */
+#define BLOCKED_MIN_BLOCK ((size_t)BLOCK_SIZE)
+#define BLOCKED_MAX_BLOCK (8 * BLOCKED_MIN_BLOCK)
+
+/* The kernels live in vector_kernels.inc, for every vector width. */
+enum blocked_opcode {
+        BLOCKED_COPY = VECTOR_BLOCKED_COPY,
+        BLOCKED_NOT = VECTOR_BLOCKED_NOT,
+        BLOCKED_AND = VECTOR_BLOCKED_AND,
+        BLOCKED_OR = VECTOR_BLOCKED_OR,
+        BLOCKED_XOR = VECTOR_BLOCKED_XOR,
+        BLOCKED_N_OPS = VECTOR_BLOCKED_N_OPS
+};
+
+struct blocked_ref {
+        bool temp;
+        size_t index;
+};
+
+struct blocked_op {
+        enum blocked_opcode op;
+        struct blocked_ref dst;
+        struct blocked_ref src[2];
+};
+
+/* Ops [begin, end) run over a whole tile before the next segment. */
+struct blocked_segment {
+        size_t begin;
+        size_t end;
+};
+
+struct blocked_query {
+        struct blocked_shape shape;
+        vector_blocked_kernel_t *const *kernels;
+        size_t n_temps;
+        size_t n_ops;
+        size_t cap_ops;
+        struct blocked_op *ops;
+        size_t n_segments;
+        struct blocked_segment *segments;
+        /*
+         * Where each temporary lives in the scratch area, in vectors:
+         * a block for those only live within a segment, a tile for
+         * those live across segments.
+         */
+        size_t *temp_offsets;
+        bool *temp_spilled;
+        size_t n_temp_vecs;
+        /* While compiling: temporaries in use, and ptrs[] read. */
+        size_t live_temps;
+        bool used[FILTER_MAX_PTRS];
+};
+
+struct blocked_shape
+blocked_choose_shape(size_t n_streams, size_t l1d_size, size_t l2_size)
+{
+        size_t per_vector = n_streams * sizeof(__m256i);
+        struct blocked_shape ret = {
+                .block = BLOCKED_MIN_BLOCK,
+                .tile = BLOCKED_MIN_BLOCK,
+        };
+        size_t tile;
+
+        /* Leave half of each level for everything else. */
+        while (ret.block < BLOCKED_MAX_BLOCK &&
+            2 * ret.block * per_vector <= l1d_size / 2)
+                ret.block *= 2;
+
+        ret.tile = ret.block;
+        if (ret.block * per_vector <= l1d_size / 2)
+                return ret;
+
+        tile = (l2_size / 2) / per_vector;
+        tile -= tile % BLOCKED_MIN_BLOCK;
+        if (tile > ret.tile)
+                ret.tile = tile;
+        return ret;
+}
+
+static void
+push_op(struct blocked_query *query, enum blocked_opcode op,
+    struct blocked_ref dst, struct blocked_ref x, struct blocked_ref y)
+{
+
+        if (query->n_ops == query->cap_ops) {
+                query->cap_ops = 2 * query->cap_ops + 16;
+                query->ops = realloc(query->ops,
+                    query->cap_ops * sizeof(query->ops[0]));
+                assert(query->ops != NULL);
+        }
+
+        query->ops[query->n_ops++] = (struct blocked_op) {
+                .op = op,
+                .dst = dst,
+                .src = { x, y },
+        };
+        return;
+}
+
+static struct blocked_ref
+alloc_temp(struct blocked_query *query)
+{
+        struct blocked_ref ret = {
+                .temp = true,
+                .index = query->live_temps++,
+        };
+
+        if (query->live_temps > query->n_temps)
+                query->n_temps = query->live_temps;
+        return ret;
+}
+
+static enum blocked_opcode
+binop(enum expr_kind kind)
+{
+
+        switch (kind) {
+        case EXPR_AND:
+                return BLOCKED_AND;
+        case EXPR_OR:
+                return BLOCKED_OR;
+        case EXPR_XOR:
+                return BLOCKED_XOR;
+        default:
+                assert(0 && "not a binary operator");
+                return BLOCKED_N_OPS;
+        }
+}
+
+/**
+ * Returns where `expr`'s value is: a ptrs[] entry for variables, and
+ * `dst` otherwise.  Temporaries are allocated as a stack.
+ */
+static struct blocked_ref
+gen(struct blocked_query *query, const struct expr *expr, struct blocked_ref dst)
+{
+        struct blocked_ref acc;
+
+        if (expr->kind == EXPR_VAR) {
+                assert(expr->var < FILTER_MAX_PTRS);
+                query->used[expr->var] = true;
+                return (struct blocked_ref) { .index = expr->var };
+        }
+
+        acc = gen(query, expr->args[0], dst);
+        if (expr->kind == EXPR_NOT) {
+                push_op(query, BLOCKED_NOT, dst, acc, acc);
+                return dst;
+        }
+
+        for (size_t i = 1; i < expr->n_args; i++) {
+                const struct expr *arg = expr->args[i];
+                struct blocked_ref value;
+
+                if (arg->kind == EXPR_VAR) {
+                        value = gen(query, arg, dst);
+                        push_op(query, binop(expr->kind), dst, acc, value);
+                } else {
+                        struct blocked_ref temp = alloc_temp(query);
+
+                        /* acc may be dst, so don't evaluate into it. */
+                        value = gen(query, arg, temp);
+                        push_op(query, binop(expr->kind), dst, acc, value);
+                        query->live_temps--;
+                }
+
+                acc = dst;
+        }
+
+        /* A single argument, e.g., (and x). */
+        if (acc.temp != dst.temp || acc.index != dst.index)
+                push_op(query, BLOCKED_COPY, dst, acc, acc);
+        return dst;
+}
+
+/**
+ * Marks the streams `op` touches in `ptrs` and `temps`, and returns
+ * how many weren't marked yet.
+ */
+static size_t
+mark_streams(bool *ptrs, bool *temps, const struct blocked_op *op)
+{
+        size_t ret = 0;
+
+        for (size_t k = 0; k < 3; k++) {
+                struct blocked_ref ref = (k == 0) ? op->dst : op->src[k - 1];
+                bool *seen = ref.temp ? &temps[ref.index] : &ptrs[ref.index];
+
+                ret += !*seen;
+                *seen = true;
+        }
+
+        return ret;
+}
+
+/**
+ * Splits the op list into segments that touch few enough streams for
+ * a block of each to fit in half of `l1d_size`.  Queries that aren't
+ * tiled fit whole, and are a single segment.
+ */
+static void
+split_segments(struct blocked_query *query, size_t l1d_size)
+{
+        size_t max_streams = l1d_size / 2 /
+            (query->shape.block * sizeof(__m256i));
+        bool ptrs[FILTER_MAX_PTRS] = { false };
+        bool *temps;
+        size_t n_streams = 0;
+        size_t begin = 0;
+
+        query->segments = calloc(query->n_ops + 1, sizeof(query->segments[0]));
+        temps = calloc(query->n_temps + 1, sizeof(temps[0]));
+        assert(query->segments != NULL && temps != NULL);
+
+        for (size_t i = 0; i < query->n_ops; i++) {
+                size_t n = mark_streams(ptrs, temps, &query->ops[i]);
+
+                if (query->shape.tile == query->shape.block ||
+                    n_streams + n <= max_streams || i == begin) {
+                        n_streams += n;
+                        continue;
+                }
+
+                query->segments[query->n_segments++] =
+                    (struct blocked_segment) { begin, i };
+                memset(ptrs, 0, sizeof(ptrs));
+                memset(temps, 0, query->n_temps * sizeof(temps[0]));
+                n_streams = mark_streams(ptrs, temps, &query->ops[i]);
+                begin = i;
+        }
+
+        query->segments[query->n_segments++] =
+            (struct blocked_segment) { begin, query->n_ops };
+        free(temps);
+        return;
+}
+
+static bool
+same_ref(struct blocked_ref x, struct blocked_ref y)
+{
+
+        return x.temp == y.temp && x.index == y.index;
+}
+
+/**
+ * Gives each temporary a block of scratch if all its values are
+ * written and read in the same segment, and a whole tile otherwise.
+ */
+static void
+layout_temps(struct blocked_query *query)
+{
+        size_t *written;
+
+        written = calloc(query->n_temps + 1, sizeof(written[0]));
+        query->temp_offsets = calloc(query->n_temps + 1,
+            sizeof(query->temp_offsets[0]));
+        query->temp_spilled = calloc(query->n_temps + 1,
+            sizeof(query->temp_spilled[0]));
+        assert(written != NULL && query->temp_offsets != NULL &&
+            query->temp_spilled != NULL);
+
+        for (size_t s = 0; s < query->n_segments; s++) {
+                const struct blocked_segment *segment = &query->segments[s];
+
+                for (size_t i = segment->begin; i < segment->end; i++) {
+                        const struct blocked_op *op = &query->ops[i];
+
+                        for (size_t k = 0; k < 2; k++) {
+                                if (op->src[k].temp &&
+                                    written[op->src[k].index] != s)
+                                        query->temp_spilled[op->src[k].index] = true;
+                        }
+
+                        /* A new value, unless the op updates it in place. */
+                        if (op->dst.temp && !same_ref(op->dst, op->src[0]) &&
+                            !same_ref(op->dst, op->src[1]))
+                                written[op->dst.index] = s;
+                }
+        }
+
+        for (size_t t = 0; t < query->n_temps; t++) {
+                query->temp_offsets[t] = query->n_temp_vecs;
+                query->n_temp_vecs += query->temp_spilled[t]
+                    ? query->shape.tile : query->shape.block;
+        }
+
+        free(written);
+        return;
+}
+
+struct blocked_query *
+blocked_compile(const struct expr *expr, const struct blocked_shape *shape)
+{
+
+        return blocked_compile_kernels(expr, shape, NULL);
+}
+
+struct blocked_query *
+blocked_compile_kernels(const struct expr *expr,
+    const struct blocked_shape *shape, const struct vector_kernels *vector)
+{
+        struct blocked_query *ret;
+        struct blocked_ref dst = { .index = 0 }, value;
+        size_t n_streams = 0, k = 0;
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        value = gen(ret, expr, dst);
+        if (value.temp || value.index != dst.index)
+                push_op(ret, BLOCKED_COPY, dst, value, value);
+
+        for (size_t i = 0; i < FILTER_MAX_PTRS; i++)
+                n_streams += ret->used[i];
+
+        /* And dst. */
+        n_streams += ret->n_temps + 1;
+        ret->shape = (shape != NULL) ? *shape
+            : blocked_choose_shape(n_streams, filter_l1d_size(), filter_l2_size());
+
+        while ((BLOCKED_MIN_BLOCK << k) < ret->shape.block)
+                k++;
+        assert((BLOCKED_MIN_BLOCK << k) == ret->shape.block &&
+            ret->shape.block <= BLOCKED_MAX_BLOCK &&
+            ret->shape.tile % ret->shape.block == 0);
+        if (vector == NULL)
+                vector = vector_kernels_widest();
+        ret->kernels = vector->blocked[k];
+        split_segments(ret, filter_l1d_size());
+        layout_temps(ret);
+        return ret;
+}
+
+void
+blocked_destroy(struct blocked_query *query)
+{
+
+        if (query == NULL)
+                return;
+
+        free(query->ops);
+        free(query->segments);
+        free(query->temp_offsets);
+        free(query->temp_spilled);
+        free(query);
+        return;
+}
+
+struct blocked_shape
+blocked_query_shape(const struct blocked_query *query)
+{
+
+        return query->shape;
+}
+
+size_t
+blocked_query_n_ops(const struct blocked_query *query)
+{
+
+        return query->n_ops;
+}
+
+size_t
+blocked_query_n_temps(const struct blocked_query *query)
+{
+
+        return query->n_temps;
+}
+
+size_t
+blocked_query_n_segments(const struct blocked_query *query)
+{
+
+        return query->n_segments;
+}
+
+/**
+ * Runs `segment` over vectors [begin, begin + n) of each stream,
+ * `offset` vectors into the current tile.
+ */
+static void
+run_ops(const struct blocked_query *query,
+    const struct blocked_segment *segment, struct filter_state *state,
+    __m256i *temps, size_t offset, size_t begin, size_t n)
+{
+
+        for (size_t i = segment->begin; i < segment->end; i++) {
+                const struct blocked_op *op = &query->ops[i];
+                __m256i *ptrs[3];
+
+                for (size_t k = 0; k < 3; k++) {
+                        struct blocked_ref ref =
+                            (k == 0) ? op->dst : op->src[k - 1];
+
+                        if (!ref.temp)
+                                ptrs[k] = &state->ptrs[ref.index][begin];
+                        else if (query->temp_spilled[ref.index])
+                                ptrs[k] = &temps[query->temp_offsets[ref.index] + offset];
+                        else
+                                ptrs[k] = &temps[query->temp_offsets[ref.index]];
+                }
+
+                query->kernels[op->op](ptrs[0], ptrs[1], ptrs[2], n);
+        }
+
+        return;
+}
+
+void
+blocked_run(const struct blocked_query *query, struct filter_state *state)
+{
+        size_t count = state->count;
+        size_t block = query->shape.block;
+        size_t tile = query->shape.tile;
+        size_t n_temps = query->n_temp_vecs;
+        __m256i *temps = state->scratch.val;
+
+        if ((count % BLOCK_SIZE) != 0)
+                __builtin_unreachable();
+
+        if (n_temps > sizeof(state->scratch.val) / sizeof(__m256i))
+                temps = filter_arena_vecs(filter_arena_thread(), n_temps);
+
+        for (size_t begin = 0; begin < count; begin += tile) {
+                size_t end = (count - begin < tile) ? count : begin + tile;
+
+                /*
+                 * Each segment sweeps the tile one block at a time,
+                 * so its temporaries are read back from L1; those
+                 * live across segments wait in L2.
+                 */
+                for (size_t s = 0; s < query->n_segments; s++) {
+                        for (size_t i = begin; i < end; i += block) {
+                                size_t n = (end - i < block) ? end - i : block;
+
+                                run_ops(query, &query->segments[s], state,
+                                    temps, i - begin, i, n);
+                        }
+                }
+        }
+
+        if (temps != state->scratch.val)
+                filter_arena_vecs_release(filter_arena_thread(), temps, n_temps);
+        return;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "interface.h"
+#include "query.h"
+
+/**
+ * Blocked evaluation of arbitrary queries, with a block size chosen
+ * per query instead of the compile-time BLOCK_SIZE.
+ *
+ * The query becomes a list of two-operand ops over `ptrs[]` and
+ * temporaries, with kernels specialised for blocks of `block`
+ * vectors (1, 2, 4 or 8 times BLOCK_SIZE), for the widest vectors
+ * the CPU supports (vector.h).
+ *
+ * For narrow queries, `tile == block`, and the block is as large as
+ * fits every stream (inputs, temporaries and dst) in half the L1D:
+ * the whole op list runs once per block, and each temporary only
+ * needs a block.
+ *
+ * Deep queries have too many streams for even BLOCK_SIZE blocks to
+ * fit in L1.  Their op list is split in segments that each touch few
+ * enough streams to fit, and each L2-sized tile runs one segment at a
+ * time, a block at a time.  Temporaries that only live within a
+ * segment still take a block; those live across segments take a
+ * tile, and wait in L2 for the next segment.  Temporaries that don't
+ * fit in `scratch` come from the thread's arena.
+ */
+struct blocked_shape {
+        /* Vectors per op list run; BLOCK_SIZE times a power of two. */
+        size_t block;
+        /* Vectors per sweep; a multiple of `block`. */
+        size_t tile;
+};
+
+struct blocked_query;
+struct vector_kernels;
+
+/**
+ * The shape for a query that touches `n_streams` arrays, given the L1D
+ * and L2 sizes in bytes.
+ */
+struct blocked_shape blocked_choose_shape(size_t n_streams,
+    size_t l1d_size, size_t l2_size);
+
+/**
+ * Compiles `expr` with `shape`, or, if NULL, with the shape chosen for
+ * the host's caches (policy.h).
+ */
+struct blocked_query *blocked_compile(const struct expr *,
+    const struct blocked_shape *shape);
+
+/**
+ * Like blocked_compile, with the kernels instantiated in `vector`
+ * instead of the widest the CPU supports.
+ */
+struct blocked_query *blocked_compile_kernels(const struct expr *,
+    const struct blocked_shape *shape, const struct vector_kernels *vector);
+
+void blocked_destroy(struct blocked_query *);
+
+struct blocked_shape blocked_query_shape(const struct blocked_query *);
+
+/**
+ * Number of ops, each a kernel call per block.
+ */
+size_t blocked_query_n_ops(const struct blocked_query *);
+
+/**
+ * Number of temporaries live at once.
+ */
+size_t blocked_query_n_temps(const struct blocked_query *);
+
+/**
+ * Number of segments the op list runs in, 1 unless tiled.
+ */
+size_t blocked_query_n_segments(const struct blocked_query *);
+
+void blocked_run(const struct blocked_query *, struct filter_state *);
@@ -0,0 +1,402 @@
+#include "cache.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Longest spelling the alias index handles; longer ones canonicalise. */
+#define ALIAS_MAX_TOKENS 256
+/* Spellings remembered for each shape. */
+#define ALIAS_MAX_PER_ENTRY 8
+
+struct cache_entry {
+        struct cache_entry *next;
+        uint64_t hash;
+        char *key;
+        uint64_t last_use;
+        struct query_program *program;
+        struct stitched_query *stitched;
+        size_t n_aliases;
+        struct cache_alias *aliases;
+};
+
+/**
+ * A spelling of a query that maps to a cached shape, so that repeat
+ * queries skip canonicalisation: `tokens` is the query in prefix
+ * order with its inputs renamed in order of first occurrence, and
+ * shape input k is the spelling's input perm[k].
+ */
+struct cache_alias {
+        struct cache_alias *next;
+        /* The next alias of the same entry. */
+        struct cache_alias *next_alias;
+        struct cache_entry *entry;
+        uint64_t hash;
+        size_t n_tokens;
+        uint32_t *tokens;
+        size_t perm[FILTER_MAX_PTRS - 1];
+};
+
+/**
+ * A query's spelling, as built by encode.
+ */
+struct spelling {
+        size_t n_tokens;
+        uint32_t tokens[ALIAS_MAX_TOKENS];
+        size_t n_inputs;
+        size_t inputs[FILTER_MAX_PTRS - 1];
+        /* 1 + the index in `inputs` of each ptrs[] slot, or 0. */
+        uint8_t number[FILTER_MAX_PTRS];
+};
+
+_Static_assert(FILTER_MAX_PTRS <= 256, "spelling.number indices");
+
+struct query_cache {
+        unsigned compile_flags;
+        unsigned cache_flags;
+        size_t capacity;
+        size_t size;
+        uint64_t clock;
+        size_t n_buckets;
+        struct cache_entry **buckets;
+        /* Aliases, in as many buckets. */
+        struct cache_alias **aliases;
+        struct query_cache_stats stats;
+};
+
+static uint64_t
+hash_key(const char *key)
+{
+        uint64_t ret = 0xcbf29ce484222325ULL;
+
+        for (size_t i = 0; key[i] != '\0'; i++) {
+                ret ^= (uint8_t)key[i];
+                ret *= 0x100000001b3ULL;
+        }
+
+        return ret;
+}
+
+/**
+ * Appends `expr`'s spelling; returns false if it's too long.
+ */
+static bool
+encode(struct spelling *spelling, const struct expr *expr)
+{
+
+        if (spelling->n_tokens == ALIAS_MAX_TOKENS)
+                return false;
+
+        if (expr->kind == EXPR_VAR) {
+                if (spelling->number[expr->var] == 0) {
+                        spelling->inputs[spelling->n_inputs++] = expr->var;
+                        spelling->number[expr->var] = spelling->n_inputs;
+                }
+
+                spelling->tokens[spelling->n_tokens++] =
+                    spelling->number[expr->var];
+                return true;
+        }
+
+        assert(expr->n_args < (1U << 16));
+        spelling->tokens[spelling->n_tokens++] =
+            ((uint32_t)expr->kind << 16) | expr->n_args;
+        for (size_t i = 0; i < expr->n_args; i++) {
+                if (!encode(spelling, expr->args[i]))
+                        return false;
+        }
+
+        return true;
+}
+
+static uint64_t
+hash_tokens(const uint32_t *tokens, size_t n)
+{
+        uint64_t ret = 0xcbf29ce484222325ULL;
+
+        for (size_t i = 0; i < n; i++) {
+                ret ^= tokens[i];
+                ret *= 0x100000001b3ULL;
+        }
+
+        return ret;
+}
+
+struct query_cache *
+query_cache_create(size_t capacity, unsigned compile_flags,
+    unsigned cache_flags)
+{
+        struct query_cache *ret;
+
+        assert(capacity > 0);
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->compile_flags = compile_flags;
+        ret->cache_flags = cache_flags;
+        ret->capacity = capacity;
+        ret->n_buckets = 1;
+        while (ret->n_buckets < 2 * capacity)
+                ret->n_buckets *= 2;
+
+        ret->buckets = calloc(ret->n_buckets, sizeof(ret->buckets[0]));
+        ret->aliases = calloc(ret->n_buckets, sizeof(ret->aliases[0]));
+        assert(ret->buckets != NULL && ret->aliases != NULL);
+        return ret;
+}
+
+static void
+entry_destroy(struct cache_entry *entry)
+{
+
+        while (entry->aliases != NULL) {
+                struct cache_alias *alias = entry->aliases;
+
+                entry->aliases = alias->next_alias;
+                free(alias->tokens);
+                free(alias);
+        }
+
+        stitched_query_destroy(entry->stitched);
+        query_program_destroy(entry->program);
+        free(entry->key);
+        free(entry);
+        return;
+}
+
+void
+query_cache_destroy(struct query_cache *cache)
+{
+
+        if (cache == NULL)
+                return;
+
+        for (size_t i = 0; i < cache->n_buckets; i++) {
+                struct cache_entry *entry = cache->buckets[i];
+
+                while (entry != NULL) {
+                        struct cache_entry *next = entry->next;
+
+                        entry_destroy(entry);
+                        entry = next;
+                }
+        }
+
+        free(cache->aliases);
+        free(cache->buckets);
+        free(cache);
+        return;
+}
+
+/**
+ * Linear scan: we only get here on misses, which also compile.
+ */
+static void
+evict_lru(struct query_cache *cache)
+{
+        struct cache_entry **victim = NULL;
+
+        for (size_t i = 0; i < cache->n_buckets; i++) {
+                for (struct cache_entry **cur = &cache->buckets[i];
+                     *cur != NULL; cur = &(*cur)->next) {
+                        if (victim == NULL ||
+                            (*cur)->last_use < (*victim)->last_use)
+                                victim = cur;
+                }
+        }
+
+        if (victim != NULL) {
+                struct cache_entry *entry = *victim;
+
+                *victim = entry->next;
+                for (struct cache_alias *alias = entry->aliases;
+                     alias != NULL; alias = alias->next_alias) {
+                        struct cache_alias **cur = &cache->aliases[
+                            alias->hash & (cache->n_buckets - 1)];
+
+                        while (*cur != alias)
+                                cur = &(*cur)->next;
+                        *cur = alias->next;
+                }
+
+                entry_destroy(entry);
+                cache->size--;
+                cache->stats.evictions++;
+        }
+
+        return;
+}
+
+/**
+ * Finds or compiles `expr`'s shape, and fills `plan->inputs`.
+ */
+static struct cache_entry *
+lookup_shape(struct query_cache *cache, const struct expr *expr,
+    struct query_plan *plan)
+{
+        struct cache_entry *entry;
+        struct query_program *program;
+        struct expr *shape;
+        uint64_t hash;
+        char *key;
+
+        shape = expr_shape(expr, plan->inputs, &plan->n_inputs);
+        key = expr_format(shape);
+        hash = hash_key(key);
+
+        for (entry = cache->buckets[hash & (cache->n_buckets - 1)];
+             entry != NULL; entry = entry->next) {
+                if (entry->hash == hash && strcmp(entry->key, key) == 0)
+                        break;
+        }
+
+        if (entry != NULL) {
+                cache->stats.hits++;
+                free(key);
+                expr_destroy(shape);
+                return entry;
+        }
+
+        cache->stats.misses++;
+        program = query_compile(shape, cache->compile_flags);
+        expr_destroy(shape);
+        if (program == NULL) {
+                free(key);
+                return NULL;
+        }
+
+        if (cache->size >= cache->capacity)
+                evict_lru(cache);
+
+        entry = calloc(1, sizeof(*entry));
+        assert(entry != NULL);
+        entry->hash = hash;
+        entry->key = key;
+        entry->program = program;
+        if ((cache->cache_flags & QUERY_CACHE_STITCH) != 0)
+                entry->stitched = stitch_query(program);
+
+        entry->next = cache->buckets[hash & (cache->n_buckets - 1)];
+        cache->buckets[hash & (cache->n_buckets - 1)] = entry;
+        cache->size++;
+        return entry;
+}
+
+static void
+add_alias(struct query_cache *cache, struct cache_entry *entry,
+    const struct spelling *spelling, uint64_t hash,
+    const struct query_plan *plan)
+{
+        struct cache_alias *alias;
+
+        if (entry->n_aliases == ALIAS_MAX_PER_ENTRY)
+                return;
+
+        /* Canonicalisation keeps every input. */
+        assert(plan->n_inputs == spelling->n_inputs);
+        alias = calloc(1, sizeof(*alias));
+        assert(alias != NULL);
+        alias->entry = entry;
+        alias->hash = hash;
+        alias->n_tokens = spelling->n_tokens;
+        alias->tokens = malloc(spelling->n_tokens * sizeof(alias->tokens[0]));
+        assert(alias->tokens != NULL);
+        memcpy(alias->tokens, spelling->tokens,
+            spelling->n_tokens * sizeof(alias->tokens[0]));
+        for (size_t k = 0; k < plan->n_inputs; k++)
+                alias->perm[k] = spelling->number[plan->inputs[k]] - 1;
+
+        alias->next_alias = entry->aliases;
+        entry->aliases = alias;
+        entry->n_aliases++;
+        alias->next = cache->aliases[hash & (cache->n_buckets - 1)];
+        cache->aliases[hash & (cache->n_buckets - 1)] = alias;
+        return;
+}
+
+bool
+query_cache_lookup(struct query_cache *cache, const struct expr *expr,
+    struct query_plan *plan)
+{
+        struct spelling spelling;
+        struct cache_entry *entry;
+        uint64_t hash = 0;
+        bool encoded;
+
+        spelling.n_tokens = 0;
+        spelling.n_inputs = 0;
+        memset(spelling.number, 0, sizeof(spelling.number));
+        encoded = encode(&spelling, expr);
+        if (encoded) {
+                struct cache_alias *alias;
+
+                hash = hash_tokens(spelling.tokens, spelling.n_tokens);
+                for (alias = cache->aliases[hash & (cache->n_buckets - 1)];
+                     alias != NULL; alias = alias->next) {
+                        if (alias->hash == hash &&
+                            alias->n_tokens == spelling.n_tokens &&
+                            memcmp(alias->tokens, spelling.tokens,
+                                spelling.n_tokens *
+                                sizeof(spelling.tokens[0])) == 0)
+                                break;
+                }
+
+                if (alias != NULL) {
+                        cache->stats.hits++;
+                        entry = alias->entry;
+                        plan->n_inputs = spelling.n_inputs;
+                        for (size_t k = 0; k < plan->n_inputs; k++) {
+                                plan->inputs[k] =
+                                    spelling.inputs[alias->perm[k]];
+                        }
+                        goto out;
+                }
+        }
+
+        entry = lookup_shape(cache, expr, plan);
+        if (entry == NULL)
+                return false;
+
+        if (encoded)
+                add_alias(cache, entry, &spelling, hash, plan);
+
+out:
+        entry->last_use = ++cache->clock;
+        plan->program = entry->program;
+        plan->stitched = entry->stitched;
+        return true;
+}
+
+struct query_cache_stats
+query_cache_stats(const struct query_cache *cache)
+{
+
+        return cache->stats;
+}
+
+void
+query_plan_bind(const struct query_plan *plan, struct filter_state *bound,
+    const struct filter_state *state)
+{
+
+        bound->count = state->count;
+        bound->ptrs[0] = state->ptrs[0];
+        for (size_t i = 0; i < plan->n_inputs; i++)
+                bound->ptrs[i + 1] = state->ptrs[plan->inputs[i]];
+
+        return;
+}
+
+void
+query_plan_run(const struct query_plan *plan, struct filter_state *state)
+{
+        struct filter_state bound;
+
+        query_plan_bind(plan, &bound, state);
+        if (plan->stitched != NULL)
+                stitch_run(plan->stitched, &bound);
+        else
+                query_run(plan->program, &bound);
+
+        return;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "interface.h"
+#include "query.h"
+#include "stitch.h"
+
+/**
+ * Cache of compiled programs (and stitched code), keyed by query
+ * shape (see expr_shape).  Operands only flow through `ptrs[]`, so
+ * a compiled shape can serve any query with that shape, once its
+ * inputs are permuted into place.
+ *
+ * Each shape also remembers a few spellings of the queries that
+ * mapped to it, with their inputs renamed, so a repeat query is found
+ * with one pass over the expression and no allocation, and only new
+ * spellings pay for canonicalisation.
+ */
+struct query_cache;
+
+enum query_cache_flags {
+        /* Also stitch native code for each shape. */
+        QUERY_CACHE_STITCH = 1 << 0,
+};
+
+/**
+ * A compiled shape, and where its inputs come from in the query's
+ * filter_state: shape input k reads `ptrs[inputs[k - 1]]`.
+ *
+ * The pointers remain valid until a later lookup misses and evicts
+ * the entry, or the cache is destroyed.
+ */
+struct query_plan {
+        const struct query_program *program;
+        /* NULL if not stitching, or stitching failed. */
+        const struct stitched_query *stitched;
+        size_t n_inputs;
+        size_t inputs[FILTER_MAX_PTRS - 1];
+};
+
+struct query_cache_stats {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+};
+
+/**
+ * `compile_flags` are passed to query_compile.  The cache holds at
+ * most `capacity` shapes, and evicts the least recently used.
+ */
+struct query_cache *query_cache_create(size_t capacity,
+    unsigned compile_flags, unsigned cache_flags);
+
+void query_cache_destroy(struct query_cache *);
+
+/**
+ * Returns false if the query's shape does not compile.
+ */
+bool query_cache_lookup(struct query_cache *, const struct expr *,
+    struct query_plan *);
+
+struct query_cache_stats query_cache_stats(const struct query_cache *);
+
+/**
+ * Evaluates the plan's query against `state`, where the query's
+ * inputs are in `state->ptrs`.
+ */
+void query_plan_run(const struct query_plan *, struct filter_state *);
+
+/**
+ * Fills `bound` with the count and pointers in `state`, permuted for
+ * the plan's shape.  The scratch area is left alone.
+ */
+void query_plan_bind(const struct query_plan *, struct filter_state *bound,
+    const struct filter_state *state);
@@ -0,0 +1,262 @@
+#include "query.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct expr *
+expr_copy(const struct expr *expr)
+{
+        struct expr **args;
+        struct expr *ret;
+
+        if (expr->kind == EXPR_VAR)
+                return expr_var(expr->var);
+
+        args = calloc(expr->n_args, sizeof(args[0]));
+        assert(args != NULL);
+        for (size_t i = 0; i < expr->n_args; i++)
+                args[i] = expr_copy(expr->args[i]);
+
+        ret = expr_nary(expr->kind, expr->n_args, args);
+        free(args);
+        return ret;
+}
+
+static const char *
+kind_name(enum expr_kind kind)
+{
+
+        switch (kind) {
+        case EXPR_VAR:
+                break;
+        case EXPR_NOT:
+                return "not";
+        case EXPR_AND:
+                return "and";
+        case EXPR_OR:
+                return "or";
+        case EXPR_XOR:
+                return "xor";
+        }
+
+        __builtin_unreachable();
+}
+
+static void
+format(FILE *stream, const struct expr *expr)
+{
+
+        if (expr->kind == EXPR_VAR) {
+                fprintf(stream, "%zu", expr->var);
+                return;
+        }
+
+        fprintf(stream, "(%s", kind_name(expr->kind));
+        for (size_t i = 0; i < expr->n_args; i++) {
+                fputc(' ', stream);
+                format(stream, expr->args[i]);
+        }
+
+        fputc(')', stream);
+        return;
+}
+
+char *
+expr_format(const struct expr *expr)
+{
+        FILE *stream;
+        char *ret = NULL;
+        size_t size;
+
+        stream = open_memstream(&ret, &size);
+        assert(stream != NULL);
+        format(stream, expr);
+        fclose(stream);
+        return ret;
+}
+
+/**
+ * Total order on shapes: leaves compare equal.
+ */
+static int
+shape_cmp(const struct expr *x, const struct expr *y)
+{
+
+        if (x->kind != y->kind)
+                return (x->kind < y->kind) ? -1 : 1;
+
+        if (x->n_args != y->n_args)
+                return (x->n_args < y->n_args) ? -1 : 1;
+
+        for (size_t i = 0; i < x->n_args; i++) {
+                int r = shape_cmp(x->args[i], y->args[i]);
+
+                if (r != 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int
+shape_cmp_ptr(const void *vx, const void *vy)
+{
+        const struct expr *const *x = vx;
+        const struct expr *const *y = vy;
+
+        return shape_cmp(*x, *y);
+}
+
+static bool
+expr_equal(const struct expr *x, const struct expr *y)
+{
+
+        if (x->kind != y->kind || x->n_args != y->n_args)
+                return false;
+
+        if (x->kind == EXPR_VAR)
+                return x->var == y->var;
+
+        for (size_t i = 0; i < x->n_args; i++) {
+                if (!expr_equal(x->args[i], y->args[i]))
+                        return false;
+        }
+
+        return true;
+}
+
+struct arg_list {
+        struct expr **args;
+        size_t n;
+        size_t capacity;
+};
+
+static void
+push_arg(struct arg_list *list, struct expr *arg)
+{
+
+        if (list->n == list->capacity) {
+                list->capacity = 2 * list->capacity + 4;
+                list->args = realloc(list->args,
+                    list->capacity * sizeof(list->args[0]));
+                assert(list->args != NULL);
+        }
+
+        list->args[list->n++] = arg;
+        return;
+}
+
+/**
+ * Canonicalise `expr`'s arguments and splice nested nodes of the same
+ * kind into `list`.
+ */
+static void
+flatten_into(struct arg_list *list, enum expr_kind kind,
+    const struct expr *expr)
+{
+
+        for (size_t i = 0; i < expr->n_args; i++) {
+                struct expr *arg = expr_canonicalise(expr->args[i]);
+
+                if (arg->kind != kind) {
+                        push_arg(list, arg);
+                        continue;
+                }
+
+                for (size_t j = 0; j < arg->n_args; j++)
+                        push_arg(list, arg->args[j]);
+
+                arg->n_args = 0;
+                expr_destroy(arg);
+        }
+
+        return;
+}
+
+struct expr *
+expr_canonicalise(const struct expr *expr)
+{
+        struct arg_list list = { .args = NULL };
+        struct expr *ret;
+        size_t n = 0;
+
+        switch (expr->kind) {
+        case EXPR_VAR:
+                return expr_var(expr->var);
+        case EXPR_NOT:
+                ret = expr_canonicalise(expr->args[0]);
+                if (ret->kind == EXPR_NOT) {
+                        struct expr *inner = ret->args[0];
+
+                        ret->n_args = 0;
+                        expr_destroy(ret);
+                        return inner;
+                }
+
+                return expr_not(ret);
+        default:
+                break;
+        }
+
+        flatten_into(&list, expr->kind, expr);
+
+        /* x & x = x | x = x. */
+        for (size_t i = 0; i < list.n; i++) {
+                bool dup = false;
+
+                for (size_t j = 0; j < n && expr->kind != EXPR_XOR; j++)
+                        dup = dup || expr_equal(list.args[i], list.args[j]);
+
+                if (dup)
+                        expr_destroy(list.args[i]);
+                else
+                        list.args[n++] = list.args[i];
+        }
+
+        if (n == 1) {
+                ret = list.args[0];
+        } else {
+                qsort(list.args, n, sizeof(list.args[0]), shape_cmp_ptr);
+                ret = expr_nary(expr->kind, n, list.args);
+        }
+
+        free(list.args);
+        return ret;
+}
+
+static void
+rename_inputs(struct expr *expr, size_t *inputs, size_t *n_inputs)
+{
+
+        if (expr->kind != EXPR_VAR) {
+                for (size_t i = 0; i < expr->n_args; i++)
+                        rename_inputs(expr->args[i], inputs, n_inputs);
+                return;
+        }
+
+        for (size_t i = 0; i < *n_inputs; i++) {
+                if (inputs[i] == expr->var) {
+                        expr->var = i + 1;
+                        return;
+                }
+        }
+
+        assert(*n_inputs < FILTER_MAX_PTRS - 1);
+        inputs[(*n_inputs)++] = expr->var;
+        expr->var = *n_inputs;
+        return;
+}
+
+struct expr *
+expr_shape(const struct expr *expr, size_t *inputs, size_t *n_inputs)
+{
+        struct expr *ret;
+
+        ret = expr_canonicalise(expr);
+        *n_inputs = 0;
+        rename_inputs(ret, inputs, n_inputs);
+        return ret;
+}
@@ -0,0 +1,544 @@
+#include "query.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_SPILL_SLOTS                                                 \
+        (sizeof(((struct filter_state *)0)->scratch.val) / sizeof(__m256i))
+
+enum {
+        NO_REG = -1,
+};
+
+#define NO_VALUE SIZE_MAX
+
+/**
+ * A value computed by the program.  Values live in a register or,
+ * after a spill, in a scratch slot.  Values are numbered in
+ * allocation order, and the oldest ones are the ones we'll need last.
+ */
+struct value {
+        int reg;
+        size_t slot;
+};
+
+/**
+ * Where a DAG node used more than once lives after its first
+ * evaluation, and how many uses are left.
+ */
+struct shared {
+        size_t slot;
+        size_t remaining;
+};
+
+struct codegen {
+        const struct query_dag *dag;
+        bool cse;
+        /* Per node. */
+        size_t *need;
+        struct shared *shared;
+
+        struct vm_insn *insns;
+        size_t n_insns;
+        size_t cap_insns;
+
+        struct value *values;
+        size_t n_values;
+        size_t cap_values;
+
+        size_t owner[THREADED_NREG];
+        bool slot_used[NUM_SPILL_SLOTS];
+        size_t n_spills;
+        bool failed;
+};
+
+static void
+emit(struct codegen *cg, enum vm_opcode opcode, int reg, int src, size_t arg)
+{
+        struct vm_insn *insn;
+
+        if (cg->n_insns == cg->cap_insns) {
+                cg->cap_insns = 2 * cg->cap_insns + 16;
+                cg->insns = realloc(cg->insns,
+                    cg->cap_insns * sizeof(cg->insns[0]));
+                assert(cg->insns != NULL);
+        }
+
+        insn = &cg->insns[cg->n_insns++];
+        *insn = (struct vm_insn) {
+                .opcode = opcode,
+                .reg = reg,
+                .src = src,
+                .arg = { arg },
+        };
+        return;
+}
+
+static size_t
+new_value(struct codegen *cg, int reg)
+{
+        size_t ret = cg->n_values++;
+
+        if (ret == cg->cap_values) {
+                cg->cap_values = 2 * cg->cap_values + 16;
+                cg->values = realloc(cg->values,
+                    cg->cap_values * sizeof(cg->values[0]));
+                assert(cg->values != NULL);
+        }
+
+        cg->values[ret] = (struct value) { .reg = reg };
+        cg->owner[reg] = ret;
+        return ret;
+}
+
+static size_t
+alloc_slot(struct codegen *cg)
+{
+
+        for (size_t i = 0; i < NUM_SPILL_SLOTS; i++) {
+                if (!cg->slot_used[i]) {
+                        cg->slot_used[i] = true;
+                        if (i >= cg->n_spills)
+                                cg->n_spills = i + 1;
+                        return i;
+                }
+        }
+
+        cg->failed = true;
+        return 0;
+}
+
+/**
+ * Find a free register, spilling the oldest value other than `keep`
+ * if necessary.
+ */
+static int
+get_reg(struct codegen *cg, size_t keep)
+{
+        int victim = NO_REG;
+        size_t slot;
+
+        for (int i = 0; i < THREADED_NREG; i++) {
+                if (cg->owner[i] == NO_VALUE)
+                        return i;
+        }
+
+        for (int i = 0; i < THREADED_NREG; i++) {
+                if (cg->owner[i] == keep)
+                        continue;
+
+                if (victim == NO_REG || cg->owner[i] < cg->owner[victim])
+                        victim = i;
+        }
+
+        assert(victim != NO_REG);
+        slot = alloc_slot(cg);
+        emit(cg, VM_SPILL, victim, 0, slot);
+        cg->values[cg->owner[victim]] = (struct value) {
+                .reg = NO_REG,
+                .slot = slot,
+        };
+        cg->owner[victim] = NO_VALUE;
+        return victim;
+}
+
+static void
+ensure_reg(struct codegen *cg, size_t value, size_t keep)
+{
+        struct value *v = &cg->values[value];
+        int reg;
+
+        if (v->reg != NO_REG)
+                return;
+
+        reg = get_reg(cg, keep);
+        emit(cg, VM_FILL, reg, 0, v->slot);
+        cg->slot_used[v->slot] = false;
+        v->reg = reg;
+        cg->owner[reg] = value;
+        return;
+}
+
+static void
+release(struct codegen *cg, size_t value)
+{
+        int reg = cg->values[value].reg;
+
+        assert(reg != NO_REG);
+        cg->owner[reg] = NO_VALUE;
+        return;
+}
+
+/**
+ * Number of registers needed to evaluate node `id` without spilling,
+ * when the arguments of n-ary operators are evaluated in decreasing
+ * order of need.  Memoised in `cg->need`.
+ */
+static size_t
+need(struct codegen *cg, size_t id)
+{
+        const struct dag_node *node = &cg->dag->nodes[id];
+        size_t max = 0;
+        size_t ret = 0;
+
+        if (cg->need[id] != 0)
+                return cg->need[id];
+
+        switch (node->kind) {
+        case EXPR_VAR:
+                return cg->need[id] = 1;
+        case EXPR_NOT:
+                return cg->need[id] = need(cg, node->args[0]);
+        default:
+                break;
+        }
+
+        /* The first argument gets all registers, others one fewer. */
+        for (size_t i = 0; i < node->n_args; i++) {
+                size_t n = need(cg, node->args[i]);
+
+                if (n > max) {
+                        ret = (max + 1 > n) ? max + 1 : n;
+                        max = n;
+                } else if (n + 1 > ret) {
+                        ret = n + 1;
+                }
+        }
+
+        return cg->need[id] = ret;
+}
+
+struct arg_need {
+        size_t arg;
+        size_t need;
+        bool negated;
+        size_t index;
+};
+
+/**
+ * Sort by decreasing need.  On ties, evaluate negated arguments
+ * last, so that `and` can consume them as `andn`.
+ */
+static int
+cmp_need_desc(const void *vx, const void *vy)
+{
+        const struct arg_need *x = vx;
+        const struct arg_need *y = vy;
+
+        if (x->need != y->need)
+                return (x->need > y->need) ? -1 : 1;
+
+        if (x->negated != y->negated)
+                return x->negated ? 1 : -1;
+
+        if (x->index == y->index)
+                return 0;
+
+        return (x->index < y->index) ? -1 : 1;
+}
+
+static size_t gen(struct codegen *, size_t);
+
+static size_t
+gen_nary(struct codegen *cg, const struct dag_node *node)
+{
+        struct arg_need *order;
+        enum vm_opcode opcode;
+        size_t acc;
+
+        switch (node->kind) {
+        case EXPR_AND:
+                opcode = VM_AND;
+                break;
+        case EXPR_OR:
+                opcode = VM_OR;
+                break;
+        case EXPR_XOR:
+                opcode = VM_XOR;
+                break;
+        default:
+                __builtin_unreachable();
+        }
+
+        order = calloc(node->n_args, sizeof(order[0]));
+        assert(order != NULL);
+        for (size_t i = 0; i < node->n_args; i++) {
+                size_t arg = node->args[i];
+
+                order[i] = (struct arg_need) {
+                        .arg = arg,
+                        .need = need(cg, arg),
+                        .negated = cg->dag->nodes[arg].kind == EXPR_NOT,
+                        .index = i,
+                };
+        }
+
+        qsort(order, node->n_args, sizeof(order[0]), cmp_need_desc);
+
+        acc = gen(cg, order[0].arg);
+        for (size_t i = 1; i < node->n_args; i++) {
+                size_t other = gen(cg, order[i].arg);
+
+                ensure_reg(cg, acc, other);
+                emit(cg, opcode, cg->values[acc].reg,
+                    cg->values[other].reg, 0);
+                release(cg, other);
+        }
+
+        free(order);
+        return acc;
+}
+
+/**
+ * Reload a shared node from its scratch slot, and free the slot
+ * after the last use.
+ */
+static size_t
+gen_shared(struct codegen *cg, size_t id)
+{
+        size_t slot = cg->shared[id].slot;
+        int reg = get_reg(cg, NO_VALUE);
+        size_t ret = new_value(cg, reg);
+
+        emit(cg, VM_FILL, reg, 0, slot);
+        if (--cg->shared[id].remaining == 0) {
+                cg->slot_used[slot] = false;
+                cg->shared[id].slot = NO_VALUE;
+        }
+
+        return ret;
+}
+
+/**
+ * Returns a value that is in a register.
+ */
+static size_t
+gen(struct codegen *cg, size_t id)
+{
+        const struct dag_node *node = &cg->dag->nodes[id];
+        size_t ret;
+        int reg;
+
+        if (cg->shared[id].slot != NO_VALUE)
+                return gen_shared(cg, id);
+
+        switch (node->kind) {
+        case EXPR_VAR:
+                reg = get_reg(cg, NO_VALUE);
+                ret = new_value(cg, reg);
+                emit(cg, VM_LOAD, reg, 0, node->var);
+                /* Never worth a slot: reloading costs as much as a fill. */
+                return ret;
+        case EXPR_NOT:
+                ret = gen(cg, node->args[0]);
+                ensure_reg(cg, ret, NO_VALUE);
+                emit(cg, VM_NOT, cg->values[ret].reg, 0, 0);
+                break;
+        default:
+                ret = gen_nary(cg, node);
+                ensure_reg(cg, ret, NO_VALUE);
+                break;
+        }
+
+        if (cg->cse && node->uses > 1) {
+                size_t slot = alloc_slot(cg);
+
+                emit(cg, VM_SPILL, cg->values[ret].reg, 0, slot);
+                cg->shared[id] = (struct shared) {
+                        .slot = slot,
+                        .remaining = node->uses - 1,
+                };
+        }
+
+        return ret;
+}
+
+static op_t *
+lower(const struct vm_insn *insn)
+{
+        const struct threaded_prims *prims = &threaded_prims;
+        const struct threaded_supers *supers = &threaded_supers;
+
+        switch (insn->opcode) {
+        case VM_LOAD:
+                return prims->load[insn->reg];
+        case VM_STORE:
+                return prims->store[insn->reg];
+        case VM_SPILL:
+                return prims->spill[insn->reg];
+        case VM_FILL:
+                return prims->fill[insn->reg];
+        case VM_NOT:
+                return prims->negate[insn->reg];
+        case VM_OR:
+                return prims->bin[THREADED_OR][insn->reg][insn->src];
+        case VM_AND:
+                return prims->bin[THREADED_AND][insn->reg][insn->src];
+        case VM_XOR:
+                return prims->bin[THREADED_XOR][insn->reg][insn->src];
+        case VM_LOOP:
+                return prims->loop;
+        case VM_OR_MEM:
+                return supers->mem[THREADED_OR][insn->reg];
+        case VM_AND_MEM:
+                return supers->mem[THREADED_AND][insn->reg];
+        case VM_XOR_MEM:
+                return supers->mem[THREADED_XOR][insn->reg];
+        case VM_ANDN:
+                return supers->andn[insn->reg][insn->src];
+        case VM_ANDN_MEM:
+                return supers->andn_mem[insn->reg];
+        case VM_LOAD_OR2:
+                return supers->load_or2[insn->reg];
+        case VM_LOAD_OR3:
+                return supers->load_or3[insn->reg];
+        case VM_OR2_MEM:
+                return supers->or2_mem[insn->reg];
+        case VM_OR3_MEM:
+                return supers->or3_mem[insn->reg];
+        case VM_XOR_OR:
+                return supers->xor_or[insn->reg];
+        case VM_AND_XOR_MEM:
+                return supers->and_xor_mem[insn->reg];
+        case VM_AND_XOR_OR_MEM:
+                return supers->and_xor_or_mem[insn->reg];
+        case VM_STORE_LOOP:
+                return supers->store_loop[insn->reg];
+        }
+
+        __builtin_unreachable();
+}
+
+struct query_program *
+query_compile_batch(const struct expr *const *exprs, const size_t *dsts,
+    size_t n_exprs, unsigned flags)
+{
+        struct codegen cg = { .failed = false };
+        struct query_dag *dag = query_dag_create();
+        struct query_program *ret;
+        size_t *roots;
+
+        roots = calloc(n_exprs, sizeof(roots[0]));
+        assert(roots != NULL);
+        for (size_t i = 0; i < n_exprs; i++)
+                roots[i] = query_dag_add(dag, exprs[i]);
+
+        cg.dag = dag;
+        cg.cse = (flags & QUERY_NO_CSE) == 0;
+        cg.need = calloc(dag->n_nodes, sizeof(cg.need[0]));
+        cg.shared = calloc(dag->n_nodes, sizeof(cg.shared[0]));
+        assert(cg.need != NULL && cg.shared != NULL);
+        for (size_t i = 0; i < dag->n_nodes; i++)
+                cg.shared[i].slot = NO_VALUE;
+
+        for (size_t i = 0; i < THREADED_NREG; i++)
+                cg.owner[i] = NO_VALUE;
+
+        for (size_t i = 0; i < n_exprs; i++) {
+                size_t root = gen(&cg, roots[i]);
+
+                emit(&cg, VM_STORE, cg.values[root].reg, 0, dsts[i]);
+                release(&cg, root);
+        }
+
+        emit(&cg, VM_LOOP, 0, 0, 0);
+        free(cg.values);
+        free(cg.shared);
+        free(cg.need);
+        free(roots);
+        query_dag_destroy(dag);
+
+        if (cg.failed) {
+                free(cg.insns);
+                return NULL;
+        }
+
+        if ((flags & QUERY_NO_SUPERINSTRUCTIONS) == 0)
+                cg.n_insns = query_tile(cg.insns, cg.n_insns);
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->n_insns = cg.n_insns;
+        ret->insns = cg.insns;
+        ret->n_spills = cg.n_spills;
+        ret->ops = calloc(ret->n_insns, sizeof(ret->ops[0]));
+        assert(ret->ops != NULL);
+        for (size_t i = 0; i < ret->n_insns; i++) {
+                const struct vm_insn *insn = &ret->insns[i];
+
+                ret->ops[i] = (struct op) {
+                        .op = lower(insn),
+                        .arg = insn->arg[0],
+                        .arg1 = insn->arg[1],
+                        .arg2 = insn->arg[2],
+                };
+        }
+
+        return ret;
+}
+
+struct query_program *
+query_compile(const struct expr *expr, unsigned flags)
+{
+        static const size_t dst = 0;
+
+        return query_compile_batch(&expr, &dst, 1, flags);
+}
+
+size_t
+vm_insn_n_ptrs(const struct vm_insn *insn)
+{
+
+        switch (insn->opcode) {
+        case VM_LOAD:
+        case VM_STORE:
+        case VM_OR_MEM:
+        case VM_AND_MEM:
+        case VM_XOR_MEM:
+        case VM_ANDN_MEM:
+        case VM_STORE_LOOP:
+                return 1;
+        case VM_LOAD_OR2:
+        case VM_OR2_MEM:
+        case VM_AND_XOR_MEM:
+                return 2;
+        case VM_LOAD_OR3:
+        case VM_OR3_MEM:
+        case VM_XOR_OR:
+        case VM_AND_XOR_OR_MEM:
+                return 3;
+        default:
+                return 0;
+        }
+}
+
+void
+query_program_destroy(struct query_program *program)
+{
+
+        if (program == NULL)
+                return;
+
+        free(program->insns);
+        free(program->ops);
+        free(program);
+        return;
+}
+
+void
+query_run(const struct query_program *program, struct filter_state *state)
+{
+
+        if (state->count > 0) {
+                const struct op_list *ops = (const void *)program->ops;
+                __m256i zero = { 0 };
+
+                ops->ops[0].op(state, ops, sizeof(struct op), 0,
+                               ops->ops[0].arg,
+                               zero, zero, zero, zero);
+        }
+
+        return;
+}
@@ -0,0 +1,196 @@
+#include "query.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Hash-consing: a node is identified by its kind, variable and
+ * argument node ids, and the arguments of commutative operators are
+ * sorted by id, so structurally equal subexpressions map to the same
+ * node, however they're written.
+ */
+
+static uint64_t
+hash_node(enum expr_kind kind, size_t var, size_t n_args, const size_t *args)
+{
+        uint64_t ret = 0xcbf29ce484222325ULL;
+        uint64_t words[2] = { kind, var };
+
+        for (size_t i = 0; i < 2 + n_args; i++) {
+                ret ^= (i < 2) ? words[i] : args[i - 2];
+                ret *= 0x100000001b3ULL;
+                ret ^= ret >> 29;
+        }
+
+        return ret;
+}
+
+static bool
+node_equal(const struct dag_node *node, enum expr_kind kind, size_t var,
+    size_t n_args, const size_t *args)
+{
+
+        return node->kind == kind && node->var == var &&
+            node->n_args == n_args &&
+            memcmp(node->args, args, n_args * sizeof(args[0])) == 0;
+}
+
+static void
+grow_buckets(struct query_dag *dag)
+{
+        size_t n_buckets = 2 * dag->n_buckets + 16;
+        size_t *buckets;
+
+        buckets = malloc(n_buckets * sizeof(buckets[0]));
+        assert(buckets != NULL);
+        for (size_t i = 0; i < n_buckets; i++)
+                buckets[i] = SIZE_MAX;
+
+        /* Open addressing, linear probing. */
+        for (size_t i = 0; i < dag->n_nodes; i++) {
+                size_t j = dag->nodes[i].hash % n_buckets;
+
+                while (buckets[j] != SIZE_MAX)
+                        j = (j + 1) % n_buckets;
+                buckets[j] = i;
+        }
+
+        free(dag->buckets);
+        dag->buckets = buckets;
+        dag->n_buckets = n_buckets;
+        return;
+}
+
+/**
+ * Returns the node for (kind, var, args), creating it if needed.
+ * Takes ownership of `args`.
+ */
+static size_t
+intern(struct query_dag *dag, enum expr_kind kind, size_t var,
+    size_t n_args, size_t *args)
+{
+        uint64_t hash = hash_node(kind, var, n_args, args);
+        struct dag_node *node;
+        size_t i;
+
+        if (2 * (dag->n_nodes + 1) > dag->n_buckets)
+                grow_buckets(dag);
+
+        for (i = hash % dag->n_buckets; dag->buckets[i] != SIZE_MAX;
+             i = (i + 1) % dag->n_buckets) {
+                node = &dag->nodes[dag->buckets[i]];
+                if (node->hash == hash &&
+                    node_equal(node, kind, var, n_args, args)) {
+                        free(args);
+                        return dag->buckets[i];
+                }
+        }
+
+        if (dag->n_nodes == dag->cap_nodes) {
+                dag->cap_nodes = 2 * dag->cap_nodes + 16;
+                dag->nodes = realloc(dag->nodes,
+                    dag->cap_nodes * sizeof(dag->nodes[0]));
+                assert(dag->nodes != NULL);
+        }
+
+        dag->buckets[i] = dag->n_nodes;
+        dag->nodes[dag->n_nodes] = (struct dag_node) {
+                .kind = kind,
+                .var = var,
+                .n_args = n_args,
+                .args = args,
+                .hash = hash,
+        };
+
+        for (size_t j = 0; j < n_args; j++)
+                dag->nodes[args[j]].uses++;
+
+        return dag->n_nodes++;
+}
+
+static int
+cmp_size(const void *vx, const void *vy)
+{
+        size_t x = *(const size_t *)vx;
+        size_t y = *(const size_t *)vy;
+
+        if (x == y)
+                return 0;
+
+        return (x < y) ? -1 : 1;
+}
+
+static size_t
+add_expr(struct query_dag *dag, const struct expr *expr)
+{
+        size_t n_args = expr->n_args;
+        size_t *args = NULL;
+
+        if (expr->kind == EXPR_VAR)
+                return intern(dag, EXPR_VAR, expr->var, 0, NULL);
+
+        args = calloc(n_args, sizeof(args[0]));
+        assert(args != NULL);
+        for (size_t i = 0; i < n_args; i++)
+                args[i] = add_expr(dag, expr->args[i]);
+
+        if (expr->kind != EXPR_NOT)
+                qsort(args, n_args, sizeof(args[0]), cmp_size);
+
+        /* x & x = x | x = x. */
+        if (expr->kind == EXPR_AND || expr->kind == EXPR_OR) {
+                size_t n = 0;
+
+                for (size_t i = 0; i < n_args; i++) {
+                        if (n == 0 || args[n - 1] != args[i])
+                                args[n++] = args[i];
+                }
+
+                n_args = n;
+                if (n_args == 1) {
+                        size_t ret = args[0];
+
+                        free(args);
+                        return ret;
+                }
+        }
+
+        return intern(dag, expr->kind, 0, n_args, args);
+}
+
+struct query_dag *
+query_dag_create(void)
+{
+        struct query_dag *ret;
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        return ret;
+}
+
+size_t
+query_dag_add(struct query_dag *dag, const struct expr *expr)
+{
+        size_t ret = add_expr(dag, expr);
+
+        dag->nodes[ret].uses++;
+        return ret;
+}
+
+void
+query_dag_destroy(struct query_dag *dag)
+{
+
+        if (dag == NULL)
+                return;
+
+        for (size_t i = 0; i < dag->n_nodes; i++)
+                free(dag->nodes[i].args);
+
+        free(dag->nodes);
+        free(dag->buckets);
+        free(dag);
+        return;
+}
@@ -0,0 +1,115 @@
+#include "deque.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+/*
+ * Memory orders follow Lê, Pop, Cohen and Zappa Nardelli's "Correct
+ * and Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).
+ */
+
+void
+task_deque_reset(struct task_deque *deque, size_t capacity)
+{
+        size_t size = 1;
+
+        while (size < capacity)
+                size *= 2;
+
+        if (deque->slots == NULL || deque->mask + 1 < size) {
+                free(deque->slots);
+                deque->slots = calloc(size, sizeof(deque->slots[0]));
+                assert(deque->slots != NULL);
+                deque->mask = size - 1;
+        }
+
+        deque->top = 0;
+        deque->bottom = 0;
+        return;
+}
+
+void
+task_deque_fini(struct task_deque *deque)
+{
+
+        free(deque->slots);
+        deque->slots = NULL;
+        return;
+}
+
+static void
+store_slot(struct pool_task *slot, struct pool_task task)
+{
+
+        __atomic_store_n(&slot->job, task.job, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->begin, task.begin, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->end, task.end, __ATOMIC_RELAXED);
+        return;
+}
+
+static struct pool_task
+load_slot(const struct pool_task *slot)
+{
+
+        return (struct pool_task) {
+                .job = __atomic_load_n(&slot->job, __ATOMIC_RELAXED),
+                .begin = __atomic_load_n(&slot->begin, __ATOMIC_RELAXED),
+                .end = __atomic_load_n(&slot->end, __ATOMIC_RELAXED),
+        };
+}
+
+void
+task_deque_push(struct task_deque *deque, struct pool_task task)
+{
+        int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+        int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+        assert((size_t)(bottom - top) <= deque->mask);
+        store_slot(&deque->slots[bottom & deque->mask], task);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return;
+}
+
+bool
+task_deque_pop(struct task_deque *deque, struct pool_task *out)
+{
+        int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+        int64_t top;
+        bool ret = true;
+
+        __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+        if (top > bottom) {
+                __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+                return false;
+        }
+
+        *out = load_slot(&deque->slots[bottom & deque->mask]);
+        if (top == bottom) {
+                /* Last task: race thieves for it. */
+                ret = __atomic_compare_exchange_n(&deque->top, &top, top + 1,
+                    false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+                __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        }
+
+        return ret;
+}
+
+bool
+task_deque_steal(struct task_deque *deque, struct pool_task *out)
+{
+        int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+        int64_t bottom;
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+        if (top >= bottom)
+                return false;
+
+        *out = load_slot(&deque->slots[top & deque->mask]);
+        return __atomic_compare_exchange_n(&deque->top, &top, top + 1,
+            false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
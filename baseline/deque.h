@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A range of vectors in one job of a batch.
+ */
+struct pool_task {
+        size_t job;
+        size_t begin;
+        size_t end;
+};
+
+/**
+ * Chase-Lev work-stealing deque, with a fixed power-of-two capacity.
+ * The owner pushes and pops at the bottom, and any thread may steal
+ * from the top.
+ *
+ * The slots are only accessed with atomic loads and stores of each
+ * field: a thief may read a slot while the owner overwrites it, but
+ * then fails the CAS on `top` and discards what it read.
+ */
+struct task_deque {
+        int64_t top;
+        int64_t bottom;
+        size_t mask;
+        struct pool_task *slots;
+};
+
+/**
+ * (Re)initialises an empty deque with room for at least `capacity`
+ * tasks.  Not thread-safe.
+ */
+void task_deque_reset(struct task_deque *, size_t capacity);
+
+void task_deque_fini(struct task_deque *);
+
+/**
+ * Owner only.  The deque must not be full.
+ */
+void task_deque_push(struct task_deque *, struct pool_task);
+
+/**
+ * Owner only.  Returns false if the deque is empty.
+ */
+bool task_deque_pop(struct task_deque *, struct pool_task *);
+
+/**
+ * Any thread.  Returns false if the deque looked empty, or we lost a
+ * race for its top task.
+ */
+bool task_deque_steal(struct task_deque *, struct pool_task *);
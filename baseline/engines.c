@@ -0,0 +1,209 @@
+#include "engines.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "vector.h"
+
+const struct query_engines *query_engines_current;
+
+void
+query_engines_compile(struct query_engines *engines, const struct expr *expr,
+    const struct planner *planner, size_t expected_runs,
+    const double *densities)
+{
+
+        memset(engines, 0, sizeof(*engines));
+        engines->blocked = blocked_compile(expr, NULL);
+        engines->planned = planner_compile(planner, expr, expected_runs,
+            densities);
+        assert(engines->planned != NULL);
+        if (!vector_avx2_supported())
+                return;
+
+        engines->program = query_compile(expr, QUERY_NO_SUPERINSTRUCTIONS);
+        assert(engines->program != NULL);
+        engines->program_fused = query_compile(expr, 0);
+        assert(engines->program_fused != NULL);
+        engines->stitched = stitch_query(engines->program_fused);
+        assert(engines->stitched != NULL);
+        engines->short_circuit = short_circuit_compile(expr, densities, 0);
+        assert(engines->short_circuit != NULL);
+        engines->ternlog = ternlog_partition(expr);
+        engines->ternlog_threaded = ternlog_thread(engines->ternlog);
+        return;
+}
+
+void
+query_engines_destroy(struct query_engines *engines)
+{
+
+        planned_query_destroy(engines->planned);
+        blocked_destroy(engines->blocked);
+        if (!vector_avx2_supported())
+                return;
+
+        ternlog_threaded_destroy(engines->ternlog_threaded);
+        ternlog_program_destroy(engines->ternlog);
+        short_circuit_destroy(engines->short_circuit);
+        stitched_query_destroy(engines->stitched);
+        query_program_destroy(engines->program_fused);
+        query_program_destroy(engines->program);
+        return;
+}
+
+void
+compiled_inreg(struct filter_state *state)
+{
+
+        query_run(query_engines_current->program, state);
+        return;
+}
+
+void
+compiled_inreg_fused(struct filter_state *state)
+{
+
+        query_run(query_engines_current->program_fused, state);
+        return;
+}
+
+void
+stitched_fused(struct filter_state *state)
+{
+
+        stitch_run(query_engines_current->stitched, state);
+        return;
+}
+
+void
+blocked_adaptive(struct filter_state *state)
+{
+
+        blocked_run(query_engines_current->blocked, state);
+        return;
+}
+
+void
+compiled_short_circuit(struct filter_state *state)
+{
+
+        short_circuit_run(query_engines_current->short_circuit, state);
+        return;
+}
+
+void
+planned(struct filter_state *state)
+{
+
+        planned_query_run(query_engines_current->planned, state);
+        return;
+}
+
+void
+planned_threaded(struct filter_state *state)
+{
+
+        planned_query_run_with(query_engines_current->planned,
+            PLANNER_THREADED, state);
+        return;
+}
+
+void
+planned_stitched(struct filter_state *state)
+{
+
+        planned_query_run_with(query_engines_current->planned,
+            PLANNER_STITCHED, state);
+        return;
+}
+
+void
+planned_blocked(struct filter_state *state)
+{
+
+        planned_query_run_with(query_engines_current->planned,
+            PLANNER_BLOCKED, state);
+        return;
+}
+
+void
+planned_short_circuit(struct filter_state *state)
+{
+
+        planned_query_run_with(query_engines_current->planned,
+            PLANNER_SHORT_CIRCUIT, state);
+        return;
+}
+
+void
+planned_baseline(struct filter_state *state)
+{
+
+        planned_query_run_with(query_engines_current->planned,
+            PLANNER_BASELINE, state);
+        return;
+}
+
+void
+planned_fused_blocking(struct filter_state *state)
+{
+
+        planned_query_run_with(query_engines_current->planned,
+            PLANNER_FUSED_BLOCKING, state);
+        return;
+}
+
+void
+ternlog_blocked(struct filter_state *state)
+{
+
+        ternlog_run(query_engines_current->ternlog, state);
+        return;
+}
+
+void
+ternlog_threaded(struct filter_state *state)
+{
+
+        ternlog_threaded_run(query_engines_current->ternlog_threaded, state);
+        return;
+}
+
+const struct query_engine query_engine_table[] = {
+        { "compiled_inreg", compiled_inreg, true, false },
+        { "compiled_inreg_fused", compiled_inreg_fused, true, false },
+        { "stitched_fused", stitched_fused, true, false },
+        { "blocked_adaptive", blocked_adaptive, false, false },
+        { "compiled_short_circuit", compiled_short_circuit, true, false },
+        { "planned", planned, false, false },
+        { "planned_threaded", planned_threaded, true, false },
+        { "planned_stitched", planned_stitched, true, false },
+        { "planned_blocked", planned_blocked, false, false },
+        { "planned_short_circuit", planned_short_circuit, true, false },
+        { "planned_baseline", planned_baseline, false, false },
+        { "planned_fused_blocking", planned_fused_blocking, false, false },
+        { "ternlog", ternlog_blocked, true, true },
+        { "ternlog_threaded", ternlog_threaded, true, true },
+};
+
+const size_t query_engine_count =
+    sizeof(query_engine_table) / sizeof(query_engine_table[0]);
+
+bool
+query_engine_available(const struct query_engine *engine)
+{
+
+        if (engine->avx2 && !vector_avx2_supported())
+                return false;
+
+        if (engine->avx512 && !__builtin_cpu_supports("avx512f"))
+                return false;
+
+        /* Not every partition has a threaded form. */
+        if (engine->fn == ternlog_threaded &&
+            query_engines_current->ternlog_threaded == NULL)
+                return false;
+
+        return true;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "blocked.h"
+#include "interface.h"
+#include "planner.h"
+#include "query.h"
+#include "short_circuit.h"
+#include "stitch.h"
+#include "ternlog.h"
+
+/**
+ * One query compiled for every engine for arbitrary queries, so that
+ * tests, benchmarks and the fuzzer can run them side by side as
+ * filter_fn_t.
+ */
+struct query_engines {
+        struct query_program *program;
+        struct query_program *program_fused;
+        struct stitched_query *stitched;
+        struct blocked_query *blocked;
+        struct short_circuit_query *short_circuit;
+        struct planned_query *planned;
+        struct ternlog_program *ternlog;
+        /* NULL if the partition has no threaded form. */
+        struct ternlog_threaded *ternlog_threaded;
+};
+
+/**
+ * Compiles `expr` for every engine.  `planner` plans for
+ * `expected_runs` runs, and `densities` (may be NULL) are passed to
+ * short_circuit_compile.  Without AVX2 (vector_avx2_supported), only
+ * the blocked and planned engines are compiled, and the others are
+ * NULL.
+ */
+void query_engines_compile(struct query_engines *, const struct expr *,
+    const struct planner *planner, size_t expected_runs,
+    const double *densities);
+
+void query_engines_destroy(struct query_engines *);
+
+/**
+ * The compiled query that the functions below run.
+ */
+extern const struct query_engines *query_engines_current;
+
+void compiled_inreg(struct filter_state *);
+
+void compiled_inreg_fused(struct filter_state *);
+
+void stitched_fused(struct filter_state *);
+
+void blocked_adaptive(struct filter_state *);
+
+void compiled_short_circuit(struct filter_state *);
+
+/**
+ * The planner's choice, then each of its strategies regardless.
+ */
+void planned(struct filter_state *);
+
+void planned_threaded(struct filter_state *);
+
+void planned_stitched(struct filter_state *);
+
+void planned_blocked(struct filter_state *);
+
+void planned_short_circuit(struct filter_state *);
+
+/**
+ * These fall back to threaded unless the query has the sample query's
+ * shape.
+ */
+void planned_baseline(struct filter_state *);
+
+void planned_fused_blocking(struct filter_state *);
+
+/**
+ * Only call these when the CPU supports AVX2 and AVX-512F.
+ */
+void ternlog_blocked(struct filter_state *);
+
+void ternlog_threaded(struct filter_state *);
+
+struct query_engine {
+        const char *name;
+        filter_fn_t *fn;
+        bool avx2;
+        bool avx512;
+};
+
+extern const struct query_engine query_engine_table[];
+extern const size_t query_engine_count;
+
+/**
+ * Whether `engine` can run `query_engines_current` on this CPU.
+ */
+bool query_engine_available(const struct query_engine *);
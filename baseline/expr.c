@@ -0,0 +1,266 @@
+#include "query.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct expr *
+expr_var(size_t var)
+{
+        struct expr *ret;
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->kind = EXPR_VAR;
+        ret->var = var;
+        return ret;
+}
+
+struct expr *
+expr_not(struct expr *arg)
+{
+
+        return expr_nary(EXPR_NOT, 1, &arg);
+}
+
+struct expr *
+expr_nary(enum expr_kind kind, size_t n_args, struct expr **args)
+{
+        struct expr *ret;
+
+        assert(kind != EXPR_VAR);
+        assert(n_args > 0);
+        assert(kind != EXPR_NOT || n_args == 1);
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->kind = kind;
+        ret->n_args = n_args;
+        ret->args = calloc(n_args, sizeof(ret->args[0]));
+        assert(ret->args != NULL);
+        memcpy(ret->args, args, n_args * sizeof(ret->args[0]));
+        return ret;
+}
+
+void
+expr_destroy(struct expr *expr)
+{
+
+        if (expr == NULL)
+                return;
+
+        for (size_t i = 0; i < expr->n_args; i++)
+                expr_destroy(expr->args[i]);
+
+        free(expr->args);
+        free(expr);
+        return;
+}
+
+struct parser {
+        const char *cur;
+        const char *const *names;
+        size_t n_names;
+};
+
+static void
+skip_space(struct parser *parser)
+{
+
+        while (isspace((unsigned char)*parser->cur))
+                parser->cur++;
+        return;
+}
+
+static size_t
+symbol_length(const char *src)
+{
+        size_t ret = 0;
+
+        while (src[ret] != '\0' && src[ret] != '(' && src[ret] != ')' &&
+            !isspace((unsigned char)src[ret]))
+                ret++;
+
+        return ret;
+}
+
+static bool
+symbol_is(const char *sym, size_t len, const char *name)
+{
+
+        return strlen(name) == len && memcmp(sym, name, len) == 0;
+}
+
+static struct expr *
+parse_atom(struct parser *parser)
+{
+        const char *sym = parser->cur;
+        size_t len = symbol_length(sym);
+        size_t var = 0;
+
+        if (len == 0)
+                return NULL;
+
+        parser->cur += len;
+        for (size_t i = 0; i < parser->n_names; i++) {
+                if (parser->names[i] != NULL &&
+                    symbol_is(sym, len, parser->names[i]))
+                        return expr_var(i);
+        }
+
+        for (size_t i = 0; i < len; i++) {
+                if (!isdigit((unsigned char)sym[i]))
+                        return NULL;
+
+                var = 10 * var + (sym[i] - '0');
+                if (var >= FILTER_MAX_PTRS)
+                        return NULL;
+        }
+
+        return expr_var(var);
+}
+
+static struct expr *parse_expr(struct parser *);
+
+static struct expr *
+parse_list(struct parser *parser)
+{
+        static const struct {
+                const char *name;
+                enum expr_kind kind;
+        } ops[] = {
+                { "not", EXPR_NOT },
+                { "and", EXPR_AND },
+                { "or", EXPR_OR },
+                { "xor", EXPR_XOR },
+        };
+        struct expr **args = NULL;
+        struct expr *ret = NULL;
+        size_t n_args = 0;
+        const char *sym;
+        size_t len;
+        int kind = -1;
+
+        skip_space(parser);
+        sym = parser->cur;
+        len = symbol_length(sym);
+        for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+                if (symbol_is(sym, len, ops[i].name))
+                        kind = ops[i].kind;
+        }
+
+        if (kind < 0)
+                return NULL;
+
+        parser->cur += len;
+        for (;;) {
+                struct expr *arg;
+
+                skip_space(parser);
+                if (*parser->cur == ')') {
+                        parser->cur++;
+                        break;
+                }
+
+                arg = parse_expr(parser);
+                if (arg == NULL)
+                        goto out;
+
+                args = realloc(args, (n_args + 1) * sizeof(args[0]));
+                assert(args != NULL);
+                args[n_args++] = arg;
+        }
+
+        if (n_args == 0 || (kind == EXPR_NOT && n_args != 1))
+                goto out;
+
+        ret = expr_nary(kind, n_args, args);
+        n_args = 0;
+
+out:
+        for (size_t i = 0; i < n_args; i++)
+                expr_destroy(args[i]);
+        free(args);
+        return ret;
+}
+
+static struct expr *
+parse_expr(struct parser *parser)
+{
+
+        skip_space(parser);
+        if (*parser->cur == '(') {
+                parser->cur++;
+                return parse_list(parser);
+        }
+
+        return parse_atom(parser);
+}
+
+struct expr *
+expr_parse(const char *src, const char *const *names, size_t n_names)
+{
+        struct parser parser = {
+                .cur = src,
+                .names = names,
+                .n_names = n_names,
+        };
+        struct expr *ret;
+
+        ret = parse_expr(&parser);
+        if (ret == NULL)
+                return NULL;
+
+        skip_space(&parser);
+        if (*parser.cur != '\0') {
+                expr_destroy(ret);
+                return NULL;
+        }
+
+        return ret;
+}
+
+static uint64_t
+eval_word(const struct expr *expr, const struct filter_state *state,
+    size_t word)
+{
+        uint64_t acc;
+
+        switch (expr->kind) {
+        case EXPR_VAR:
+                return ((const uint64_t *)state->ptrs[expr->var])[word];
+        case EXPR_NOT:
+                return ~eval_word(expr->args[0], state, word);
+        case EXPR_AND:
+                acc = ~(uint64_t)0;
+                for (size_t i = 0; i < expr->n_args; i++)
+                        acc &= eval_word(expr->args[i], state, word);
+                return acc;
+        case EXPR_OR:
+                acc = 0;
+                for (size_t i = 0; i < expr->n_args; i++)
+                        acc |= eval_word(expr->args[i], state, word);
+                return acc;
+        case EXPR_XOR:
+                acc = 0;
+                for (size_t i = 0; i < expr->n_args; i++)
+                        acc ^= eval_word(expr->args[i], state, word);
+                return acc;
+        }
+
+        __builtin_unreachable();
+}
+
+void
+expr_eval(const struct expr *expr, struct filter_state *state)
+{
+        size_t n_words = state->count * sizeof(__m256i) / sizeof(uint64_t);
+        uint64_t *dst = (uint64_t *)state->dst;
+
+        for (size_t i = 0; i < n_words; i++)
+                dst[i] = eval_word(expr, state, i);
+
+        return;
+}
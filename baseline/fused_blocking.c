@@ -1,4 +1,9 @@
 #include "interface.h"
+#include "policy.h"
+#include "popcount.h"
+#include "sink.h"
+
+#include <stdbool.h>
 
 static NO_INLINE __m256i
 block_xor_or(__m256i noise,
@@ -54,3 +59,155 @@ fused_blocking(struct filter_state *restrict state)
 
         return;
 }
+
+void
+fused_blocking_count(struct filter_state *restrict state)
+{
+        size_t count = state->count;
+        __m256i *restrict tmp = state->scratch.val;
+        const __m256i *restrict x0 = state->x0;
+        const __m256i *restrict x1 = state->x1;
+        const __m256i *restrict neg_x = state->neg_x;
+        const __m256i *restrict y0 = state->y0;
+        const __m256i *restrict neg_y = state->neg_y;
+        struct popcount_acc acc = popcount_acc_init();
+
+        if ((count % BLOCK_SIZE) != 0)
+                __builtin_unreachable();
+
+        for (size_t i = 0; i < count; i+= BLOCK_SIZE) {
+                __m256i noise;
+
+                asm volatile("" : "=x"(noise));
+                block_xor_or(noise, tmp, neg_x + i, x0 + i, x1 + i);
+                asm volatile("" : "=x"(noise));
+                nblock_and_xor(noise, tmp, neg_y + i, y0 + i);
+                popcount_add_block(&acc, tmp);
+        }
+
+        state->popcount = popcount_acc_sum(&acc);
+        return;
+}
+
+void
+fused_blocking_emit(struct filter_state *restrict state)
+{
+        size_t count = state->count;
+        __m256i *restrict tmp = state->scratch.val;
+        const __m256i *restrict x0 = state->x0;
+        const __m256i *restrict x1 = state->x1;
+        const __m256i *restrict neg_x = state->neg_x;
+        const __m256i *restrict y0 = state->y0;
+        const __m256i *restrict neg_y = state->neg_y;
+
+        if ((count % BLOCK_SIZE) != 0)
+                __builtin_unreachable();
+
+        for (size_t i = 0; i < count; i+= BLOCK_SIZE) {
+                __m256i noise;
+
+                asm volatile("" : "=x"(noise));
+                block_xor_or(noise, tmp, neg_x + i, x0 + i, x1 + i);
+                asm volatile("" : "=x"(noise));
+                nblock_and_xor(noise, tmp, neg_y + i, y0 + i);
+                filter_sink_push(state->sink, tmp, BLOCK_SIZE, i);
+        }
+
+        filter_sink_flush(state->sink);
+        return;
+}
+
+static void
+prefetch_block(const __m256i *ptr)
+{
+
+        for (size_t i = 0; i < BLOCK_SIZE; i += 2)
+                _mm_prefetch((const char *)&ptr[i], _MM_HINT_T0);
+
+        return;
+}
+
+void
+fused_blocking_nt(struct filter_state *restrict state)
+{
+        size_t count = state->count;
+        size_t distance = filter_prefetch_distance(5);
+        __m256i *restrict dst = state->dst;
+        __m256i *restrict tmp = state->scratch.val;
+        const __m256i *restrict x0 = state->x0;
+        const __m256i *restrict x1 = state->x1;
+        const __m256i *restrict neg_x = state->neg_x;
+        const __m256i *restrict y0 = state->y0;
+        const __m256i *restrict neg_y = state->neg_y;
+
+        if ((count % BLOCK_SIZE) != 0)
+                __builtin_unreachable();
+
+        /*
+         * nblock_and_xor reads its accumulator back, so work in a
+         * scratch block and only stream the final result to dst.
+         */
+        for (size_t i = 0; i < count; i+= BLOCK_SIZE) {
+                size_t ahead = i + distance;
+                __m256i noise;
+
+                /* Only whole blocks that are in the arrays. */
+                if (ahead + BLOCK_SIZE <= count) {
+                        prefetch_block(x0 + ahead);
+                        prefetch_block(x1 + ahead);
+                        prefetch_block(neg_x + ahead);
+                        prefetch_block(y0 + ahead);
+                        prefetch_block(neg_y + ahead);
+                }
+
+                asm volatile("" : "=x"(noise));
+                block_xor_or(noise, tmp, neg_x + i, x0 + i, x1 + i);
+                asm volatile("" : "=x"(noise));
+                nblock_and_xor(noise, tmp, neg_y + i, y0 + i);
+                for (size_t j = 0; j < BLOCK_SIZE; j++)
+                        _mm256_stream_si256(&dst[i + j], tmp[j]);
+        }
+
+        _mm_sfence();
+        return;
+}
+
+static bool
+block_any(const __m256i *block)
+{
+        __m256i acc = block[0];
+
+        for (size_t i = 1; i < BLOCK_SIZE; i++)
+                acc |= block[i];
+
+        return !_mm256_testz_si256(acc, acc);
+}
+
+void
+fused_blocking_short_circuit(struct filter_state *restrict state)
+{
+        size_t count = state->count;
+        __m256i *restrict dst = state->dst;
+        const __m256i *restrict x0 = state->x0;
+        const __m256i *restrict x1 = state->x1;
+        const __m256i *restrict neg_x = state->neg_x;
+        const __m256i *restrict y0 = state->y0;
+        const __m256i *restrict neg_y = state->neg_y;
+
+        if ((count % BLOCK_SIZE) != 0)
+                __builtin_unreachable();
+
+        for (size_t i = 0; i < count; i+= BLOCK_SIZE) {
+                __m256i noise;
+
+                asm volatile("" : "=x"(noise));
+                block_xor_or(noise, dst + i, neg_x + i, x0 + i, x1 + i);
+                if (!block_any(dst + i))
+                        continue;
+
+                asm volatile("" : "=x"(noise));
+                nblock_and_xor(noise, dst + i, neg_y + i, y0 + i);
+        }
+
+        return;
+}
@@ -0,0 +1,392 @@
+#define RUN_ME /*
+objs=
+for f in noop vector blocked expr arena policy pool deque shapes engines planner; do
+  ${CC:-cc} ${CFLAGS:- -O2 -g} -std=gnu11 -W -Wall -c $f.c -o $f.o || exit
+  objs="$objs $f.o"
+done
+for f in baseline blocking fused_blocking specialised_widget threaded_inreg \
+    compile dag superinstructions tile stitch canon cache ternlog ternlog_avx512 \
+    shared_scan short_circuit roaring sink segment range incremental subexpr_cache; do
+  ${CC:-cc} ${CFLAGS:- -O2 -g} -mavx2 -mpopcnt -mtune=native -std=gnu11 -W -Wall \
+   -c $f.c -o $f.o || exit
+  objs="$objs $f.o"
+done
+exec ${CC:-cc} ${CFLAGS:- -O2 -g} -std=gnu11 -W -Wall \
+ $objs stitch_templates.S -pthread $0 -o $(basename $0 .c)
+
+*/
+/*
+ * Differential fuzzer: decodes each input into a query, a length,
+ * a bit range and input densities, and checks every backend against
+ * expr_eval, aborting on the first mismatch.  Without AVX2, it only
+ * checks the backends that run there, on whole bitmaps.
+ *
+ * Build with `sh fuzz.c`, and run `./fuzz` to fuzz offline with
+ * random inputs (`-n` iterations, `-s` seed), or `./fuzz FILE...` to
+ * replay inputs, e.g., under AFL with `./fuzz @@`.  For libFuzzer,
+ * build with
+ *
+ *   CC=clang CFLAGS="-O1 -g -fsanitize=fuzzer -DFUZZ_LIBFUZZER" sh fuzz.c
+ *
+ * which only defines LLVMFuzzerTestOneInput.
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "engines.h"
+#include "interface.h"
+#include "planner.h"
+#include "query.h"
+#include "range.h"
+#include "shapes.h"
+#include "vector.h"
+
+#define FUZZ_MAX_BLOCKS 8
+#define FUZZ_MAX_INPUTS 16
+#define FUZZ_MAX_DEPTH 6
+#define FUZZ_MAX_ARGS 4
+
+static const char *const toy_names[] = {
+        "dst", "x0", "x1", "neg_x", "y0", "neg_y",
+};
+
+static const char toy_query[] = "(and (xor neg_x (or x0 x1)) (xor neg_y y0))";
+
+struct fuzz_input {
+        const uint8_t *data;
+        size_t size;
+        size_t pos;
+};
+
+/* 0 once the input runs out. */
+static uint8_t
+next_byte(struct fuzz_input *input)
+{
+
+        return (input->pos < input->size) ? input->data[input->pos++] : 0;
+}
+
+static size_t
+next_u16(struct fuzz_input *input)
+{
+        size_t lo = next_byte(input);
+
+        return lo | ((size_t)next_byte(input) << 8);
+}
+
+static struct expr *
+decode_expr(struct fuzz_input *input, size_t n_inputs, size_t depth)
+{
+        static const enum expr_kind kinds[] = {
+                EXPR_VAR, EXPR_NOT, EXPR_AND, EXPR_OR, EXPR_XOR,
+        };
+        struct expr *args[FUZZ_MAX_ARGS];
+        uint8_t byte = next_byte(input);
+        enum expr_kind kind = kinds[byte % 5];
+        size_t n_args;
+
+        if (kind == EXPR_VAR || depth == 0)
+                return expr_var(1 + (byte >> 3) % n_inputs);
+
+        if (kind == EXPR_NOT)
+                return expr_not(decode_expr(input, n_inputs, depth - 1));
+
+        n_args = 1 + (byte >> 3) % FUZZ_MAX_ARGS;
+        for (size_t i = 0; i < n_args; i++)
+                args[i] = decode_expr(input, n_inputs, depth - 1);
+
+        return expr_nary(kind, n_args, args);
+}
+
+static struct planner *fuzz_planner;
+static struct query_engines fuzz_engines;
+
+/* The hand-written kernels, which only implement the sample query. */
+static const struct query_engine toy_backends[] = {
+        { "baseline", baseline, true, false },
+        { "blocking", blocking, true, false },
+        { "fused_blocking", fused_blocking, true, false },
+        { "fused_blocking_short_circuit", fused_blocking_short_circuit, true, false },
+        { "specialised_widget", specialised_widget, true, false },
+        { "fully_specialised_widget", fully_specialised_widget, true, false },
+        { "threaded_inreg", threaded_inreg, true, false },
+        { "threaded_inreg_fused", threaded_inreg_fused, true, false },
+        { "wired_inreg_fused", wired_inreg_fused, true, false },
+        { "baseline_nt", baseline_nt, true, false },
+        { "fused_blocking_nt", fused_blocking_nt, true, false },
+        { "wired_inreg_fused_nt", wired_inreg_fused_nt, true, false },
+        { "baseline_vec", baseline_vec, false, false },
+        { "fused_blocking_vec", fused_blocking_vec, false, false },
+        { "baseline_avx512", baseline_avx512, true, true },
+        { "fused_blocking_avx512", fused_blocking_avx512, true, true },
+        { "threaded_ternlog", threaded_ternlog, true, true },
+};
+
+/* Only on AVX2 hosts. */
+static const struct query_engine toy_count_backends[] = {
+        { "baseline_count", baseline_count, true, false },
+        { "fused_blocking_count", fused_blocking_count, true, false },
+        { "threaded_inreg_fused_count", threaded_inreg_fused_count, true, false },
+        { "wired_inreg_fused_count", wired_inreg_fused_count, true, false },
+};
+
+static void
+compile_backends(const struct expr *expr)
+{
+
+        if (fuzz_planner == NULL) {
+                const struct planner_costs costs = {
+                        .call = { 1, 1, 1, 1, 1, 1 },
+                };
+
+                fuzz_planner = planner_create_with(&costs);
+        }
+
+        query_engines_compile(&fuzz_engines, expr, fuzz_planner, 1, NULL);
+        query_engines_current = &fuzz_engines;
+        return;
+}
+
+static __m256i *
+alloc_vecs(size_t count)
+{
+        __m256i *ret;
+        int r;
+
+        r = posix_memalign((void **)&ret, 64, count * sizeof(__m256i));
+        assert(r == 0);
+        return ret;
+}
+
+static NO_INLINE void
+mismatch(const char *backend, const struct expr *expr, size_t begin,
+    size_t end, size_t bits)
+{
+        char *src = expr_format(expr);
+
+        fprintf(stderr, "fuzz: %s differs from expr_eval on %s, bits [%zu, %zu) of %zu\n",
+            backend, src, begin, end, bits);
+        free(src);
+        abort();
+        return;
+}
+
+/**
+ * Runs `backend` on bits [begin, end), and compares dst with
+ * `expected`.
+ */
+static void
+check_backend(const struct query_engine *backend, const struct expr *expr,
+    struct filter_state *state, const __m256i *before,
+    const __m256i *expected, size_t begin, size_t end)
+{
+        size_t vec_size = state->count * sizeof(__m256i);
+
+        if (!query_engine_available(backend))
+                return;
+
+        memcpy(state->dst, before, vec_size);
+        if (vector_avx2_supported())
+                filter_run_range(backend->fn, state, begin, end);
+        else
+                backend->fn(state);
+        if (memcmp(state->dst, expected, vec_size) != 0)
+                mismatch(backend->name, expr, begin, end, 8 * vec_size);
+
+        return;
+}
+
+static void
+fuzz_one(const uint8_t *data, size_t size)
+{
+        struct fuzz_input input = { .data = data, .size = size };
+        const struct query_engine *backends;
+        size_t n_backends, n_inputs, count, bits, begin, end;
+        uint8_t mode = next_byte(&input);
+        bool toy = (mode & 1) != 0;
+        struct filter_state *state;
+        __m256i *before, *expected, *full;
+        struct expr *expr;
+        uint64_t seed, want = 0;
+        int r;
+
+        count = BLOCK_SIZE * (1 + next_byte(&input) % FUZZ_MAX_BLOCKS);
+        bits = 8 * sizeof(__m256i) * count;
+        if (mode & 2) {
+                begin = 0;
+                end = bits;
+        } else {
+                begin = next_u16(&input) % bits;
+                end = begin + next_u16(&input) % (bits - begin + 1);
+        }
+
+        /* filter_run_range is built for AVX2 hosts only. */
+        if (!vector_avx2_supported()) {
+                begin = 0;
+                end = bits;
+        }
+
+        if (toy) {
+                expr = expr_parse(toy_query, toy_names,
+                    sizeof(toy_names) / sizeof(toy_names[0]));
+                n_inputs = 5;
+                backends = toy_backends;
+                n_backends = sizeof(toy_backends) / sizeof(toy_backends[0]);
+        } else {
+                n_inputs = 1 + next_byte(&input) % FUZZ_MAX_INPUTS;
+                expr = decode_expr(&input, n_inputs, FUZZ_MAX_DEPTH);
+                compile_backends(expr);
+                backends = query_engine_table;
+                n_backends = query_engine_count;
+        }
+
+        assert(expr != NULL);
+        r = posix_memalign((void **)&state, 64, sizeof(*state));
+        assert(r == 0);
+        memset(state, 0, sizeof(*state));
+        state->count = count;
+        seed = next_byte(&input);
+        for (size_t k = 1; k <= n_inputs; k++) {
+                struct shape_density density = {
+                        .kind = SHAPE_UNIFORM,
+                        .p = next_byte(&input) / 255.0,
+                };
+
+                state->ptrs[k] = alloc_vecs(count);
+                shape_fill(state->ptrs[k], count, &density, k, seed);
+        }
+
+        /* dst starts out as garbage, and keeps it outside the range. */
+        before = alloc_vecs(count);
+        shape_fill(before, count, &(struct shape_density) { .p = 0.5 },
+            FILTER_MAX_PTRS, seed);
+        full = alloc_vecs(count);
+        state->dst = full;
+        expr_eval(expr, state);
+        expected = alloc_vecs(count);
+        memcpy(expected, before, count * sizeof(__m256i));
+        for (size_t bit = begin; bit < end; bit++) {
+                uint64_t *words = (uint64_t *)expected;
+                uint64_t mask = 1ULL << (bit % 64);
+                uint64_t value = ((const uint64_t *)full)[bit / 64] & mask;
+
+                words[bit / 64] = (words[bit / 64] & ~mask) | value;
+                want += (value != 0);
+        }
+
+        state->dst = alloc_vecs(count);
+        for (size_t i = 0; i < n_backends; i++)
+                check_backend(&backends[i], expr, state, before, expected, begin, end);
+
+        if (toy && vector_avx2_supported()) {
+                for (size_t i = 0; i < sizeof(toy_count_backends) / sizeof(toy_count_backends[0]); i++) {
+                        state->popcount = ~0ULL;
+                        filter_run_range(toy_count_backends[i].fn, state, begin, end);
+                        if (state->popcount != want)
+                                mismatch(toy_count_backends[i].name, expr, begin, end, bits);
+                }
+        } else if (!toy) {
+                query_engines_destroy(&fuzz_engines);
+        }
+
+        for (size_t i = 0; i < FILTER_MAX_PTRS; i++)
+                free(state->ptrs[i]);
+        free(state);
+        free(before);
+        free(expected);
+        free(full);
+        expr_destroy(expr);
+        return;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+
+        fuzz_one(data, size);
+        return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+static void
+fuzz_file(const char *path)
+{
+        FILE *file = (strcmp(path, "-") == 0) ? stdin : fopen(path, "rb");
+        uint8_t *data = NULL;
+        size_t size = 0, cap = 0;
+
+        if (file == NULL) {
+                perror(path);
+                exit(1);
+        }
+
+        for (;;) {
+                size_t n;
+
+                if (size == cap) {
+                        cap = 2 * cap + 4096;
+                        data = realloc(data, cap);
+                        assert(data != NULL);
+                }
+
+                n = fread(data + size, 1, cap - size, file);
+                if (n == 0)
+                        break;
+                size += n;
+        }
+
+        if (file != stdin)
+                fclose(file);
+        fuzz_one(data, size);
+        free(data);
+        return;
+}
+
+int
+main(int argc, char **argv)
+{
+        size_t iterations = 10000;
+        uint64_t seed = 1;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        iterations = strtoull(optarg, NULL, 0);
+                        break;
+                case 's':
+                        seed = strtoull(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-n iterations] [-s seed] [file...]\n",
+                            argv[0]);
+                        return 1;
+                }
+        }
+
+        if (optind < argc) {
+                for (int i = optind; i < argc; i++)
+                        fuzz_file(argv[i]);
+                return 0;
+        }
+
+        for (size_t i = 0; i < iterations; i++) {
+                uint8_t data[256];
+                size_t size = 1 + shape_random(&seed) % sizeof(data);
+
+                for (size_t j = 0; j < size; j++)
+                        data[j] = shape_random(&seed);
+
+                fuzz_one(data, size);
+                if ((i + 1) % 1000 == 0)
+                        fprintf(stderr, "fuzz: %zu inputs\n", i + 1);
+        }
+
+        return 0;
+}
+#endif
@@ -0,0 +1,315 @@
+#include "incremental.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "popcount.h"
+
+/* Blocks per summary group, one bit each in a dirty mask. */
+#define GROUP_BLOCKS 64
+
+struct tracked_bitmap {
+        /* Never reused, even for a bitmap at the same address. */
+        uint64_t id;
+        __m256i *vecs;
+        size_t count;
+        size_t n_blocks;
+        uint64_t version;
+        /* Version of the last write to each block, and to each group. */
+        uint64_t *block_version;
+        uint64_t *group_version;
+};
+
+struct standing_query {
+        filter_fn_t *fn;
+        struct tracked_bitmap *inputs[FILTER_MAX_PTRS];
+        /* Input versions as of the last refresh. */
+        uint64_t seen[FILTER_MAX_PTRS];
+        size_t count;
+        size_t n_blocks;
+        uint64_t popcount;
+        __m256i *result;
+        struct filter_state *state;
+        struct filter_state *slice;
+};
+
+/* The last tracked_bitmap id handed out. */
+static uint64_t last_id;
+
+static size_t
+n_groups(size_t n_blocks)
+{
+
+        return (n_blocks + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+}
+
+struct tracked_bitmap *
+tracked_bitmap_create(__m256i *vecs, size_t count)
+{
+        struct tracked_bitmap *ret;
+
+        assert(count % BLOCK_SIZE == 0);
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->id = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
+        ret->vecs = vecs;
+        ret->count = count;
+        ret->n_blocks = count / BLOCK_SIZE;
+        /* One spare entry each, so an empty bitmap's calloc isn't NULL. */
+        ret->block_version = calloc(ret->n_blocks + 1,
+            sizeof(ret->block_version[0]));
+        ret->group_version = calloc(n_groups(ret->n_blocks) + 1,
+            sizeof(ret->group_version[0]));
+        assert(ret->block_version != NULL && ret->group_version != NULL);
+        return ret;
+}
+
+void
+tracked_bitmap_destroy(struct tracked_bitmap *bitmap)
+{
+
+        if (bitmap == NULL)
+                return;
+
+        free(bitmap->block_version);
+        free(bitmap->group_version);
+        free(bitmap);
+        return;
+}
+
+__m256i *
+tracked_bitmap_vecs(const struct tracked_bitmap *bitmap)
+{
+
+        return bitmap->vecs;
+}
+
+uint64_t
+tracked_bitmap_id(const struct tracked_bitmap *bitmap)
+{
+
+        return bitmap->id;
+}
+
+uint64_t
+tracked_bitmap_version(const struct tracked_bitmap *bitmap)
+{
+
+        return bitmap->version;
+}
+
+void
+tracked_bitmap_touch(struct tracked_bitmap *bitmap, size_t begin, size_t end)
+{
+        uint64_t version;
+
+        assert(begin <= end && end <= bitmap->count);
+        if (begin == end)
+                return;
+
+        version = ++bitmap->version;
+        for (size_t block = begin / BLOCK_SIZE; block <= (end - 1) / BLOCK_SIZE; block++) {
+                bitmap->block_version[block] = version;
+                bitmap->group_version[block / GROUP_BLOCKS] = version;
+        }
+
+        return;
+}
+
+void
+tracked_bitmap_set_bit(struct tracked_bitmap *bitmap, size_t bit, bool value)
+{
+        uint64_t *words = (uint64_t *)bitmap->vecs;
+        uint64_t mask = 1ULL << (bit % 64);
+        size_t vec = bit / (8 * sizeof(__m256i));
+
+        assert(vec < bitmap->count);
+        words[bit / 64] = value ? (words[bit / 64] | mask)
+            : (words[bit / 64] & ~mask);
+        tracked_bitmap_touch(bitmap, vec, vec + 1);
+        return;
+}
+
+static uint64_t
+count_vecs(const __m256i *vecs, size_t count)
+{
+        struct popcount_acc acc = popcount_acc_init();
+
+        for (size_t i = 0; i < count; i += BLOCK_SIZE)
+                popcount_add_block(&acc, &vecs[i]);
+
+        return popcount_acc_sum(&acc);
+}
+
+struct standing_query *
+standing_query_create(filter_fn_t *fn,
+    struct tracked_bitmap *const inputs[FILTER_MAX_PTRS])
+{
+        struct standing_query *ret;
+        int r;
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->fn = fn;
+        r = posix_memalign((void **)&ret->state, 64, sizeof(*ret->state));
+        assert(r == 0);
+        memset(ret->state, 0, sizeof(*ret->state));
+        r = posix_memalign((void **)&ret->slice, 64, sizeof(*ret->slice));
+        assert(r == 0);
+        memset(ret->slice, 0, sizeof(*ret->slice));
+
+        for (size_t i = 1; i < FILTER_MAX_PTRS; i++) {
+                struct tracked_bitmap *input = inputs[i];
+
+                if (input == NULL)
+                        continue;
+
+                assert(ret->count == 0 || ret->count == input->count);
+                ret->count = input->count;
+                ret->inputs[i] = input;
+                ret->seen[i] = input->version;
+                ret->state->ptrs[i] = input->vecs;
+        }
+
+        assert(ret->count > 0);
+        ret->n_blocks = ret->count / BLOCK_SIZE;
+        r = posix_memalign((void **)&ret->result, 64, ret->count * sizeof(__m256i));
+        assert(r == 0);
+        ret->state->count = ret->count;
+        ret->state->dst = ret->result;
+        fn(ret->state);
+        ret->popcount = count_vecs(ret->result, ret->count);
+        return ret;
+}
+
+void
+standing_query_destroy(struct standing_query *query)
+{
+
+        if (query == NULL)
+                return;
+
+        free(query->result);
+        free(query->state);
+        free(query->slice);
+        free(query);
+        return;
+}
+
+/**
+ * Re-evaluates blocks `[begin, end)`, and updates the popcount.
+ */
+static void
+refresh_run(struct standing_query *query, size_t begin, size_t end)
+{
+        size_t vec_begin = begin * BLOCK_SIZE;
+        size_t vec_end = end * BLOCK_SIZE;
+        const __m256i *result = query->result + vec_begin;
+
+        query->popcount -= count_vecs(result, vec_end - vec_begin);
+        filter_state_slice(query->slice, query->state, vec_begin, vec_end);
+        query->fn(query->slice);
+        query->popcount += count_vecs(result, vec_end - vec_begin);
+        return;
+}
+
+/**
+ * Blocks in `group` that any of the `n_changed` inputs at `changed`
+ * wrote since the last refresh.
+ */
+static uint64_t
+dirty_mask(const struct standing_query *query, const size_t *changed,
+    size_t n_changed, size_t group)
+{
+        size_t first = group * GROUP_BLOCKS;
+        size_t n = query->n_blocks - first;
+        uint64_t ret = 0;
+
+        if (n > GROUP_BLOCKS)
+                n = GROUP_BLOCKS;
+
+        for (size_t i = 0; i < n_changed; i++) {
+                const struct tracked_bitmap *input = query->inputs[changed[i]];
+                uint64_t seen = query->seen[changed[i]];
+
+                if (input->group_version[group] <= seen)
+                        continue;
+
+                for (size_t j = 0; j < n; j++)
+                        ret |= (uint64_t)(input->block_version[first + j] > seen) << j;
+        }
+
+        return ret;
+}
+
+size_t
+standing_query_refresh(struct standing_query *query)
+{
+        size_t groups = n_groups(query->n_blocks);
+        /* Inputs written since the last refresh. */
+        size_t changed[FILTER_MAX_PTRS];
+        size_t n_changed = 0;
+        /* The pending run of dirty blocks, empty if begin == end. */
+        size_t run_begin = 0, run_end = 0;
+        size_t ret = 0;
+
+        for (size_t i = 1; i < FILTER_MAX_PTRS; i++) {
+                if (query->inputs[i] != NULL &&
+                    query->inputs[i]->version != query->seen[i])
+                        changed[n_changed++] = i;
+        }
+
+        if (n_changed == 0)
+                return 0;
+
+        for (size_t group = 0; group < groups; group++) {
+                uint64_t mask = dirty_mask(query, changed, n_changed, group);
+
+                while (mask != 0) {
+                        size_t block = group * GROUP_BLOCKS + __builtin_ctzll(mask);
+
+                        mask &= mask - 1;
+                        ret++;
+                        if (block == run_end && run_begin != run_end) {
+                                run_end++;
+                                continue;
+                        }
+
+                        if (run_begin != run_end)
+                                refresh_run(query, run_begin, run_end);
+                        run_begin = block;
+                        run_end = block + 1;
+                }
+        }
+
+        if (run_begin != run_end)
+                refresh_run(query, run_begin, run_end);
+
+        for (size_t i = 0; i < n_changed; i++)
+                query->seen[changed[i]] = query->inputs[changed[i]]->version;
+
+        return ret;
+}
+
+const __m256i *
+standing_query_result(const struct standing_query *query)
+{
+
+        return query->result;
+}
+
+size_t
+standing_query_count(const struct standing_query *query)
+{
+
+        return query->count;
+}
+
+uint64_t
+standing_query_popcount(const struct standing_query *query)
+{
+
+        return query->popcount;
+}
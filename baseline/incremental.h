@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+
+/**
+ * Incremental re-evaluation of standing queries over bitmaps that
+ * change in place.
+ *
+ * A tracked bitmap stamps each block of BLOCK_SIZE vectors with the
+ * bitmap's version when it's written, and keeps the latest stamp for
+ * each group of 64 blocks.  A standing query remembers the version of
+ * each input it last saw; refreshing it returns right away if no
+ * input moved on, only looks at the inputs that did, skips their
+ * clean groups, and only re-evaluates (and re-counts) blocks stamped
+ * since then, in runs of consecutive dirty blocks.  Any number of
+ * standing queries may share an input.
+ */
+struct tracked_bitmap;
+
+/**
+ * Tracks `count` vectors at `vecs`, a multiple of BLOCK_SIZE; the
+ * caller keeps ownership of the vectors.
+ */
+struct tracked_bitmap *tracked_bitmap_create(__m256i *vecs, size_t count);
+
+void tracked_bitmap_destroy(struct tracked_bitmap *);
+
+__m256i *tracked_bitmap_vecs(const struct tracked_bitmap *);
+
+/**
+ * A non-zero id, unique to this tracked bitmap in the process, even
+ * if another is later created at the same address.
+ */
+uint64_t tracked_bitmap_id(const struct tracked_bitmap *);
+
+uint64_t tracked_bitmap_version(const struct tracked_bitmap *);
+
+/**
+ * Marks vectors `[begin, end)` as written, e.g., after updating them
+ * directly through tracked_bitmap_vecs.
+ */
+void tracked_bitmap_touch(struct tracked_bitmap *, size_t begin, size_t end);
+
+void tracked_bitmap_set_bit(struct tracked_bitmap *, size_t bit, bool value);
+
+struct standing_query;
+
+/**
+ * `fn` evaluates the query over `ptrs[1 ...]`, bound to `inputs[1 ...]`
+ * (NULL for unused slots; `inputs[0]` is ignored), all of the same
+ * count, into a result bitmap owned by the standing query.  The query
+ * is evaluated once, in full, right away.
+ */
+struct standing_query *standing_query_create(filter_fn_t *fn,
+    struct tracked_bitmap *const inputs[FILTER_MAX_PTRS]);
+
+void standing_query_destroy(struct standing_query *);
+
+/**
+ * Re-evaluates the blocks that any input wrote since the last
+ * refresh, patching the result and its popcount in place.  Returns
+ * the number of blocks re-evaluated.
+ */
+size_t standing_query_refresh(struct standing_query *);
+
+const __m256i *standing_query_result(const struct standing_query *);
+
+size_t standing_query_count(const struct standing_query *);
+
+/**
+ * Number of set bits in the result, as of the last refresh.
+ */
+uint64_t standing_query_popcount(const struct standing_query *);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <immintrin.h>
+#include <stdint.h>
 
 #define NO_INLINE __attribute__((noinline, noclone))
 
@@ -8,8 +9,21 @@
 #define BLOCK_SIZE 16
 #endif
 
+struct filter_sink;
+
+/*
+ * ptrs[0] is the destination, inputs follow.  The named fields alias
+ * the first slots for the sample query.
+ */
+#ifndef FILTER_MAX_PTRS
+#define FILTER_MAX_PTRS 64
+#endif
+
 struct filter_state {
-        /* Count in __m256i; must be a multiple of 32. */
+        /*
+         * Count in __m256i; must be a multiple of BLOCK_SIZE.  See
+         * range.h for other lengths and for sub-ranges.
+         */
         size_t count;
         union {
                 struct {
@@ -21,15 +35,22 @@ struct filter_state {
                         const __m256i *y0;
                         const __m256i *neg_y;
                 };
-                __m256i *ptrs[6];
+                __m256i *ptrs[FILTER_MAX_PTRS];
         };
 
         struct {
                 size_t index;
                 __m256i val[4 * BLOCK_SIZE];
         } scratch;
+
+        /* Set by the *_count methods: number of set bits in the result. */
+        uint64_t popcount;
+        /* Consumer for the *_emit methods' set bits, see sink.h. */
+        struct filter_sink *sink;
 };
 
+typedef void filter_fn_t(struct filter_state *);
+
 void noop(struct filter_state *);
 
 /**
@@ -52,6 +73,52 @@ void blocking(struct filter_state *);
  */
 void fused_blocking(struct filter_state *);
 
+/**
+ * Skip the second conjunct's loads for blocks where the first is
+ * already all zero.
+ */
+void fused_blocking_short_circuit(struct filter_state *);
+
+/**
+ * Count-only versions of the above: the result is reduced to
+ * `state->popcount` as it's computed (see popcount.h), and `dst` is
+ * never touched, so it need not be allocated.
+ */
+void baseline_count(struct filter_state *);
+
+void fused_blocking_count(struct filter_state *);
+
+/**
+ * Streaming versions: each block's set bits are decoded into
+ * `state->sink` right after the block is computed, and `dst` is never
+ * touched.  The sink is flushed before returning.
+ */
+void baseline_emit(struct filter_state *);
+
+void fused_blocking_emit(struct filter_state *);
+
+/**
+ * Streaming versions for results that don't fit in cache: `dst` is
+ * written with non-temporal stores (and an `sfence` at the end), and
+ * inputs are prefetched filter_prefetch_distance (policy.h) vectors
+ * ahead.
+ */
+void baseline_nt(struct filter_state *);
+
+void fused_blocking_nt(struct filter_state *);
+
+void wired_inreg_fused_nt(struct filter_state *);
+
+/**
+ * Pick the regular or the `_nt` version depending on how `count`
+ * compares with the LLC, see policy.h.
+ */
+void baseline_auto(struct filter_state *);
+
+void fused_blocking_auto(struct filter_state *);
+
+void wired_inreg_fused_auto(struct filter_state *);
+
 /**
  * What if we had a widget for one iteration of that loop?
  */
@@ -73,3 +140,31 @@ void threaded_inreg_fused(struct filter_state *);
  * Hardwire the "next" calls.
  */
 void wired_inreg_fused(struct filter_state *);
+
+/**
+ * `threaded_inreg_fused` and `wired_inreg_fused`, with the final
+ * store replaced by a popcount into `state->popcount`.
+ */
+void threaded_inreg_fused_count(struct filter_state *);
+
+void wired_inreg_fused_count(struct filter_state *);
+
+/**
+ * AVX-512 versions of baseline, fused_blocking and
+ * threaded_inreg_fused, with each 3-input subexpression fused into a
+ * single VPTERNLOG.  Only call these when the CPU supports AVX-512F.
+ */
+void baseline_avx512(struct filter_state *);
+
+void fused_blocking_avx512(struct filter_state *);
+
+void threaded_ternlog(struct filter_state *);
+
+/**
+ * `baseline` and `fused_blocking`, dispatched at runtime to the widest
+ * vector width the CPU supports (see vector.h).  They're the only
+ * width-generic methods; the others need AVX2.
+ */
+void baseline_vec(struct filter_state *);
+
+void fused_blocking_vec(struct filter_state *);
@@ -0,0 +1,625 @@
+#include "planner.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <x86intrin.h>
+
+#include "blocked.h"
+#include "short_circuit.h"
+#include "stitch.h"
+#include "vector.h"
+
+/*
+ * The calibration query, with the sample query's shape, and the sizes
+ * we time it at.
+ */
+#define CAL_QUERY "(and (xor 1 (or 2 3)) (xor 4 5))"
+#define CAL_PTRS 6
+#define CAL_SMALL (8 * BLOCK_SIZE)
+#define CAL_LARGE (64 * BLOCK_SIZE)
+#define CAL_REPS 15
+
+/* The sample query, over filter_state's named inputs. */
+#define SAMPLE_QUERY "(and (xor 3 (or 1 2)) (xor 5 4))"
+
+const char *const planner_strategy_names[PLANNER_N_STRATEGIES] = {
+        [PLANNER_THREADED] = "threaded",
+        [PLANNER_STITCHED] = "stitched",
+        [PLANNER_BLOCKED] = "blocked",
+        [PLANNER_SHORT_CIRCUIT] = "short_circuit",
+        [PLANNER_BASELINE] = "baseline",
+        [PLANNER_FUSED_BLOCKING] = "fused_blocking",
+};
+
+struct planner {
+        struct planner_costs costs;
+        /* Whether the strategies built for AVX2 hosts can run. */
+        bool avx2;
+};
+
+struct planned_query {
+        const struct planner *planner;
+        struct query_program *program;
+        struct stitched_query *stitched;
+        struct blocked_query *blocked;
+        struct short_circuit_query *short_circuit;
+        /* The ptrs[] index for each of the sample query's slots. */
+        size_t sample_ptrs[CAL_PTRS];
+        size_t expected_runs;
+        /* Units of work per vector, see planner.h. */
+        double work[PLANNER_N_STRATEGIES];
+        /* Blocked kernel calls per vector. */
+        double kernels;
+        bool built[PLANNER_N_STRATEGIES];
+        /* Strategies that can't run this query. */
+        bool failed[PLANNER_N_STRATEGIES];
+        /* For planner_compile_cached, NULL otherwise. */
+        struct subexpr_cache *cache;
+        struct expr *expr;
+        /* By ptrs[] slot: 0.5 for results bound by the cache. */
+        double densities[FILTER_MAX_PTRS];
+        /* The plan for the last rewrite of `expr`, and its text. */
+        struct planned_query *rewritten;
+        char *rewritten_src;
+};
+
+/* fmin and fmax without libm. */
+static double
+min_double(double x, double y)
+{
+
+        return (x < y) ? x : y;
+}
+
+static double
+max_double(double x, double y)
+{
+
+        return (x > y) ? x : y;
+}
+
+static double
+now_ticks(void)
+{
+        uint64_t ret;
+
+        _mm_lfence();
+        ret = __rdtsc();
+        _mm_lfence();
+        return ret;
+}
+
+/**
+ * Runs a hand-written sample query kernel with its slots pointing to
+ * the query's inputs.
+ */
+static void
+run_sample(filter_fn_t *fn, const size_t *ptrs, struct filter_state *state)
+{
+        struct filter_state local;
+
+        local.count = state->count;
+        for (size_t i = 0; i < CAL_PTRS; i++)
+                local.ptrs[i] = state->ptrs[ptrs[i]];
+
+        fn(&local);
+        return;
+}
+
+static void
+run_strategy(const struct planned_query *query,
+    enum planner_strategy strategy, struct filter_state *state)
+{
+
+        switch (strategy) {
+        case PLANNER_THREADED:
+                query_run(query->program, state);
+                break;
+        case PLANNER_STITCHED:
+                stitch_run(query->stitched, state);
+                break;
+        case PLANNER_BLOCKED:
+                blocked_run(query->blocked, state);
+                break;
+        case PLANNER_SHORT_CIRCUIT:
+                short_circuit_run(query->short_circuit, state);
+                break;
+        case PLANNER_BASELINE:
+                run_sample(query->planner->avx2 ? baseline : baseline_vec,
+                    query->sample_ptrs, state);
+                break;
+        case PLANNER_FUSED_BLOCKING:
+                run_sample(query->planner->avx2 ? fused_blocking :
+                    fused_blocking_vec, query->sample_ptrs, state);
+                break;
+        default:
+                assert(0 && "unknown strategy");
+        }
+
+        return;
+}
+
+/**
+ * xorshift64, from a fixed seed.
+ */
+static void
+fill_random(uint64_t *words, size_t n)
+{
+        uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+        for (size_t i = 0; i < n; i++) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                words[i] = x;
+        }
+
+        return;
+}
+
+/**
+ * Fastest of CAL_REPS runs of `strategy` on `count` vectors.
+ */
+static double
+time_run(const struct planned_query *query, enum planner_strategy strategy,
+    struct filter_state *state, size_t count)
+{
+        double ret = INFINITY;
+
+        state->count = count;
+        for (size_t i = 0; i < CAL_REPS; i++) {
+                double begin = now_ticks();
+
+                run_strategy(query, strategy, state);
+                ret = min_double(ret, now_ticks() - begin);
+        }
+
+        return ret;
+}
+
+/**
+ * Ticks per vector, between CAL_SMALL and CAL_LARGE vectors.
+ */
+static double
+time_slope(const struct planned_query *query, enum planner_strategy strategy,
+    struct filter_state *state)
+{
+        double small, large;
+
+        small = time_run(query, strategy, state, CAL_SMALL);
+        large = time_run(query, strategy, state, CAL_LARGE);
+        return max_double(0, large - small) / (CAL_LARGE - CAL_SMALL);
+}
+
+/**
+ * Times blocked kernels with the smallest and largest blocks, to split
+ * their per-vector cost between the ops and the kernel calls.
+ */
+static void
+calibrate_blocked(struct planner_costs *costs, struct planned_query *query,
+    const struct expr *expr, struct filter_state *state)
+{
+        static const size_t blocks[2] = { BLOCK_SIZE, 8 * BLOCK_SIZE };
+        struct blocked_query *blocked = query->blocked;
+        double ops = blocked_query_n_ops(blocked);
+        double slopes[2];
+
+        for (size_t i = 0; i < 2; i++) {
+                struct blocked_shape shape = { blocks[i], blocks[i] };
+
+                query->blocked = blocked_compile(expr, &shape);
+                slopes[i] = time_slope(query, PLANNER_BLOCKED, state);
+                blocked_destroy(query->blocked);
+        }
+
+        query->blocked = blocked;
+        costs->kernel = max_double(0, (slopes[0] - slopes[1]) /
+            (ops * (1.0 / blocks[0] - 1.0 / blocks[1])));
+        costs->vector[PLANNER_BLOCKED] = max_double(0,
+            slopes[1] / ops - costs->kernel / blocks[1]);
+        return;
+}
+
+static void
+calibrate(struct planner *planner)
+{
+        struct planner_costs *costs = &planner->costs;
+        struct planned_query *query;
+        struct filter_state *state;
+        struct expr *expr;
+        __m256i *buf;
+        double overhead;
+        size_t insns;
+        int r;
+
+        expr = expr_parse(CAL_QUERY, NULL, 0);
+        assert(expr != NULL);
+        query = planner_compile(planner, expr, 1, NULL);
+        assert(query != NULL);
+        for (size_t s = 0; s < PLANNER_N_STRATEGIES; s++)
+                assert(s == PLANNER_STITCHED || query->built[s] ||
+                    !planner->avx2);
+
+        costs->build[PLANNER_STITCHED] = INFINITY;
+        if (planner->avx2) {
+                insns = query->program->n_insns;
+                for (size_t i = 0; i < CAL_REPS; i++) {
+                        double begin = now_ticks();
+                        struct stitched_query *stitched;
+
+                        stitched = stitch_query(query->program);
+                        costs->build[PLANNER_STITCHED] = min_double(
+                            costs->build[PLANNER_STITCHED],
+                            (now_ticks() - begin) / insns);
+                        stitched_query_destroy(stitched);
+                }
+
+                query->stitched = stitch_query(query->program);
+                assert(query->stitched != NULL);
+        }
+
+        r = posix_memalign((void **)&state, 64, sizeof(*state));
+        assert(r == 0);
+        memset(state, 0, sizeof(*state));
+        r = posix_memalign((void **)&buf, 64,
+            CAL_PTRS * CAL_LARGE * sizeof(__m256i));
+        assert(r == 0);
+        /* Random bits, so short-circuiting never skips a block. */
+        fill_random((uint64_t *)buf,
+            CAL_PTRS * CAL_LARGE * sizeof(__m256i) / sizeof(uint64_t));
+        for (size_t i = 0; i < CAL_PTRS; i++)
+                state->ptrs[i] = buf + i * CAL_LARGE;
+
+        /* What the timer itself costs. */
+        overhead = INFINITY;
+        for (size_t i = 0; i < CAL_REPS; i++) {
+                double begin = now_ticks();
+
+                overhead = min_double(overhead, now_ticks() - begin);
+        }
+
+        for (size_t s = 0; s < PLANNER_N_STRATEGIES; s++) {
+                double slope, one;
+
+                if (query->failed[s])
+                        continue;
+
+                slope = time_slope(query, s, state);
+                one = time_run(query, s, state, BLOCK_SIZE);
+                costs->vector[s] = slope / query->work[s];
+                costs->call[s] = max_double(0,
+                    one - overhead - BLOCK_SIZE * slope);
+        }
+
+        calibrate_blocked(costs, query, expr, state);
+
+        free(buf);
+        free(state);
+        planned_query_destroy(query);
+        expr_destroy(expr);
+        return;
+}
+
+struct planner *
+planner_create(void)
+{
+        struct planner *ret;
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->avx2 = vector_avx2_supported();
+        calibrate(ret);
+        return ret;
+}
+
+struct planner *
+planner_create_with(const struct planner_costs *costs)
+{
+        struct planner *ret;
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->costs = *costs;
+        ret->avx2 = vector_avx2_supported();
+        return ret;
+}
+
+void
+planner_destroy(struct planner *planner)
+{
+
+        free(planner);
+        return;
+}
+
+struct planner_costs
+planner_costs(const struct planner *planner)
+{
+
+        return planner->costs;
+}
+
+/**
+ * If `expr` has the sample query's shape, over inputs other than dst,
+ * fills `ptrs` with the index of the input in each sample query slot.
+ */
+static bool
+match_sample(const struct expr *expr, size_t ptrs[CAL_PTRS])
+{
+        size_t inputs[FILTER_MAX_PTRS], sample_inputs[FILTER_MAX_PTRS];
+        size_t n_inputs, n_sample_inputs;
+        struct expr *sample, *shape, *sample_shape;
+        char *x, *y;
+        bool ret;
+
+        sample = expr_parse(SAMPLE_QUERY, NULL, 0);
+        assert(sample != NULL);
+        sample_shape = expr_shape(sample, sample_inputs, &n_sample_inputs);
+        shape = expr_shape(expr, inputs, &n_inputs);
+        x = expr_format(shape);
+        y = expr_format(sample_shape);
+        ret = (strcmp(x, y) == 0);
+        assert(!ret || n_inputs == n_sample_inputs);
+
+        ptrs[0] = 0;
+        for (size_t i = 0; ret && i < n_inputs; i++) {
+                ret = (inputs[i] != 0);
+                ptrs[sample_inputs[i]] = inputs[i];
+        }
+
+        free(x);
+        free(y);
+        expr_destroy(shape);
+        expr_destroy(sample_shape);
+        expr_destroy(sample);
+        return ret;
+}
+
+struct planned_query *
+planner_compile(const struct planner *planner, const struct expr *expr,
+    size_t expected_runs, const double *densities)
+{
+        struct planned_query *ret;
+        struct query_program *program = NULL;
+        struct blocked_shape shape;
+
+        if (planner->avx2) {
+                program = query_compile(expr, 0);
+                if (program == NULL)
+                        return NULL;
+        }
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->planner = planner;
+        ret->program = program;
+        ret->expected_runs = (expected_runs > 0) ? expected_runs : 1;
+
+        /* Elsewhere, it's only blocked and the sample query kernels. */
+        ret->failed[PLANNER_THREADED] = (program == NULL);
+        ret->failed[PLANNER_STITCHED] = (program == NULL);
+        if (program != NULL) {
+                ret->work[PLANNER_THREADED] = program->n_insns;
+                ret->work[PLANNER_STITCHED] = program->n_insns;
+        }
+
+        ret->blocked = blocked_compile(expr, NULL);
+        shape = blocked_query_shape(ret->blocked);
+        ret->work[PLANNER_BLOCKED] = blocked_query_n_ops(ret->blocked);
+        ret->kernels = ret->work[PLANNER_BLOCKED] / shape.block;
+
+        /* Without a conjunction, it's only the threaded VM. */
+        ret->short_circuit = (planner->avx2 && expr->kind == EXPR_AND &&
+            expr->n_args > 1) ? short_circuit_compile(expr, densities, 0) : NULL;
+        ret->failed[PLANNER_SHORT_CIRCUIT] = (ret->short_circuit == NULL);
+        if (ret->short_circuit != NULL) {
+                ret->work[PLANNER_SHORT_CIRCUIT] =
+                    short_circuit_expected_insns(ret->short_circuit);
+        }
+
+        ret->failed[PLANNER_BASELINE] = !match_sample(expr, ret->sample_ptrs);
+        ret->failed[PLANNER_FUSED_BLOCKING] = ret->failed[PLANNER_BASELINE];
+        ret->work[PLANNER_BASELINE] = 1;
+        ret->work[PLANNER_FUSED_BLOCKING] = 1;
+
+        for (size_t s = 0; s < PLANNER_N_STRATEGIES; s++)
+                ret->built[s] = (s != PLANNER_STITCHED) && !ret->failed[s];
+        return ret;
+}
+
+/**
+ * The largest ptrs[] slot `expr` reads.
+ */
+static size_t
+max_var(const struct expr *expr)
+{
+        size_t ret = 0;
+
+        if (expr->kind == EXPR_VAR)
+                return expr->var;
+
+        for (size_t i = 0; i < expr->n_args; i++) {
+                size_t var = max_var(expr->args[i]);
+
+                ret = (var > ret) ? var : ret;
+        }
+
+        return ret;
+}
+
+struct planned_query *
+planner_compile_cached(const struct planner *planner, const struct expr *expr,
+    size_t expected_runs, const double *densities,
+    struct subexpr_cache *cache)
+{
+        size_t n_vars = max_var(expr) + 1;
+        struct planned_query *ret;
+
+        ret = planner_compile(planner, expr, expected_runs, densities);
+        if (ret == NULL)
+                return NULL;
+
+        ret->cache = cache;
+        ret->expr = expr_copy(expr);
+        for (size_t i = 0; i < FILTER_MAX_PTRS; i++) {
+                ret->densities[i] = (densities != NULL && i < n_vars)
+                    ? densities[i] : 0.5;
+        }
+
+        return ret;
+}
+
+void
+planned_query_destroy(struct planned_query *query)
+{
+
+        if (query == NULL)
+                return;
+
+        planned_query_destroy(query->rewritten);
+        free(query->rewritten_src);
+        expr_destroy(query->expr);
+        blocked_destroy(query->blocked);
+        /* Built for AVX2 hosts, and NULL elsewhere. */
+        if (query->short_circuit != NULL)
+                short_circuit_destroy(query->short_circuit);
+        if (query->stitched != NULL)
+                stitched_query_destroy(query->stitched);
+        if (query->program != NULL)
+                query_program_destroy(query->program);
+        free(query);
+        return;
+}
+
+enum planner_strategy
+planned_query_choose(const struct planned_query *query, size_t count,
+    double costs[PLANNER_N_STRATEGIES])
+{
+        const struct planner_costs *model = &query->planner->costs;
+        enum planner_strategy ret = PLANNER_THREADED;
+
+        for (size_t s = 0; s < PLANNER_N_STRATEGIES; s++) {
+                double cost;
+
+                if (query->failed[s]) {
+                        costs[s] = INFINITY;
+                        continue;
+                }
+
+                cost = model->call[s] + count * query->work[s] * model->vector[s];
+                if (s == PLANNER_BLOCKED)
+                        cost += count * query->kernels * model->kernel;
+                if (!query->built[s]) {
+                        cost += model->build[s] * query->program->n_insns /
+                            query->expected_runs;
+                }
+
+                costs[s] = cost;
+                if (cost < costs[ret])
+                        ret = s;
+        }
+
+        return ret;
+}
+
+/**
+ * Builds `strategy`'s code if needed; returns false if it can't run
+ * the query.
+ */
+static bool
+build(struct planned_query *query, enum planner_strategy strategy)
+{
+
+        if (query->built[strategy] || query->failed[strategy])
+                return query->built[strategy];
+
+        assert(strategy == PLANNER_STITCHED);
+        query->stitched = stitch_query(query->program);
+        query->failed[strategy] = (query->stitched == NULL);
+        query->built[strategy] = !query->failed[strategy];
+        return query->built[strategy];
+}
+
+void
+planned_query_run_with(struct planned_query *query,
+    enum planner_strategy strategy, struct filter_state *state)
+{
+
+        if (!build(query, strategy)) {
+                strategy = query->planner->avx2 ? PLANNER_THREADED :
+                    PLANNER_BLOCKED;
+        }
+
+        run_strategy(query, strategy, state);
+        return;
+}
+
+void
+planned_query_run(struct planned_query *query, struct filter_state *state)
+{
+        double costs[PLANNER_N_STRATEGIES];
+
+        planned_query_run_with(query,
+            planned_query_choose(query, state->count, costs), state);
+        return;
+}
+
+/**
+ * Rewrites the query through its cache, and returns the plan for the
+ * rewritten query, recompiled only if the rewrite changed since the
+ * last run.
+ */
+static struct planned_query *
+rewrite(struct planned_query *query, struct filter_state *state,
+    struct tracked_bitmap *const inputs[FILTER_MAX_PTRS])
+{
+        struct expr *rewritten;
+        char *src;
+
+        rewritten = subexpr_cache_rewrite(query->cache, query->expr, state,
+            inputs);
+        src = expr_format(rewritten);
+        if (query->rewritten != NULL && strcmp(src, query->rewritten_src) == 0) {
+                free(src);
+                expr_destroy(rewritten);
+                return query->rewritten;
+        }
+
+        planned_query_destroy(query->rewritten);
+        free(query->rewritten_src);
+        query->rewritten = planner_compile(query->planner, rewritten,
+            query->expected_runs, query->densities);
+        assert(query->rewritten != NULL);
+        query->rewritten_src = src;
+        expr_destroy(rewritten);
+        return query->rewritten;
+}
+
+void
+planned_query_run_tracked(struct planned_query *query,
+    struct filter_state *state,
+    struct tracked_bitmap *const inputs[FILTER_MAX_PTRS])
+{
+
+        for (size_t i = 1; i < FILTER_MAX_PTRS; i++) {
+                state->ptrs[i] = (inputs[i] != NULL)
+                    ? tracked_bitmap_vecs(inputs[i]) : NULL;
+        }
+
+        if (query->cache == NULL) {
+                planned_query_run(query, state);
+                return;
+        }
+
+        planned_query_run(rewrite(query, state, inputs), state);
+        /* Unbind the cached results. */
+        for (size_t i = 1; i < FILTER_MAX_PTRS; i++) {
+                if (inputs[i] == NULL)
+                        state->ptrs[i] = NULL;
+        }
+
+        return;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "incremental.h"
+#include "interface.h"
+#include "query.h"
+#include "subexpr_cache.h"
+
+/**
+ * Picks an evaluation strategy for each query and `count`, from a
+ * cost model calibrated by microbenchmarks on the host.
+ *
+ * Each strategy costs
+ *
+ *   build * insns / expected_runs + call + count * work * vector,
+ *
+ * where `insns` is the length of the query's compiled program, and
+ * `work` is what each strategy does per vector for this query:
+ *  - threaded and stitched run `insns` instructions;
+ *  - blocked runs each of its ops over every vector, plus a kernel
+ *    call per op and block, and the block shrinks as the query's
+ *    inputs and temporaries add streams (blocked.h), so `work` is
+ *    ops * (1 + kernel / (vector * block));
+ *  - short-circuit runs each conjunct's instructions, for the blocks
+ *    whose running `and` is still live when it gets there
+ *    (short_circuit_expected_insns);
+ *  - baseline and fused_blocking only run queries with the sample
+ *    query's shape, with fixed work.
+ * build, call, vector and kernel are the strategy's measured costs
+ * for calibration queries.  Only stitching costs anything to build;
+ * the other strategies' code is built by planner_compile, which needs
+ * their op counts anyway.  After building once, the build cost is 0.
+ *
+ * Every strategy streams each input and dst once, so memory traffic
+ * beyond the caches costs them all the same, and isn't modelled.
+ *
+ * Without AVX2 (vector_avx2_supported), threaded, stitched and
+ * short-circuit fail for every query, and baseline and fused_blocking
+ * run the sample query's `*_vec` kernels instead.
+ */
+enum planner_strategy {
+        /* query_run on the compiled program. */
+        PLANNER_THREADED,
+        /* stitch_run on native code stitched from the program. */
+        PLANNER_STITCHED,
+        /* blocked_run, with a block size chosen for the query. */
+        PLANNER_BLOCKED,
+        /* short_circuit_run, for conjunctions. */
+        PLANNER_SHORT_CIRCUIT,
+        /* The hand-written sample query kernels, on renamed inputs. */
+        PLANNER_BASELINE,
+        PLANNER_FUSED_BLOCKING,
+        PLANNER_N_STRATEGIES
+};
+
+extern const char *const planner_strategy_names[PLANNER_N_STRATEGIES];
+
+/**
+ * In TSC ticks.
+ */
+struct planner_costs {
+        /* Per instruction of the compiled program. */
+        double build[PLANNER_N_STRATEGIES];
+        double call[PLANNER_N_STRATEGIES];
+        /* Per vector and unit of work. */
+        double vector[PLANNER_N_STRATEGIES];
+        /* Per blocked kernel call. */
+        double kernel;
+};
+
+struct planner;
+
+/**
+ * Calibrates the cost model, in a few milliseconds, with the fastest
+ * of repeated runs of up to 64 blocks, timed with the TSC.
+ */
+struct planner *planner_create(void);
+
+/**
+ * Uses `costs` as is, e.g., for tests.
+ */
+struct planner *planner_create_with(const struct planner_costs *);
+
+void planner_destroy(struct planner *);
+
+struct planner_costs planner_costs(const struct planner *);
+
+/**
+ * A query compiled for the planner; the strategies' code is only
+ * built when the planner first picks them.
+ */
+struct planned_query;
+
+/**
+ * `expected_runs` amortises build costs, and `densities` (may be
+ * NULL) are passed to short_circuit_compile.  Returns NULL if the
+ * query doesn't compile.
+ */
+struct planned_query *planner_compile(const struct planner *,
+    const struct expr *, size_t expected_runs, const double *densities);
+
+/**
+ * Like planner_compile, for queries over tracked bitmaps that share
+ * hot subexpressions with other queries through `cache` (see
+ * planned_query_run_tracked).  The cache must outlive the query.
+ */
+struct planned_query *planner_compile_cached(const struct planner *,
+    const struct expr *, size_t expected_runs, const double *densities,
+    struct subexpr_cache *cache);
+
+void planned_query_destroy(struct planned_query *);
+
+/**
+ * Fills `costs` with the estimated cost of each strategy for `count`
+ * vectors (infinite for strategies that can't run the query), and
+ * returns the cheapest.
+ */
+enum planner_strategy planned_query_choose(const struct planned_query *,
+    size_t count, double costs[PLANNER_N_STRATEGIES]);
+
+/**
+ * Evaluates the query with the cheapest strategy for `state->count`.
+ */
+void planned_query_run(struct planned_query *, struct filter_state *);
+
+/**
+ * Evaluates the query over `inputs[1 ...]` (NULL for unused slots;
+ * `inputs[0]` is ignored), bound to `state->ptrs[]`, into
+ * `state->dst`.
+ *
+ * For a query compiled with a cache, the query is first rewritten by
+ * subexpr_cache_rewrite, which keys results by the inputs' ids and
+ * refreshes them when the inputs' versions move on, and the rewritten
+ * query is planned like any other.  Its plan is kept until a rewrite
+ * substitutes different results, e.g., once a subexpression gets hot
+ * or is evicted.
+ */
+void planned_query_run_tracked(struct planned_query *,
+    struct filter_state *state,
+    struct tracked_bitmap *const inputs[FILTER_MAX_PTRS]);
+
+/**
+ * Evaluates the query with `strategy`, building it if needed.
+ */
+void planned_query_run_with(struct planned_query *,
+    enum planner_strategy strategy, struct filter_state *);
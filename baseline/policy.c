@@ -0,0 +1,127 @@
+#include "policy.h"
+
+#include <unistd.h>
+
+#include "interface.h"
+
+/* When sysconf doesn't know. */
+#define DEFAULT_L1D_SIZE (32UL << 10)
+#define DEFAULT_L2_SIZE (256UL << 10)
+#define DEFAULT_LLC_SIZE (8UL << 20)
+
+/**
+ * sysconf's answer for the first of `names` it knows, or `fallback`,
+ * cached in `cached`.
+ */
+static size_t
+cache_size(size_t *cached, const int *names, size_t n_names, size_t fallback)
+{
+        size_t ret = __atomic_load_n(cached, __ATOMIC_RELAXED);
+
+        if (ret != 0)
+                return ret;
+
+        ret = fallback;
+        for (size_t i = 0; i < n_names; i++) {
+                long r = sysconf(names[i]);
+
+                if (r > 0) {
+                        ret = r;
+                        break;
+                }
+        }
+
+        __atomic_store_n(cached, ret, __ATOMIC_RELAXED);
+        return ret;
+}
+
+size_t
+filter_l1d_size(void)
+{
+        static const int names[] = { _SC_LEVEL1_DCACHE_SIZE };
+        static size_t cached;
+
+        return cache_size(&cached, names, 1, DEFAULT_L1D_SIZE);
+}
+
+size_t
+filter_l2_size(void)
+{
+        static const int names[] = { _SC_LEVEL2_CACHE_SIZE };
+        static size_t cached;
+
+        return cache_size(&cached, names, 1, DEFAULT_L2_SIZE);
+}
+
+size_t
+filter_llc_size(void)
+{
+        static const int names[] = {
+                _SC_LEVEL3_CACHE_SIZE,
+                _SC_LEVEL2_CACHE_SIZE,
+        };
+        static size_t cached;
+
+        return cache_size(&cached, names, 2, DEFAULT_LLC_SIZE);
+}
+
+bool
+filter_policy_streaming(size_t count, size_t n_streams)
+{
+
+        /* The LLC is shared; don't count on more than half of it. */
+        return n_streams * count * sizeof(__m256i) > filter_llc_size() / 2;
+}
+
+size_t
+filter_prefetch_distance(size_t n_streams)
+{
+#ifdef FILTER_PREFETCH_DISTANCE
+        (void)n_streams;
+        return FILTER_PREFETCH_DISTANCE;
+#else
+        size_t ret = filter_l1d_size() / 2 / (n_streams * sizeof(__m256i));
+
+        ret -= ret % BLOCK_SIZE;
+        return (ret > BLOCK_SIZE) ? ret : BLOCK_SIZE;
+#endif
+}
+
+/* dst and the five inputs. */
+#define TOY_STREAMS 6
+
+void
+baseline_auto(struct filter_state *state)
+{
+
+        if (filter_policy_streaming(state->count, TOY_STREAMS))
+                baseline_nt(state);
+        else
+                baseline(state);
+
+        return;
+}
+
+void
+fused_blocking_auto(struct filter_state *state)
+{
+
+        if (filter_policy_streaming(state->count, TOY_STREAMS))
+                fused_blocking_nt(state);
+        else
+                fused_blocking(state);
+
+        return;
+}
+
+void
+wired_inreg_fused_auto(struct filter_state *state)
+{
+
+        if (filter_policy_streaming(state->count, TOY_STREAMS))
+                wired_inreg_fused_nt(state);
+        else
+                wired_inreg_fused(state);
+
+        return;
+}
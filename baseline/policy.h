@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Cache policy for the output and input streams: regular stores and
+ * hardware prefetching are best while everything fits in the last
+ * level cache, but, past that, `dst` is only evicting inputs and
+ * paying for reads-for-ownership of lines we overwrite entirely.
+ */
+
+/**
+ * Sizes of the L1 data, L2 and last level caches in bytes, or guesses
+ * if we can't tell.
+ */
+size_t filter_l1d_size(void);
+
+size_t filter_l2_size(void);
+
+size_t filter_llc_size(void);
+
+/**
+ * Whether a query over `n_streams` arrays (inputs and output) of
+ * `count` vectors should use non-temporal stores and software
+ * prefetching.
+ */
+bool filter_policy_streaming(size_t count, size_t n_streams);
+
+/**
+ * How far ahead, in __m256i, to prefetch each of `n_streams` inputs:
+ * as far as we can while the lines in flight for every stream fit in
+ * half the L1D, so they aren't evicted before we get to them, in
+ * whole blocks.  Compiling with -DFILTER_PREFETCH_DISTANCE=n fixes it
+ * to `n` instead.
+ */
+size_t filter_prefetch_distance(size_t n_streams);
@@ -0,0 +1,556 @@
+#define _GNU_SOURCE
+#include "pool.h"
+#include "deque.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* From <numaif.h>, to avoid depending on libnuma. */
+#ifndef MPOL_F_NODE
+#define MPOL_F_NODE (1 << 0)
+#endif
+#ifndef MPOL_F_ADDR
+#define MPOL_F_ADDR (1 << 1)
+#endif
+
+/* Chunks of at least a page are rounded to whole pages. */
+#define PAGE_VECS (4096 / sizeof(__m256i))
+
+/* Aim for this many chunks per worker, for load balancing. */
+#define CHUNKS_PER_WORKER 4
+
+/* Batch tasks are split until they're at most this many vectors. */
+#define BATCH_GRAIN (16 * PAGE_VECS)
+
+/* Each split pushes a task; tasks halve, so this bounds the depth. */
+#define BATCH_MAX_SPLITS 64
+
+/* The node of a worker we couldn't pin, which may run anywhere. */
+#define POOL_NO_NODE SIZE_MAX
+
+struct pool_worker {
+        struct filter_pool *pool;
+        pthread_t thread;
+        int cpu;
+        size_t node;
+        struct task_deque deque;
+        uint64_t rng;
+};
+
+struct pool_chunk {
+        size_t begin;
+        size_t end;
+        size_t node;
+};
+
+struct filter_pool {
+        pthread_mutex_t lock;
+        pthread_cond_t start;
+        pthread_cond_t done;
+        uint64_t generation;
+        size_t active;
+        bool shutdown;
+
+        size_t n_workers;
+        struct pool_worker *workers;
+        size_t n_nodes;
+
+        /* What each worker does for the current job. */
+        void (*work)(struct filter_pool *, struct pool_worker *);
+
+        /* The current single filter_pool_run job. */
+        filter_fn_t *fn;
+        const struct filter_state *state;
+        size_t n_chunks;
+        size_t chunk_capacity;
+        struct pool_chunk *chunks;
+        /* Chunk indices, grouped by node. */
+        size_t *order;
+        /* Node k's chunks are order[node_begin[k] .. node_begin[k + 1]). */
+        size_t *node_begin;
+        /* Next index in order[] for each node; atomic. */
+        size_t *node_next;
+
+        /* The current batch. */
+        const struct filter_job *jobs;
+        /* Vectors left to evaluate in the batch; atomic. */
+        size_t pending;
+};
+
+void
+filter_state_slice(struct filter_state *dst, const struct filter_state *state,
+    size_t begin, size_t end)
+{
+
+        dst->count = end - begin;
+        for (size_t i = 0; i < FILTER_MAX_PTRS; i++)
+                dst->ptrs[i] = (state->ptrs[i] == NULL) ? NULL
+                    : state->ptrs[i] + begin;
+
+        dst->popcount = 0;
+        dst->sink = NULL;
+        return;
+}
+
+static size_t
+current_node(void)
+{
+        unsigned cpu, node;
+
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+                return 0;
+
+        return node;
+}
+
+/**
+ * The node that backs `addr`, or 0 if we can't tell.
+ */
+static size_t
+address_node(const void *addr)
+{
+        int node;
+
+        if (syscall(SYS_get_mempolicy, &node, NULL, 0UL, addr,
+            MPOL_F_NODE | MPOL_F_ADDR) != 0 || node < 0)
+                return 0;
+
+        return node;
+}
+
+static void
+run_chunk(struct filter_pool *pool, const struct pool_chunk *chunk)
+{
+        struct filter_state local;
+
+        filter_state_slice(&local, pool->state, chunk->begin, chunk->end);
+        pool->fn(&local);
+        return;
+}
+
+/**
+ * Drain our node's chunks, then help the other nodes.  Unpinned
+ * workers have no node, and just help from node 0 on.
+ */
+static void
+run_chunks(struct filter_pool *pool, struct pool_worker *worker)
+{
+        size_t node = (worker->node == POOL_NO_NODE) ? 0 : worker->node;
+
+        for (size_t k = 0; k < pool->n_nodes; k++) {
+                size_t current = (node + k) % pool->n_nodes;
+                size_t end = pool->node_begin[current + 1];
+
+                for (;;) {
+                        size_t i = __atomic_fetch_add(&pool->node_next[current],
+                            1, __ATOMIC_RELAXED);
+
+                        if (i >= end)
+                                break;
+
+                        run_chunk(pool, &pool->chunks[pool->order[i]]);
+                }
+        }
+
+        return;
+}
+
+static void *
+worker_main(void *arg)
+{
+        struct pool_worker *worker = arg;
+        struct filter_pool *pool = worker->pool;
+        uint64_t seen = 0;
+
+        for (;;) {
+                pthread_mutex_lock(&pool->lock);
+                while (pool->generation == seen && !pool->shutdown)
+                        pthread_cond_wait(&pool->start, &pool->lock);
+
+                if (pool->shutdown) {
+                        pthread_mutex_unlock(&pool->lock);
+                        break;
+                }
+
+                seen = pool->generation;
+                pthread_mutex_unlock(&pool->lock);
+
+                pool->work(pool, worker);
+
+                pthread_mutex_lock(&pool->lock);
+                if (--pool->active == 0)
+                        pthread_cond_signal(&pool->done);
+                pthread_mutex_unlock(&pool->lock);
+        }
+
+        return NULL;
+}
+
+static void *
+worker_start(void *arg)
+{
+        struct pool_worker *worker = arg;
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        /*
+         * E.g., if the CPU left our cpuset since we probed it: the
+         * worker may then run on any node, so it has no local chunks.
+         * Only this thread reads its node.
+         */
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+                worker->node = POOL_NO_NODE;
+        return worker_main(worker);
+}
+
+struct filter_pool *
+filter_pool_create(size_t n_threads)
+{
+        struct filter_pool *ret;
+        cpu_set_t set;
+        int cpus[CPU_SETSIZE];
+        size_t n_cpus = 0;
+
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                        if (CPU_ISSET(cpu, &set))
+                                cpus[n_cpus++] = cpu;
+                }
+        }
+
+        if (n_cpus == 0)
+                cpus[n_cpus++] = 0;
+
+        if (n_threads == 0)
+                n_threads = n_cpus;
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        pthread_mutex_init(&ret->lock, NULL);
+        pthread_cond_init(&ret->start, NULL);
+        pthread_cond_init(&ret->done, NULL);
+        ret->n_workers = n_threads;
+        ret->workers = calloc(n_threads, sizeof(ret->workers[0]));
+        assert(ret->workers != NULL);
+
+        /*
+         * Find each worker's node before starting any, so the node
+         * tables are sized once.  Worker 0 is the caller, which we
+         * leave unpinned.
+         */
+        for (size_t i = 0; i < n_threads; i++) {
+                struct pool_worker *worker = &ret->workers[i];
+                cpu_set_t probe;
+                unsigned cpu, node;
+
+                worker->pool = ret;
+                worker->rng = i + 1;
+                worker->cpu = cpus[i % n_cpus];
+                worker->node = 0;
+
+                CPU_ZERO(&probe);
+                CPU_SET(worker->cpu, &probe);
+                if (i > 0 && sched_setaffinity(0, sizeof(probe), &probe) == 0 &&
+                    syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+                        worker->node = node;
+
+                if (worker->node + 1 > ret->n_nodes)
+                        ret->n_nodes = worker->node + 1;
+        }
+
+        sched_setaffinity(0, sizeof(set), &set);
+        ret->workers[0].node = current_node();
+        if (ret->workers[0].node + 1 > ret->n_nodes)
+                ret->n_nodes = ret->workers[0].node + 1;
+
+        ret->node_begin = calloc(ret->n_nodes + 1, sizeof(ret->node_begin[0]));
+        ret->node_next = calloc(ret->n_nodes, sizeof(ret->node_next[0]));
+        assert(ret->node_begin != NULL && ret->node_next != NULL);
+
+        for (size_t i = 1; i < n_threads; i++) {
+                int r = pthread_create(&ret->workers[i].thread, NULL,
+                    worker_start, &ret->workers[i]);
+
+                assert(r == 0);
+        }
+
+        return ret;
+}
+
+void
+filter_pool_destroy(struct filter_pool *pool)
+{
+
+        if (pool == NULL)
+                return;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = true;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (size_t i = 1; i < pool->n_workers; i++)
+                pthread_join(pool->workers[i].thread, NULL);
+
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->start);
+        pthread_mutex_destroy(&pool->lock);
+        for (size_t i = 0; i < pool->n_workers; i++)
+                task_deque_fini(&pool->workers[i].deque);
+
+        free(pool->node_next);
+        free(pool->node_begin);
+        free(pool->order);
+        free(pool->chunks);
+        free(pool->workers);
+        free(pool);
+        return;
+}
+
+size_t
+filter_pool_size(const struct filter_pool *pool)
+{
+
+        return pool->n_workers;
+}
+
+/**
+ * Wakes the other workers up for the current job, works on it
+ * ourselves, and waits for everyone to finish.
+ */
+static void
+run_workers(struct filter_pool *pool)
+{
+
+        pthread_mutex_lock(&pool->lock);
+        pool->active = pool->n_workers - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->work(pool, &pool->workers[0]);
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->active > 0)
+                pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+}
+
+static size_t
+chunk_size(const struct filter_pool *pool, size_t count)
+{
+        size_t target = count / (CHUNKS_PER_WORKER * pool->n_workers);
+        size_t round = (target >= PAGE_VECS) ? PAGE_VECS : BLOCK_SIZE;
+
+        if (target < BLOCK_SIZE)
+                target = BLOCK_SIZE;
+
+        return (target + round - 1) / round * round;
+}
+
+/**
+ * Splits the state in chunks, and groups them by the node of their
+ * first input (or destination, without inputs).
+ */
+static void
+plan_chunks(struct filter_pool *pool, const struct filter_state *state)
+{
+        size_t count = state->count;
+        size_t size = chunk_size(pool, count);
+        const __m256i *probe = state->ptrs[1] != NULL ? state->ptrs[1]
+            : state->ptrs[0];
+
+        pool->n_chunks = (count + size - 1) / size;
+        if (pool->n_chunks > pool->chunk_capacity) {
+                pool->chunk_capacity = pool->n_chunks;
+                pool->chunks = realloc(pool->chunks,
+                    pool->chunk_capacity * sizeof(pool->chunks[0]));
+                pool->order = realloc(pool->order,
+                    pool->chunk_capacity * sizeof(pool->order[0]));
+                assert(pool->chunks != NULL && pool->order != NULL);
+        }
+
+        for (size_t i = 0; i <= pool->n_nodes; i++)
+                pool->node_begin[i] = 0;
+
+        for (size_t i = 0; i < pool->n_chunks; i++) {
+                struct pool_chunk *chunk = &pool->chunks[i];
+
+                chunk->begin = i * size;
+                chunk->end = (count - chunk->begin < size) ? count
+                    : chunk->begin + size;
+                chunk->node = 0;
+                if (pool->n_nodes > 1 && probe != NULL)
+                        chunk->node = address_node(probe + chunk->begin);
+                if (chunk->node >= pool->n_nodes)
+                        chunk->node = 0;
+
+                pool->node_begin[chunk->node + 1]++;
+        }
+
+        for (size_t i = 0; i < pool->n_nodes; i++) {
+                pool->node_begin[i + 1] += pool->node_begin[i];
+                pool->node_next[i] = pool->node_begin[i];
+        }
+
+        /* Counting sort, with node_next as the write cursors. */
+        for (size_t i = 0; i < pool->n_chunks; i++)
+                pool->order[pool->node_next[pool->chunks[i].node]++] = i;
+
+        for (size_t i = 0; i < pool->n_nodes; i++)
+                pool->node_next[i] = pool->node_begin[i];
+
+        return;
+}
+
+void
+filter_pool_run(struct filter_pool *pool, filter_fn_t *fn,
+    const struct filter_state *state)
+{
+
+        if (state->count == 0)
+                return;
+
+        pool->work = run_chunks;
+        pool->fn = fn;
+        pool->state = state;
+        plan_chunks(pool, state);
+
+        /* Not worth waking anyone up. */
+        if (pool->n_workers == 1 || pool->n_chunks == 1) {
+                for (size_t i = 0; i < pool->n_chunks; i++)
+                        run_chunk(pool, &pool->chunks[i]);
+                return;
+        }
+
+        pool->workers[0].node = current_node() % pool->n_nodes;
+        run_workers(pool);
+        return;
+}
+
+static uint64_t
+xorshift(uint64_t *state)
+{
+        uint64_t x = *state;
+
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        *state = x;
+        return x;
+}
+
+static bool
+steal(struct filter_pool *pool, struct pool_worker *worker,
+    struct pool_task *out)
+{
+
+        for (size_t attempt = 0; attempt < pool->n_workers; attempt++) {
+                struct pool_worker *victim;
+
+                victim = &pool->workers[xorshift(&worker->rng) % pool->n_workers];
+                if (victim != worker && task_deque_steal(&victim->deque, out))
+                        return true;
+        }
+
+        return false;
+}
+
+/**
+ * Splits large tasks in halves, and leaves the upper halves for
+ * thieves (or for ourselves, later), before running the rest.
+ */
+static void
+run_task(struct filter_pool *pool, struct pool_worker *worker,
+    struct pool_task task)
+{
+        const struct filter_job *job = &pool->jobs[task.job];
+        struct filter_state local;
+
+        while (task.end - task.begin > BATCH_GRAIN) {
+                size_t half = (task.end - task.begin) / 2;
+                size_t mid = task.begin +
+                    (half + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+
+                task_deque_push(&worker->deque, (struct pool_task) {
+                        .job = task.job,
+                        .begin = mid,
+                        .end = task.end,
+                });
+                task.end = mid;
+        }
+
+        filter_state_slice(&local, job->state, task.begin, task.end);
+        job->fn(&local);
+        __atomic_sub_fetch(&pool->pending, task.end - task.begin,
+            __ATOMIC_RELEASE);
+        return;
+}
+
+static void
+run_batch(struct filter_pool *pool, struct pool_worker *worker)
+{
+
+        while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0) {
+                struct pool_task task;
+
+                if (task_deque_pop(&worker->deque, &task) ||
+                    steal(pool, worker, &task)) {
+                        run_task(pool, worker, task);
+                        continue;
+                }
+
+                sched_yield();
+        }
+
+        return;
+}
+
+void
+filter_pool_run_batch(struct filter_pool *pool,
+    const struct filter_job *jobs, size_t n_jobs)
+{
+        size_t capacity = n_jobs / pool->n_workers + 1 + BATCH_MAX_SPLITS;
+        size_t pending = 0;
+
+        for (size_t i = 0; i < pool->n_workers; i++)
+                task_deque_reset(&pool->workers[i].deque, capacity);
+
+        /* Deal whole jobs round-robin; splitting balances the rest. */
+        for (size_t i = 0; i < n_jobs; i++) {
+                struct pool_worker *worker = &pool->workers[i % pool->n_workers];
+
+                if (jobs[i].state->count == 0)
+                        continue;
+
+                pending += jobs[i].state->count;
+                task_deque_push(&worker->deque, (struct pool_task) {
+                        .job = i,
+                        .begin = 0,
+                        .end = jobs[i].state->count,
+                });
+        }
+
+        if (pending == 0)
+                return;
+
+        pool->work = run_batch;
+        pool->jobs = jobs;
+        pool->pending = pending;
+        if (pool->n_workers == 1) {
+                run_batch(pool, &pool->workers[0]);
+                return;
+        }
+
+        run_workers(pool);
+        return;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "interface.h"
+
+/**
+ * A pool of worker threads, each pinned to a CPU, that evaluate a
+ * filter in parallel by splitting `[0, count)` in chunks.
+ */
+struct filter_pool;
+
+/**
+ * Creates a pool of `n_threads` workers, including the calling
+ * thread, or one per CPU in our affinity mask if 0.  A worker that
+ * can't be pinned runs unpinned, with no NUMA node of its own.
+ */
+struct filter_pool *filter_pool_create(size_t n_threads);
+
+void filter_pool_destroy(struct filter_pool *);
+
+size_t filter_pool_size(const struct filter_pool *);
+
+/**
+ * Calls `fn` on chunks of `state` from every worker, and returns once
+ * all chunks are done.  Chunks are multiples of BLOCK_SIZE vectors,
+ * and, when the inputs live on several NUMA nodes, preferentially
+ * evaluated by workers on the node of their first input.
+ *
+ * `fn` sees a private filter_state for each chunk, so must not rely
+ * on `scratch` surviving across calls, and must write `dst`: chunks
+ * have no sink, and their popcounts aren't added up.  Only one thread
+ * may run jobs on a pool at a time.
+ */
+void filter_pool_run(struct filter_pool *, filter_fn_t *fn,
+    const struct filter_state *state);
+
+/**
+ * One query of a batch: `fn` applied to `state`.
+ */
+struct filter_job {
+        filter_fn_t *fn;
+        const struct filter_state *state;
+};
+
+/**
+ * Evaluates every job, and returns once they're all done.  Jobs are
+ * dealt to the workers' work-stealing deques, and split in halves of
+ * whole blocks as they run, so idle workers can steal part of a large
+ * job instead of waiting behind it.  Jobs must write to disjoint
+ * destinations; `fn` sees a private filter_state per chunk, as for
+ * filter_pool_run.
+ */
+void filter_pool_run_batch(struct filter_pool *,
+    const struct filter_job *jobs, size_t n_jobs);
+
+/**
+ * Fills `dst` with the `[begin, end)` slice of `state`: non-NULL
+ * pointers are offset by `begin` vectors, and the count is
+ * `end - begin`.  The slice's popcount starts at 0, for callers to
+ * add up, and it has no sink: *_emit methods would number their bits
+ * from the start of the slice.
+ */
+void filter_state_slice(struct filter_state *dst,
+    const struct filter_state *state, size_t begin, size_t end);
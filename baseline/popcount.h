@@ -0,0 +1,168 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "interface.h"
+
+/**
+ * Population counts for the count-only methods: vectors are reduced to
+ * per-64-bit-lane counts, and summed horizontally once, at the end.
+ *
+ * With AVX-512 VPOPCNTDQ, each vector is a single `vpopcntq`.
+ * Otherwise, we use Mula's `vpshufb` nibble lookup, and blocks of 16
+ * vectors first go through a Harley-Seal carry-save adder tree, so
+ * that we only count one vector in 16, plus the final residues; any
+ * remainder of a block (e.g., with -DBLOCK_SIZE=8) is counted one
+ * vector at a time.
+ */
+
+struct popcount_acc {
+        /* Per-lane bit counts. */
+        __m256i counts;
+        /* Per-lane bit counts, in units of 16. */
+        __m256i sixteens;
+        /* Carry-save residues; the units are in the names. */
+        __m256i ones;
+        __m256i twos;
+        __m256i fours;
+        __m256i eights;
+};
+
+static inline __m256i
+popcount_lanes_pshufb(__m256i x)
+{
+        const __m256i lookup = _mm256_setr_epi8(
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low = _mm256_set1_epi8(0x0f);
+        __m256i lo = _mm256_shuffle_epi8(lookup, x & low);
+        __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_srli_epi16(x, 4) & low);
+
+        return _mm256_sad_epu8(_mm256_add_epi8(lo, hi),
+            _mm256_setzero_si256());
+}
+
+/**
+ * Number of set bits in each 64-bit lane of x.
+ */
+static inline __m256i
+popcount_lanes(__m256i x)
+{
+
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512VL__)
+        return _mm256_popcnt_epi64(x);
+#else
+        return popcount_lanes_pshufb(x);
+#endif
+}
+
+static inline uint64_t
+popcount_hsum(__m256i lanes)
+{
+
+        return (uint64_t)_mm256_extract_epi64(lanes, 0) +
+            (uint64_t)_mm256_extract_epi64(lanes, 1) +
+            (uint64_t)_mm256_extract_epi64(lanes, 2) +
+            (uint64_t)_mm256_extract_epi64(lanes, 3);
+}
+
+static inline struct popcount_acc
+popcount_acc_init(void)
+{
+        const __m256i zero = _mm256_setzero_si256();
+
+        return (struct popcount_acc) {
+                .counts = zero,
+                .sixteens = zero,
+                .ones = zero,
+                .twos = zero,
+                .fours = zero,
+                .eights = zero,
+        };
+}
+
+/* Carry-save adder: (*hi, *lo) = a + b + c. */
+static inline void
+popcount_csa(__m256i *hi, __m256i *lo, __m256i a, __m256i b, __m256i c)
+{
+        __m256i u = a ^ b;
+
+        *hi = (a & b) | (u & c);
+        *lo = u ^ c;
+        return;
+}
+
+/**
+ * Adds the bits of 16 vectors to `acc`, with a Harley-Seal tree.
+ */
+static inline void
+popcount_harley_seal16(struct popcount_acc *acc, const __m256i *v)
+{
+        __m256i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+        __m256i sixteens;
+
+        popcount_csa(&twos_a, &acc->ones, acc->ones, v[0], v[1]);
+        popcount_csa(&twos_b, &acc->ones, acc->ones, v[2], v[3]);
+        popcount_csa(&fours_a, &acc->twos, acc->twos, twos_a, twos_b);
+        popcount_csa(&twos_a, &acc->ones, acc->ones, v[4], v[5]);
+        popcount_csa(&twos_b, &acc->ones, acc->ones, v[6], v[7]);
+        popcount_csa(&fours_b, &acc->twos, acc->twos, twos_a, twos_b);
+        popcount_csa(&eights_a, &acc->fours, acc->fours, fours_a, fours_b);
+
+        popcount_csa(&twos_a, &acc->ones, acc->ones, v[8], v[9]);
+        popcount_csa(&twos_b, &acc->ones, acc->ones, v[10], v[11]);
+        popcount_csa(&fours_a, &acc->twos, acc->twos, twos_a, twos_b);
+        popcount_csa(&twos_a, &acc->ones, acc->ones, v[12], v[13]);
+        popcount_csa(&twos_b, &acc->ones, acc->ones, v[14], v[15]);
+        popcount_csa(&fours_b, &acc->twos, acc->twos, twos_a, twos_b);
+        popcount_csa(&eights_b, &acc->fours, acc->fours, fours_a, fours_b);
+
+        popcount_csa(&sixteens, &acc->eights, acc->eights, eights_a, eights_b);
+        acc->sixteens = _mm256_add_epi64(acc->sixteens,
+            popcount_lanes(sixteens));
+        return;
+}
+
+/**
+ * Adds the bits of a BLOCK_SIZE-vector block to `acc`.
+ */
+static inline void
+popcount_add_block(struct popcount_acc *acc, const __m256i *block)
+{
+
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512VL__)
+        for (size_t i = 0; i < BLOCK_SIZE; i++)
+                acc->counts = _mm256_add_epi64(acc->counts,
+                    popcount_lanes(block[i]));
+#else
+        size_t i;
+
+        for (i = 0; i + 16 <= BLOCK_SIZE; i += 16)
+                popcount_harley_seal16(acc, block + i);
+
+        for (; i < BLOCK_SIZE; i++)
+                acc->counts = _mm256_add_epi64(acc->counts,
+                    popcount_lanes(block[i]));
+#endif
+        return;
+}
+
+/**
+ * Total number of bits added to `acc`.
+ */
+static inline uint64_t
+popcount_acc_sum(const struct popcount_acc *acc)
+{
+        __m256i total;
+
+        total = _mm256_slli_epi64(acc->sixteens, 4);
+        total = _mm256_add_epi64(total,
+            _mm256_slli_epi64(popcount_lanes(acc->eights), 3));
+        total = _mm256_add_epi64(total,
+            _mm256_slli_epi64(popcount_lanes(acc->fours), 2));
+        total = _mm256_add_epi64(total,
+            _mm256_slli_epi64(popcount_lanes(acc->twos), 1));
+        total = _mm256_add_epi64(total, popcount_lanes(acc->ones));
+        total = _mm256_add_epi64(total, acc->counts);
+        return popcount_hsum(total);
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+#include "threaded.h"
+
+enum expr_kind {
+        EXPR_VAR,
+        EXPR_NOT,
+        EXPR_AND,
+        EXPR_OR,
+        EXPR_XOR,
+};
+
+/**
+ * A boolean expression over the bitmaps in `filter_state.ptrs`.
+ *
+ * Leaves refer to `ptrs[var]`.  `ptrs[0]` is usually the
+ * destination, so inputs start at 1.  `not` has exactly one argument;
+ * `and`, `or` and `xor` have one or more.
+ */
+struct expr {
+        enum expr_kind kind;
+        size_t var;
+        size_t n_args;
+        struct expr **args;
+};
+
+struct expr *expr_var(size_t var);
+
+/**
+ * Constructors take ownership of their arguments.
+ */
+struct expr *expr_not(struct expr *);
+
+/**
+ * `args` is copied, the expressions it points to are not.
+ */
+struct expr *expr_nary(enum expr_kind, size_t n_args, struct expr **args);
+
+/**
+ * Parse an s-expression like `(and (xor neg_x (or x0 x1)) y0)`.
+ *
+ * Symbols are looked up in `names` (`names[i]` denotes `ptrs[i]`),
+ * and decimal integers denote ptrs indices directly.
+ *
+ * Returns NULL on syntax errors.
+ */
+struct expr *expr_parse(const char *src,
+    const char *const *names, size_t n_names);
+
+void expr_destroy(struct expr *);
+
+struct expr *expr_copy(const struct expr *);
+
+/**
+ * Returns a malloc'ed s-expression for `expr`, with numeric inputs;
+ * expr_parse(expr_format(e), NULL, 0) is equivalent to e.
+ */
+char *expr_format(const struct expr *);
+
+/**
+ * Returns a canonical copy of `expr`: nested and/or/xor are
+ * flattened, single-argument operators and double negations are
+ * dropped, duplicate arguments of and/or are removed, and arguments
+ * are sorted by shape, regardless of the inputs they refer to.
+ */
+struct expr *expr_canonicalise(const struct expr *);
+
+/**
+ * Canonicalises `expr`, then renames its inputs to 1, 2, ... in
+ * order of first occurrence.  `inputs[k - 1]` receives the original
+ * ptrs index for input k, and `*n_inputs` the number of distinct
+ * inputs, at most FILTER_MAX_PTRS - 1.
+ *
+ * Queries that only differ in their inputs, or in the order of
+ * commutative operators, map to the same shape.
+ */
+struct expr *expr_shape(const struct expr *, size_t *inputs, size_t *n_inputs);
+
+/**
+ * Scalar reference evaluator: writes the expression's value to
+ * `state->dst` for all `state->count` vectors.
+ */
+void expr_eval(const struct expr *, struct filter_state *);
+
+/**
+ * Linear register-machine code, before lowering to threaded ops.
+ *
+ * The code generator never reads the source register of a binary
+ * operation again, so superinstruction selection may assume it dead.
+ */
+enum vm_opcode {
+        /* reg = ptrs[arg[0]][i] */
+        VM_LOAD,
+        /* ptrs[arg[0]][i] = reg */
+        VM_STORE,
+        /* scratch.val[arg[0]] = reg */
+        VM_SPILL,
+        /* reg = scratch.val[arg[0]] */
+        VM_FILL,
+        /* reg = ~reg */
+        VM_NOT,
+        /* reg op= src */
+        VM_OR,
+        VM_AND,
+        VM_XOR,
+        /* Next iteration. */
+        VM_LOOP,
+
+        /*
+         * Superinstructions, formed by query_tile.  pN is
+         * ptrs[arg[N]][i].
+         */
+        /* reg op= p0 */
+        VM_OR_MEM,
+        VM_AND_MEM,
+        VM_XOR_MEM,
+        /* reg &= ~src */
+        VM_ANDN,
+        /* reg &= ~p0 */
+        VM_ANDN_MEM,
+        /* reg = p0 | p1 (| p2) */
+        VM_LOAD_OR2,
+        VM_LOAD_OR3,
+        /* reg |= p0 | p1 (| p2) */
+        VM_OR2_MEM,
+        VM_OR3_MEM,
+        /* reg = p0 ^ (p1 | p2) */
+        VM_XOR_OR,
+        /* reg &= p0 ^ p1 */
+        VM_AND_XOR_MEM,
+        /* reg &= p0 ^ (p1 | p2) */
+        VM_AND_XOR_OR_MEM,
+        /* ptrs[arg[0]][i] = reg, then next iteration. */
+        VM_STORE_LOOP,
+};
+
+struct vm_insn {
+        enum vm_opcode opcode;
+        uint8_t reg;
+        uint8_t src;
+        size_t arg[3];
+};
+
+struct query_program {
+        size_t n_insns;
+        struct vm_insn *insns;
+        /* Number of scratch.val slots used for spills. */
+        size_t n_spills;
+        /* Lowered op list, n_insns entries. */
+        struct op *ops;
+};
+
+enum query_compile_flags {
+        /* Only use the base primitives, like threaded_inreg. */
+        QUERY_NO_SUPERINSTRUCTIONS = 1 << 0,
+        /* Recompute repeated subexpressions at each use. */
+        QUERY_NO_CSE = 1 << 1,
+};
+
+/**
+ * Hash-consed expression DAG: structurally equal subexpressions,
+ * modulo the order of commutative arguments, are the same node.
+ */
+struct dag_node {
+        enum expr_kind kind;
+        size_t var;
+        size_t n_args;
+        /* Node ids, sorted for commutative operators. */
+        size_t *args;
+        /* Number of references from other nodes and roots. */
+        size_t uses;
+        uint64_t hash;
+};
+
+struct query_dag {
+        size_t n_nodes;
+        size_t cap_nodes;
+        /* Children before parents. */
+        struct dag_node *nodes;
+        size_t n_buckets;
+        size_t *buckets;
+};
+
+struct query_dag *query_dag_create(void);
+
+/**
+ * Adds `expr` as a root, and returns its node id.
+ */
+size_t query_dag_add(struct query_dag *, const struct expr *);
+
+void query_dag_destroy(struct query_dag *);
+
+/**
+ * Compile an expression to a threaded program that stores its value
+ * in `ptrs[0]`.
+ *
+ * Returns NULL if the expression needs more spill slots than
+ * `filter_state.scratch` has.
+ */
+struct query_program *query_compile(const struct expr *, unsigned flags);
+
+/**
+ * Compiles a batch of expressions into one program that stores the
+ * value of `exprs[k]` in `ptrs[dsts[k]]`.  Subexpressions used more
+ * than once, in one query or across the batch, are computed once per
+ * iteration and kept in a scratch slot until their last use.
+ *
+ * Destinations must not be inputs of any expression in the batch.
+ */
+struct query_program *query_compile_batch(const struct expr *const *exprs,
+    const size_t *dsts, size_t n_exprs, unsigned flags);
+
+/**
+ * Rewrite `insns` in place to use superinstructions, greedily
+ * matching the largest patterns first.  Returns the new length.
+ */
+size_t query_tile(struct vm_insn *insns, size_t n_insns);
+
+/**
+ * Number of `ptrs[]` indices the instruction reads or writes: they're
+ * arg[0 .. n).
+ */
+size_t vm_insn_n_ptrs(const struct vm_insn *);
+
+void query_program_destroy(struct query_program *);
+
+void query_run(const struct query_program *, struct filter_state *);
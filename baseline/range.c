@@ -0,0 +1,247 @@
+#include "range.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "pool.h"
+
+#define BITS_PER_VEC (8 * sizeof(__m256i))
+#define BITS_PER_WORD 64
+
+/* The 64-bit lanes of vector `vec` that overlap words [w_begin, w_end). */
+static inline unsigned
+lane_mask(size_t vec, size_t w_begin, size_t w_end)
+{
+        unsigned ret = 0;
+
+        for (size_t k = 0; k < 4; k++) {
+                size_t w = 4 * vec + k;
+
+                ret |= (unsigned)(w >= w_begin && w < w_end) << k;
+        }
+
+        return ret;
+}
+
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+static inline __m256i
+load_lanes(const __m256i *src, unsigned lanes)
+{
+
+        return _mm256_maskz_loadu_epi64((__mmask8)lanes, src);
+}
+
+static inline void
+store_lanes(__m256i *dst, unsigned lanes, __m256i value)
+{
+
+        _mm256_mask_storeu_epi64(dst, (__mmask8)lanes, value);
+        return;
+}
+#else
+static inline __m256i
+lanes_to_vec(unsigned lanes)
+{
+
+        return _mm256_set_epi64x(-(long long)((lanes >> 3) & 1),
+            -(long long)((lanes >> 2) & 1), -(long long)((lanes >> 1) & 1),
+            -(long long)(lanes & 1));
+}
+
+static inline __m256i
+load_lanes(const __m256i *src, unsigned lanes)
+{
+
+        return _mm256_maskload_epi64((const long long *)src, lanes_to_vec(lanes));
+}
+
+static inline void
+store_lanes(__m256i *dst, unsigned lanes, __m256i value)
+{
+
+        _mm256_maskstore_epi64((long long *)dst, lanes_to_vec(lanes), value);
+        return;
+}
+#endif
+
+/**
+ * Clears the bits of staged words that are outside `[begin, end)`.
+ */
+static void
+clear_outside(uint64_t *words, size_t vec, size_t n, size_t begin, size_t end)
+{
+        size_t w_begin = begin / BITS_PER_WORD;
+        size_t w_end = (end + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+        if ((begin % BITS_PER_WORD) != 0 && w_begin >= 4 * vec &&
+            w_begin < 4 * (vec + n))
+                words[w_begin - 4 * vec] &=
+                    ~((UINT64_C(1) << (begin % BITS_PER_WORD)) - 1);
+
+        if ((end % BITS_PER_WORD) != 0 && w_end - 1 >= 4 * vec &&
+            w_end - 1 < 4 * (vec + n))
+                words[w_end - 1 - 4 * vec] &=
+                    (UINT64_C(1) << (end % BITS_PER_WORD)) - 1;
+
+        return;
+}
+
+/**
+ * Evaluates vectors `[vec, vec + n)`, for n <= BLOCK_SIZE, through a
+ * block of staging vectors per non-NULL pointer.  Inputs are zero
+ * outside `[begin, end)`.  Returns fn's popcount for the block.
+ */
+static uint64_t
+run_edge(filter_fn_t *fn, const struct filter_state *state,
+    struct filter_state *local, __m256i *staging, size_t vec, size_t n,
+    size_t begin, size_t end)
+{
+        size_t w_begin = begin / BITS_PER_WORD;
+        size_t w_end = (end + BITS_PER_WORD - 1) / BITS_PER_WORD;
+        uint64_t *words;
+        __m256i *out = state->ptrs[0];
+        __m256i *next = staging;
+
+        for (size_t i = 0; i < FILTER_MAX_PTRS; i++) {
+                const __m256i *src = state->ptrs[i];
+
+                local->ptrs[i] = NULL;
+                if (src == NULL)
+                        continue;
+
+                local->ptrs[i] = next;
+                for (size_t j = 0; j < BLOCK_SIZE; j++) {
+                        next[j] = (j < n)
+                            ? load_lanes(&src[vec + j], lane_mask(vec + j, w_begin, w_end))
+                            : _mm256_setzero_si256();
+                }
+
+                clear_outside((uint64_t *)next, vec, n, begin, end);
+                next += BLOCK_SIZE;
+        }
+
+        local->count = BLOCK_SIZE;
+        local->popcount = 0;
+        fn(local);
+        if (out == NULL)
+                return local->popcount;
+
+        /* Keep the bits of dst's partial words that are out of range. */
+        words = (uint64_t *)local->ptrs[0];
+        if ((begin % BITS_PER_WORD) != 0 && w_begin >= 4 * vec &&
+            w_begin < 4 * (vec + n)) {
+                uint64_t keep = (UINT64_C(1) << (begin % BITS_PER_WORD)) - 1;
+                uint64_t old = ((const uint64_t *)out)[w_begin];
+
+                words[w_begin - 4 * vec] = (old & keep) |
+                    (words[w_begin - 4 * vec] & ~keep);
+        }
+
+        if ((end % BITS_PER_WORD) != 0 && w_end - 1 >= 4 * vec &&
+            w_end - 1 < 4 * (vec + n)) {
+                uint64_t keep = ~((UINT64_C(1) << (end % BITS_PER_WORD)) - 1);
+                uint64_t old = ((const uint64_t *)out)[w_end - 1];
+
+                words[w_end - 1 - 4 * vec] = (old & keep) |
+                    (words[w_end - 1 - 4 * vec] & ~keep);
+        }
+
+        for (size_t j = 0; j < n; j++)
+                store_lanes(&out[vec + j], lane_mask(vec + j, w_begin, w_end),
+                    local->ptrs[0][j]);
+
+        return local->popcount;
+}
+
+/**
+ * Evaluates the edge vectors `[vec_begin, vec_end)`.  Returns the sum
+ * of fn's popcounts, and adds the number of blocks to `*n_blocks`.
+ */
+static uint64_t
+run_edges(filter_fn_t *fn, const struct filter_state *state,
+    struct filter_state *local, __m256i *staging, size_t vec_begin,
+    size_t vec_end, size_t begin, size_t end, size_t *n_blocks)
+{
+        uint64_t ret = 0;
+
+        for (size_t vec = vec_begin; vec < vec_end; vec += BLOCK_SIZE) {
+                size_t n = (vec_end - vec < BLOCK_SIZE) ? vec_end - vec : BLOCK_SIZE;
+
+                ret += run_edge(fn, state, local, staging, vec, n, begin, end);
+                ++*n_blocks;
+        }
+
+        return ret;
+}
+
+void
+filter_run_range(filter_fn_t *fn, struct filter_state *state,
+    size_t begin, size_t end)
+{
+        struct filter_arena *arena = filter_arena_thread();
+        struct filter_state *local;
+        __m256i *staging;
+        size_t vec_begin = begin / BITS_PER_VEC;
+        size_t vec_end = (end + BITS_PER_VEC - 1) / BITS_PER_VEC;
+        /* Whole blocks of whole vectors. */
+        size_t body_begin = (begin + BITS_PER_VEC - 1) / BITS_PER_VEC;
+        size_t body_end = end / BITS_PER_VEC;
+        size_t n_ptrs = 0, n_blocks = 0;
+        uint64_t edge_popcount;
+
+        assert(begin <= end);
+        assert(state->sink == NULL);
+        state->popcount = 0;
+        if (begin == end)
+                return;
+
+        body_begin = (body_begin + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        body_end -= body_end % BLOCK_SIZE;
+        if (body_begin >= body_end)
+                body_begin = body_end = vec_end;
+
+        local = filter_arena_state(arena);
+        if (body_begin < body_end) {
+                filter_state_slice(local, state, body_begin, body_end);
+                fn(local);
+                state->popcount = local->popcount;
+        }
+
+        if (vec_begin == body_begin && body_end == vec_end) {
+                filter_arena_state_release(arena, local);
+                return;
+        }
+
+        for (size_t i = 0; i < FILTER_MAX_PTRS; i++)
+                n_ptrs += (state->ptrs[i] != NULL);
+
+        staging = filter_arena_vecs(arena, n_ptrs * BLOCK_SIZE);
+        edge_popcount = run_edges(fn, state, local, staging, vec_begin,
+            body_begin, begin, end, &n_blocks);
+        edge_popcount += run_edges(fn, state, local, staging, body_end,
+            vec_end, begin, end, &n_blocks);
+
+        /*
+         * Staged bits outside the range evaluate to the query's value
+         * on all-zero inputs; a block of zeros tells us what that is.
+         */
+        if (edge_popcount != 0) {
+                size_t block_bits = BLOCK_SIZE * BITS_PER_VEC;
+                size_t edge_bits = (end - begin) -
+                    (body_end - body_begin) * BITS_PER_VEC;
+
+                memset(staging, 0, n_ptrs * BLOCK_SIZE * sizeof(__m256i));
+                local->popcount = 0;
+                fn(local);
+                assert(local->popcount == 0 || local->popcount == block_bits);
+                if (local->popcount != 0)
+                        edge_popcount -= n_blocks * block_bits - edge_bits;
+        }
+
+        state->popcount += edge_popcount;
+        filter_arena_vecs_release(arena, staging, n_ptrs * BLOCK_SIZE);
+        filter_arena_state_release(arena, local);
+        return;
+}
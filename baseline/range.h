@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "interface.h"
+
+/**
+ * Evaluates `fn` on bits `[begin, end)` of `state`'s bitmaps, for any
+ * `begin <= end`, and leaves the other bits of `dst` alone.  For the
+ * *_count methods, `state->popcount` is the number of set bits in the
+ * range, and `dst` may be NULL as they never store to it.  The *_emit
+ * methods aren't supported (`state->sink` must be NULL): use
+ * filter_sink_run.
+ *
+ * `state->ptrs[]` point to bit 0 of each bitmap and must be 32-byte
+ * aligned; non-NULL entries are the query's operands, and only need
+ * to hold the 64-bit words that overlap `[begin, end)`.
+ * `state->count` is ignored.
+ *
+ * Whole blocks in the middle are passed to `fn` in place.  The ragged
+ * edges are staged a block at a time with masked loads and stores
+ * (`vpmaskmovq`, or AVX-512 mask registers when available), so we
+ * never touch words outside the range, and only merge the result's
+ * partial words at `begin` and `end` into `dst`.
+ */
+void filter_run_range(filter_fn_t *fn, struct filter_state *state,
+    size_t begin, size_t end);
@@ -0,0 +1,568 @@
+#include "roaring.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/* Decode this many vectors of a chunk at a time. */
+#define ROARING_BLOCK (4 * BLOCK_SIZE)
+
+/* Arrays are worth it up to this many positions. */
+#define ROARING_MAX_ARRAY (ROARING_CHUNK_BITS / 16)
+
+static size_t
+chunk_vecs(size_t count, size_t chunk)
+{
+        size_t begin = chunk * ROARING_CHUNK_VECS;
+
+        return (count - begin < ROARING_CHUNK_VECS) ? count - begin
+            : ROARING_CHUNK_VECS;
+}
+
+/**
+ * Sets bits [begin, end), a word at a time.
+ */
+static void
+set_bits(__m256i *vecs, size_t begin, size_t end)
+{
+        uint64_t *words = (uint64_t *)vecs;
+
+        while (begin < end) {
+                size_t shift = begin % 64;
+                size_t n = (end - begin < 64 - shift) ? end - begin : 64 - shift;
+                uint64_t mask = (n == 64) ? ~0ULL : ((1ULL << n) - 1) << shift;
+
+                words[begin / 64] |= mask;
+                begin += n;
+        }
+
+        return;
+}
+
+/**
+ * Picks the smallest container for `card` bits in `n_runs` runs.
+ */
+static enum roaring_kind
+choose_kind(size_t card, size_t n_runs, size_t n_vecs)
+{
+        size_t run_size = n_runs * sizeof(struct roaring_run);
+        size_t array_size = (card <= ROARING_MAX_ARRAY)
+            ? card * sizeof(uint16_t) : SIZE_MAX;
+        size_t dense_size = n_vecs * sizeof(__m256i);
+
+        if (card == 0)
+                return ROARING_EMPTY;
+
+        if (run_size <= array_size && run_size < dense_size)
+                return ROARING_RUN;
+
+        return (array_size < dense_size) ? ROARING_ARRAY : ROARING_DENSE;
+}
+
+static __m256i *
+alloc_dense(void)
+{
+        __m256i *ret;
+        int r;
+
+        r = posix_memalign((void **)&ret, 32,
+            ROARING_CHUNK_VECS * sizeof(__m256i));
+        assert(r == 0);
+        memset(ret, 0, ROARING_CHUNK_VECS * sizeof(__m256i));
+        return ret;
+}
+
+/**
+ * Bits of `words[i]` that start (end) a run, i.e., whose lower
+ * (higher) neighbour is clear.
+ */
+static uint64_t
+run_starts(const uint64_t *words, size_t i)
+{
+        uint64_t below = (i == 0) ? 0 : words[i - 1] >> 63;
+
+        return words[i] & ~((words[i] << 1) | below);
+}
+
+static uint64_t
+run_ends(const uint64_t *words, size_t n_words, size_t i)
+{
+        uint64_t above = (i + 1 == n_words) ? 0 : words[i + 1] << 63;
+
+        return words[i] & ~((words[i] >> 1) | above);
+}
+
+static struct roaring_container
+encode(const __m256i *vecs, size_t n_vecs)
+{
+        const uint64_t *words = (const uint64_t *)vecs;
+        size_t n_words = 4 * n_vecs;
+        size_t card = 0, n_runs = 0;
+        struct roaring_container ret = { .kind = ROARING_EMPTY };
+
+        for (size_t i = 0; i < n_words; i++) {
+                card += __builtin_popcountll(words[i]);
+                n_runs += __builtin_popcountll(run_starts(words, i));
+        }
+
+        ret.kind = choose_kind(card, n_runs, n_vecs);
+        switch (ret.kind) {
+        case ROARING_EMPTY:
+                break;
+        case ROARING_RUN: {
+                size_t n_starts = 0, n_ends = 0;
+
+                ret.runs = calloc(n_runs, sizeof(ret.runs[0]));
+                assert(ret.runs != NULL);
+                /* Starts and ends alternate, so fill them separately. */
+                for (size_t i = 0; i < n_words; i++) {
+                        uint64_t starts = run_starts(words, i);
+                        uint64_t ends = run_ends(words, n_words, i);
+
+                        for (; starts != 0; starts &= starts - 1) {
+                                ret.runs[n_starts++].start =
+                                    64 * i + __builtin_ctzll(starts);
+                        }
+
+                        for (; ends != 0; ends &= ends - 1) {
+                                ret.runs[n_ends++].last =
+                                    64 * i + __builtin_ctzll(ends);
+                        }
+                }
+
+                assert(n_starts == n_runs && n_ends == n_runs);
+                ret.n = n_runs;
+                break;
+        }
+        case ROARING_ARRAY: {
+                size_t n = 0;
+
+                ret.positions = calloc(card, sizeof(ret.positions[0]));
+                assert(ret.positions != NULL);
+                for (size_t i = 0; i < n_words; i++) {
+                        for (uint64_t w = words[i]; w != 0; w &= w - 1)
+                                ret.positions[n++] = 64 * i + __builtin_ctzll(w);
+                }
+
+                ret.n = card;
+                break;
+        }
+        case ROARING_DENSE:
+                ret.bits = alloc_dense();
+                memcpy(ret.bits, vecs, n_vecs * sizeof(__m256i));
+                break;
+        }
+
+        return ret;
+}
+
+/**
+ * Encodes a chunk from its sorted, disjoint and non-adjacent runs.
+ */
+static struct roaring_container
+encode_runs(const struct roaring_run *runs, size_t n_runs, size_t n_vecs)
+{
+        struct roaring_container ret = { .kind = ROARING_EMPTY };
+        size_t card = 0;
+
+        for (size_t i = 0; i < n_runs; i++)
+                card += (size_t)runs[i].last - runs[i].start + 1;
+
+        ret.kind = choose_kind(card, n_runs, n_vecs);
+        switch (ret.kind) {
+        case ROARING_EMPTY:
+                break;
+        case ROARING_RUN:
+                ret.runs = calloc(n_runs, sizeof(ret.runs[0]));
+                assert(ret.runs != NULL);
+                memcpy(ret.runs, runs, n_runs * sizeof(ret.runs[0]));
+                ret.n = n_runs;
+                break;
+        case ROARING_ARRAY: {
+                size_t n = 0;
+
+                ret.positions = calloc(card, sizeof(ret.positions[0]));
+                assert(ret.positions != NULL);
+                for (size_t i = 0; i < n_runs; i++) {
+                        for (size_t bit = runs[i].start; bit <= runs[i].last; bit++)
+                                ret.positions[n++] = bit;
+                }
+
+                ret.n = card;
+                break;
+        }
+        case ROARING_DENSE:
+                ret.bits = alloc_dense();
+                for (size_t i = 0; i < n_runs; i++)
+                        set_bits(ret.bits, runs[i].start, (size_t)runs[i].last + 1);
+                break;
+        }
+
+        return ret;
+}
+
+/**
+ * Appends [start, last] to sorted `runs`, merging it with the last run
+ * if they overlap or touch.
+ */
+static void
+append_run(struct roaring_run *runs, size_t *n_runs, size_t start, size_t last)
+{
+        struct roaring_run *prev = (*n_runs > 0) ? &runs[*n_runs - 1] : NULL;
+
+        if (prev != NULL && start <= (size_t)prev->last + 1) {
+                if (last > prev->last)
+                        prev->last = last;
+                return;
+        }
+
+        runs[(*n_runs)++] = (struct roaring_run) {
+                .start = start,
+                .last = last,
+        };
+        return;
+}
+
+static struct roaring_bitmap *
+alloc_bitmap(size_t count)
+{
+        struct roaring_bitmap *ret;
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->count = count;
+        ret->n_chunks = (count + ROARING_CHUNK_VECS - 1) / ROARING_CHUNK_VECS;
+        ret->chunks = calloc(ret->n_chunks, sizeof(ret->chunks[0]));
+        assert(ret->chunks != NULL || ret->n_chunks == 0);
+        return ret;
+}
+
+struct roaring_bitmap *
+roaring_from_dense(const __m256i *vecs, size_t count)
+{
+        struct roaring_bitmap *ret = alloc_bitmap(count);
+
+        for (size_t i = 0; i < ret->n_chunks; i++) {
+                ret->chunks[i] = encode(vecs + i * ROARING_CHUNK_VECS,
+                    chunk_vecs(count, i));
+        }
+
+        return ret;
+}
+
+/* Merged runs never touch, so a chunk has at most this many. */
+#define ROARING_MAX_RUNS (ROARING_CHUNK_BITS / 2)
+
+struct roaring_bitmap *
+roaring_from_positions(const uint64_t *positions, size_t n, size_t count)
+{
+        struct roaring_bitmap *ret = alloc_bitmap(count);
+        struct roaring_run *runs;
+        size_t i = 0;
+
+        runs = calloc(ROARING_MAX_RUNS, sizeof(runs[0]));
+        assert(runs != NULL);
+        for (size_t chunk = 0; chunk < ret->n_chunks; chunk++) {
+                uint64_t base = (uint64_t)chunk * ROARING_CHUNK_BITS;
+                size_t n_vecs = chunk_vecs(count, chunk);
+                size_t n_runs = 0;
+
+                for (; i < n && positions[i] < base + 256 * n_vecs; i++) {
+                        assert(i == 0 || positions[i - 1] <= positions[i]);
+                        append_run(runs, &n_runs, positions[i] - base,
+                            positions[i] - base);
+                }
+
+                ret->chunks[chunk] = encode_runs(runs, n_runs, n_vecs);
+        }
+
+        assert(i == n);
+        free(runs);
+        return ret;
+}
+
+struct roaring_bitmap *
+roaring_from_runs(const struct roaring_interval *intervals, size_t n,
+    size_t count)
+{
+        struct roaring_bitmap *ret = alloc_bitmap(count);
+        struct roaring_run *runs;
+        size_t i = 0;
+
+        runs = calloc(ROARING_MAX_RUNS, sizeof(runs[0]));
+        assert(runs != NULL);
+        for (size_t chunk = 0; chunk < ret->n_chunks; chunk++) {
+                uint64_t base = (uint64_t)chunk * ROARING_CHUNK_BITS;
+                uint64_t end = base + 256 * chunk_vecs(count, chunk);
+                size_t n_runs = 0;
+
+                /*
+                 * An interval that crosses into the next chunk stays,
+                 * so the next chunk revisits the ones after it, and
+                 * skips those it covered that end before the chunk.
+                 */
+                for (; i < n && intervals[i].start < end; i++) {
+                        uint64_t start = intervals[i].start;
+                        uint64_t last = intervals[i].last;
+
+                        assert(start <= last);
+                        assert(i == 0 || intervals[i - 1].start <= start);
+                        if (last < base)
+                                continue;
+
+                        append_run(runs, &n_runs,
+                            ((start < base) ? base : start) - base,
+                            ((last >= end) ? end - 1 : last) - base);
+                        if (last >= end)
+                                break;
+                }
+
+                ret->chunks[chunk] = encode_runs(runs, n_runs,
+                    chunk_vecs(count, chunk));
+        }
+
+        assert(i == n);
+        free(runs);
+        return ret;
+}
+
+void
+roaring_destroy(struct roaring_bitmap *bitmap)
+{
+
+        if (bitmap == NULL)
+                return;
+
+        for (size_t i = 0; i < bitmap->n_chunks; i++) {
+                /* All pointers share the union. */
+                if (bitmap->chunks[i].kind != ROARING_EMPTY)
+                        free(bitmap->chunks[i].bits);
+        }
+
+        free(bitmap->chunks);
+        free(bitmap);
+        return;
+}
+
+size_t
+roaring_size(const struct roaring_bitmap *bitmap)
+{
+        size_t ret = bitmap->n_chunks * sizeof(bitmap->chunks[0]);
+
+        for (size_t i = 0; i < bitmap->n_chunks; i++) {
+                const struct roaring_container *chunk = &bitmap->chunks[i];
+
+                switch (chunk->kind) {
+                case ROARING_EMPTY:
+                        break;
+                case ROARING_ARRAY:
+                        ret += chunk->n * sizeof(chunk->positions[0]);
+                        break;
+                case ROARING_RUN:
+                        ret += chunk->n * sizeof(chunk->runs[0]);
+                        break;
+                case ROARING_DENSE:
+                        ret += ROARING_CHUNK_VECS * sizeof(__m256i);
+                        break;
+                }
+        }
+
+        return ret;
+}
+
+/**
+ * What we know about a chunk before decoding it.
+ */
+enum tri {
+        TRI_ZERO,
+        TRI_ONE,
+        TRI_MIXED,
+};
+
+static enum tri
+chunk_tri(const struct roaring_container *chunk, size_t n_vecs)
+{
+
+        if (chunk->kind == ROARING_EMPTY)
+                return TRI_ZERO;
+
+        if (chunk->kind == ROARING_RUN && chunk->n == 1 &&
+            chunk->runs[0].start == 0 &&
+            chunk->runs[0].last == 256 * n_vecs - 1)
+                return TRI_ONE;
+
+        return TRI_MIXED;
+}
+
+static enum tri
+eval_tri(const struct expr *expr, const enum tri *inputs)
+{
+        bool mixed = false;
+        enum tri arg;
+        unsigned ones = 0;
+
+        switch (expr->kind) {
+        case EXPR_VAR:
+                return inputs[expr->var];
+        case EXPR_NOT:
+                arg = eval_tri(expr->args[0], inputs);
+                return (arg == TRI_MIXED) ? TRI_MIXED
+                    : (arg == TRI_ZERO) ? TRI_ONE : TRI_ZERO;
+        default:
+                break;
+        }
+
+        for (size_t i = 0; i < expr->n_args; i++) {
+                arg = eval_tri(expr->args[i], inputs);
+                if (expr->kind == EXPR_AND && arg == TRI_ZERO)
+                        return TRI_ZERO;
+                if (expr->kind == EXPR_OR && arg == TRI_ONE)
+                        return TRI_ONE;
+
+                mixed = mixed || arg == TRI_MIXED;
+                ones += (arg == TRI_ONE);
+        }
+
+        if (mixed)
+                return TRI_MIXED;
+
+        switch (expr->kind) {
+        case EXPR_AND:
+                return TRI_ONE;
+        case EXPR_OR:
+                return TRI_ZERO;
+        default:
+                return (ones % 2 == 1) ? TRI_ONE : TRI_ZERO;
+        }
+}
+
+static size_t
+lower_bound_position(const struct roaring_container *chunk, uint32_t bit)
+{
+        size_t lo = 0, hi = chunk->n;
+
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+
+                if (chunk->positions[mid] < bit)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+static size_t
+lower_bound_run(const struct roaring_container *chunk, uint32_t bit)
+{
+        size_t lo = 0, hi = chunk->n;
+
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+
+                if (chunk->runs[mid].last < bit)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+/**
+ * Returns the vectors [begin, begin + n) of the chunk, decoded into
+ * `staging` if necessary.
+ */
+static const __m256i *
+decode(const struct roaring_container *chunk, size_t begin, size_t n,
+    __m256i *staging)
+{
+        uint32_t lo = 256 * begin, hi = 256 * (begin + n);
+
+        if (chunk->kind == ROARING_DENSE)
+                return chunk->bits + begin;
+
+        memset(staging, 0, n * sizeof(__m256i));
+        switch (chunk->kind) {
+        case ROARING_ARRAY:
+                for (size_t i = lower_bound_position(chunk, lo);
+                     i < chunk->n && chunk->positions[i] < hi; i++)
+                        set_bits(staging, chunk->positions[i] - lo,
+                            chunk->positions[i] - lo + 1);
+                break;
+        case ROARING_RUN:
+                for (size_t i = lower_bound_run(chunk, lo);
+                     i < chunk->n && chunk->runs[i].start < hi; i++) {
+                        uint32_t start = chunk->runs[i].start;
+                        uint32_t end = (uint32_t)chunk->runs[i].last + 1;
+
+                        set_bits(staging, ((start < lo) ? lo : start) - lo,
+                            ((end > hi) ? hi : end) - lo);
+                }
+                break;
+        default:
+                break;
+        }
+
+        return staging;
+}
+
+void
+roaring_run(filter_fn_t *fn, const struct expr *expr, __m256i *dst,
+    const struct roaring_bitmap *const *inputs, size_t n_ptrs)
+{
+        struct filter_arena *arena = filter_arena_thread();
+        struct filter_state *state;
+        enum tri tris[FILTER_MAX_PTRS];
+        __m256i *staging;
+        size_t count, n_chunks;
+
+        assert(n_ptrs > 1 && n_ptrs <= FILTER_MAX_PTRS);
+        count = inputs[1]->count;
+        n_chunks = inputs[1]->n_chunks;
+        for (size_t k = 1; k < n_ptrs; k++)
+                assert(inputs[k]->count == count);
+
+        state = filter_arena_state(arena);
+        staging = filter_arena_vecs(arena, n_ptrs * ROARING_BLOCK);
+
+        tris[0] = TRI_MIXED;
+        for (size_t chunk = 0; chunk < n_chunks; chunk++) {
+                size_t base = chunk * ROARING_CHUNK_VECS;
+                size_t n_vecs = chunk_vecs(count, chunk);
+                enum tri result;
+
+                for (size_t k = 1; k < n_ptrs; k++)
+                        tris[k] = chunk_tri(&inputs[k]->chunks[chunk], n_vecs);
+
+                result = eval_tri(expr, tris);
+                if (result != TRI_MIXED) {
+                        memset(dst + base, (result == TRI_ONE) ? 0xff : 0,
+                            n_vecs * sizeof(__m256i));
+                        continue;
+                }
+
+                for (size_t begin = 0; begin < n_vecs; begin += ROARING_BLOCK) {
+                        size_t n = (n_vecs - begin < ROARING_BLOCK)
+                            ? n_vecs - begin : ROARING_BLOCK;
+
+                        state->count = n;
+                        state->dst = dst + base + begin;
+                        for (size_t k = 1; k < n_ptrs; k++) {
+                                state->ptrs[k] = (__m256i *)decode(
+                                    &inputs[k]->chunks[chunk], begin, n,
+                                    staging + k * ROARING_BLOCK);
+                        }
+
+                        fn(state);
+                }
+        }
+
+        filter_arena_vecs_release(arena, staging, n_ptrs * ROARING_BLOCK);
+        filter_arena_state_release(arena, state);
+        return;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+#include "query.h"
+
+/**
+ * Roaring-style compressed bitmaps: the universe is split in chunks
+ * of 64K bits (256 vectors), each stored in the smallest of
+ *
+ *  - nothing, for all-zero chunks;
+ *  - a sorted array of 16-bit positions;
+ *  - sorted runs of set bits, as (start, last) position pairs;
+ *  - a dense 8 KiB bitmap.
+ */
+#define ROARING_CHUNK_BITS 65536
+#define ROARING_CHUNK_VECS (ROARING_CHUNK_BITS / 256)
+
+enum roaring_kind {
+        ROARING_EMPTY,
+        ROARING_ARRAY,
+        ROARING_RUN,
+        ROARING_DENSE,
+};
+
+struct roaring_run {
+        uint16_t start;
+        uint16_t last;
+};
+
+struct roaring_container {
+        enum roaring_kind kind;
+        /* Number of positions or runs. */
+        uint32_t n;
+        union {
+                uint16_t *positions;
+                struct roaring_run *runs;
+                __m256i *bits;
+        };
+};
+
+struct roaring_bitmap {
+        /* In __m256i, as for filter_state. */
+        size_t count;
+        size_t n_chunks;
+        struct roaring_container *chunks;
+};
+
+/**
+ * An inclusive range of bit positions, for `roaring_from_runs`.
+ */
+struct roaring_interval {
+        uint64_t start;
+        uint64_t last;
+};
+
+/**
+ * Encodes `count` dense vectors, a 64-bit word at a time.
+ */
+struct roaring_bitmap *roaring_from_dense(const __m256i *, size_t count);
+
+/**
+ * Encodes the `n` set bits at `positions`, sorted in ascending order
+ * (duplicates are fine), all below `256 * count`.
+ */
+struct roaring_bitmap *roaring_from_positions(const uint64_t *positions,
+    size_t n, size_t count);
+
+/**
+ * Encodes the union of `n` intervals, sorted by start (they may
+ * overlap or touch), all below `256 * count`.  Never materialises
+ * a dense chunk unless that is the smallest container.
+ */
+struct roaring_bitmap *roaring_from_runs(const struct roaring_interval *,
+    size_t n, size_t count);
+
+void roaring_destroy(struct roaring_bitmap *);
+
+/**
+ * Bytes of memory used by the containers.
+ */
+size_t roaring_size(const struct roaring_bitmap *);
+
+/**
+ * Evaluates `expr` into `dst`, with `ptrs[k]` read from `inputs[k]`
+ * (`inputs[0]` is ignored).
+ *
+ * For each chunk, we first evaluate `expr` over the inputs' container
+ * kinds, and fill the chunk of `dst` directly when the result is
+ * known to be all zeros (or all ones), e.g., for an `and` with an
+ * empty chunk.  Otherwise, `fn` evaluates `expr` on blocks of the
+ * chunk: dense containers are passed in place, and the others are
+ * decoded into a small staging block that stays in L1.
+ *
+ * `fn` may be a hardcoded kernel for `expr`, like `blocking` or
+ * `fused_blocking`, or interpret a compiled program.
+ */
+void roaring_run(filter_fn_t *fn, const struct expr *expr, __m256i *dst,
+    const struct roaring_bitmap *const *inputs, size_t n_ptrs);
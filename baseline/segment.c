@@ -0,0 +1,433 @@
+#include "segment.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Alignment of containers in roaring payloads. */
+#define SEGMENT_CONTAINER_ALIGN 64
+
+struct segment {
+        const uint8_t *base;
+        size_t size;
+        const struct segment_header *header;
+        const struct segment_entry *entries;
+        /* Views of the roaring payloads, built by segment_open. */
+        struct roaring_bitmap **roaring;
+};
+
+static size_t
+align_up(size_t x, size_t align)
+{
+
+        return (x + align - 1) / align * align;
+}
+
+static size_t
+container_bytes(const struct roaring_container *chunk)
+{
+
+        switch (chunk->kind) {
+        case ROARING_ARRAY:
+                return chunk->n * sizeof(chunk->positions[0]);
+        case ROARING_RUN:
+                return chunk->n * sizeof(chunk->runs[0]);
+        case ROARING_DENSE:
+                return ROARING_CHUNK_VECS * sizeof(__m256i);
+        default:
+                return 0;
+        }
+}
+
+static size_t
+roaring_payload_size(const struct roaring_bitmap *bitmap)
+{
+        size_t ret = align_up(bitmap->n_chunks * sizeof(struct segment_chunk),
+            SEGMENT_CONTAINER_ALIGN);
+
+        for (size_t i = 0; i < bitmap->n_chunks; i++)
+                ret += align_up(container_bytes(&bitmap->chunks[i]),
+                    SEGMENT_CONTAINER_ALIGN);
+
+        return ret;
+}
+
+static int
+write_all(int fd, const void *buf, size_t size, size_t offset)
+{
+        const uint8_t *bytes = buf;
+
+        while (size > 0) {
+                ssize_t r = pwrite(fd, bytes, size, offset);
+
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r <= 0)
+                        return -1;
+
+                bytes += r;
+                size -= r;
+                offset += r;
+        }
+
+        return 0;
+}
+
+static int
+write_roaring(int fd, const struct roaring_bitmap *bitmap, size_t offset)
+{
+        struct segment_chunk *chunks;
+        size_t at;
+        int ret = 0;
+
+        chunks = calloc(bitmap->n_chunks, sizeof(chunks[0]));
+        assert(chunks != NULL || bitmap->n_chunks == 0);
+
+        at = align_up(bitmap->n_chunks * sizeof(chunks[0]),
+            SEGMENT_CONTAINER_ALIGN);
+        for (size_t i = 0; i < bitmap->n_chunks && ret == 0; i++) {
+                const struct roaring_container *chunk = &bitmap->chunks[i];
+                size_t bytes = container_bytes(chunk);
+
+                chunks[i] = (struct segment_chunk) {
+                        .kind = chunk->kind,
+                        .n = chunk->n,
+                        .offset = at,
+                };
+
+                if (bytes > 0)
+                        ret = write_all(fd, chunk->bits, bytes, offset + at);
+                at += align_up(bytes, SEGMENT_CONTAINER_ALIGN);
+        }
+
+        if (ret == 0)
+                ret = write_all(fd, chunks,
+                    bitmap->n_chunks * sizeof(chunks[0]), offset);
+
+        free(chunks);
+        return ret;
+}
+
+int
+segment_write(const char *path, const struct segment_input *inputs,
+    size_t n_bitmaps, size_t count)
+{
+        struct segment_header header = {
+                .version = SEGMENT_VERSION,
+                .n_bitmaps = n_bitmaps,
+                .count = count,
+        };
+        struct segment_entry *entries;
+        size_t offset;
+        int fd, ret = 0;
+
+        entries = calloc(n_bitmaps, sizeof(entries[0]));
+        assert(entries != NULL || n_bitmaps == 0);
+
+        offset = sizeof(header) + n_bitmaps * sizeof(entries[0]);
+        for (size_t i = 0; i < n_bitmaps; i++) {
+                const struct segment_input *input = &inputs[i];
+
+                assert((input->dense == NULL) != (input->roaring == NULL));
+                offset = align_up(offset, SEGMENT_ALIGN);
+                entries[i].offset = offset;
+                if (input->dense != NULL) {
+                        entries[i].kind = SEGMENT_DENSE;
+                        entries[i].size = count * sizeof(__m256i);
+                } else {
+                        assert(input->roaring->count == count);
+                        entries[i].kind = SEGMENT_ROARING;
+                        entries[i].size = roaring_payload_size(input->roaring);
+                }
+
+                offset += entries[i].size;
+        }
+
+        memcpy(header.magic, SEGMENT_MAGIC, sizeof(header.magic));
+        header.file_size = align_up(offset, SEGMENT_ALIGN);
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                free(entries);
+                return -1;
+        }
+
+        ret = write_all(fd, &header, sizeof(header), 0);
+        if (ret == 0)
+                ret = write_all(fd, entries, n_bitmaps * sizeof(entries[0]),
+                    sizeof(header));
+
+        for (size_t i = 0; i < n_bitmaps && ret == 0; i++) {
+                if (entries[i].kind == SEGMENT_DENSE)
+                        ret = write_all(fd, inputs[i].dense, entries[i].size,
+                            entries[i].offset);
+                else
+                        ret = write_roaring(fd, inputs[i].roaring,
+                            entries[i].offset);
+        }
+
+        if (ret == 0)
+                ret = ftruncate(fd, header.file_size);
+
+        if (close(fd) != 0)
+                ret = -1;
+
+        free(entries);
+        return ret;
+}
+
+/**
+ * Positions and runs are strictly increasing and within the chunk's
+ * `bits`: roaring.c trusts them when it expands containers.
+ */
+static bool
+valid_container(const struct roaring_container *chunk, size_t bits)
+{
+
+        switch (chunk->kind) {
+        case ROARING_ARRAY:
+                for (size_t i = 0; i < chunk->n; i++) {
+                        if (chunk->positions[i] >= bits ||
+                            (i > 0 && chunk->positions[i] <= chunk->positions[i - 1]))
+                                return false;
+                }
+
+                return true;
+        case ROARING_RUN:
+                for (size_t i = 0; i < chunk->n; i++) {
+                        const struct roaring_run *run = &chunk->runs[i];
+
+                        if (run->start > run->last || run->last >= bits ||
+                            (i > 0 && run->start <= chunk->runs[i - 1].last))
+                                return false;
+                }
+
+                return true;
+        default:
+                return true;
+        }
+}
+
+/**
+ * segment_open bounds the count by the file size first, so the sizes
+ * below can't overflow.
+ */
+static bool
+valid_entry(const struct segment *segment, const struct segment_entry *entry)
+{
+        size_t count = segment->header->count;
+
+        if (entry->offset % SEGMENT_ALIGN != 0 ||
+            entry->offset > segment->size ||
+            entry->size > segment->size - entry->offset)
+                return false;
+
+        switch (entry->kind) {
+        case SEGMENT_DENSE:
+                return entry->size == count * sizeof(__m256i);
+        case SEGMENT_ROARING:
+                return entry->size >= ((count + ROARING_CHUNK_VECS - 1) /
+                    ROARING_CHUNK_VECS) * sizeof(struct segment_chunk);
+        default:
+                return false;
+        }
+}
+
+/**
+ * Builds the chunk array for the roaring payload at `entry`, or
+ * returns NULL if its containers are out of bounds or invalid.
+ */
+static struct roaring_bitmap *
+build_roaring(const struct segment *segment,
+    const struct segment_entry *entry)
+{
+        const struct segment_chunk *chunks;
+        const uint8_t *payload;
+        struct roaring_bitmap *ret;
+
+        payload = segment->base + entry->offset;
+        chunks = (const void *)payload;
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->count = segment->header->count;
+        ret->n_chunks = (ret->count + ROARING_CHUNK_VECS - 1) /
+            ROARING_CHUNK_VECS;
+        ret->chunks = calloc(ret->n_chunks, sizeof(ret->chunks[0]));
+        assert(ret->chunks != NULL || ret->n_chunks == 0);
+        for (size_t j = 0; j < ret->n_chunks; j++) {
+                struct roaring_container *chunk = &ret->chunks[j];
+                size_t bits = 256 * (ret->count - j * ROARING_CHUNK_VECS);
+
+                chunk->kind = chunks[j].kind;
+                chunk->n = chunks[j].n;
+                chunk->bits = (__m256i *)(payload + chunks[j].offset);
+                if (chunk->kind > ROARING_DENSE ||
+                    chunks[j].offset % SEGMENT_CONTAINER_ALIGN != 0 ||
+                    chunks[j].offset > entry->size ||
+                    container_bytes(chunk) > entry->size - chunks[j].offset ||
+                    !valid_container(chunk, (bits < ROARING_CHUNK_BITS) ?
+                    bits : ROARING_CHUNK_BITS)) {
+                        free(ret->chunks);
+                        free(ret);
+                        return NULL;
+                }
+        }
+
+        return ret;
+}
+
+static void
+free_roaring(struct segment *segment)
+{
+
+        if (segment->roaring == NULL)
+                return;
+
+        for (size_t i = 0; i < segment->header->n_bitmaps; i++) {
+                /* The containers live in the mapping. */
+                if (segment->roaring[i] != NULL)
+                        free(segment->roaring[i]->chunks);
+                free(segment->roaring[i]);
+        }
+
+        free(segment->roaring);
+        return;
+}
+
+struct segment *
+segment_open(const char *path)
+{
+        const struct segment_header *header;
+        struct segment *ret;
+        struct stat st;
+        void *base;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return NULL;
+
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header)) {
+                close(fd);
+                return NULL;
+        }
+
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED)
+                return NULL;
+
+        /* Hints only: failures are fine. */
+        (void)madvise(base, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        (void)madvise(base, st.st_size, MADV_HUGEPAGE);
+#endif
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->base = base;
+        ret->size = st.st_size;
+        ret->header = header = base;
+        ret->entries = (const void *)(ret->base + sizeof(*header));
+
+        if (memcmp(header->magic, SEGMENT_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != SEGMENT_VERSION ||
+            header->file_size != ret->size ||
+            header->count % BLOCK_SIZE != 0 ||
+            header->count > ret->size / sizeof(__m256i) ||
+            header->n_bitmaps > (ret->size - sizeof(*header)) /
+            sizeof(ret->entries[0]))
+                goto fail;
+
+        for (size_t i = 0; i < header->n_bitmaps; i++) {
+                if (!valid_entry(ret, &ret->entries[i]))
+                        goto fail;
+        }
+
+        /*
+         * Build every chunk array up front, so segment_roaring is a
+         * lookup that threads can share, and corrupt payloads fail
+         * here rather than on each access.
+         */
+        ret->roaring = calloc(header->n_bitmaps, sizeof(ret->roaring[0]));
+        assert(ret->roaring != NULL || header->n_bitmaps == 0);
+        for (size_t i = 0; i < header->n_bitmaps; i++) {
+                if (ret->entries[i].kind != SEGMENT_ROARING)
+                        continue;
+
+                ret->roaring[i] = build_roaring(ret, &ret->entries[i]);
+                if (ret->roaring[i] == NULL)
+                        goto fail;
+        }
+
+        return ret;
+
+fail:
+        free_roaring(ret);
+        munmap(base, st.st_size);
+        free(ret);
+        return NULL;
+}
+
+void
+segment_close(struct segment *segment)
+{
+
+        if (segment == NULL)
+                return;
+
+        free_roaring(segment);
+        munmap((void *)segment->base, segment->size);
+        free(segment);
+        return;
+}
+
+size_t
+segment_count(const struct segment *segment)
+{
+
+        return segment->header->count;
+}
+
+size_t
+segment_n_bitmaps(const struct segment *segment)
+{
+
+        return segment->header->n_bitmaps;
+}
+
+enum segment_kind
+segment_kind(const struct segment *segment, size_t i)
+{
+
+        assert(i < segment->header->n_bitmaps);
+        return segment->entries[i].kind;
+}
+
+const __m256i *
+segment_dense(const struct segment *segment, size_t i)
+{
+        const struct segment_entry *entry;
+
+        assert(i < segment->header->n_bitmaps);
+        entry = &segment->entries[i];
+        if (entry->kind != SEGMENT_DENSE)
+                return NULL;
+
+        return (const void *)(segment->base + entry->offset);
+}
+
+const struct roaring_bitmap *
+segment_roaring(const struct segment *segment, size_t i)
+{
+
+        assert(i < segment->header->n_bitmaps);
+        return segment->roaring[i];
+}
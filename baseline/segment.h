@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+#include "roaring.h"
+
+/**
+ * On-disk segments: a set of bitmaps over the same `count` vectors,
+ * meant to be `mmap`ed and evaluated in place, so opening a segment
+ * never reads or copies dense data, and concurrent processes share
+ * its pages through the page cache.
+ *
+ * The layout, in native byte order, is
+ *
+ *  - a 64-byte `segment_header`;
+ *  - the directory, one 32-byte `segment_entry` per bitmap;
+ *  - payloads, each at a page-aligned offset.
+ *
+ * Dense payloads are the raw vectors.  Roaring payloads are an array
+ * of `segment_chunk`, one per 64K-bit chunk, followed by the
+ * containers' positions, runs or bits, each 64-byte aligned.
+ */
+#define SEGMENT_MAGIC "BMSEGMNT"
+#define SEGMENT_VERSION 1
+#define SEGMENT_ALIGN 4096
+
+enum segment_kind {
+        SEGMENT_DENSE = 1,
+        SEGMENT_ROARING = 2,
+};
+
+struct segment_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t n_bitmaps;
+        /* In __m256i, for every bitmap. */
+        uint64_t count;
+        uint64_t file_size;
+        uint8_t reserved[32];
+};
+
+struct segment_entry {
+        uint32_t kind;
+        uint32_t reserved;
+        uint64_t offset;
+        uint64_t size;
+        uint64_t reserved1;
+};
+
+struct segment_chunk {
+        /* enum roaring_kind */
+        uint32_t kind;
+        uint32_t n;
+        /* From the start of the payload. */
+        uint64_t offset;
+};
+
+/**
+ * One bitmap to write: exactly one of `dense` (`count` vectors) or
+ * `roaring` is non-NULL.
+ */
+struct segment_input {
+        const __m256i *dense;
+        const struct roaring_bitmap *roaring;
+};
+
+/**
+ * Writes a segment of `n_bitmaps` bitmaps of `count` vectors each to
+ * `path`.  Returns 0 on success, -1 with errno set on failure.
+ */
+int segment_write(const char *path, const struct segment_input *inputs,
+    size_t n_bitmaps, size_t count);
+
+struct segment;
+
+/**
+ * Maps the segment at `path` read-only, and builds the chunk array of
+ * each roaring bitmap from its payload.  Returns NULL if the file
+ * can't be mapped or isn't a valid segment, including any roaring
+ * container that is out of bounds or unsorted.
+ */
+struct segment *segment_open(const char *path);
+
+void segment_close(struct segment *);
+
+size_t segment_count(const struct segment *);
+
+size_t segment_n_bitmaps(const struct segment *);
+
+enum segment_kind segment_kind(const struct segment *, size_t i);
+
+/**
+ * Bitmap `i`, straight from the mapping, or NULL if it isn't dense.
+ * The result is suitable for `filter_state.ptrs[]`.
+ */
+const __m256i *segment_dense(const struct segment *, size_t i);
+
+/**
+ * Bitmap `i`, or NULL if it isn't compressed.  The containers point
+ * into the mapping, and the chunk array was built by segment_open, so
+ * any number of threads may call this at once.  The bitmap belongs to
+ * the segment: don't roaring_destroy it.
+ */
+const struct roaring_bitmap *segment_roaring(const struct segment *,
+    size_t i);
@@ -0,0 +1,285 @@
+#include "shapes.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define MAX_ARGS 64
+/* Bits of precision for uniform densities. */
+#define DENSITY_BITS 16
+
+const struct shape_bench shape_suite[] = {
+        { "wide_or_8", { .kind = SHAPE_WIDE_OR, .width = 8 } },
+        { "wide_or_32", { .kind = SHAPE_WIDE_OR, .width = 32 } },
+        { "and_of_xor_4x1", { .kind = SHAPE_AND_OF_XOR, .width = 4, .depth = 1 } },
+        { "and_of_xor_4x3", { .kind = SHAPE_AND_OF_XOR, .width = 4, .depth = 3 } },
+        { "repeated_8", { .kind = SHAPE_REPEATED, .width = 8, .n_inputs = 8, .seed = 1 } },
+        { "negated_6", { .kind = SHAPE_NEGATED, .width = 6 } },
+        {
+                "random_4x4",
+                { .kind = SHAPE_RANDOM, .width = 4, .depth = 4, .n_inputs = 16, .seed = 1 },
+        },
+        {
+                "random_3x6",
+                { .kind = SHAPE_RANDOM, .width = 3, .depth = 6, .n_inputs = 24, .seed = 2 },
+        },
+};
+
+const size_t shape_suite_count = sizeof(shape_suite) / sizeof(shape_suite[0]);
+
+const struct shape_input_density shape_densities[] = {
+        { "dense", { .kind = SHAPE_UNIFORM, .p = 0.5 } },
+        { "sparse", { .kind = SHAPE_UNIFORM, .p = 0.01 } },
+        { "zipf", { .kind = SHAPE_ZIPF, .p = 0.5 } },
+        { "clustered", { .kind = SHAPE_CLUSTERED, .p = 0.05, .run = 2048 } },
+};
+
+const size_t shape_densities_count = sizeof(shape_densities) / sizeof(shape_densities[0]);
+
+uint64_t
+shape_random(uint64_t *state)
+{
+        uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+struct generator {
+        uint64_t random;
+        /* Next fresh input. */
+        size_t next_var;
+        /* Largest input used. */
+        size_t max_var;
+};
+
+static struct expr *
+var(struct generator *gen, size_t index)
+{
+
+        assert(index > 0 && index < FILTER_MAX_PTRS);
+        if (index > gen->max_var)
+                gen->max_var = index;
+        return expr_var(index);
+}
+
+static struct expr *
+fresh(struct generator *gen)
+{
+
+        return var(gen, gen->next_var++);
+}
+
+static struct expr *
+binary(enum expr_kind kind, struct expr *x, struct expr *y)
+{
+        struct expr *args[2] = { x, y };
+
+        return expr_nary(kind, 2, args);
+}
+
+static struct expr *
+random_tree(struct generator *gen, const struct shape_params *params,
+    size_t depth)
+{
+        static const enum expr_kind kinds[] = { EXPR_AND, EXPR_OR, EXPR_XOR };
+        struct expr *args[MAX_ARGS];
+        uint64_t r = shape_random(&gen->random);
+        size_t n_args;
+
+        /* Leaves anywhere but at the root. */
+        if (depth == 0 || (depth < params->depth && r % 5 == 0))
+                return var(gen, 1 + (r >> 8) % params->n_inputs);
+
+        if (r % 5 == 1)
+                return expr_not(random_tree(gen, params, depth - 1));
+
+        n_args = 2 + (r >> 8) % (params->width - 1);
+        for (size_t i = 0; i < n_args; i++)
+                args[i] = random_tree(gen, params, depth - 1);
+
+        return expr_nary(kinds[(r >> 16) % 3], n_args, args);
+}
+
+struct expr *
+shape_query(const struct shape_params *params, size_t *n_inputs)
+{
+        struct generator gen = {
+                .random = params->seed,
+                .next_var = 1,
+        };
+        struct expr *args[MAX_ARGS];
+        struct expr *terms[MAX_ARGS];
+        size_t width = params->width;
+        struct expr *ret;
+
+        assert(width > 0 && width <= MAX_ARGS);
+        switch (params->kind) {
+        case SHAPE_WIDE_OR:
+                for (size_t i = 0; i < width; i++)
+                        args[i] = fresh(&gen);
+                ret = expr_nary(EXPR_OR, width, args);
+                break;
+        case SHAPE_AND_OF_XOR:
+                for (size_t i = 0; i < width; i++) {
+                        struct expr *acc = fresh(&gen);
+
+                        for (size_t d = 0; d < params->depth; d++) {
+                                struct expr *x = fresh(&gen);
+
+                                acc = binary(EXPR_XOR, x, binary(EXPR_OR, fresh(&gen), acc));
+                        }
+
+                        args[i] = acc;
+                }
+
+                ret = expr_nary(EXPR_AND, width, args);
+                break;
+        case SHAPE_REPEATED: {
+                size_t n_terms = params->n_inputs / 2;
+
+                assert(n_terms >= 2);
+                for (size_t i = 0; i < n_terms; i++) {
+                        struct expr *x = fresh(&gen);
+
+                        terms[i] = binary(EXPR_OR, x, fresh(&gen));
+                }
+
+                for (size_t i = 0; i < width; i++) {
+                        size_t x = i % n_terms;
+                        size_t y = (x + 1 + shape_random(&gen.random) % (n_terms - 1)) % n_terms;
+
+                        args[i] = binary(EXPR_XOR, expr_copy(terms[x]),
+                            expr_copy(terms[y]));
+                }
+
+                for (size_t i = 0; i < n_terms; i++)
+                        expr_destroy(terms[i]);
+
+                ret = expr_nary(EXPR_AND, width, args);
+                break;
+        }
+        case SHAPE_NEGATED:
+                for (size_t i = 0; i < width; i++) {
+                        struct expr *x = fresh(&gen);
+
+                        switch (i % 3) {
+                        case 0:
+                                args[i] = expr_not(x);
+                                break;
+                        case 1:
+                                args[i] = binary(EXPR_OR, expr_not(x), fresh(&gen));
+                                break;
+                        default:
+                                args[i] = expr_not(binary(EXPR_XOR, x, fresh(&gen)));
+                                break;
+                        }
+                }
+
+                ret = expr_nary(EXPR_AND, width, args);
+                break;
+        case SHAPE_RANDOM:
+                assert(width >= 2 && params->n_inputs > 0);
+                ret = random_tree(&gen, params, params->depth);
+                break;
+        default:
+                assert(0 && "unknown shape");
+                return NULL;
+        }
+
+        *n_inputs = gen.max_var;
+        return ret;
+}
+
+double
+shape_input_p(const struct shape_density *density, size_t k)
+{
+
+        assert(k > 0);
+        return (density->kind == SHAPE_ZIPF) ? density->p / k : density->p;
+}
+
+/**
+ * Each bit is set with probability p, to DENSITY_BITS bits: for p's
+ * binary digits b_1 ... b_n, from the last, acc = b ? acc | r : acc & r
+ * for a fresh random word r gives P(bit) = (b + P) / 2.
+ */
+static uint64_t
+uniform_word(uint64_t *random, uint32_t p_fixed)
+{
+        uint64_t acc = 0;
+
+        for (size_t i = 0; i < DENSITY_BITS; i++) {
+                uint64_t r;
+
+                /* acc & r is still 0 until the first one bit. */
+                if ((p_fixed & 1) == 0 && acc == 0) {
+                        p_fixed >>= 1;
+                        continue;
+                }
+
+                r = shape_random(random);
+                acc = (p_fixed & 1) ? (acc | r) : (acc & r);
+                p_fixed >>= 1;
+        }
+
+        return acc;
+}
+
+static void
+set_bits(uint64_t *words, size_t begin, size_t end)
+{
+
+        for (size_t bit = begin; bit < end; ) {
+                size_t n = 64 - bit % 64;
+                uint64_t mask;
+
+                if (n > end - bit)
+                        n = end - bit;
+                mask = (n == 64) ? ~0ULL : ((1ULL << n) - 1) << (bit % 64);
+                words[bit / 64] |= mask;
+                bit += n;
+        }
+
+        return;
+}
+
+void
+shape_fill(__m256i *dst, size_t count, const struct shape_density *density,
+    size_t k, uint64_t seed)
+{
+        uint64_t *words = (uint64_t *)dst;
+        size_t n_words = 4 * count;
+        uint64_t random = seed ^ (0x2545f4914f6cdd1dULL * k);
+        double p = shape_input_p(density, k);
+
+        if (density->kind != SHAPE_CLUSTERED) {
+                uint32_t p_fixed;
+
+                p = (p < 0) ? 0 : (p > 1) ? 1 : p;
+                p_fixed = (uint32_t)(p * (1U << DENSITY_BITS) + 0.5);
+                for (size_t i = 0; i < n_words; i++)
+                        words[i] = (p_fixed >= (1U << DENSITY_BITS)) ? ~0ULL
+                            : uniform_word(&random, p_fixed);
+                return;
+        }
+
+        memset(dst, 0, count * sizeof(__m256i));
+        if (p <= 0)
+                return;
+
+        /* Alternating runs, of lengths uniform in [1, 2 * mean). */
+        for (size_t bit = 0, ones = 0; bit < 64 * n_words; ones ^= 1) {
+                double mean = ones ? density->run : density->run * (1 - p) / p;
+                size_t span = (mean < 1) ? 1 : (size_t)(2 * mean);
+                size_t n = 1 + shape_random(&random) % span;
+
+                if (n > 64 * n_words - bit)
+                        n = 64 * n_words - bit;
+                if (ones)
+                        set_bits(words, bit, bit + n);
+                bit += n;
+        }
+
+        return;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+#include "query.h"
+
+/**
+ * Generated benchmark queries and inputs, for query shapes beyond the
+ * sample query: wide or-trees, deep and-of-xor conjunctions, repeated
+ * subterms, negations and random mixes, over inputs with realistic
+ * densities.
+ */
+enum shape_kind {
+        /* (or 1 ... width) */
+        SHAPE_WIDE_OR,
+        /*
+         * `width` conjuncts, each `depth` levels of
+         * (xor a (or b ...)) over fresh inputs.
+         */
+        SHAPE_AND_OF_XOR,
+        /*
+         * A conjunction of `width` xors of pairs of `n_inputs / 2`
+         * shared (or a b) subterms.
+         */
+        SHAPE_REPEATED,
+        /* `width` conjuncts, each a negated input, or/xor with a negation. */
+        SHAPE_NEGATED,
+        /* A random and/or/xor/not tree of `depth` levels and fan-out <= `width`. */
+        SHAPE_RANDOM,
+        SHAPE_N_KINDS
+};
+
+struct shape_params {
+        enum shape_kind kind;
+        size_t width;
+        size_t depth;
+        /* Input pool for SHAPE_REPEATED and SHAPE_RANDOM. */
+        size_t n_inputs;
+        uint64_t seed;
+};
+
+enum shape_density_kind {
+        /* Every bit set with probability `p`. */
+        SHAPE_UNIFORM,
+        /* Input k (from 1) set with probability `p / k`. */
+        SHAPE_ZIPF,
+        /* Runs of about `run` ones, a fraction `p` of bits overall. */
+        SHAPE_CLUSTERED,
+};
+
+struct shape_density {
+        enum shape_density_kind kind;
+        double p;
+        size_t run;
+};
+
+struct shape_bench {
+        const char *name;
+        struct shape_params params;
+};
+
+struct shape_input_density {
+        const char *name;
+        struct shape_density density;
+};
+
+extern const struct shape_bench shape_suite[];
+extern const size_t shape_suite_count;
+
+extern const struct shape_input_density shape_densities[];
+extern const size_t shape_densities_count;
+
+/**
+ * Generates a query over ptrs[1 ... *n_inputs].  The same params
+ * always generate the same query.
+ */
+struct expr *shape_query(const struct shape_params *, size_t *n_inputs);
+
+/**
+ * Steps the splitmix64 generator that drives the above.
+ */
+uint64_t shape_random(uint64_t *state);
+
+/**
+ * Expected fraction of set bits in input `k`, from 1.
+ */
+double shape_input_p(const struct shape_density *, size_t k);
+
+/**
+ * Fills `count` vectors for input `k` with `density`; the same seed
+ * gives the same bits.
+ */
+void shape_fill(__m256i *dst, size_t count, const struct shape_density *,
+    size_t k, uint64_t seed);
@@ -0,0 +1,216 @@
+#include "shared_scan.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "policy.h"
+#include "pool.h"
+
+/* Batches up to this size keep their bookkeeping on the stack. */
+#define SHARED_SCAN_SMALL 16
+
+struct scan_query {
+        const struct shared_scan_query *query;
+        size_t n_used;
+        /* Indices of the ptrs[] the program accesses, dst included. */
+        uint8_t used[FILTER_MAX_PTRS];
+};
+
+_Static_assert(FILTER_MAX_PTRS <= 256, "scan_query.used indices");
+
+static void
+find_used(struct scan_query *scan)
+{
+        const struct query_program *program = scan->query->program;
+        bool seen[FILTER_MAX_PTRS] = { false };
+
+        for (size_t i = 0; i < program->n_insns; i++) {
+                const struct vm_insn *insn = &program->insns[i];
+                size_t n = vm_insn_n_ptrs(insn);
+
+                for (size_t j = 0; j < n; j++) {
+                        size_t index = insn->arg[j];
+
+                        if (!seen[index])
+                                scan->used[scan->n_used++] = index;
+                        seen[index] = true;
+                }
+        }
+
+        return;
+}
+
+/**
+ * Number of distinct arrays the queries access, with an open-addressed
+ * set of their addresses.
+ */
+static size_t
+count_streams(struct filter_arena *arena, const struct scan_query *scans,
+    size_t n_queries)
+{
+        const __m256i *small[SHARED_SCAN_SMALL * 8];
+        const __m256i **set;
+        size_t n_used = 0, n_slots = 1, n_vecs, n_streams = 0;
+
+        for (size_t i = 0; i < n_queries; i++)
+                n_used += scans[i].n_used;
+
+        while (n_slots < 2 * n_used)
+                n_slots *= 2;
+
+        n_vecs = (n_slots * sizeof(set[0]) + sizeof(__m256i) - 1) /
+            sizeof(__m256i);
+        set = (n_slots <= sizeof(small) / sizeof(small[0])) ? small
+            : (const __m256i **)filter_arena_vecs(arena, n_vecs);
+        memset(set, 0, n_slots * sizeof(set[0]));
+        for (size_t i = 0; i < n_queries; i++) {
+                const struct filter_state *state = scans[i].query->state;
+
+                for (size_t j = 0; j < scans[i].n_used; j++) {
+                        const __m256i *ptr = state->ptrs[scans[i].used[j]];
+                        size_t slot = ((uintptr_t)ptr >> 5) *
+                            0x9e3779b97f4a7c15ULL;
+
+                        for (slot &= n_slots - 1; set[slot] != NULL &&
+                             set[slot] != ptr; slot = (slot + 1) & (n_slots - 1))
+                                ;
+
+                        if (set[slot] == NULL) {
+                                set[slot] = ptr;
+                                n_streams++;
+                        }
+                }
+        }
+
+        if (set != small)
+                filter_arena_vecs_release(arena, (__m256i *)set, n_vecs);
+        return n_streams;
+}
+
+/**
+ * Keeps a block of every input and output in half of the L1D.
+ */
+static size_t
+block_size(size_t n_streams)
+{
+        size_t ret = filter_l1d_size() / 2 / (sizeof(__m256i) * n_streams);
+
+        ret -= ret % BLOCK_SIZE;
+        return (ret < BLOCK_SIZE) ? BLOCK_SIZE : ret;
+}
+
+static void
+run_query(const struct shared_scan_query *query, struct filter_state *state)
+{
+
+        if (query->stitched != NULL)
+                stitch_run(query->stitched, state);
+        else
+                query_run(query->program, state);
+        return;
+}
+
+/**
+ * Runs each query over all of `[0, count)`, one after the other.
+ */
+static void
+run_whole(const struct shared_scan_query *queries, size_t n_queries)
+{
+
+        for (size_t i = 0; i < n_queries; i++)
+                run_query(&queries[i], queries[i].state);
+        return;
+}
+
+/**
+ * Whether `n_streams` arrays of `count` vectors fit in the L1D at once,
+ * so that blocking would only add overhead: the queries may as well
+ * run whole, each reading what the previous ones left in L1.
+ */
+static bool
+fits_l1(size_t n_streams, size_t count)
+{
+
+        return n_streams * count * sizeof(__m256i) <= filter_l1d_size();
+}
+
+/**
+ * An upper bound on the queries' streams that doesn't look at their
+ * programs: every array bound in their states.
+ */
+static size_t
+count_bound(const struct shared_scan_query *queries, size_t n_queries)
+{
+        size_t ret = 0;
+
+        for (size_t i = 0; i < n_queries; i++) {
+                for (size_t j = 0; j < FILTER_MAX_PTRS; j++)
+                        ret += (queries[i].state->ptrs[j] != NULL);
+        }
+
+        return ret;
+}
+
+void
+shared_scan_run(const struct shared_scan_query *queries, size_t n_queries)
+{
+        struct filter_arena *arena;
+        struct scan_query small[SHARED_SCAN_SMALL];
+        struct scan_query *scans = small;
+        struct filter_state *local;
+        size_t count, block, n_vecs, n_streams;
+
+        if (n_queries == 0)
+                return;
+
+        count = queries[0].state->count;
+        for (size_t i = 0; i < n_queries; i++)
+                assert(queries[i].state->count == count);
+
+        if (fits_l1(count_bound(queries, n_queries), count)) {
+                run_whole(queries, n_queries);
+                return;
+        }
+
+        arena = filter_arena_thread();
+        n_vecs = (n_queries * sizeof(scans[0]) + sizeof(__m256i) - 1) /
+            sizeof(__m256i);
+        if (n_queries > SHARED_SCAN_SMALL)
+                scans = (struct scan_query *)filter_arena_vecs(arena, n_vecs);
+        for (size_t i = 0; i < n_queries; i++) {
+                scans[i].query = &queries[i];
+                scans[i].n_used = 0;
+                find_used(&scans[i]);
+        }
+
+        n_streams = count_streams(arena, scans, n_queries);
+        if (scans != small)
+                filter_arena_vecs_release(arena, (__m256i *)scans, n_vecs);
+
+        if (fits_l1(n_streams, count)) {
+                run_whole(queries, n_queries);
+                return;
+        }
+
+        block = block_size(n_streams);
+
+        /* Queries run one after the other, so they can share a slice. */
+        local = filter_arena_state(arena);
+        for (size_t begin = 0; begin < count; begin += block) {
+                size_t end = (count - begin < block) ? count : begin + block;
+
+                for (size_t i = 0; i < n_queries; i++) {
+                        const struct shared_scan_query *query = &queries[i];
+
+                        filter_state_slice(local, query->state, begin, end);
+                        run_query(query, local);
+                }
+        }
+
+        filter_arena_state_release(arena, local);
+        return;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "interface.h"
+#include "query.h"
+#include "stitch.h"
+
+/**
+ * One query of a shared scan: a compiled program, optionally stitched,
+ * and the filter_state that holds its destination and inputs.
+ */
+struct shared_scan_query {
+        const struct query_program *program;
+        /* If non-NULL, run this instead of `program`. */
+        const struct stitched_query *stitched;
+        struct filter_state *state;
+};
+
+/**
+ * Evaluates all the queries in one pass over their inputs: we walk
+ * `[0, count)` in blocks sized so that the union of all queries'
+ * distinct inputs fits in half the L1D, and run every query on a
+ * block before moving to the next.  Each input is thus streamed from
+ * memory once, however many queries read it.
+ *
+ * When all of the inputs and outputs fit in the L1D at once, there is
+ * nothing to share: the queries just run whole, one after the other.
+ *
+ * All states must have the same count, and destinations must not
+ * alias each other's inputs.
+ */
+void shared_scan_run(const struct shared_scan_query *, size_t n_queries);
@@ -0,0 +1,295 @@
+#include "short_circuit.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Vectors per block; each block pays for a query_run per conjunct. */
+#define SHORT_CIRCUIT_BLOCK (4 * BLOCK_SIZE)
+
+struct short_circuit_query {
+        size_t n_conjuncts;
+        /* programs[0] stores the first conjunct, others and into dst. */
+        struct query_program **programs;
+        /* Estimated fraction of blocks still live before each conjunct. */
+        double *live;
+        size_t n_used;
+        /* ptrs[] indices any program accesses. */
+        size_t used[FILTER_MAX_PTRS];
+};
+
+double
+expr_density(const struct expr *expr, const double *densities)
+{
+        double ret;
+
+        switch (expr->kind) {
+        case EXPR_VAR:
+                return (densities == NULL) ? 0.5 : densities[expr->var];
+        case EXPR_NOT:
+                return 1 - expr_density(expr->args[0], densities);
+        case EXPR_AND:
+                ret = 1;
+                for (size_t i = 0; i < expr->n_args; i++)
+                        ret *= expr_density(expr->args[i], densities);
+                return ret;
+        case EXPR_OR:
+                ret = 1;
+                for (size_t i = 0; i < expr->n_args; i++)
+                        ret *= 1 - expr_density(expr->args[i], densities);
+                return 1 - ret;
+        case EXPR_XOR:
+                ret = 0;
+                for (size_t i = 0; i < expr->n_args; i++) {
+                        double p = expr_density(expr->args[i], densities);
+
+                        ret = ret * (1 - p) + (1 - ret) * p;
+                }
+                return ret;
+        }
+
+        __builtin_unreachable();
+}
+
+void
+filter_state_sample_densities(const struct filter_state *state,
+    size_t n_ptrs, size_t stride, double *densities)
+{
+        size_t n_sampled = 0;
+
+        assert(stride > 0);
+        for (size_t i = 0; i < state->count; i += stride)
+                n_sampled++;
+
+        for (size_t k = 1; k < n_ptrs; k++) {
+                const uint64_t *words = (const uint64_t *)state->ptrs[k];
+                size_t bits = 0;
+
+                for (size_t i = 0; i < state->count; i += stride) {
+                        for (size_t j = 0; j < 4; j++)
+                                bits += __builtin_popcountll(words[4 * i + j]);
+                }
+
+                densities[k] = (n_sampled == 0) ? 0.5
+                    : (double)bits / (256.0 * n_sampled);
+        }
+
+        return;
+}
+
+/* x**n without libm. */
+static double
+pow_size(double x, size_t n)
+{
+        double ret = 1;
+
+        for (; n > 0; n /= 2) {
+                if (n % 2 != 0)
+                        ret *= x;
+                x *= x;
+        }
+
+        return ret;
+}
+
+static size_t
+n_leaves(const struct expr *expr)
+{
+        size_t ret = 0;
+
+        if (expr->kind == EXPR_VAR)
+                return 1;
+
+        for (size_t i = 0; i < expr->n_args; i++)
+                ret += n_leaves(expr->args[i]);
+
+        return ret;
+}
+
+struct ranked {
+        const struct expr *conjunct;
+        double rank;
+        size_t index;
+};
+
+static int
+cmp_rank(const void *vx, const void *vy)
+{
+        const struct ranked *x = vx;
+        const struct ranked *y = vy;
+
+        if (x->rank != y->rank)
+                return (x->rank < y->rank) ? -1 : 1;
+
+        if (x->index == y->index)
+                return 0;
+
+        return (x->index < y->index) ? -1 : 1;
+}
+
+static void
+find_used(struct short_circuit_query *query)
+{
+        bool seen[FILTER_MAX_PTRS] = { false };
+
+        for (size_t k = 0; k < query->n_conjuncts; k++) {
+                const struct query_program *program = query->programs[k];
+
+                for (size_t i = 0; i < program->n_insns; i++) {
+                        const struct vm_insn *insn = &program->insns[i];
+
+                        for (size_t j = 0; j < vm_insn_n_ptrs(insn); j++) {
+                                size_t index = insn->arg[j];
+
+                                if (!seen[index])
+                                        query->used[query->n_used++] = index;
+                                seen[index] = true;
+                        }
+                }
+        }
+
+        return;
+}
+
+struct short_circuit_query *
+short_circuit_compile(const struct expr *expr, const double *densities,
+    unsigned flags)
+{
+        struct short_circuit_query *ret;
+        struct ranked *order;
+        size_t n = (expr->kind == EXPR_AND) ? expr->n_args : 1;
+        double density = 1;
+
+        order = calloc(n, sizeof(order[0]));
+        assert(order != NULL);
+        for (size_t i = 0; i < n; i++) {
+                const struct expr *conjunct = (expr->kind == EXPR_AND)
+                    ? expr->args[i] : expr;
+                double p = expr_density(conjunct, densities);
+
+                /*
+                 * Expected work per bit we get to zero: cheap, sparse
+                 * conjuncts first.
+                 */
+                order[i] = (struct ranked) {
+                        .conjunct = conjunct,
+                        .rank = (p >= 1) ? INFINITY : n_leaves(conjunct) / (1 - p),
+                        .index = i,
+                };
+        }
+
+        qsort(order, n, sizeof(order[0]), cmp_rank);
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->programs = calloc(n, sizeof(ret->programs[0]));
+        ret->live = calloc(n, sizeof(ret->live[0]));
+        assert(ret->programs != NULL && ret->live != NULL);
+        for (size_t i = 0; i < n; i++) {
+                struct expr *acc = NULL;
+
+                /* A block is dead once none of its bits are left. */
+                ret->live[i] = 1 - pow_size(1 - density,
+                    SHORT_CIRCUIT_BLOCK * 8 * sizeof(__m256i));
+                density *= expr_density(order[i].conjunct, densities);
+
+                if (i > 0) {
+                        struct expr *args[2] = {
+                                expr_var(0),
+                                expr_copy(order[i].conjunct),
+                        };
+
+                        acc = expr_nary(EXPR_AND, 2, args);
+                }
+
+                ret->programs[i] = query_compile(
+                    (acc != NULL) ? acc : order[i].conjunct, flags);
+                expr_destroy(acc);
+                if (ret->programs[i] == NULL) {
+                        free(order);
+                        short_circuit_destroy(ret);
+                        return NULL;
+                }
+
+                ret->n_conjuncts++;
+        }
+
+        free(order);
+        find_used(ret);
+        return ret;
+}
+
+void
+short_circuit_destroy(struct short_circuit_query *query)
+{
+
+        if (query == NULL)
+                return;
+
+        for (size_t i = 0; i < query->n_conjuncts; i++)
+                query_program_destroy(query->programs[i]);
+
+        free(query->programs);
+        free(query->live);
+        free(query);
+        return;
+}
+
+size_t
+short_circuit_n_conjuncts(const struct short_circuit_query *query)
+{
+
+        return query->n_conjuncts;
+}
+
+double
+short_circuit_expected_insns(const struct short_circuit_query *query)
+{
+        double ret = 0;
+
+        for (size_t i = 0; i < query->n_conjuncts; i++)
+                ret += query->live[i] * query->programs[i]->n_insns;
+
+        return ret;
+}
+
+static bool
+any(const __m256i *vecs, size_t n)
+{
+        __m256i acc = { 0 };
+
+        for (size_t i = 0; i < n; i++)
+                acc |= vecs[i];
+
+        return !_mm256_testz_si256(acc, acc);
+}
+
+void
+short_circuit_run(const struct short_circuit_query *query,
+    struct filter_state *state)
+{
+        struct filter_state local;
+        size_t count = state->count;
+
+        for (size_t begin = 0; begin < count; begin += SHORT_CIRCUIT_BLOCK) {
+                size_t end = (count - begin < SHORT_CIRCUIT_BLOCK) ? count
+                    : begin + SHORT_CIRCUIT_BLOCK;
+
+                local.count = end - begin;
+                for (size_t i = 0; i < query->n_used; i++) {
+                        size_t index = query->used[i];
+
+                        local.ptrs[index] = state->ptrs[index] + begin;
+                }
+
+                for (size_t k = 0; k < query->n_conjuncts; k++) {
+                        if (k > 0 && !any(local.dst, local.count))
+                                break;
+
+                        query_run(query->programs[k], &local);
+                }
+        }
+
+        return;
+}
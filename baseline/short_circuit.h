@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "interface.h"
+#include "query.h"
+
+/**
+ * Blocked evaluation of a conjunction that stops evaluating a block
+ * once its running `and` is all zero.  The conjuncts are compiled
+ * separately (all but the first as `dst &= conjunct`), and ordered by
+ * estimated cost per zero bit, so the most selective cheap conjuncts
+ * come first.
+ */
+struct short_circuit_query;
+
+/**
+ * `densities[k]`, if non-NULL, is the estimated fraction of set bits
+ * in `ptrs[k]`; inputs default to 0.5.  Returns NULL if a conjunct
+ * does not compile.
+ */
+struct short_circuit_query *short_circuit_compile(const struct expr *,
+    const double *densities, unsigned flags);
+
+void short_circuit_destroy(struct short_circuit_query *);
+
+size_t short_circuit_n_conjuncts(const struct short_circuit_query *);
+
+/**
+ * Expected number of threaded instructions run per vector: each
+ * conjunct's program, weighted by the odds that a block's running
+ * `and` isn't all zero yet when it gets there, for the densities
+ * given to short_circuit_compile and independent bits.
+ */
+double short_circuit_expected_insns(const struct short_circuit_query *);
+
+void short_circuit_run(const struct short_circuit_query *,
+    struct filter_state *);
+
+/**
+ * Estimated fraction of set bits in the expression's value, assuming
+ * independent inputs.
+ */
+double expr_density(const struct expr *, const double *densities);
+
+/**
+ * Estimates the density of `ptrs[1 .. n_ptrs)` by counting the bits of
+ * every `stride`th vector; `densities[0]` is left alone.
+ */
+void filter_state_sample_densities(const struct filter_state *,
+    size_t n_ptrs, size_t stride, double *densities);
@@ -0,0 +1,153 @@
+#include "sink.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "pool.h"
+
+/* Evaluate this many vectors at a time in filter_sink_run. */
+#define SINK_BLOCK (4 * BLOCK_SIZE)
+
+/* Bit positions set in each byte value, padded with zeros. */
+static uint8_t byte_positions[256][8];
+static pthread_once_t byte_positions_once = PTHREAD_ONCE_INIT;
+
+static void
+init_byte_positions(void)
+{
+
+        for (size_t byte = 0; byte < 256; byte++) {
+                size_t n = 0;
+
+                for (size_t bit = 0; bit < 8; bit++) {
+                        if ((byte >> bit) & 1)
+                                byte_positions[byte][n++] = bit;
+                }
+        }
+
+        return;
+}
+
+struct filter_sink *
+filter_sink_create(filter_sink_fn_t *fn, void *ctx)
+{
+        struct filter_sink *ret;
+        int r;
+
+        pthread_once(&byte_positions_once, init_byte_positions);
+        r = posix_memalign((void **)&ret, 64, sizeof(*ret));
+        assert(r == 0);
+        ret->fn = fn;
+        ret->ctx = ctx;
+        ret->n_buffered = 0;
+        ret->n_emitted = 0;
+        return ret;
+}
+
+void
+filter_sink_destroy(struct filter_sink *sink)
+{
+
+        if (sink == NULL)
+                return;
+
+        filter_sink_flush(sink);
+        free(sink);
+        return;
+}
+
+void
+filter_sink_flush(struct filter_sink *sink)
+{
+
+        if (sink->n_buffered > 0)
+                sink->fn(sink->ctx, sink->buffer, sink->n_buffered);
+
+        sink->n_buffered = 0;
+        return;
+}
+
+/**
+ * Appends the positions of the set bits in `word` to `out`, offset by
+ * `base`, a byte at a time: look up the byte's positions, widen them
+ * to 32 bits, add the base, and store all 8 lanes unconditionally;
+ * only the first popcount(byte) are kept.
+ */
+static size_t
+decode_word(uint32_t *out, uint64_t word, uint32_t base)
+{
+        size_t n = 0;
+
+        for (size_t k = 0; k < 8 && word != 0; k++, word >>= 8) {
+                uint8_t byte = word & 0xff;
+                __m256i positions;
+
+                positions = _mm256_cvtepu8_epi32(
+                    _mm_loadl_epi64((const void *)byte_positions[byte]));
+                positions = _mm256_add_epi32(positions,
+                    _mm256_set1_epi32(base + 8 * k));
+                _mm256_storeu_si256((__m256i *)(out + n), positions);
+                n += __builtin_popcount(byte);
+        }
+
+        return n;
+}
+
+void
+filter_sink_push(struct filter_sink *sink, const __m256i *vecs,
+    size_t n_vecs, size_t first)
+{
+
+        assert(256 * (uint64_t)(first + n_vecs) <= (1ULL << 32));
+        for (size_t i = 0; i < n_vecs; i++) {
+                const uint64_t *words = (const uint64_t *)&vecs[i];
+                uint32_t base = 256 * (first + i);
+                size_t n = sink->n_buffered;
+
+                if (_mm256_testz_si256(vecs[i], vecs[i]))
+                        continue;
+
+                if (n + 256 > FILTER_SINK_CAPACITY) {
+                        filter_sink_flush(sink);
+                        n = 0;
+                }
+
+                for (size_t j = 0; j < 4; j++)
+                        n += decode_word(sink->buffer + n, words[j], base + 64 * j);
+
+                sink->n_emitted += n - sink->n_buffered;
+                sink->n_buffered = n;
+        }
+
+        return;
+}
+
+void
+filter_sink_run(struct filter_sink *sink, filter_fn_t *fn,
+    const struct filter_state *state)
+{
+        struct filter_arena *arena = filter_arena_thread();
+        struct filter_state *local;
+        __m256i *staging;
+        size_t count = state->count;
+
+        local = filter_arena_state(arena);
+        staging = filter_arena_vecs(arena, SINK_BLOCK);
+
+        for (size_t begin = 0; begin < count; begin += SINK_BLOCK) {
+                size_t end = (count - begin < SINK_BLOCK) ? count
+                    : begin + SINK_BLOCK;
+
+                filter_state_slice(local, state, begin, end);
+                local->dst = staging;
+                fn(local);
+                filter_sink_push(sink, staging, end - begin, begin);
+        }
+
+        filter_sink_flush(sink);
+        filter_arena_vecs_release(arena, staging, SINK_BLOCK);
+        filter_arena_state_release(arena, local);
+        return;
+}
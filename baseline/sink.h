@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+
+/**
+ * Streaming consumers for results: instead of materialising `dst`,
+ * evaluators hand each block to a sink while it's still in registers
+ * or L1, and the sink decodes its set bits into a bounded buffer of
+ * bit indices, which it passes to a callback whenever it fills up.
+ *
+ * Indices are absolute bit positions, i.e., `256 * vector + bit`, so
+ * results are limited to 2^32 bits (512 MiB).
+ */
+typedef void filter_sink_fn_t(void *ctx, const uint32_t *indices, size_t n);
+
+/* Indices buffered before calling the consumer. */
+#define FILTER_SINK_CAPACITY 4096
+
+struct filter_sink {
+        filter_sink_fn_t *fn;
+        void *ctx;
+        size_t n_buffered;
+        /* Total number of indices emitted, flushed or not. */
+        uint64_t n_emitted;
+        /* The decoder may write up to 8 indices past the last one. */
+        uint32_t buffer[FILTER_SINK_CAPACITY + 8];
+};
+
+struct filter_sink *filter_sink_create(filter_sink_fn_t *fn, void *ctx);
+
+/**
+ * Flushes any buffered index, and frees the sink.
+ */
+void filter_sink_destroy(struct filter_sink *);
+
+/**
+ * Passes the buffered indices to the consumer.
+ */
+void filter_sink_flush(struct filter_sink *);
+
+/**
+ * Decodes the set bits of `n_vecs` result vectors, the first of which
+ * is vector `first` of the result.
+ */
+void filter_sink_push(struct filter_sink *, const __m256i *vecs,
+    size_t n_vecs, size_t first);
+
+/**
+ * Streams the result of any `fn` to `sink`: `fn` is called on slices
+ * of `state` (as with filter_state_slice) whose `dst` is a staging
+ * block that stays in L1, and `state->dst` is never touched.
+ * Flushes the sink before returning.
+ */
+void filter_sink_run(struct filter_sink *sink, filter_fn_t *fn,
+    const struct filter_state *state);
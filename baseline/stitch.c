@@ -0,0 +1,277 @@
+#include "stitch.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+struct stitch_template {
+        const uint8_t *begin;
+        const uint8_t *end;
+};
+
+/* Must match the tables at the end of stitch_templates.S. */
+extern const struct stitch_templates {
+        struct stitch_template prologue_count;
+        struct stitch_template prologue;
+        struct stitch_template epilogue;
+        struct stitch_template loop;
+        struct stitch_template ptr;
+        struct stitch_template load_tmp;
+        struct stitch_template or_mem_tmp;
+        struct stitch_template xor_mem_tmp;
+
+        struct stitch_template load[THREADED_NREG];
+        struct stitch_template store[THREADED_NREG];
+        struct stitch_template spill[THREADED_NREG];
+        struct stitch_template fill[THREADED_NREG];
+        struct stitch_template negate[THREADED_NREG];
+        struct stitch_template mem[THREADED_NBINOP][THREADED_NREG];
+        struct stitch_template and_tmp[THREADED_NREG];
+        struct stitch_template andn_tmp[THREADED_NREG];
+
+        struct stitch_template bin[THREADED_NBINOP][THREADED_NREG][THREADED_NREG];
+        struct stitch_template andn[THREADED_NREG][THREADED_NREG];
+} stitch_templates;
+
+struct code_buf {
+        uint8_t *data;
+        size_t size;
+        size_t capacity;
+};
+
+static void
+append(struct code_buf *buf, const struct stitch_template *tpl)
+{
+        size_t len = tpl->end - tpl->begin;
+
+        if (buf->size + len > buf->capacity) {
+                buf->capacity = 2 * (buf->size + len);
+                buf->data = realloc(buf->data, buf->capacity);
+                assert(buf->data != NULL);
+        }
+
+        memcpy(buf->data + buf->size, tpl->begin, len);
+        buf->size += len;
+        return;
+}
+
+/**
+ * All our relocations are 32-bit immediates at the very end of the
+ * template.
+ */
+static void
+append_reloc(struct code_buf *buf, const struct stitch_template *tpl,
+    int32_t value)
+{
+
+        append(buf, tpl);
+        memcpy(buf->data + buf->size - sizeof(value), &value, sizeof(value));
+        return;
+}
+
+static void
+append_ptr(struct code_buf *buf, size_t index)
+{
+
+        append_reloc(buf, &stitch_templates.ptr,
+            offsetof(struct filter_state, ptrs) + index * sizeof(__m256i *));
+        return;
+}
+
+static int32_t
+slot_offset(size_t slot)
+{
+
+        return offsetof(struct filter_state, scratch.val) +
+            slot * sizeof(__m256i);
+}
+
+static void
+append_loop(struct code_buf *buf, size_t top)
+{
+        const struct stitch_template *tpl = &stitch_templates.loop;
+        size_t end = buf->size + (tpl->end - tpl->begin);
+
+        append_reloc(buf, tpl, (int32_t)top - (int32_t)end);
+        return;
+}
+
+static int
+binop_index(enum vm_opcode opcode)
+{
+
+        switch (opcode) {
+        case VM_OR:
+        case VM_OR_MEM:
+                return THREADED_OR;
+        case VM_AND:
+        case VM_AND_MEM:
+                return THREADED_AND;
+        case VM_XOR:
+        case VM_XOR_MEM:
+                return THREADED_XOR;
+        default:
+                __builtin_unreachable();
+        }
+}
+
+static void
+link_insn(struct code_buf *buf, const struct vm_insn *insn, size_t top)
+{
+        const struct stitch_templates *tpl = &stitch_templates;
+        unsigned reg = insn->reg;
+
+        switch (insn->opcode) {
+        case VM_LOAD:
+                append_ptr(buf, insn->arg[0]);
+                append(buf, &tpl->load[reg]);
+                return;
+        case VM_STORE:
+                append_ptr(buf, insn->arg[0]);
+                append(buf, &tpl->store[reg]);
+                return;
+        case VM_SPILL:
+                append_reloc(buf, &tpl->spill[reg], slot_offset(insn->arg[0]));
+                return;
+        case VM_FILL:
+                append_reloc(buf, &tpl->fill[reg], slot_offset(insn->arg[0]));
+                return;
+        case VM_NOT:
+                append(buf, &tpl->negate[reg]);
+                return;
+        case VM_OR:
+        case VM_AND:
+        case VM_XOR:
+                append(buf, &tpl->bin[binop_index(insn->opcode)][reg][insn->src]);
+                return;
+        case VM_LOOP:
+                append_loop(buf, top);
+                return;
+        case VM_OR_MEM:
+        case VM_AND_MEM:
+        case VM_XOR_MEM:
+                append_ptr(buf, insn->arg[0]);
+                append(buf, &tpl->mem[binop_index(insn->opcode)][reg]);
+                return;
+        case VM_ANDN:
+                append(buf, &tpl->andn[reg][insn->src]);
+                return;
+        case VM_ANDN_MEM:
+                append_ptr(buf, insn->arg[0]);
+                append(buf, &tpl->load_tmp);
+                append(buf, &tpl->andn_tmp[reg]);
+                return;
+        case VM_LOAD_OR2:
+        case VM_LOAD_OR3:
+                append_ptr(buf, insn->arg[0]);
+                append(buf, &tpl->load[reg]);
+                append_ptr(buf, insn->arg[1]);
+                append(buf, &tpl->mem[THREADED_OR][reg]);
+                if (insn->opcode == VM_LOAD_OR3) {
+                        append_ptr(buf, insn->arg[2]);
+                        append(buf, &tpl->mem[THREADED_OR][reg]);
+                }
+                return;
+        case VM_OR2_MEM:
+        case VM_OR3_MEM:
+                for (size_t i = 0; i < (insn->opcode == VM_OR3_MEM ? 3 : 2); i++) {
+                        append_ptr(buf, insn->arg[i]);
+                        append(buf, &tpl->mem[THREADED_OR][reg]);
+                }
+                return;
+        case VM_XOR_OR:
+                append_ptr(buf, insn->arg[1]);
+                append(buf, &tpl->load[reg]);
+                append_ptr(buf, insn->arg[2]);
+                append(buf, &tpl->mem[THREADED_OR][reg]);
+                append_ptr(buf, insn->arg[0]);
+                append(buf, &tpl->mem[THREADED_XOR][reg]);
+                return;
+        case VM_AND_XOR_MEM:
+                append_ptr(buf, insn->arg[0]);
+                append(buf, &tpl->load_tmp);
+                append_ptr(buf, insn->arg[1]);
+                append(buf, &tpl->xor_mem_tmp);
+                append(buf, &tpl->and_tmp[reg]);
+                return;
+        case VM_AND_XOR_OR_MEM:
+                append_ptr(buf, insn->arg[1]);
+                append(buf, &tpl->load_tmp);
+                append_ptr(buf, insn->arg[2]);
+                append(buf, &tpl->or_mem_tmp);
+                append_ptr(buf, insn->arg[0]);
+                append(buf, &tpl->xor_mem_tmp);
+                append(buf, &tpl->and_tmp[reg]);
+                return;
+        case VM_STORE_LOOP:
+                append_ptr(buf, insn->arg[0]);
+                append(buf, &tpl->store[reg]);
+                append_loop(buf, top);
+                return;
+        }
+
+        __builtin_unreachable();
+}
+
+struct stitched_query *
+stitch_query(const struct query_program *program)
+{
+        struct code_buf buf = { .data = NULL };
+        struct stitched_query *ret;
+        size_t top;
+        void *code;
+
+        append_reloc(&buf, &stitch_templates.prologue_count,
+            offsetof(struct filter_state, count));
+        append(&buf, &stitch_templates.prologue);
+        top = buf.size;
+        for (size_t i = 0; i < program->n_insns; i++)
+                link_insn(&buf, &program->insns[i], top);
+        append(&buf, &stitch_templates.epilogue);
+
+        code = mmap(NULL, buf.size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED) {
+                free(buf.data);
+                return NULL;
+        }
+
+        memcpy(code, buf.data, buf.size);
+        free(buf.data);
+        if (mprotect(code, buf.size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(code, buf.size);
+                return NULL;
+        }
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->code = code;
+        ret->size = buf.size;
+        ret->fn = (void (*)(struct filter_state *))code;
+        return ret;
+}
+
+void
+stitched_query_destroy(struct stitched_query *query)
+{
+
+        if (query == NULL)
+                return;
+
+        munmap(query->code, query->size);
+        free(query);
+        return;
+}
+
+void
+stitch_run(const struct stitched_query *query, struct filter_state *state)
+{
+
+        if (state->count > 0)
+                query->fn(state);
+
+        return;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "interface.h"
+#include "query.h"
+
+/**
+ * Native code for a compiled query, stitched together from the
+ * machine code templates in stitch_templates.S: one straight-line
+ * loop body, with pointer offsets and the branch back patched in.
+ */
+struct stitched_query {
+        void (*fn)(struct filter_state *);
+        void *code;
+        size_t size;
+};
+
+/**
+ * Returns NULL if we can't map executable memory.
+ */
+struct stitched_query *stitch_query(const struct query_program *);
+
+void stitched_query_destroy(struct stitched_query *);
+
+void stitch_run(const struct stitched_query *, struct filter_state *);
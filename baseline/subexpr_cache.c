@@ -0,0 +1,650 @@
+#include "subexpr_cache.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "incremental.h"
+
+/* Subexpressions we count uses of before materialising them. */
+#define GHOST_CAPACITY 1024
+#define N_BUCKETS 1024
+
+struct subexpr_entry {
+        struct subexpr_entry *next;
+        /* The next materialised result, see subexpr_cache.results. */
+        struct subexpr_entry *next_result;
+        uint64_t hash;
+        char *key;
+        /* For and/or/xor: the arguments' keys, sorted. */
+        enum expr_kind kind;
+        size_t n_args;
+        char **arg_keys;
+        uint64_t last_use;
+        /* Epoch of the last rewrite that bound the result. */
+        uint64_t pinned;
+        size_t uses;
+        /* The shape doesn't compile. */
+        bool failed;
+        struct query_program *program;
+        /* The program's inputs, by id, and their versions in `vecs`. */
+        size_t n_inputs;
+        uint64_t ids[FILTER_MAX_PTRS - 1];
+        uint64_t versions[FILTER_MAX_PTRS - 1];
+        size_t count;
+        /* NULL until materialised. */
+        __m256i *vecs;
+};
+
+struct subexpr_cache {
+        size_t capacity;
+        size_t hot_threshold;
+        size_t size;
+        size_t n_ghosts;
+        uint64_t clock;
+        uint64_t epoch;
+        struct subexpr_entry *buckets[N_BUCKETS];
+        /* Materialised entries, to look for subsets of n-ary nodes. */
+        struct subexpr_entry *results;
+        struct subexpr_cache_stats stats;
+};
+
+/**
+ * The caller's inputs for one rewrite.
+ */
+struct bindings {
+        struct filter_state *state;
+        /* The tracked input in each slot, or 0. */
+        uint64_t ids[FILTER_MAX_PTRS];
+        uint64_t versions[FILTER_MAX_PTRS];
+        /* Slots that held inputs before we bound any results. */
+        bool input[FILTER_MAX_PTRS];
+};
+
+/**
+ * Keys for each node of an expression, in the same tree shape.
+ */
+struct node_key {
+        char *key;
+        size_t n_args;
+        struct node_key *args;
+};
+
+static uint64_t
+hash_key(const char *key)
+{
+        uint64_t ret = 0xcbf29ce484222325ULL;
+
+        for (size_t i = 0; key[i] != '\0'; i++) {
+                ret ^= (uint8_t)key[i];
+                ret *= 0x100000001b3ULL;
+        }
+
+        return ret;
+}
+
+struct subexpr_cache *
+subexpr_cache_create(size_t capacity, size_t hot_threshold)
+{
+        struct subexpr_cache *ret;
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->capacity = capacity;
+        ret->hot_threshold = (hot_threshold > 0) ? hot_threshold : 1;
+        return ret;
+}
+
+static void
+entry_destroy(struct subexpr_entry *entry)
+{
+
+        query_program_destroy(entry->program);
+        for (size_t i = 0; i < entry->n_args; i++)
+                free(entry->arg_keys[i]);
+        free(entry->arg_keys);
+        free(entry->vecs);
+        free(entry->key);
+        free(entry);
+        return;
+}
+
+void
+subexpr_cache_destroy(struct subexpr_cache *cache)
+{
+
+        if (cache == NULL)
+                return;
+
+        for (size_t i = 0; i < N_BUCKETS; i++) {
+                struct subexpr_entry *entry = cache->buckets[i];
+
+                while (entry != NULL) {
+                        struct subexpr_entry *next = entry->next;
+
+                        entry_destroy(entry);
+                        entry = next;
+                }
+        }
+
+        free(cache);
+        return;
+}
+
+/**
+ * Evicts the least recently used ghost (if `materialised` is false),
+ * or materialised result not bound by the current rewrite.  Returns
+ * false if there is none.
+ */
+static bool
+evict_lru(struct subexpr_cache *cache, bool materialised)
+{
+        struct subexpr_entry **victim = NULL;
+        struct subexpr_entry *entry;
+
+        for (size_t i = 0; i < N_BUCKETS; i++) {
+                for (struct subexpr_entry **cur = &cache->buckets[i];
+                     *cur != NULL; cur = &(*cur)->next) {
+                        if (((*cur)->vecs != NULL) != materialised)
+                                continue;
+                        if (materialised && (*cur)->pinned == cache->epoch)
+                                continue;
+                        if (victim == NULL ||
+                            (*cur)->last_use < (*victim)->last_use)
+                                victim = cur;
+                }
+        }
+
+        if (victim == NULL)
+                return false;
+
+        entry = *victim;
+        *victim = entry->next;
+        if (entry->vecs != NULL) {
+                struct subexpr_entry **cur = &cache->results;
+
+                while (*cur != entry)
+                        cur = &(*cur)->next_result;
+                *cur = entry->next_result;
+                cache->size -= entry->count * sizeof(__m256i);
+                cache->stats.evictions++;
+        } else {
+                cache->n_ghosts--;
+        }
+
+        entry_destroy(entry);
+        return true;
+}
+
+static int
+compare_keys(const void *x, const void *y)
+{
+        const struct node_key *a = x, *b = y;
+
+        return strcmp(a->key, b->key);
+}
+
+static int
+compare_strings(const void *x, const void *y)
+{
+        const char *const *a = x, *const *b = y;
+
+        return strcmp(*a, *b);
+}
+
+static bool
+commutative(enum expr_kind kind)
+{
+
+        return kind == EXPR_AND || kind == EXPR_OR || kind == EXPR_XOR;
+}
+
+/**
+ * Fills `ret` with keys for `expr`, which must be canonical, and its
+ * subexpressions: the expression with each input replaced by its id,
+ * and the arguments of commutative operators sorted.  Keys are built
+ * bottom-up from the arguments', so that a whole query is keyed in
+ * one pass.
+ */
+static void
+make_keys(struct node_key *ret, const struct expr *expr, const uint64_t *ids)
+{
+        static const char *const names[] = {
+                [EXPR_NOT] = "not",
+                [EXPR_AND] = "and",
+                [EXPR_OR] = "or",
+                [EXPR_XOR] = "xor",
+        };
+        size_t len;
+        char *out;
+
+        ret->n_args = 0;
+        ret->args = NULL;
+        if (expr->kind == EXPR_VAR) {
+                assert(ids[expr->var] != 0 && "every input is tracked");
+                ret->key = malloc(24);
+                assert(ret->key != NULL);
+                snprintf(ret->key, 24, "#%" PRIx64, ids[expr->var]);
+                return;
+        }
+
+        ret->n_args = expr->n_args;
+        ret->args = calloc(expr->n_args, sizeof(ret->args[0]));
+        assert(ret->args != NULL);
+        len = strlen(names[expr->kind]) + 3;
+        for (size_t i = 0; i < expr->n_args; i++) {
+                make_keys(&ret->args[i], expr->args[i], ids);
+                len += strlen(ret->args[i].key) + 1;
+        }
+
+        /* Keep the arguments in the expression's order for rewrite. */
+        {
+                struct node_key sorted[expr->n_args];
+
+                memcpy(sorted, ret->args, sizeof(sorted));
+                if (expr->kind != EXPR_NOT)
+                        qsort(sorted, expr->n_args, sizeof(sorted[0]),
+                            compare_keys);
+
+                ret->key = out = malloc(len);
+                assert(out != NULL);
+                out += sprintf(out, "(%s", names[expr->kind]);
+                for (size_t i = 0; i < expr->n_args; i++)
+                        out += sprintf(out, " %s", sorted[i].key);
+                sprintf(out, ")");
+        }
+
+        return;
+}
+
+static void
+destroy_keys(struct node_key *keys)
+{
+
+        for (size_t i = 0; i < keys->n_args; i++)
+                destroy_keys(&keys->args[i]);
+
+        free(keys->args);
+        free(keys->key);
+        return;
+}
+
+/**
+ * The ptrs[] slot of the input bitmap with `id`.
+ */
+static size_t
+find_slot(const struct bindings *bindings, uint64_t id)
+{
+
+        for (size_t i = 1; i < FILTER_MAX_PTRS; i++) {
+                if (bindings->input[i] && bindings->ids[i] == id)
+                        return i;
+        }
+
+        assert(0 && "the key names every input");
+        return 0;
+}
+
+/**
+ * (Re)computes `entry`'s result from `state`'s inputs.
+ */
+static void
+materialise(struct subexpr_entry *entry, const struct bindings *bindings)
+{
+        struct filter_arena *arena = filter_arena_thread();
+        struct filter_state *local;
+
+        local = filter_arena_state(arena);
+        local->count = entry->count;
+        local->dst = entry->vecs;
+        for (size_t i = 0; i < entry->n_inputs; i++) {
+                size_t slot = find_slot(bindings, entry->ids[i]);
+
+                local->ptrs[i + 1] = bindings->state->ptrs[slot];
+                entry->versions[i] = bindings->versions[slot];
+        }
+
+        query_run(entry->program, local);
+        filter_arena_state_release(arena, local);
+        return;
+}
+
+static bool
+stale(const struct subexpr_entry *entry, const struct bindings *bindings)
+{
+
+        for (size_t i = 0; i < entry->n_inputs; i++) {
+                size_t slot = find_slot(bindings, entry->ids[i]);
+
+                if (entry->versions[i] != bindings->versions[slot])
+                        return true;
+        }
+
+        return false;
+}
+
+/**
+ * Compiles `expr`'s shape for `entry`; returns false if it doesn't.
+ */
+static bool
+compile(struct subexpr_entry *entry, const struct expr *expr,
+    const uint64_t *ids)
+{
+        size_t inputs[FILTER_MAX_PTRS - 1];
+        struct expr *shape;
+
+        shape = expr_shape(expr, inputs, &entry->n_inputs);
+        for (size_t i = 0; i < entry->n_inputs; i++)
+                entry->ids[i] = ids[inputs[i]];
+
+        entry->program = query_compile(shape, 0);
+        expr_destroy(shape);
+        return entry->program != NULL;
+}
+
+/**
+ * Brings a materialised `entry` up to date for the current rewrite.
+ */
+static void
+use_result(struct subexpr_cache *cache, struct subexpr_entry *entry,
+    const struct bindings *bindings)
+{
+
+        if (stale(entry, bindings)) {
+                materialise(entry, bindings);
+                cache->stats.refreshes++;
+        }
+
+        cache->stats.hits++;
+        entry->last_use = ++cache->clock;
+        entry->pinned = cache->epoch;
+        return;
+}
+
+/**
+ * Returns the up-to-date result for `expr`, with keys `keys`,
+ * materialising it if it's hot, or NULL.
+ */
+static struct subexpr_entry *
+lookup(struct subexpr_cache *cache, const struct expr *expr,
+    const struct node_key *keys, const struct bindings *bindings)
+{
+        const struct filter_state *state = bindings->state;
+        size_t bytes = state->count * sizeof(__m256i);
+        const char *key = keys->key;
+        struct subexpr_entry *entry;
+        uint64_t hash = hash_key(key);
+        int r;
+
+        for (entry = cache->buckets[hash % N_BUCKETS]; entry != NULL;
+             entry = entry->next) {
+                if (entry->hash == hash && entry->count == state->count &&
+                    strcmp(entry->key, key) == 0)
+                        break;
+        }
+
+        if (entry == NULL) {
+                if (cache->n_ghosts >= GHOST_CAPACITY)
+                        evict_lru(cache, false);
+
+                entry = calloc(1, sizeof(*entry));
+                assert(entry != NULL);
+                entry->hash = hash;
+                entry->key = strdup(key);
+                assert(entry->key != NULL);
+                entry->kind = expr->kind;
+                if (commutative(expr->kind)) {
+                        entry->n_args = expr->n_args;
+                        entry->arg_keys = calloc(expr->n_args,
+                            sizeof(entry->arg_keys[0]));
+                        assert(entry->arg_keys != NULL);
+                        for (size_t i = 0; i < expr->n_args; i++) {
+                                entry->arg_keys[i] = strdup(keys->args[i].key);
+                                assert(entry->arg_keys[i] != NULL);
+                        }
+
+                        qsort(entry->arg_keys, entry->n_args,
+                            sizeof(entry->arg_keys[0]), compare_strings);
+                }
+
+                entry->count = state->count;
+                entry->next = cache->buckets[hash % N_BUCKETS];
+                cache->buckets[hash % N_BUCKETS] = entry;
+                cache->n_ghosts++;
+        }
+
+        entry->uses++;
+        entry->last_use = ++cache->clock;
+        if (entry->vecs != NULL) {
+                use_result(cache, entry, bindings);
+                return entry;
+        }
+
+        if (entry->failed || entry->uses < cache->hot_threshold ||
+            bytes > cache->capacity) {
+                cache->stats.misses++;
+                return NULL;
+        }
+
+        while (cache->size + bytes > cache->capacity) {
+                if (!evict_lru(cache, true)) {
+                        cache->stats.misses++;
+                        return NULL;
+                }
+        }
+
+        if (entry->program == NULL && !compile(entry, expr, bindings->ids)) {
+                entry->failed = true;
+                cache->stats.misses++;
+                return NULL;
+        }
+
+        r = posix_memalign((void **)&entry->vecs, 64, bytes);
+        assert(r == 0);
+        materialise(entry, bindings);
+        entry->next_result = cache->results;
+        cache->results = entry;
+        cache->n_ghosts--;
+        cache->size += bytes;
+        cache->stats.materialisations++;
+        entry->pinned = cache->epoch;
+        return entry;
+}
+
+static size_t
+free_slot(const struct filter_state *state)
+{
+
+        for (size_t i = 1; i < FILTER_MAX_PTRS; i++) {
+                if (state->ptrs[i] == NULL)
+                        return i;
+        }
+
+        return 0;
+}
+
+static int
+compare_key_ptrs(const void *x, const void *y)
+{
+        const struct node_key *const *a = x, *const *b = y;
+
+        return strcmp((*a)->key, (*b)->key);
+}
+
+/**
+ * Whether `entry`'s arguments are among those of `keys` not yet
+ * `covered`; if so, fills `match` with their indices.  `sorted` are
+ * `keys`' arguments, sorted.
+ */
+static bool
+covers(const struct subexpr_entry *entry, const struct node_key *keys,
+    const struct node_key *const *sorted, const bool *covered, size_t *match)
+{
+        size_t i = 0;
+
+        for (size_t j = 0; i < entry->n_args && j < keys->n_args; j++) {
+                size_t index = sorted[j] - keys->args;
+                int cmp;
+
+                if (covered[index])
+                        continue;
+
+                cmp = strcmp(entry->arg_keys[i], sorted[j]->key);
+                if (cmp < 0)
+                        return false;
+                if (cmp == 0)
+                        match[i++] = index;
+        }
+
+        return i == entry->n_args;
+}
+
+/**
+ * Binds materialised results of the same operator over subsets of the
+ * arguments of `expr`, a commutative node with keys `keys`, largest
+ * first, e.g., a cached (and a b) inside (and a b c).  Marks the
+ * arguments they stand for as `covered`, and stores a variable for
+ * each in `vars`; returns how many.
+ */
+static size_t
+bind_subsets(struct subexpr_cache *cache, const struct expr *expr,
+    const struct node_key *keys, struct bindings *bindings, bool *covered,
+    struct expr **vars)
+{
+        const struct node_key *sorted[expr->n_args];
+        size_t match[expr->n_args], best_match[expr->n_args];
+        size_t ret = 0;
+
+        for (size_t i = 0; i < expr->n_args; i++)
+                sorted[i] = &keys->args[i];
+        qsort(sorted, expr->n_args, sizeof(sorted[0]), compare_key_ptrs);
+
+        for (;;) {
+                struct subexpr_entry *best = NULL;
+                size_t slot = free_slot(bindings->state);
+
+                if (slot == 0)
+                        break;
+
+                for (struct subexpr_entry *entry = cache->results;
+                     entry != NULL; entry = entry->next_result) {
+                        if (entry->kind != expr->kind ||
+                            entry->n_args >= expr->n_args ||
+                            entry->count != bindings->state->count)
+                                continue;
+                        if (best != NULL && entry->n_args <= best->n_args)
+                                continue;
+                        if (!covers(entry, keys, sorted, covered, match))
+                                continue;
+
+                        best = entry;
+                        memcpy(best_match, match,
+                            entry->n_args * sizeof(match[0]));
+                }
+
+                if (best == NULL)
+                        break;
+
+                use_result(cache, best, bindings);
+                bindings->state->ptrs[slot] = best->vecs;
+                vars[ret++] = expr_var(slot);
+                for (size_t i = 0; i < best->n_args; i++)
+                        covered[best_match[i]] = true;
+        }
+
+        return ret;
+}
+
+static struct expr *
+rewrite(struct subexpr_cache *cache, const struct expr *expr,
+    const struct node_key *keys, struct bindings *bindings)
+{
+        struct filter_state *state = bindings->state;
+        struct expr **args;
+        struct expr *ret;
+        size_t n_args = 0;
+        bool *covered;
+
+        /* Not worth a load of their own. */
+        if (expr->kind == EXPR_VAR ||
+            (expr->kind == EXPR_NOT && expr->args[0]->kind == EXPR_VAR))
+                return expr_copy(expr);
+
+        if (free_slot(state) != 0) {
+                struct subexpr_entry *entry;
+
+                entry = lookup(cache, expr, keys, bindings);
+                if (entry != NULL) {
+                        size_t slot = free_slot(state);
+
+                        state->ptrs[slot] = entry->vecs;
+                        return expr_var(slot);
+                }
+        }
+
+        args = calloc(expr->n_args, sizeof(args[0]));
+        covered = calloc(expr->n_args, sizeof(covered[0]));
+        assert(args != NULL && covered != NULL);
+        if (commutative(expr->kind) && expr->n_args > 2)
+                n_args = bind_subsets(cache, expr, keys, bindings, covered,
+                    args);
+
+        for (size_t i = 0; i < expr->n_args; i++) {
+                if (!covered[i])
+                        args[n_args++] = rewrite(cache, expr->args[i],
+                            &keys->args[i], bindings);
+        }
+
+        ret = expr_nary(expr->kind, n_args, args);
+        free(covered);
+        free(args);
+        return ret;
+}
+
+struct expr *
+subexpr_cache_rewrite(struct subexpr_cache *cache, const struct expr *expr,
+    struct filter_state *state,
+    struct tracked_bitmap *const inputs[FILTER_MAX_PTRS])
+{
+        struct bindings bindings = {
+                .state = state,
+        };
+        struct node_key keys;
+        struct expr *canonical, *ret;
+
+        for (size_t i = 1; i < FILTER_MAX_PTRS; i++) {
+                if (inputs[i] == NULL)
+                        continue;
+
+                assert(state->ptrs[i] == tracked_bitmap_vecs(inputs[i]));
+                bindings.ids[i] = tracked_bitmap_id(inputs[i]);
+                bindings.versions[i] = tracked_bitmap_version(inputs[i]);
+                bindings.input[i] = true;
+        }
+
+        cache->epoch++;
+        canonical = expr_canonicalise(expr);
+        make_keys(&keys, canonical, bindings.ids);
+        ret = rewrite(cache, canonical, &keys, &bindings);
+        destroy_keys(&keys);
+        expr_destroy(canonical);
+        return ret;
+}
+
+struct subexpr_cache_stats
+subexpr_cache_stats(const struct subexpr_cache *cache)
+{
+
+        return cache->stats;
+}
+
+size_t
+subexpr_cache_size(const struct subexpr_cache *cache)
+{
+
+        return cache->size;
+}
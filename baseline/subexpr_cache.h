@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+#include "incremental.h"
+#include "query.h"
+
+/**
+ * Cache of materialised subexpression results, so that queries that
+ * share a hot subexpression, e.g., `(xor neg_x (or x0 x1))` with
+ * different `y` terms, only compute it once.
+ *
+ * Entries are keyed by the subexpression's canonical form (see
+ * expr_canonicalise) over the inputs' tracked_bitmap_id, and
+ * remember the tracked_bitmap_version of each input they were
+ * computed from.  An entry whose inputs have since moved on is
+ * recomputed in place the next time it's used.  A materialised
+ * and/or/xor also stands in for a subset of the arguments of a wider
+ * node of the same operator, e.g., a cached `(and a b)` inside
+ * `(and a b c)`.
+ *
+ * Subexpressions are only materialised once they've been seen
+ * `hot_threshold` times; results are evicted least recently used
+ * first to stay under `capacity` bytes.
+ */
+struct subexpr_cache;
+
+struct subexpr_cache_stats {
+        /* Subexpressions replaced with an up-to-date result. */
+        size_t hits;
+        /* Lookups of subexpressions that weren't materialised. */
+        size_t misses;
+        size_t materialisations;
+        /* Materialised results recomputed for newer inputs. */
+        size_t refreshes;
+        size_t evictions;
+};
+
+struct subexpr_cache *subexpr_cache_create(size_t capacity,
+    size_t hot_threshold);
+
+void subexpr_cache_destroy(struct subexpr_cache *);
+
+/**
+ * Returns a copy of `expr` in which the largest cached subexpressions
+ * are replaced with variables for their materialised results.  Those
+ * results are bound to `state->ptrs[]` slots that were NULL, so any
+ * engine can load them like an input; the caller may reset the slots
+ * to NULL afterwards.
+ *
+ * `inputs[k]` is the tracked bitmap in `state->ptrs[k]` (NULL for
+ * slots that aren't inputs; `inputs[0]` is ignored), and every
+ * variable of `expr` must be one of them.  planned_query_run_tracked
+ * calls this for queries compiled with a cache.
+ *
+ * The bound results remain valid until the next call, or until the
+ * cache is destroyed.
+ */
+struct expr *subexpr_cache_rewrite(struct subexpr_cache *, const struct expr *,
+    struct filter_state *state,
+    struct tracked_bitmap *const inputs[FILTER_MAX_PTRS]);
+
+struct subexpr_cache_stats subexpr_cache_stats(const struct subexpr_cache *);
+
+/**
+ * Bytes of materialised results.
+ */
+size_t subexpr_cache_size(const struct subexpr_cache *);
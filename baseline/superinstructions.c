@@ -0,0 +1,123 @@
+#include "threaded.h"
+
+/**
+ * Superinstructions for compiled queries: each of them replaces a
+ * few base primitives and their NEXT() dispatch.  Like xor_or and
+ * acc_and_xor in threaded_inreg.c, operands other than `arg` come
+ * from the op itself.
+ */
+
+#define SELF()                                                          \
+        ((const struct op *)((uintptr_t)ops + ip - sizeof(struct op)))
+
+#define PTR(index) (*(const __m256i *)((uintptr_t)state->ptrs[(index)] + i))
+
+#define P0 PTR(arg)
+#define P1 PTR(SELF()->arg1)
+#define P2 PTR(SELF()->arg2)
+
+#define DEFINE_OP(name, body)                                           \
+        static NO_INLINE void                                           \
+        name(struct filter_state *restrict state,                       \
+             const struct op_list *restrict ops,                        \
+             size_t ip, size_t i, size_t arg,                           \
+             __m256i a, __m256i b, __m256i c, __m256i d)                \
+        {                                                               \
+                                                                        \
+                body;                                                   \
+                NEXT();                                                 \
+        }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+#define GEN_SUPER(reg)                                                  \
+        DEFINE_OP(or_mem_##reg, reg |= P0)                              \
+        DEFINE_OP(and_mem_##reg, reg &= P0)                             \
+        DEFINE_OP(xor_mem_##reg, reg ^= P0)                             \
+        DEFINE_OP(andn_mem_##reg, reg &= ~P0)                           \
+        DEFINE_OP(load_or2_##reg, reg = P0 | P1)                        \
+        DEFINE_OP(load_or3_##reg, reg = P0 | P1 | P2)                   \
+        DEFINE_OP(or2_mem_##reg, reg |= P0 | P1)                        \
+        DEFINE_OP(or3_mem_##reg, reg |= P0 | P1 | P2)                   \
+        DEFINE_OP(xor_or_##reg, reg = P0 ^ (P1 | P2))                   \
+        DEFINE_OP(and_xor_mem_##reg, reg &= P0 ^ P1)                    \
+        DEFINE_OP(and_xor_or_mem_##reg, reg &= P0 ^ (P1 | P2))          \
+                                                                        \
+        static NO_INLINE void                                           \
+        store_loop_##reg(struct filter_state *restrict state,           \
+                         const struct op_list *restrict ops,            \
+                         size_t ip, size_t i, size_t arg,               \
+                         __m256i a, __m256i b, __m256i c, __m256i d)    \
+        {                                                               \
+                                                                        \
+                *(__m256i *)((uintptr_t)state->ptrs[arg] + i) = reg;    \
+                                                                        \
+                ip = 0;                                                 \
+                i += sizeof(__m256i);                                   \
+                if (__builtin_expect(i >= sizeof(__m256i) * state->count, 0)) \
+                        return;                                         \
+                                                                        \
+                NEXT();                                                 \
+        }
+
+GEN_SUPER(a);
+GEN_SUPER(b);
+GEN_SUPER(c);
+GEN_SUPER(d);
+
+#undef GEN_SUPER
+
+#define GEN_ANDN(dst, src)                                              \
+        DEFINE_OP(andn_##dst##_##src, dst &= ~src)
+
+GEN_ANDN(a, b);
+GEN_ANDN(a, c);
+GEN_ANDN(a, d);
+GEN_ANDN(b, a);
+GEN_ANDN(b, c);
+GEN_ANDN(b, d);
+GEN_ANDN(c, a);
+GEN_ANDN(c, b);
+GEN_ANDN(c, d);
+GEN_ANDN(d, a);
+GEN_ANDN(d, b);
+GEN_ANDN(d, c);
+
+#undef GEN_ANDN
+
+#pragma GCC diagnostic pop
+
+#undef DEFINE_OP
+#undef P2
+#undef P1
+#undef P0
+#undef PTR
+#undef SELF
+
+#define PER_REG(name) { name##_a, name##_b, name##_c, name##_d }
+
+const struct threaded_supers threaded_supers = {
+        .mem = {
+                [THREADED_OR] = PER_REG(or_mem),
+                [THREADED_AND] = PER_REG(and_mem),
+                [THREADED_XOR] = PER_REG(xor_mem),
+        },
+        .andn = {
+                { NULL, andn_a_b, andn_a_c, andn_a_d },
+                { andn_b_a, NULL, andn_b_c, andn_b_d },
+                { andn_c_a, andn_c_b, NULL, andn_c_d },
+                { andn_d_a, andn_d_b, andn_d_c, NULL },
+        },
+        .andn_mem = PER_REG(andn_mem),
+        .load_or2 = PER_REG(load_or2),
+        .load_or3 = PER_REG(load_or3),
+        .or2_mem = PER_REG(or2_mem),
+        .or3_mem = PER_REG(or3_mem),
+        .xor_or = PER_REG(xor_or),
+        .and_xor_mem = PER_REG(and_xor_mem),
+        .and_xor_or_mem = PER_REG(and_xor_or_mem),
+        .store_loop = PER_REG(store_loop),
+};
+
+#undef PER_REG
@@ -0,0 +1,250 @@
+#include "ternlog.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+uint8_t
+ternlog_apply(uint8_t imm, uint8_t a, uint8_t b, uint8_t c)
+{
+        uint8_t ret = 0;
+
+        for (unsigned lane = 0; lane < 8; lane++) {
+                unsigned index = (((a >> lane) & 1) << 2) |
+                    (((b >> lane) & 1) << 1) | ((c >> lane) & 1);
+
+                ret |= ((imm >> index) & 1) << lane;
+        }
+
+        return ret;
+}
+
+/**
+ * A subexpression that is a function of at most three leaves (inputs
+ * or temporaries).  `table` treats leaves[0] as operand A, etc.
+ */
+struct cut {
+        size_t n;
+        struct ternlog_ref leaves[3];
+        uint8_t table;
+};
+
+struct partition {
+        struct ternlog_node *nodes;
+        size_t n_nodes;
+        size_t capacity;
+
+        bool *temp_used;
+        size_t n_temps;
+};
+
+static const uint8_t operand_table[3] = { TERNLOG_A, TERNLOG_B, TERNLOG_C };
+
+static bool
+ref_equal(struct ternlog_ref x, struct ternlog_ref y)
+{
+
+        return x.temp == y.temp && x.index == y.index;
+}
+
+static size_t
+alloc_temp(struct partition *partition)
+{
+        size_t i;
+
+        for (i = 0; i < partition->n_temps; i++) {
+                if (!partition->temp_used[i])
+                        break;
+        }
+
+        if (i == partition->n_temps) {
+                partition->n_temps++;
+                partition->temp_used = realloc(partition->temp_used,
+                    partition->n_temps * sizeof(partition->temp_used[0]));
+                assert(partition->temp_used != NULL);
+        }
+
+        partition->temp_used[i] = true;
+        return i;
+}
+
+static void
+emit(struct partition *partition, const struct cut *cut,
+    struct ternlog_ref dst)
+{
+        struct ternlog_node *node;
+
+        if (partition->n_nodes == partition->capacity) {
+                partition->capacity = 2 * partition->capacity + 4;
+                partition->nodes = realloc(partition->nodes,
+                    partition->capacity * sizeof(partition->nodes[0]));
+                assert(partition->nodes != NULL);
+        }
+
+        node = &partition->nodes[partition->n_nodes++];
+        node->imm = cut->table;
+        node->dst = dst;
+        for (size_t i = 0; i < 3; i++)
+                node->src[i] = cut->leaves[i < cut->n ? i : 0];
+
+        return;
+}
+
+/**
+ * Evaluate `cut` into a fresh temporary, and replace it with that
+ * temporary.  Temporaries are only read once, so the node's inputs
+ * are free for reuse, even as its destination.
+ */
+static void
+materialise(struct partition *partition, struct cut *cut)
+{
+        struct ternlog_ref dst = { .temp = true };
+
+        for (size_t i = 0; i < cut->n; i++) {
+                if (cut->leaves[i].temp)
+                        partition->temp_used[cut->leaves[i].index] = false;
+        }
+
+        dst.index = alloc_temp(partition);
+        emit(partition, cut, dst);
+        *cut = (struct cut) {
+                .n = 1,
+                .leaves = { dst },
+                .table = TERNLOG_A,
+        };
+        return;
+}
+
+/**
+ * Computes the union of the two cuts' leaves in `out`, or returns
+ * false if there are more than three.
+ */
+static bool
+union_leaves(const struct cut *x, const struct cut *y, struct cut *out)
+{
+
+        *out = *x;
+        for (size_t i = 0; i < y->n; i++) {
+                bool found = false;
+
+                for (size_t j = 0; j < out->n; j++)
+                        found = found || ref_equal(out->leaves[j], y->leaves[i]);
+
+                if (found)
+                        continue;
+
+                if (out->n == 3)
+                        return false;
+
+                out->leaves[out->n++] = y->leaves[i];
+        }
+
+        return true;
+}
+
+/**
+ * `cut`'s table, in terms of the leaves of `target`, which must be a
+ * superset.
+ */
+static uint8_t
+remap(const struct cut *cut, const struct cut *target)
+{
+        uint8_t operands[3] = { 0, 0, 0 };
+
+        for (size_t i = 0; i < cut->n; i++) {
+                for (size_t j = 0; j < target->n; j++) {
+                        if (ref_equal(cut->leaves[i], target->leaves[j]))
+                                operands[i] = operand_table[j];
+                }
+        }
+
+        return ternlog_apply(cut->table, operands[0], operands[1],
+            operands[2]);
+}
+
+static uint8_t
+combine(enum expr_kind kind, uint8_t x, uint8_t y)
+{
+
+        switch (kind) {
+        case EXPR_AND:
+                return x & y;
+        case EXPR_OR:
+                return x | y;
+        case EXPR_XOR:
+                return x ^ y;
+        default:
+                __builtin_unreachable();
+        }
+}
+
+static struct cut
+partition_expr(struct partition *partition, const struct expr *expr)
+{
+        struct cut acc;
+
+        switch (expr->kind) {
+        case EXPR_VAR:
+                return (struct cut) {
+                        .n = 1,
+                        .leaves = { { .temp = false, .index = expr->var } },
+                        .table = TERNLOG_A,
+                };
+        case EXPR_NOT:
+                acc = partition_expr(partition, expr->args[0]);
+                acc.table = ~acc.table;
+                return acc;
+        default:
+                break;
+        }
+
+        acc = partition_expr(partition, expr->args[0]);
+        for (size_t i = 1; i < expr->n_args; i++) {
+                struct cut arg = partition_expr(partition, expr->args[i]);
+                struct cut merged;
+
+                /* Materialise the wider side first, then the other. */
+                while (!union_leaves(&acc, &arg, &merged)) {
+                        if (acc.n >= arg.n)
+                                materialise(partition, &acc);
+                        else
+                                materialise(partition, &arg);
+                }
+
+                merged.table = combine(expr->kind, remap(&acc, &merged),
+                    remap(&arg, &merged));
+                acc = merged;
+        }
+
+        return acc;
+}
+
+struct ternlog_program *
+ternlog_partition(const struct expr *expr)
+{
+        struct partition partition = { .nodes = NULL };
+        struct ternlog_program *ret;
+        struct cut root;
+
+        root = partition_expr(&partition, expr);
+        emit(&partition, &root, (struct ternlog_ref) { .index = 0 });
+        free(partition.temp_used);
+
+        ret = calloc(1, sizeof(*ret));
+        assert(ret != NULL);
+        ret->n_nodes = partition.n_nodes;
+        ret->nodes = partition.nodes;
+        ret->n_temps = partition.n_temps;
+        return ret;
+}
+
+void
+ternlog_program_destroy(struct ternlog_program *program)
+{
+
+        if (program == NULL)
+                return;
+
+        free(program->nodes);
+        free(program);
+        return;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interface.h"
+#include "query.h"
+
+/**
+ * VPTERNLOG truth tables for the three operands: the table for any
+ * boolean function of the operands is that function applied to these
+ * constants, e.g., TERNLOG_A ^ (TERNLOG_B | TERNLOG_C).
+ */
+enum {
+        TERNLOG_A = 0xf0,
+        TERNLOG_B = 0xcc,
+        TERNLOG_C = 0xaa,
+};
+
+/**
+ * An operand: `ptrs[index]` or a temporary.
+ */
+struct ternlog_ref {
+        bool temp;
+        size_t index;
+};
+
+/**
+ * dst = ternlog(src[0], src[1], src[2], imm).  Unused operands
+ * repeat src[0], and the table ignores them.
+ */
+struct ternlog_node {
+        uint8_t imm;
+        struct ternlog_ref dst;
+        struct ternlog_ref src[3];
+};
+
+/**
+ * An expression, partitioned in ternary logic nodes.  The nodes are
+ * in evaluation order; the last one writes to `ptrs[0]`, the others
+ * to one of `n_temps` temporaries.
+ */
+struct ternlog_program {
+        size_t n_nodes;
+        struct ternlog_node *nodes;
+        size_t n_temps;
+};
+
+struct ternlog_program *ternlog_partition(const struct expr *);
+
+void ternlog_program_destroy(struct ternlog_program *);
+
+/**
+ * Evaluates the table on 8 lanes of operand bits.
+ */
+uint8_t ternlog_apply(uint8_t imm, uint8_t a, uint8_t b, uint8_t c);
+
+/**
+ * Blocked evaluation, one VPTERNLOG per node and block.  Requires
+ * AVX-512F.
+ */
+void ternlog_run(const struct ternlog_program *, struct filter_state *);
+
+/**
+ * Threaded evaluation, ZMM at a time, for programs where each node
+ * after the first reads the previous node's value and inputs (e.g.,
+ * and/or chains of ternary subexpressions).
+ */
+struct ternlog_threaded;
+
+/**
+ * Returns NULL if the program isn't a chain.
+ */
+struct ternlog_threaded *ternlog_thread(const struct ternlog_program *);
+
+void ternlog_threaded_destroy(struct ternlog_threaded *);
+
+/**
+ * Requires AVX-512F.
+ */
+void ternlog_threaded_run(const struct ternlog_threaded *,
+    struct filter_state *);
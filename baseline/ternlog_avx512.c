@@ -0,0 +1,410 @@
+#pragma GCC target("avx512f")
+
+#include "ternlog.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+/*
+ * Everything in this file requires AVX-512F.  Inputs are only
+ * guaranteed to be 32-byte aligned, so use unaligned loads and
+ * stores.
+ */
+
+#define LOAD(ptr) _mm512_loadu_si512((const void *)(ptr))
+#define STORE(ptr, value) _mm512_storeu_si512((void *)(ptr), (value))
+
+#define TERNLOG_XOR_OR (TERNLOG_A ^ (TERNLOG_B | TERNLOG_C))
+#define TERNLOG_AND_XOR (TERNLOG_A & (TERNLOG_B ^ TERNLOG_C))
+
+/* 0x00 .. 0xff */
+#define EACH_HEX(M, hi)                                                 \
+        M(hi##0) M(hi##1) M(hi##2) M(hi##3)                             \
+        M(hi##4) M(hi##5) M(hi##6) M(hi##7)                             \
+        M(hi##8) M(hi##9) M(hi##a) M(hi##b)                             \
+        M(hi##c) M(hi##d) M(hi##e) M(hi##f)
+
+#define EACH_IMM(M)                                                     \
+        EACH_HEX(M, 0x0) EACH_HEX(M, 0x1) EACH_HEX(M, 0x2)              \
+        EACH_HEX(M, 0x3) EACH_HEX(M, 0x4) EACH_HEX(M, 0x5)              \
+        EACH_HEX(M, 0x6) EACH_HEX(M, 0x7) EACH_HEX(M, 0x8)              \
+        EACH_HEX(M, 0x9) EACH_HEX(M, 0xa) EACH_HEX(M, 0xb)              \
+        EACH_HEX(M, 0xc) EACH_HEX(M, 0xd) EACH_HEX(M, 0xe)              \
+        EACH_HEX(M, 0xf)
+
+void
+baseline_avx512(struct filter_state *restrict state)
+{
+        size_t count = state->count / 2;
+        __m512i *restrict dst = (void *)state->dst;
+        const __m512i *restrict x0 = (const void *)state->x0;
+        const __m512i *restrict x1 = (const void *)state->x1;
+        const __m512i *restrict neg_x = (const void *)state->neg_x;
+        const __m512i *restrict y0 = (const void *)state->y0;
+        const __m512i *restrict neg_y = (const void *)state->neg_y;
+
+        if ((count % (BLOCK_SIZE / 2)) != 0)
+                __builtin_unreachable();
+
+        for (size_t i = 0; i < count; i++) {
+                __m512i mask_x = _mm512_ternarylogic_epi64(LOAD(&neg_x[i]),
+                    LOAD(&x0[i]), LOAD(&x1[i]), TERNLOG_XOR_OR);
+
+                STORE(&dst[i], _mm512_ternarylogic_epi64(mask_x,
+                    LOAD(&neg_y[i]), LOAD(&y0[i]), TERNLOG_AND_XOR));
+        }
+
+        return;
+}
+
+/**
+ * Return an AVX-512 value to avoid VZEROUPPER.  `dst` may alias
+ * the operands.
+ */
+typedef __m512i block_ternlog_t(__m512i noise, __m512i *dst,
+    const __m512i *x, const __m512i *y, const __m512i *z);
+
+#define GEN_BLOCK(imm)                                                  \
+        static NO_INLINE __m512i                                        \
+        block_ternlog_##imm(__m512i noise, __m512i *dst,                \
+            const __m512i *x, const __m512i *y, const __m512i *z)       \
+        {                                                               \
+                __m512i ret;                                            \
+                                                                        \
+                (void)noise;                                            \
+                for (size_t i = 0; i < BLOCK_SIZE / 2; i++)             \
+                        STORE(&dst[i], _mm512_ternarylogic_epi64(       \
+                            LOAD(&x[i]), LOAD(&y[i]), LOAD(&z[i]), imm)); \
+                                                                        \
+                asm volatile("" : "=v"(ret));                           \
+                return ret;                                             \
+        }
+
+EACH_IMM(GEN_BLOCK)
+
+#undef GEN_BLOCK
+
+#define BLOCK_ENTRY(imm) [imm] = block_ternlog_##imm,
+
+static block_ternlog_t *const block_ternlog[256] = {
+        EACH_IMM(BLOCK_ENTRY)
+};
+
+#undef BLOCK_ENTRY
+
+void
+fused_blocking_avx512(struct filter_state *restrict state)
+{
+        size_t count = state->count;
+        __m256i *restrict dst = state->dst;
+        const __m256i *restrict x0 = state->x0;
+        const __m256i *restrict x1 = state->x1;
+        const __m256i *restrict neg_x = state->neg_x;
+        const __m256i *restrict y0 = state->y0;
+        const __m256i *restrict neg_y = state->neg_y;
+
+        if ((count % BLOCK_SIZE) != 0)
+                __builtin_unreachable();
+
+        for (size_t i = 0; i < count; i += BLOCK_SIZE) {
+                __m512i noise;
+
+                asm volatile("" : "=v"(noise));
+                block_ternlog[TERNLOG_XOR_OR](noise, (void *)(dst + i),
+                    (const void *)(neg_x + i), (const void *)(x0 + i),
+                    (const void *)(x1 + i));
+                asm volatile("" : "=v"(noise));
+                block_ternlog[TERNLOG_AND_XOR](noise, (void *)(dst + i),
+                    (const void *)(dst + i), (const void *)(neg_y + i),
+                    (const void *)(y0 + i));
+        }
+
+        return;
+}
+
+void
+ternlog_run(const struct ternlog_program *program,
+    struct filter_state *restrict state)
+{
+        size_t count = state->count;
+        size_t n_temps = program->n_temps * BLOCK_SIZE;
+        __m256i *temps = state->scratch.val;
+
+        if ((count % BLOCK_SIZE) != 0)
+                __builtin_unreachable();
+
+        if (n_temps > sizeof(state->scratch.val) / sizeof(__m256i))
+                temps = filter_arena_vecs(filter_arena_thread(), n_temps);
+
+        for (size_t i = 0; i < count; i += BLOCK_SIZE) {
+                for (size_t j = 0; j < program->n_nodes; j++) {
+                        const struct ternlog_node *node = &program->nodes[j];
+                        __m256i *ptrs[4];
+                        __m512i noise;
+
+                        for (size_t k = 0; k < 4; k++) {
+                                struct ternlog_ref ref =
+                                    (k == 0) ? node->dst : node->src[k - 1];
+
+                                ptrs[k] = ref.temp
+                                    ? &temps[ref.index * BLOCK_SIZE]
+                                    : &state->ptrs[ref.index][i];
+                        }
+
+                        asm volatile("" : "=v"(noise));
+                        block_ternlog[node->imm](noise, (void *)ptrs[0],
+                            (const void *)ptrs[1], (const void *)ptrs[2],
+                            (const void *)ptrs[3]);
+                }
+        }
+
+        if (temps != state->scratch.val)
+                filter_arena_vecs_release(filter_arena_thread(), temps, n_temps);
+        return;
+}
+
+/**
+ * ZMM-at-a-time threading, with a single register: every op is
+ * either a ternlog of three inputs, or of the accumulator and two
+ * inputs.  Like threaded_inreg, i is a byte offset.
+ */
+struct op512;
+
+typedef void op512_t(struct filter_state *, const struct op512 *,
+    size_t ip, size_t i, size_t arg, __m512i a);
+
+struct op512 {
+        op512_t *op;
+        size_t arg;
+        size_t arg1;
+        size_t arg2;
+};
+
+struct ternlog_threaded {
+        size_t n_ops;
+        struct op512 ops[];
+};
+
+#define NEXT512() do {                                                  \
+                const struct op512 *pair =                              \
+                        (const void *)((uintptr_t)ops + ip);            \
+                                                                        \
+                return pair->op(state, ops, ip + sizeof(struct op512),  \
+                                i, pair->arg, a);                       \
+        } while (0)
+
+#define SELF()                                                          \
+        ((const struct op512 *)((uintptr_t)ops + ip - sizeof(struct op512)))
+
+#define PTR(index) LOAD((uintptr_t)state->ptrs[(index)] + i)
+
+#define GEN_TERN(imm)                                                   \
+        static NO_INLINE void                                           \
+        load_tern_##imm(struct filter_state *restrict state,            \
+            const struct op512 *restrict ops,                           \
+            size_t ip, size_t i, size_t arg, __m512i a)                 \
+        {                                                               \
+                                                                        \
+                a = _mm512_ternarylogic_epi64(PTR(arg),                 \
+                    PTR(SELF()->arg1), PTR(SELF()->arg2), imm);         \
+                NEXT512();                                              \
+        }                                                               \
+                                                                        \
+        static NO_INLINE void                                           \
+        acc_tern_##imm(struct filter_state *restrict state,             \
+            const struct op512 *restrict ops,                           \
+            size_t ip, size_t i, size_t arg, __m512i a)                 \
+        {                                                               \
+                                                                        \
+                a = _mm512_ternarylogic_epi64(a, PTR(arg),              \
+                    PTR(SELF()->arg1), imm);                            \
+                NEXT512();                                              \
+        }
+
+EACH_IMM(GEN_TERN)
+
+#undef GEN_TERN
+
+static NO_INLINE void
+store_loop512(struct filter_state *restrict state,
+    const struct op512 *restrict ops,
+    size_t ip, size_t i, size_t arg, __m512i a)
+{
+
+        STORE((uintptr_t)state->ptrs[arg] + i, a);
+
+        ip = 0;
+        i += sizeof(__m512i);
+        if (__builtin_expect(i >= sizeof(__m256i) * state->count, 0))
+                return;
+
+        NEXT512();
+}
+
+#define TERN_ENTRY(imm) [imm] = load_tern_##imm,
+
+static op512_t *const load_tern[256] = {
+        EACH_IMM(TERN_ENTRY)
+};
+
+#undef TERN_ENTRY
+#define TERN_ENTRY(imm) [imm] = acc_tern_##imm,
+
+static op512_t *const acc_tern[256] = {
+        EACH_IMM(TERN_ENTRY)
+};
+
+#undef TERN_ENTRY
+
+static void
+run_op512(const struct op512 *ops, struct filter_state *state)
+{
+
+        if (state->count > 0) {
+                __m512i zero = _mm512_setzero_si512();
+
+                ops[0].op(state, ops, sizeof(struct op512), 0, ops[0].arg,
+                    zero);
+        }
+
+        return;
+}
+
+void
+threaded_ternlog(struct filter_state *restrict state)
+{
+        const struct op512 ops[] = {
+                {
+                        .op = load_tern[TERNLOG_XOR_OR],
+                        .arg = 3,
+                        .arg1 = 1,
+                        .arg2 = 2,
+                },
+                {
+                        .op = acc_tern[TERNLOG_AND_XOR],
+                        .arg = 5,
+                        .arg1 = 4,
+                },
+                {
+                        .op = store_loop512,
+                        .arg = 0,
+                },
+        };
+
+        run_op512(ops, state);
+        return;
+}
+
+/**
+ * Reorder `node`'s operands so that the temporary `acc` comes first,
+ * followed by (at most two) inputs.  Returns false if that's
+ * impossible.
+ */
+static bool
+chain_operands(const struct ternlog_node *node, size_t acc,
+    uint8_t *imm, size_t inputs[2])
+{
+        uint8_t operands[3];
+        size_t n_inputs = 0;
+
+        for (size_t i = 0; i < 3; i++) {
+                struct ternlog_ref ref = node->src[i];
+
+                if (ref.temp) {
+                        if (ref.index != acc)
+                                return false;
+
+                        operands[i] = TERNLOG_A;
+                        continue;
+                }
+
+                if (n_inputs == 2)
+                        return false;
+
+                operands[i] = (n_inputs == 0) ? TERNLOG_B : TERNLOG_C;
+                inputs[n_inputs++] = ref.index;
+        }
+
+        if (n_inputs == 0)
+                inputs[n_inputs++] = 0;
+        if (n_inputs == 1)
+                inputs[1] = inputs[0];
+
+        *imm = ternlog_apply(node->imm, operands[0], operands[1],
+            operands[2]);
+        return true;
+}
+
+struct ternlog_threaded *
+ternlog_thread(const struct ternlog_program *program)
+{
+        struct ternlog_threaded *ret;
+        size_t n = program->n_nodes;
+
+        ret = calloc(1, sizeof(*ret) + (n + 1) * sizeof(ret->ops[0]));
+        assert(ret != NULL);
+        ret->n_ops = n + 1;
+
+        for (size_t i = 0; i < n; i++) {
+                const struct ternlog_node *node = &program->nodes[i];
+                size_t inputs[2];
+                uint8_t imm;
+
+                if (node->dst.temp != (i + 1 < n))
+                        goto fail;
+
+                if (i == 0) {
+                        for (size_t j = 0; j < 3; j++) {
+                                if (node->src[j].temp)
+                                        goto fail;
+                        }
+
+                        ret->ops[i] = (struct op512) {
+                                .op = load_tern[node->imm],
+                                .arg = node->src[0].index,
+                                .arg1 = node->src[1].index,
+                                .arg2 = node->src[2].index,
+                        };
+                        continue;
+                }
+
+                if (!chain_operands(node, program->nodes[i - 1].dst.index,
+                        &imm, inputs))
+                        goto fail;
+
+                ret->ops[i] = (struct op512) {
+                        .op = acc_tern[imm],
+                        .arg = inputs[0],
+                        .arg1 = inputs[1],
+                };
+        }
+
+        ret->ops[n] = (struct op512) {
+                .op = store_loop512,
+                .arg = 0,
+        };
+        return ret;
+
+fail:
+        free(ret);
+        return NULL;
+}
+
+void
+ternlog_threaded_destroy(struct ternlog_threaded *threaded)
+{
+
+        free(threaded);
+        return;
+}
+
+void
+ternlog_threaded_run(const struct ternlog_threaded *threaded,
+    struct filter_state *state)
+{
+
+        run_op512(threaded->ops, state);
+        return;
+}
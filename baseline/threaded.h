@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "interface.h"
+
+struct op_list;
+
+/**
+ * We'll do inline threading opcodes. SysV allows 6 scalar arguments,
+ * and 8 SSE.
+ *
+ * We have the filter state, the list of operation, our index in that
+ * list, and the loop iteration index * 32.
+ *
+ * ip indicates the next instruction * sizeof(struct op).
+ */
+typedef void op_t(struct filter_state *, const struct op_list *,
+     size_t ip, size_t i, size_t arg,
+    __m256i a, __m256i b, __m256i c, __m256i d);
+
+/**
+ * The interpreter only ever looks at ops through byte offsets from
+ * the op_list, so a longer program is simply a longer array of
+ * struct op.
+ */
+struct op_list {
+        struct op {
+                op_t *op;
+                size_t arg;
+                size_t arg1;
+                size_t arg2;
+        } ops[16];
+};
+
+#define NEXT() do {                                                     \
+                const struct op *pair =                            \
+                        (const void *)((uintptr_t)ops + ip);            \
+                                                                        \
+                return pair->op(state, ops, ip + sizeof(struct op), \
+                                i, pair->arg,                           \
+                                a, b, c, d);                            \
+        } while (0)
+
+/**
+ * Register-generic primitives, for code generators.  Registers are
+ * numbered a = 0 .. d = 3.
+ */
+enum {
+        THREADED_NREG = 4,
+};
+
+enum threaded_binop {
+        THREADED_OR = 0,
+        THREADED_AND,
+        THREADED_XOR,
+        THREADED_NBINOP
+};
+
+struct threaded_prims {
+        /* reg = ptrs[arg][i] */
+        op_t *load[THREADED_NREG];
+        /* ptrs[arg][i] = reg */
+        op_t *store[THREADED_NREG];
+        /* scratch.val[arg] = reg */
+        op_t *spill[THREADED_NREG];
+        /* reg = scratch.val[arg] */
+        op_t *fill[THREADED_NREG];
+        /* reg = ~reg */
+        op_t *negate[THREADED_NREG];
+        /* [op][dst][src]: dst op= src; NULL when dst == src. */
+        op_t *bin[THREADED_NBINOP][THREADED_NREG][THREADED_NREG];
+        /* Next iteration, up to state->count. */
+        op_t *loop;
+};
+
+extern const struct threaded_prims threaded_prims;
+
+/**
+ * Superinstructions, see VM_* in query.h for their semantics.
+ */
+struct threaded_supers {
+        /* [op][reg]: reg op= p0 */
+        op_t *mem[THREADED_NBINOP][THREADED_NREG];
+        /* [dst][src]: dst &= ~src; NULL when dst == src. */
+        op_t *andn[THREADED_NREG][THREADED_NREG];
+        op_t *andn_mem[THREADED_NREG];
+        op_t *load_or2[THREADED_NREG];
+        op_t *load_or3[THREADED_NREG];
+        op_t *or2_mem[THREADED_NREG];
+        op_t *or3_mem[THREADED_NREG];
+        op_t *xor_or[THREADED_NREG];
+        op_t *and_xor_mem[THREADED_NREG];
+        op_t *and_xor_or_mem[THREADED_NREG];
+        op_t *store_loop[THREADED_NREG];
+};
+
+extern const struct threaded_supers threaded_supers;
@@ -1,55 +1,40 @@
-#include "interface.h"
+#include "threaded.h"
+#include "policy.h"
+#include "popcount.h"
 
-#include <stdint.h>
-
-struct op_list;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
 
 /**
- * We'll do inline threading opcodes. SysV allows 6 scalar arguments,
- * and 8 SSE.
- *
- * We have the filter state, the list of operation, our index in that
- * list, and the loop iteration index * 32.
- *
- * ip indicates the next instruction * sizeof(struct op).
+ * Conditionally tail calls into the next loop iteration.
  */
-typedef void op_t(struct filter_state *, const struct op_list *,
+static NO_INLINE void
+iter(struct filter_state *restrict state, const struct op_list *restrict ops,
      size_t ip, size_t i, size_t arg,
-    __m256i a, __m256i b, __m256i c, __m256i d);
-
-struct op_list {
-        struct op {
-                op_t *op;
-                size_t arg;
-                size_t arg1;
-                size_t arg2;
-        } ops[16];
-};
+    __m256i a, __m256i b, __m256i c, __m256i d)
+{
 
-#define NEXT() do {                                                     \
-                const struct op *pair =                            \
-                        (const void *)((uintptr_t)ops + ip);            \
-                                                                        \
-                return pair->op(state, ops, ip + sizeof(struct op), \
-                                i, pair->arg,                           \
-                                a, b, c, d);                            \
-        } while (0)
+        ip = 0;
+        i += sizeof(__m256i);
+        if (__builtin_expect(i >= arg, 0))
+                return;
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
+        NEXT();
+}
 
 /**
- * Conditionally tail calls into the next loop iteration.
+ * Same, but reads the bound from the state, so that the op list
+ * does not depend on the count.
  */
 static NO_INLINE void
-iter(struct filter_state *restrict state, const struct op_list *restrict ops,
+loop(struct filter_state *restrict state, const struct op_list *restrict ops,
      size_t ip, size_t i, size_t arg,
     __m256i a, __m256i b, __m256i c, __m256i d)
 {
 
         ip = 0;
         i += sizeof(__m256i);
-        if (__builtin_expect(i >= arg, 0))
+        if (__builtin_expect(i >= sizeof(__m256i) * state->count, 0))
                 return;
 
         NEXT();
@@ -88,6 +73,51 @@ GEN_LDST(d);
 
 #undef GEN_LDST
 
+/**
+ * Spill slots live in scratch.val; they only hold values for the
+ * current iteration, so they are not indexed by i.
+ */
+#define GEN_SPILL(reg)                                                  \
+        static NO_INLINE void                                           \
+        spill_##reg(struct filter_state *restrict state,                \
+                    const struct op_list *restrict ops,                 \
+                    size_t ip, size_t i, size_t arg,                    \
+                    __m256i a, __m256i b, __m256i c, __m256i d)         \
+        {                                                               \
+                                                                        \
+                state->scratch.val[arg] = reg;                          \
+                NEXT();                                                 \
+        }                                                               \
+                                                                        \
+        static NO_INLINE void                                           \
+        fill_##reg(struct filter_state *restrict state,                 \
+                   const struct op_list *restrict ops,                  \
+                   size_t ip, size_t i, size_t arg,                     \
+                   __m256i a, __m256i b, __m256i c, __m256i d)          \
+        {                                                               \
+                                                                        \
+                reg = state->scratch.val[arg];                          \
+                NEXT();                                                 \
+        }                                                               \
+                                                                        \
+        static NO_INLINE void                                           \
+        not_##reg(struct filter_state *restrict state,                  \
+                  const struct op_list *restrict ops,                   \
+                  size_t ip, size_t i, size_t arg,                      \
+                  __m256i a, __m256i b, __m256i c, __m256i d)           \
+        {                                                               \
+                                                                        \
+                reg = ~reg;                                             \
+                NEXT();                                                 \
+        }
+
+GEN_SPILL(a);
+GEN_SPILL(b);
+GEN_SPILL(c);
+GEN_SPILL(d);
+
+#undef GEN_SPILL
+
 #define GEN_BIN(dst, src)                                               \
         static NO_INLINE void                                           \
         or_##dst##_##src(struct filter_state *restrict state,           \
@@ -138,6 +168,30 @@ GEN_BIN(d, c);
 
 #pragma GCC diagnostic pop
 
+#define BIN_TABLE(op)                                                   \
+        {                                                               \
+                { NULL, op##_a_b, op##_a_c, op##_a_d },                 \
+                { op##_b_a, NULL, op##_b_c, op##_b_d },                 \
+                { op##_c_a, op##_c_b, NULL, op##_c_d },                 \
+                { op##_d_a, op##_d_b, op##_d_c, NULL },                 \
+        }
+
+const struct threaded_prims threaded_prims = {
+        .load = { load_a, load_b, load_c, load_d },
+        .store = { store_a, store_b, store_c, store_d },
+        .spill = { spill_a, spill_b, spill_c, spill_d },
+        .fill = { fill_a, fill_b, fill_c, fill_d },
+        .negate = { not_a, not_b, not_c, not_d },
+        .bin = {
+                [THREADED_OR] = BIN_TABLE(or),
+                [THREADED_AND] = BIN_TABLE(and),
+                [THREADED_XOR] = BIN_TABLE(xor),
+        },
+        .loop = loop,
+};
+
+#undef BIN_TABLE
+
 void
 threaded_inreg(struct filter_state *restrict state)
 {
@@ -255,6 +309,30 @@ store_iter(struct filter_state *restrict state, const struct op_list *restrict o
         NEXT();
 }
 
+/*
+ * Count mode: accumulate per-lane popcounts of a in d, instead of
+ * storing a.
+ */
+static NO_INLINE void
+count_iter(struct filter_state *restrict state, const struct op_list *restrict ops,
+     size_t ip, size_t i, size_t arg,
+    __m256i a, __m256i b, __m256i c, __m256i d)
+{
+        const struct op *self =
+                (const void *)((uintptr_t)ops + ip - sizeof(struct op));
+
+        d = _mm256_add_epi64(d, popcount_lanes(a));
+
+        ip = 0;
+        i += sizeof(__m256i);
+        if (__builtin_expect(i >= self->arg1, 0)) {
+                state->popcount = popcount_hsum(d);
+                return;
+        }
+
+        NEXT();
+}
+
 #pragma GCC diagnostic pop
 
 void
@@ -293,11 +371,49 @@ threaded_inreg_fused(struct filter_state *restrict state)
         return;
 }
 
+void
+threaded_inreg_fused_count(struct filter_state *restrict state)
+{
+        const struct op_list op_list = {
+                .ops = {
+                        {
+                                .op = xor_or,
+                                .arg = 3,
+                                .arg1 = 1,
+                                .arg2 = 2,
+                        },
+                        {
+                                .op = acc_and_xor,
+                                .arg = 5,
+                                .arg1 = 4,
+                        },
+                        {
+                                .op = count_iter,
+                                .arg1 = sizeof(__m256i) * state->count,
+                        },
+                },
+        };
+
+        state->popcount = 0;
+        if (state->count > 0) {
+                const struct op_list *ops = &op_list;
+                __m256i zero = { 0 };
+
+                ops->ops[0].op(state, ops, sizeof(struct op), 0,
+                               ops->ops[0].arg,
+                               zero, zero, zero, zero);
+        }
+
+        return;
+}
+
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
 static op_t wired_xor_or, wired_acc_and_xor, wired_store_iter;
+static op_t wired_xor_or_count, wired_acc_and_xor_count, wired_count_iter;
+static op_t wired_xor_or_nt, wired_acc_and_xor_nt, wired_stream_iter;
 
 #define WIRED_NEXT(next) do {                                           \
                 const struct op *pair =                                 \
@@ -352,6 +468,116 @@ wired_store_iter(struct filter_state *restrict state, const struct op_list *rest
         WIRED_NEXT(wired_xor_or);
 }
 
+/*
+ * The same loop in count mode, wired to wired_count_iter.
+ */
+static NO_INLINE void
+wired_xor_or_count(struct filter_state *restrict state, const struct op_list *restrict ops,
+     size_t ip, size_t i, size_t arg,
+    __m256i a, __m256i b, __m256i c, __m256i d)
+{
+        __m256i neg_x = *(__m256i *)((uintptr_t)state->ptrs[3] + i);
+        __m256i x0 = *(__m256i *)((uintptr_t)state->ptrs[1] + i);
+        __m256i x1 = *(__m256i *)((uintptr_t)state->ptrs[2] + i);
+
+        a = neg_x ^ (x0 | x1);
+        WIRED_NEXT(wired_acc_and_xor_count);
+}
+
+static NO_INLINE void
+wired_acc_and_xor_count(struct filter_state *restrict state, const struct op_list *restrict ops,
+     size_t ip, size_t i, size_t arg,
+    __m256i a, __m256i b, __m256i c, __m256i d)
+{
+        __m256i neg_y = *(__m256i *)((uintptr_t)state->ptrs[5] + i);
+        __m256i y0 = *(__m256i *)((uintptr_t)state->ptrs[4] + i);
+
+        a &= neg_y ^ y0;
+        WIRED_NEXT(wired_count_iter);
+}
+
+static NO_INLINE void
+wired_count_iter(struct filter_state *restrict state, const struct op_list *restrict ops,
+     size_t ip, size_t i, size_t arg,
+    __m256i a, __m256i b, __m256i c, __m256i d)
+{
+        const struct op *self =
+                (const void *)((uintptr_t)ops + ip - sizeof(struct op));
+
+        d = _mm256_add_epi64(d, popcount_lanes(a));
+
+        ip = 0;
+        i += sizeof(__m256i);
+        if (__builtin_expect(i >= self->arg1, 0)) {
+                state->popcount = popcount_hsum(d);
+                return;
+        }
+
+        WIRED_NEXT(wired_xor_or_count);
+}
+
+/*
+ * And again with non-temporal stores, prefetching inputs once per
+ * cache line.
+ */
+static NO_INLINE void
+wired_xor_or_nt(struct filter_state *restrict state, const struct op_list *restrict ops,
+     size_t ip, size_t i, size_t arg,
+    __m256i a, __m256i b, __m256i c, __m256i d)
+{
+        __m256i neg_x = *(__m256i *)((uintptr_t)state->ptrs[3] + i);
+        __m256i x0 = *(__m256i *)((uintptr_t)state->ptrs[1] + i);
+        __m256i x1 = *(__m256i *)((uintptr_t)state->ptrs[2] + i);
+
+        if ((i % 64) == 0) {
+                /* The prefetch distance, in bytes. */
+                size_t ahead = i + ops->ops[2].arg2;
+
+                /* Don't form addresses past the end of the inputs. */
+                if (ahead < sizeof(__m256i) * state->count) {
+                        for (size_t k = 1; k <= 5; k++) {
+                                _mm_prefetch((const char *)state->ptrs[k] + ahead,
+                                    _MM_HINT_T0);
+                        }
+                }
+        }
+
+        a = neg_x ^ (x0 | x1);
+        WIRED_NEXT(wired_acc_and_xor_nt);
+}
+
+static NO_INLINE void
+wired_acc_and_xor_nt(struct filter_state *restrict state, const struct op_list *restrict ops,
+     size_t ip, size_t i, size_t arg,
+    __m256i a, __m256i b, __m256i c, __m256i d)
+{
+        __m256i neg_y = *(__m256i *)((uintptr_t)state->ptrs[5] + i);
+        __m256i y0 = *(__m256i *)((uintptr_t)state->ptrs[4] + i);
+
+        a &= neg_y ^ y0;
+        WIRED_NEXT(wired_stream_iter);
+}
+
+static NO_INLINE void
+wired_stream_iter(struct filter_state *restrict state, const struct op_list *restrict ops,
+     size_t ip, size_t i, size_t arg,
+    __m256i a, __m256i b, __m256i c, __m256i d)
+{
+        const struct op *self =
+                (const void *)((uintptr_t)ops + ip - sizeof(struct op));
+
+        _mm256_stream_si256((__m256i *)((uintptr_t)state->ptrs[0] + i), a);
+
+        ip = 0;
+        i += sizeof(__m256i);
+        if (__builtin_expect(i >= self->arg1, 0)) {
+                _mm_sfence();
+                return;
+        }
+
+        WIRED_NEXT(wired_xor_or_nt);
+}
+
 #pragma GCC diagnostic pop
 
 void
@@ -389,3 +615,77 @@ wired_inreg_fused(struct filter_state *restrict state)
 
         return;
 }
+
+void
+wired_inreg_fused_count(struct filter_state *restrict state)
+{
+        const struct op_list op_list = {
+                .ops = {
+                        {
+                                .op = wired_xor_or_count,
+                                .arg = 3,
+                                .arg1 = 1,
+                                .arg2 = 2,
+                        },
+                        {
+                                .op = wired_acc_and_xor_count,
+                                .arg = 5,
+                                .arg1 = 4,
+                        },
+                        {
+                                .op = wired_count_iter,
+                                .arg1 = sizeof(__m256i) * state->count,
+                        },
+                },
+        };
+
+        state->popcount = 0;
+        if (state->count > 0) {
+                const struct op_list *ops = &op_list;
+                __m256i zero = { 0 };
+
+                ops->ops[0].op(state, ops, sizeof(struct op), 0,
+                               ops->ops[0].arg,
+                               zero, zero, zero, zero);
+        }
+
+        return;
+}
+
+void
+wired_inreg_fused_nt(struct filter_state *restrict state)
+{
+        const struct op_list op_list = {
+                .ops = {
+                        {
+                                .op = wired_xor_or_nt,
+                                .arg = 3,
+                                .arg1 = 1,
+                                .arg2 = 2,
+                        },
+                        {
+                                .op = wired_acc_and_xor_nt,
+                                .arg = 5,
+                                .arg1 = 4,
+                        },
+                        {
+                                .op = wired_stream_iter,
+                                .arg = 0,
+                                .arg1 = sizeof(__m256i) * state->count,
+                                /* For wired_xor_or_nt's prefetches. */
+                                .arg2 = sizeof(__m256i) * filter_prefetch_distance(5),
+                        },
+                },
+        };
+
+        if (state->count > 0) {
+                const struct op_list *ops = &op_list;
+                __m256i zero = { 0 };
+
+                ops->ops[0].op(state, ops, sizeof(struct op), 0,
+                               ops->ops[0].arg,
+                               zero, zero, zero, zero);
+        }
+
+        return;
+}
@@ -0,0 +1,193 @@
+#include "query.h"
+
+#include <stdbool.h>
+
+/**
+ * Superinstruction selection is a peephole pass that works like a
+ * shift-reduce parser: each instruction is appended to the output,
+ * and we then rewrite the output's tail for as long as some pattern
+ * matches.  Longer windows are tried first, and a freshly formed
+ * superinstruction may immediately grow into a larger one, e.g.,
+ * load, or_mem -> load_or2, then load_or2, or_mem -> load_or3.
+ */
+
+static struct vm_insn
+insn3(enum vm_opcode opcode, uint8_t reg, size_t a0, size_t a1, size_t a2)
+{
+
+        return (struct vm_insn) {
+                .opcode = opcode,
+                .reg = reg,
+                .arg = { a0, a1, a2 },
+        };
+}
+
+static int
+mem_opcode(enum vm_opcode opcode)
+{
+
+        switch (opcode) {
+        case VM_OR:
+                return VM_OR_MEM;
+        case VM_AND:
+                return VM_AND_MEM;
+        case VM_XOR:
+                return VM_XOR_MEM;
+        default:
+                return -1;
+        }
+}
+
+/**
+ * Is `insn` a binary operation `reg op= src` that consumes `src`,
+ * i.e., the register `def` just wrote?
+ */
+static bool
+consumes(const struct vm_insn *insn, enum vm_opcode opcode,
+    const struct vm_insn *def)
+{
+
+        return insn->opcode == opcode && insn->src == def->reg &&
+            insn->reg != def->reg;
+}
+
+/**
+ * The reduce functions return the number of instructions the window
+ * was rewritten to, or 0 if nothing matched.
+ */
+static size_t
+reduce3(struct vm_insn *t)
+{
+        struct vm_insn *x = &t[0], *y = &t[1], *z = &t[2];
+        int mem;
+
+        /* load s, p; not s; and r, s -> andn_mem r, p */
+        if (x->opcode == VM_LOAD && y->opcode == VM_NOT &&
+            y->reg == x->reg && consumes(z, VM_AND, x)) {
+                *x = insn3(VM_ANDN_MEM, z->reg, x->arg[0], 0, 0);
+                return 1;
+        }
+
+        /* load s, p0; xor_mem s, p1; and r, s -> and_xor_mem r, p0, p1 */
+        if (x->opcode == VM_LOAD && y->opcode == VM_XOR_MEM &&
+            y->reg == x->reg && consumes(z, VM_AND, x)) {
+                *x = insn3(VM_AND_XOR_MEM, z->reg,
+                    x->arg[0], y->arg[0], 0);
+                return 1;
+        }
+
+        /* load s, p; fill r, k; op r, s -> fill r, k; op_mem r, p */
+        mem = mem_opcode(z->opcode);
+        if (x->opcode == VM_LOAD && y->opcode == VM_FILL &&
+            y->reg == z->reg && mem >= 0 && consumes(z, z->opcode, x)) {
+                struct vm_insn fill = *y;
+
+                *y = insn3(mem, z->reg, x->arg[0], 0, 0);
+                *x = fill;
+                return 2;
+        }
+
+        return 0;
+}
+
+static size_t
+reduce2(struct vm_insn *t)
+{
+        struct vm_insn *x = &t[0], *y = &t[1];
+        int mem;
+
+        /* xor_or s, ...; and r, s -> and_xor_or_mem r, ... */
+        if (x->opcode == VM_XOR_OR && consumes(y, VM_AND, x)) {
+                *x = insn3(VM_AND_XOR_OR_MEM, y->reg,
+                    x->arg[0], x->arg[1], x->arg[2]);
+                return 1;
+        }
+
+        /* not s; and r, s -> andn r, s */
+        if (x->opcode == VM_NOT && consumes(y, VM_AND, x)) {
+                *x = (struct vm_insn) {
+                        .opcode = VM_ANDN,
+                        .reg = y->reg,
+                        .src = x->reg,
+                };
+                return 1;
+        }
+
+        /* load s, p; op r, s -> op_mem r, p */
+        mem = mem_opcode(y->opcode);
+        if (x->opcode == VM_LOAD && mem >= 0 && consumes(y, y->opcode, x)) {
+                *x = insn3(mem, y->reg, x->arg[0], 0, 0);
+                return 1;
+        }
+
+        /* store r, p; loop -> store_loop r, p */
+        if (x->opcode == VM_STORE && y->opcode == VM_LOOP) {
+                *x = insn3(VM_STORE_LOOP, x->reg, x->arg[0], 0, 0);
+                return 1;
+        }
+
+        if (y->reg != x->reg)
+                return 0;
+
+        /* load r, p0; or_mem r, p1 -> load_or2 r, p0, p1 */
+        if (x->opcode == VM_LOAD && y->opcode == VM_OR_MEM) {
+                *x = insn3(VM_LOAD_OR2, x->reg, x->arg[0], y->arg[0], 0);
+                return 1;
+        }
+
+        /* load_or2 r, p0, p1; or_mem r, p2 -> load_or3 r, p0, p1, p2 */
+        if (x->opcode == VM_LOAD_OR2 && y->opcode == VM_OR_MEM) {
+                *x = insn3(VM_LOAD_OR3, x->reg,
+                    x->arg[0], x->arg[1], y->arg[0]);
+                return 1;
+        }
+
+        /* load_or2 r, p1, p2; xor_mem r, p0 -> xor_or r, p0, p1, p2 */
+        if (x->opcode == VM_LOAD_OR2 && y->opcode == VM_XOR_MEM) {
+                *x = insn3(VM_XOR_OR, x->reg,
+                    y->arg[0], x->arg[0], x->arg[1]);
+                return 1;
+        }
+
+        /* or_mem r, p0; or_mem r, p1 -> or2_mem r, p0, p1 */
+        if (x->opcode == VM_OR_MEM && y->opcode == VM_OR_MEM) {
+                *x = insn3(VM_OR2_MEM, x->reg, x->arg[0], y->arg[0], 0);
+                return 1;
+        }
+
+        if (x->opcode == VM_OR2_MEM && y->opcode == VM_OR_MEM) {
+                *x = insn3(VM_OR3_MEM, x->reg,
+                    x->arg[0], x->arg[1], y->arg[0]);
+                return 1;
+        }
+
+        return 0;
+}
+
+size_t
+query_tile(struct vm_insn *insns, size_t n_insns)
+{
+        size_t n_out = 0;
+
+        for (size_t i = 0; i < n_insns; i++) {
+                insns[n_out++] = insns[i];
+
+                for (;;) {
+                        size_t n;
+
+                        if (n_out >= 3 && (n = reduce3(&insns[n_out - 3])) > 0) {
+                                n_out += n - 3;
+                                continue;
+                        }
+
+                        if (n_out >= 2 && (n = reduce2(&insns[n_out - 2])) > 0) {
+                                n_out += n - 2;
+                                continue;
+                        }
+
+                        break;
+                }
+        }
+
+        return n_out;
+}
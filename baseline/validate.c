@@ -1,16 +1,58 @@
 #define RUN_ME /*
-exec ${CC:-cc} ${CFLAGS:- -O3} -march=native -mtune=native -std=gnu11 -W -Wall      \
- noop.c baseline.c blocking.c fused_blocking.c specialised_widget.c threaded_inreg.c \
- $0 -o $(basename $0 .c)
+objs=
+for f in noop vector blocked expr arena policy pool deque shapes bench engines planner; do
+  ${CC:-cc} ${CFLAGS:- -O3} -std=gnu11 -W -Wall -c $f.c -o $f.o || exit
+  objs="$objs $f.o"
+done
+for f in baseline blocking fused_blocking specialised_widget threaded_inreg \
+    compile dag superinstructions tile stitch canon cache ternlog ternlog_avx512 \
+    shared_scan short_circuit roaring sink segment range incremental subexpr_cache; do
+  ${CC:-cc} ${CFLAGS:- -O3} -mavx2 -mpopcnt -mtune=native -std=gnu11 -W -Wall \
+   -c $f.c -o $f.o || exit
+  objs="$objs $f.o"
+done
+exec ${CC:-cc} ${CFLAGS:- -O3} -std=gnu11 -W -Wall \
+ $objs stitch_templates.S -pthread $0 -o $(basename $0 .c)
 
 */
 #include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "arena.h"
+#include "bench.h"
+#include "blocked.h"
+#include "cache.h"
+#include "engines.h"
+#include "incremental.h"
 #include "interface.h"
+#include "planner.h"
+#include "policy.h"
+#include "pool.h"
+/* For test_popcount, the only AVX2 code built into validate itself. */
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include "popcount.h"
+#pragma GCC pop_options
+#include "query.h"
+#include "range.h"
+#include "roaring.h"
+#include "segment.h"
+#include "shapes.h"
+#include "shared_scan.h"
+#include "short_circuit.h"
+#include "sink.h"
+#include "stitch.h"
+#include "subexpr_cache.h"
+#include "ternlog.h"
+#include "vector.h"
 
 typedef void bv_fn_t(struct filter_state *);
 
@@ -18,65 +60,167 @@ struct vecs {
         __m256i *vecs[6];
 };
 
-static inline uint64_t
-ticks_begin(void)
+static const char *const toy_names[] = {
+        "dst", "x0", "x1", "neg_x", "y0", "neg_y",
+};
+
+static const char toy_query[] = "(and (xor neg_x (or x0 x1)) (xor neg_y y0))";
+
+static struct expr *toy_expr;
+static struct query_engines toy_engines;
+
+/*
+ * Evaluate the sample query four times, as if four queries shared its
+ * inputs: one after the other, or in a single shared scan.
+ */
+enum { toy_copies = 4 };
+
+static void
+stitched_fused_x4(struct filter_state *state)
 {
-        uint32_t hi, lo;
 
-        asm volatile("cpuid\n\t"
-                     "rdtsc"
-                     : "=d" (hi), "=a" (lo)
-                     :: "%rbx", "%rcx");
-        return ((uint64_t)hi << 32) + lo;
+        for (size_t i = 0; i < toy_copies; i++)
+                stitch_run(toy_engines.stitched, state);
+
+        return;
 }
 
-static inline uint64_t
-ticks_end(void)
+static void
+shared_scan_x4(struct filter_state *state)
 {
-        uint32_t hi, lo;
+        struct shared_scan_query queries[toy_copies];
+
+        for (size_t i = 0; i < toy_copies; i++) {
+                queries[i] = (struct shared_scan_query) {
+                        .program = toy_engines.program_fused,
+                        .stitched = toy_engines.stitched,
+                        .state = state,
+                };
+        }
 
-        asm volatile("rdtscp\n\t"
-                     "mov %%edx, %0\n\t"
-                     "mov %%eax, %1\n\t"
-                     "cpuid"
-                     : "=r" (hi), "=r" (lo)
-                     :: "%rax", "%rbx", "%rcx", "%rdx");
-        return ((uint64_t)hi << 32) + lo;
+        shared_scan_run(queries, toy_copies);
+        return;
 }
 
+static struct planner *toy_planner;
+
+static struct query_cache *toy_cache;
+
+/**
+ * Pay for canonicalisation and the cache lookup on every call.
+ */
 static void
-clear_caches(void)
+cached_stitched(struct filter_state *state)
 {
-        static const size_t bufsz = 32 * 1024 * 1024;
-        static uint8_t *buf;
+        struct query_plan plan;
+        bool ok;
 
-        if (buf == NULL) {
-                buf = malloc(bufsz);
-                memset(buf, 42, bufsz);
-        }
+        ok = query_cache_lookup(toy_cache, toy_expr, &plan);
+        assert(ok);
+        query_plan_run(&plan, state);
+        return;
+}
+
+static struct filter_pool *toy_pool;
+
+static void
+baseline_parallel(struct filter_state *state)
+{
+
+        filter_pool_run(toy_pool, baseline, state);
+        return;
+}
+
+static void
+fused_blocking_parallel(struct filter_state *state)
+{
+
+        filter_pool_run(toy_pool, fused_blocking, state);
+        return;
+}
+
+static struct filter_sink *toy_sink;
+
+static void
+discard_indices(void *ctx, const uint32_t *indices, size_t n)
+{
+
+        (void)ctx;
+        asm volatile("" :: "r"(indices), "r"(n) : "memory");
+        return;
+}
+
+static void
+baseline_emit_toy(struct filter_state *state)
+{
+
+        state->sink = toy_sink;
+        baseline_emit(state);
+        return;
+}
+
+static void
+fused_blocking_emit_toy(struct filter_state *state)
+{
+
+        state->sink = toy_sink;
+        fused_blocking_emit(state);
+        return;
+}
+
+static void
+stitched_fused_sink(struct filter_state *state)
+{
+
+        filter_sink_run(toy_sink, stitched_fused, state);
+        return;
+}
+
+/*
+ * Allocate a fresh dst for every query, from malloc or from the
+ * thread's arena.
+ */
+static void
+baseline_malloc_dst(struct filter_state *state)
+{
+        __m256i *dst = state->dst;
+        int r;
+
+        r = posix_memalign((void **)&state->dst, 64,
+            state->count * sizeof(__m256i));
+        assert(r == 0);
+        baseline(state);
+        free(state->dst);
+        state->dst = dst;
+        return;
+}
 
-        for (size_t i = 0; i < bufsz; i += 64)
-                asm volatile("" :: "r"(buf[i]) : "memory");
+static void
+baseline_arena_dst(struct filter_state *state)
+{
+        struct filter_arena *arena = filter_arena_thread();
+        __m256i *dst = state->dst;
 
+        state->dst = filter_arena_vecs(arena, state->count);
+        baseline(state);
+        filter_arena_vecs_release(arena, state->dst, state->count);
+        state->dst = dst;
         return;
 }
 
 static struct filter_state *
 filter(bv_fn_t *fn, size_t count, struct vecs vecs)
 {
+        struct filter_arena *arena = filter_arena_thread();
         struct filter_state *ret;
         size_t vec_size = sizeof(__m256i) * count;
-        int r;
-
-        r = posix_memalign((void **)&ret, 32, sizeof(*ret));
-        assert(r == 0);
 
+        ret = filter_arena_state(arena);
         ret->count = count;
         for (size_t i = 0; i < 6; i++) {
                 __m256i *copy;
 
-                r = posix_memalign((void **)&copy, 32, vec_size);
-                assert(r == 0);
+                copy = filter_arena_vecs(arena, count);
                 memcpy(copy, vecs.vecs[i], vec_size);
                 ret->ptrs[i] = copy;
         }
@@ -124,6 +268,24 @@ destroy(struct filter_state *state)
         return;
 }
 
+/**
+ * Returns the result of filter() to the arena.
+ */
+static void
+release(struct filter_state *state)
+{
+        struct filter_arena *arena = filter_arena_thread();
+
+        if (state == NULL)
+                return;
+
+        for (size_t i = 0; i < 6; i++)
+                filter_arena_vecs_release(arena, state->ptrs[i], state->count);
+
+        filter_arena_state_release(arena, state);
+        return;
+}
+
 static int
 compare(bv_fn_t *control, bv_fn_t *test, size_t count, struct vecs vecs)
 {
@@ -133,8 +295,8 @@ compare(bv_fn_t *control, bv_fn_t *test, size_t count, struct vecs vecs)
         int r;
 
         r = memcmp(test_result->dst, control_result->dst, vec_size);
-        destroy(test_result);
-        destroy(control_result);
+        release(test_result);
+        release(control_result);
         return r;
 }
 
@@ -160,121 +322,2354 @@ random_vec(size_t count)
 static void
 test_all(size_t count)
 {
+        /* The scalar kernels run on any host. */
+        bv_fn_t *control = vector_kernels[0].baseline;
         struct vecs vecs;
 
         for (size_t i = 0; i < 6; i++)
                 vecs.vecs[i] = random_vec(count);
 
-        assert(compare(baseline, baseline, count, vecs) == 0);
-        assert(compare(baseline, blocking, count, vecs) == 0);
-        assert(compare(baseline, fused_blocking, count, vecs) == 0);
-        assert(compare(baseline, specialised_widget, count, vecs) == 0);
-        assert(compare(baseline, fully_specialised_widget, count, vecs) == 0);
-        assert(compare(baseline, threaded_inreg, count, vecs) == 0);
-        assert(compare(baseline, threaded_inreg_fused, count, vecs) == 0);
-        assert(compare(baseline, wired_inreg_fused, count, vecs) == 0);
-        
+        assert(compare(control, control, count, vecs) == 0);
+        if (vector_avx2_supported()) {
+                assert(compare(control, baseline, count, vecs) == 0);
+                assert(compare(control, blocking, count, vecs) == 0);
+                assert(compare(control, fused_blocking, count, vecs) == 0);
+                assert(compare(control, fused_blocking_short_circuit, count, vecs) == 0);
+                assert(compare(control, specialised_widget, count, vecs) == 0);
+                assert(compare(control, fully_specialised_widget, count, vecs) == 0);
+                assert(compare(control, threaded_inreg, count, vecs) == 0);
+                assert(compare(control, threaded_inreg_fused, count, vecs) == 0);
+                assert(compare(control, wired_inreg_fused, count, vecs) == 0);
+                assert(compare(control, compiled_inreg, count, vecs) == 0);
+                assert(compare(control, compiled_inreg_fused, count, vecs) == 0);
+                assert(compare(control, stitched_fused, count, vecs) == 0);
+                assert(compare(control, cached_stitched, count, vecs) == 0);
+                assert(compare(control, compiled_short_circuit, count, vecs) == 0);
+                assert(compare(control, stitched_fused_x4, count, vecs) == 0);
+                assert(compare(control, shared_scan_x4, count, vecs) == 0);
+                assert(compare(control, baseline_parallel, count, vecs) == 0);
+                assert(compare(control, fused_blocking_parallel, count, vecs) == 0);
+                assert(compare(control, baseline_nt, count, vecs) == 0);
+                assert(compare(control, fused_blocking_nt, count, vecs) == 0);
+                assert(compare(control, wired_inreg_fused_nt, count, vecs) == 0);
+                assert(compare(control, baseline_auto, count, vecs) == 0);
+                assert(compare(control, fused_blocking_auto, count, vecs) == 0);
+                assert(compare(control, wired_inreg_fused_auto, count, vecs) == 0);
+        }
+
+        if (vector_avx2_supported() && __builtin_cpu_supports("avx512f")) {
+                assert(compare(control, baseline_avx512, count, vecs) == 0);
+                assert(compare(control, fused_blocking_avx512, count, vecs) == 0);
+                assert(compare(control, threaded_ternlog, count, vecs) == 0);
+        }
+
+        assert(compare(control, blocked_adaptive, count, vecs) == 0);
+        assert(compare(control, planned, count, vecs) == 0);
+        assert(compare(control, baseline_vec, count, vecs) == 0);
+        assert(compare(control, fused_blocking_vec, count, vecs) == 0);
+        for (size_t i = 0; i < vector_kernels_count; i++) {
+                const struct vector_kernels *kernels = &vector_kernels[i];
+
+                if (!vector_kernels_supported(kernels))
+                        continue;
+
+                assert(compare(control, kernels->baseline, count, vecs) == 0);
+                assert(compare(control, kernels->fused_blocking, count, vecs) == 0);
+        }
+
         for (size_t i = 0; i < 6; i++)
                 free(vecs.vecs[i]);
         return;
 }
 
-static int
-cmp_double(const void *vx, const void *vy)
+/*
+ * The first entry stands for the shape chosen for the host.  Tiles
+ * of 48 vectors end in a partial 32-vector block.
+ */
+static const struct blocked_shape blocked_shapes[] = {
+        { 0, 0 },
+        { BLOCK_SIZE, BLOCK_SIZE },
+        { 2 * BLOCK_SIZE, 2 * BLOCK_SIZE },
+        { 8 * BLOCK_SIZE, 8 * BLOCK_SIZE },
+        { BLOCK_SIZE, 3 * BLOCK_SIZE },
+        { 2 * BLOCK_SIZE, 6 * BLOCK_SIZE },
+        { 4 * BLOCK_SIZE, 32 * BLOCK_SIZE },
+};
+
+/**
+ * Checks every engine for arbitrary queries against `expected`, with
+ * `state->dst` as the output.
+ */
+static void
+check_query(const struct expr *expr, unsigned flags, struct filter_state *state,
+    const __m256i *expected)
+{
+        size_t vec_size = sizeof(__m256i) * state->count;
+        __m256i *actual = state->dst;
+        struct query_program *program;
+        struct stitched_query *stitched;
+        struct ternlog_program *ternlog;
+        struct planned_query *planned;
+
+        program = query_compile(expr, flags);
+        assert(program != NULL);
+        memset(actual, 0, vec_size);
+        query_run(program, state);
+        assert(memcmp(actual, expected, vec_size) == 0);
+
+        stitched = stitch_query(program);
+        assert(stitched != NULL);
+        memset(actual, 0, vec_size);
+        stitch_run(stitched, state);
+        assert(memcmp(actual, expected, vec_size) == 0);
+        stitched_query_destroy(stitched);
+
+        for (size_t i = 0; i < sizeof(blocked_shapes) / sizeof(blocked_shapes[0]); i++) {
+                for (size_t j = 0; j < vector_kernels_count; j++) {
+                        struct blocked_query *blocked;
+
+                        if (!vector_kernels_supported(&vector_kernels[j]))
+                                continue;
+
+                        blocked = blocked_compile_kernels(expr,
+                            (i == 0) ? NULL : &blocked_shapes[i],
+                            &vector_kernels[j]);
+                        memset(actual, 0, vec_size);
+                        blocked_run(blocked, state);
+                        assert(memcmp(actual, expected, vec_size) == 0);
+                        blocked_destroy(blocked);
+                }
+        }
+
+        planned = planner_compile(toy_planner, expr, 1, NULL);
+        assert(planned != NULL);
+        for (size_t i = 0; i <= PLANNER_N_STRATEGIES; i++) {
+                memset(actual, 0, vec_size);
+                if (i < PLANNER_N_STRATEGIES)
+                        planned_query_run_with(planned, i, state);
+                else
+                        planned_query_run(planned, state);
+                assert(memcmp(actual, expected, vec_size) == 0);
+        }
+
+        planned_query_destroy(planned);
+
+        ternlog = ternlog_partition(expr);
+        if (__builtin_cpu_supports("avx512f")) {
+                struct ternlog_threaded *threaded;
+
+                memset(actual, 0, vec_size);
+                ternlog_run(ternlog, state);
+                assert(memcmp(actual, expected, vec_size) == 0);
+
+                threaded = ternlog_thread(ternlog);
+                if (threaded != NULL) {
+                        memset(actual, 0, vec_size);
+                        ternlog_threaded_run(threaded, state);
+                        assert(memcmp(actual, expected, vec_size) == 0);
+                        ternlog_threaded_destroy(threaded);
+                }
+        }
+
+        ternlog_program_destroy(ternlog);
+        query_program_destroy(program);
+        return;
+}
+
+/**
+ * Compare compiled programs for arbitrary queries with the reference
+ * evaluator, with inputs 1 .. n_inputs.
+ */
+static void
+test_query_flags(const char *src, size_t n_inputs, size_t count,
+    unsigned flags)
+{
+        struct filter_state *state;
+        struct expr *expr;
+        __m256i *expected;
+        __m256i *actual;
+        int r;
+
+        expr = expr_parse(src, NULL, 0);
+        assert(expr != NULL);
+
+        r = posix_memalign((void **)&state, 32, sizeof(*state));
+        assert(r == 0);
+        state->count = count;
+        for (size_t i = 1; i <= n_inputs; i++)
+                state->ptrs[i] = random_vec(count);
+
+        expected = random_vec(count);
+        actual = random_vec(count);
+
+        state->dst = expected;
+        expr_eval(expr, state);
+        state->dst = actual;
+        check_query(expr, flags, state, expected);
+
+        for (size_t i = 1; i <= n_inputs; i++)
+                free(state->ptrs[i]);
+        free(expected);
+        free(actual);
+        free(state);
+        expr_destroy(expr);
+        return;
+}
+
+/**
+ * A state with `count` vectors for each of `shape`'s inputs, filled
+ * with `density`, and an uninitialised dst.
+ */
+static struct filter_state *
+setup_shape(struct expr **expr, const struct shape_bench *shape,
+    const struct shape_input_density *density, size_t count)
+{
+        struct filter_state *ret;
+        size_t n_inputs;
+        int r;
+
+        *expr = shape_query(&shape->params, &n_inputs);
+        r = posix_memalign((void **)&ret, 64, sizeof(*ret));
+        assert(r == 0);
+        memset(ret, 0, sizeof(*ret));
+        ret->count = count;
+        ret->dst = random_vec(count);
+        for (size_t k = 1; k <= n_inputs; k++) {
+                ret->ptrs[k] = random_vec(count);
+                shape_fill(ret->ptrs[k], count, &density->density, k, 42);
+        }
+
+        return ret;
+}
+
+static void
+destroy_shape(struct expr *expr, struct filter_state *state)
+{
+
+        for (size_t i = 0; i < FILTER_MAX_PTRS; i++)
+                free(state->ptrs[i]);
+
+        free(state);
+        expr_destroy(expr);
+        return;
+}
+
+static void
+shape_densities_for(const struct shape_input_density *density,
+    double densities[FILTER_MAX_PTRS])
 {
-        const double *x = vx;
-        const double *y = vy;
 
-        if (*x == *y)
-                return 0;
+        densities[0] = 0.5;
+        for (size_t k = 1; k < FILTER_MAX_PTRS; k++)
+                densities[k] = shape_input_p(&density->density, k);
 
-        return (*x < *y) ? -1 : 1;
+        return;
 }
 
-static double
-time_fn(double offset, struct filter_state *state, bv_fn_t *fn, const char *name)
+static void
+test_shape(const struct shape_bench *shape,
+    const struct shape_input_density *density, size_t count)
 {
-        enum { num_rep = 1000 };
-        static double observations[num_rep];
-        const size_t scale = sizeof(__m256i) * state->count;
-        double ret;
+        double densities[FILTER_MAX_PTRS];
+        struct short_circuit_query *short_circuit;
+        struct filter_state *state;
+        struct expr *expr;
+        __m256i *expected, *actual;
+        size_t vec_size = sizeof(__m256i) * count;
+
+        state = setup_shape(&expr, shape, density, count);
+        actual = state->dst;
+        expected = random_vec(count);
+        state->dst = expected;
+        expr_eval(expr, state);
+        state->dst = actual;
+
+        check_query(expr, QUERY_NO_SUPERINSTRUCTIONS, state, expected);
+        check_query(expr, 0, state, expected);
 
-        for (size_t i = 0; i < num_rep; i++) {
-                uint64_t begin, end;
+        shape_densities_for(density, densities);
+        short_circuit = short_circuit_compile(expr, densities, 0);
+        assert(short_circuit != NULL);
+        memset(actual, 0, vec_size);
+        short_circuit_run(short_circuit, state);
+        assert(memcmp(actual, expected, vec_size) == 0);
+        short_circuit_destroy(short_circuit);
 
-                clear_caches();
+        free(expected);
+        destroy_shape(expr, state);
+        return;
+}
 
-                begin = ticks_begin();
-                fn(state);
-                end = ticks_end();
+static void
+test_shapes(size_t count)
+{
 
-                observations[i] = end - begin;
+        for (size_t i = 0; i < shape_suite_count; i++) {
+                for (size_t j = 0; j < shape_densities_count; j++)
+                        test_shape(&shape_suite[i], &shape_densities[j], count);
         }
 
-        qsort(observations, num_rep, sizeof(observations[0]), cmp_double);
+        return;
+}
+
+static void
+test_query(const char *src, size_t n_inputs, size_t count)
+{
+
+        test_query_flags(src, n_inputs, count, QUERY_NO_SUPERINSTRUCTIONS);
+        test_query_flags(src, n_inputs, count, 0);
+        return;
+}
+
+static void
+test_queries(size_t count)
+{
+
+        test_query("1", 1, count);
+        test_query("(not 1)", 1, count);
+        test_query("(or 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16)", 16, count);
+        test_query("(and (xor 1 (or 2 3)) (xor 4 (or 5 6 7)) (xor 8 9)"
+                   " (not (or 10 11)))", 11, count);
+        /* Deep enough to spill. */
+        test_query("(and (or (xor (and 1 2) (and 3 4)) (xor (and 5 6) (and 7 8)))"
+                   " (or (xor (and 9 10) (and 11 12))"
+                   " (xor (and 13 14) (and 15 (not (or 16 1))))))", 16, count);
+        test_query("(xor (xor (xor (xor (xor 1 (or 2 3)) (or 4 5)) 6) 7)"
+                   " (and 8 (not (xor 9 (and 10 (or 11 (not 12)))))))",
+                   12, count);
+        test_query("(and (xor 1 (or 2 3)) (xor 4 (or 5 6)) (xor 7 8)"
+                   " (not 9) (or 10 (not 11)) (not (xor 12 13)))", 13, count);
+        /* Repeated subexpressions, in various orders. */
+        test_query("(and (or 1 2) (xor 3 (or 2 1)) (or 4 (or 1 2)))", 4, count);
+        test_query("(xor (and (not (or 1 2)) 3) (or (and 3 (not (or 2 1))) 4)"
+                   " (and 1 1 (not (or 1 2))))", 4, count);
+        return;
+}
+
+/**
+ * Random bits in one block of 64 vectors out of `period`, zeros
+ * elsewhere.
+ */
+static __m256i *
+sparse_vec(size_t count, size_t period)
+{
+        __m256i *ret = random_vec(count);
+
+        for (size_t i = 0; i < count; i++) {
+                if ((i / 64) % period != 0)
+                        ret[i] = (__m256i) { 0 };
+        }
 
-	/* Report the first percentile. */
-        ret = (observations[num_rep / 100] / scale) - offset;
-        if (name != NULL)
-                printf("%32s\t%zu\t%.4f\n", name, scale, ret);
         return ret;
 }
 
+/**
+ * Short-circuiting conjunctions, with sparse inputs so that most
+ * blocks stop early.
+ */
 static void
-time_all(size_t count)
+test_short_circuit(const char *src, size_t n_inputs, size_t count)
 {
+        double densities[FILTER_MAX_PTRS];
+        struct short_circuit_query *query;
         struct filter_state *state;
-        double offset;
+        struct expr *expr;
+        __m256i *expected;
+        int r;
 
-        state = setup_empty_filter(count);
+        expr = expr_parse(src, NULL, 0);
+        assert(expr != NULL);
 
-        baseline(state);
-        blocking(state);
-        fused_blocking(state);
-        specialised_widget(state);
-        fully_specialised_widget(state);
-        threaded_inreg(state);
-        threaded_inreg_fused(state);
+        r = posix_memalign((void **)&state, 32, sizeof(*state));
+        assert(r == 0);
+        state->count = count;
+        for (size_t i = 1; i <= n_inputs; i++)
+                state->ptrs[i] = (i % 2 == 1) ? sparse_vec(count, 1 + i)
+                    : random_vec(count);
 
-        fflush(NULL);
-        fprintf(stderr, "==== n: %zu ====\n", count);
-        offset = time_fn(0, state, noop, NULL);
-        time_fn(offset, state, baseline, NULL);
-        time_fn(offset, state, baseline, "baseline");
-        time_fn(offset, state, blocking, "blocking");
-        time_fn(offset, state, fused_blocking, "fused_blocking");
-        time_fn(offset, state, specialised_widget, "specialised_widget");
-        time_fn(offset, state, fully_specialised_widget, "fully_specialised_widget");
-        time_fn(offset, state, threaded_inreg, "threaded_inreg");
-        time_fn(offset, state, threaded_inreg_fused, "threaded_inreg_fused");
-        time_fn(offset, state, wired_inreg_fused, "wired_inreg_fused");
+        expected = random_vec(count);
+        state->dst = expected;
+        expr_eval(expr, state);
+        state->dst = random_vec(count);
 
-        destroy(state);
+        filter_state_sample_densities(state, n_inputs + 1, 7, densities);
+        query = short_circuit_compile(expr, densities, 0);
+        assert(query != NULL);
+        assert(short_circuit_n_conjuncts(query) ==
+            ((expr->kind == EXPR_AND) ? expr->n_args : 1));
+        short_circuit_run(query, state);
+        assert(memcmp(state->dst, expected, sizeof(__m256i) * count) == 0);
+        short_circuit_destroy(query);
+
+        /* Default densities must give the same result, in another order. */
+        memset(state->dst, 0xff, sizeof(__m256i) * count);
+        query = short_circuit_compile(expr, NULL, 0);
+        assert(query != NULL);
+        short_circuit_run(query, state);
+        assert(memcmp(state->dst, expected, sizeof(__m256i) * count) == 0);
+        short_circuit_destroy(query);
+
+        for (size_t i = 0; i <= n_inputs; i++)
+                free(state->ptrs[i]);
+        free(expected);
+        free(state);
+        expr_destroy(expr);
         return;
 }
 
-int
-main()
+static void
+test_short_circuits(size_t count)
+{
+
+        test_short_circuit("(and 1 2 (or 3 4) (not 5))", 5, count);
+        test_short_circuit("(and (xor 2 (or 4 6)) (not (or 1 2)) 3)", 6, count);
+        test_short_circuit("(or 1 2)", 2, count);
+        test_short_circuit("(and (and 5 4) (xor 1 3) (not (and 2 3)) 1)", 5, count);
+        return;
+}
+
+/**
+ * Chunk-structured test inputs for roaring bitmaps: `kind` 0 is a
+ * few scattered bits per chunk, 1 long runs, 2 all ones or zeros by
+ * chunk, and 3 random dense bits.  Every third chunk is empty.
+ */
+static __m256i *
+roaring_test_vec(size_t count, unsigned kind)
+{
+        __m256i *ret = random_vec(count);
+        uint64_t *words = (uint64_t *)ret;
+
+        if (kind == 3)
+                return ret;
+
+        memset(ret, 0, count * sizeof(__m256i));
+        for (size_t chunk = 0; chunk * ROARING_CHUNK_VECS < count; chunk++) {
+                size_t base = chunk * ROARING_CHUNK_BITS;
+                size_t n_bits = 256 * count - base;
+
+                if (n_bits > ROARING_CHUNK_BITS)
+                        n_bits = ROARING_CHUNK_BITS;
+
+                if (chunk % 3 == 2)
+                        continue;
+
+                for (size_t i = 0; i < n_bits; i++) {
+                        bool set;
+
+                        switch (kind) {
+                        case 0:
+                                set = (i * 2654435761u) % 1021 == chunk % 7;
+                                break;
+                        case 1:
+                                set = (i / 3000) % 3 == chunk % 3;
+                                break;
+                        default:
+                                set = chunk % 2 == 0;
+                                break;
+                        }
+
+                        if (set)
+                                words[(base + i) / 64] |= 1ULL << (i % 64);
+                }
+        }
+
+        return ret;
+}
+
+static struct query_program *roaring_program;
+
+static void
+roaring_compiled(struct filter_state *state)
+{
+
+        query_run(roaring_program, state);
+        return;
+}
+
+static void
+test_roaring_query(const char *src, filter_fn_t *fn, size_t count)
+{
+        /* dst, then x0 .. neg_y. */
+        static const unsigned kinds[] = { 3, 0, 1, 2, 3, 0 };
+        enum { n_ptrs = sizeof(kinds) / sizeof(kinds[0]) };
+        const struct roaring_bitmap *inputs[n_ptrs] = { NULL };
+        struct filter_state *state;
+        struct expr *expr;
+        __m256i *actual;
+        int r;
+
+        expr = expr_parse(src, toy_names,
+            sizeof(toy_names) / sizeof(toy_names[0]));
+        assert(expr != NULL);
+        roaring_program = query_compile(expr, 0);
+        assert(roaring_program != NULL);
+
+        r = posix_memalign((void **)&state, 32, sizeof(*state));
+        assert(r == 0);
+        state->count = count;
+        for (size_t i = 1; i < n_ptrs; i++) {
+                state->ptrs[i] = roaring_test_vec(count, kinds[i]);
+                inputs[i] = roaring_from_dense(state->ptrs[i], count);
+        }
+
+        /* Everything but random bits compresses. */
+        for (size_t i = 1; i < n_ptrs && count >= ROARING_CHUNK_VECS; i++) {
+                if (kinds[i] != 3)
+                        assert(roaring_size(inputs[i]) < count * sizeof(__m256i) / 8);
+        }
+
+        state->dst = random_vec(count);
+        expr_eval(expr, state);
+        actual = random_vec(count);
+        roaring_run((fn != NULL) ? fn : roaring_compiled, expr, actual,
+            inputs, n_ptrs);
+        assert(memcmp(actual, state->dst, count * sizeof(__m256i)) == 0);
+
+        for (size_t i = 0; i < n_ptrs; i++) {
+                roaring_destroy((struct roaring_bitmap *)inputs[i]);
+                free(state->ptrs[i]);
+        }
+
+        free(actual);
+        free(state);
+        query_program_destroy(roaring_program);
+        expr_destroy(expr);
+        return;
+}
+
+/**
+ * Round-trip the sample query's inputs through a segment file, both
+ * dense and compressed, and evaluate them straight from the mapping.
+ */
+/**
+ * Swaps the first two positions or runs of the first `kind` container
+ * with at least two in bitmap `index` of the segment at `path`.
+ */
+static void
+unsort_container(const char *path, size_t index, enum roaring_kind kind)
+{
+        struct segment_entry entry;
+        struct segment_chunk chunk;
+        uint8_t elems[2 * sizeof(struct roaring_run)];
+        uint8_t tmp[sizeof(struct roaring_run)];
+        size_t size = (kind == ROARING_ARRAY) ? sizeof(uint16_t)
+            : sizeof(struct roaring_run);
+        int fd, r;
+
+        fd = open(path, O_RDWR);
+        assert(fd >= 0);
+        r = pread(fd, &entry, sizeof(entry), sizeof(struct segment_header) +
+            index * sizeof(entry));
+        assert(r == sizeof(entry) && entry.kind == SEGMENT_ROARING);
+
+        for (size_t i = 0;; i++) {
+                r = pread(fd, &chunk, sizeof(chunk),
+                    entry.offset + i * sizeof(chunk));
+                assert(r == sizeof(chunk) && (i + 1) * sizeof(chunk) <= entry.size);
+                if (chunk.kind == kind && chunk.n >= 2)
+                        break;
+        }
+
+        r = pread(fd, elems, 2 * size, entry.offset + chunk.offset);
+        assert(r == (int)(2 * size));
+        memcpy(tmp, elems, size);
+        memcpy(elems, elems + size, size);
+        memcpy(elems + size, tmp, size);
+        r = pwrite(fd, elems, 2 * size, entry.offset + chunk.offset);
+        assert(r == (int)(2 * size));
+        close(fd);
+        return;
+}
+
+static void
+test_segment(size_t count)
 {
+        static const unsigned kinds[] = { 3, 0, 1, 2, 3, 0 };
+        enum { n_ptrs = sizeof(kinds) / sizeof(kinds[0]) };
+        struct segment_input files[2 * (n_ptrs - 1)];
+        const struct roaring_bitmap *inputs[n_ptrs] = { NULL };
+        struct roaring_bitmap *compressed[n_ptrs] = { NULL };
+        struct filter_state *state, *mapped;
+        struct segment *segment;
+        char path[] = "/tmp/validate-segment-XXXXXX";
+        __m256i *actual;
+        int fd, r;
+
+        fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+
+        r = posix_memalign((void **)&state, 32, sizeof(*state));
+        assert(r == 0);
+        r = posix_memalign((void **)&mapped, 32, sizeof(*mapped));
+        assert(r == 0);
+        state->count = mapped->count = count;
+        for (size_t i = 1; i < n_ptrs; i++) {
+                state->ptrs[i] = roaring_test_vec(count, kinds[i]);
+                compressed[i] = roaring_from_dense(state->ptrs[i], count);
+                files[i - 1] = (struct segment_input) {
+                        .dense = state->ptrs[i],
+                };
+                files[n_ptrs - 1 + i - 1] = (struct segment_input) {
+                        .roaring = compressed[i],
+                };
+        }
+
+        r = segment_write(path, files, 2 * (n_ptrs - 1), count);
+        assert(r == 0);
+        segment = segment_open(path);
+        assert(segment != NULL);
+        assert(segment_count(segment) == count);
+        assert(segment_n_bitmaps(segment) == 2 * (n_ptrs - 1));
+
+        state->dst = random_vec(count);
+        baseline(state);
+
+        mapped->dst = actual = random_vec(count);
+        for (size_t i = 1; i < n_ptrs; i++) {
+                assert(segment_kind(segment, i - 1) == SEGMENT_DENSE);
+                mapped->ptrs[i] = (__m256i *)segment_dense(segment, i - 1);
+                assert(((uintptr_t)mapped->ptrs[i] % SEGMENT_ALIGN) == 0);
+                assert(segment_roaring(segment, i - 1) == NULL);
+        }
+
+        fused_blocking(mapped);
+        assert(memcmp(actual, state->dst, count * sizeof(__m256i)) == 0);
+
+        for (size_t i = 1; i < n_ptrs; i++) {
+                inputs[i] = segment_roaring(segment, n_ptrs - 1 + i - 1);
+                assert(inputs[i] != NULL);
+                assert(segment_dense(segment, n_ptrs - 1 + i - 1) == NULL);
+        }
+
+        memset(actual, 0, count * sizeof(__m256i));
+        roaring_run(fused_blocking, toy_expr, actual, inputs, n_ptrs);
+        assert(memcmp(actual, state->dst, count * sizeof(__m256i)) == 0);
+        segment_close(segment);
+
+        /* Unsorted containers from a crafted file fail to open. */
+        unsort_container(path, n_ptrs - 1, ROARING_ARRAY);
+        assert(segment_open(path) == NULL);
+        r = segment_write(path, files, 2 * (n_ptrs - 1), count);
+        assert(r == 0);
+        unsort_container(path, n_ptrs, ROARING_RUN);
+        assert(segment_open(path) == NULL);
+        r = segment_write(path, files, 2 * (n_ptrs - 1), count);
+        assert(r == 0);
+
+        /* Counts that overflow, or aren't a multiple of BLOCK_SIZE. */
+        for (size_t i = 0; i < 2; i++) {
+                uint64_t bad = (i == 0) ? (1ULL << 59) : count + 1;
+
+                fd = open(path, O_WRONLY);
+                assert(fd >= 0);
+                r = pwrite(fd, &bad, sizeof(bad),
+                    offsetof(struct segment_header, count));
+                assert(r == sizeof(bad));
+                close(fd);
+                assert(segment_open(path) == NULL);
+        }
+
+        /* Not a segment. */
+        fd = open(path, O_WRONLY | O_TRUNC);
+        assert(fd >= 0);
+        r = write(fd, state->dst, sizeof(struct segment_header));
+        assert(r == sizeof(struct segment_header));
+        close(fd);
+        assert(segment_open(path) == NULL);
+        unlink(path);
+        assert(segment_open(path) == NULL);
+
+        for (size_t i = 0; i < n_ptrs; i++) {
+                roaring_destroy(compressed[i]);
+                free(state->ptrs[i]);
+        }
+
+        free(actual);
+        free(mapped);
+        free(state);
+        return;
+}
+
+static void
+assert_roaring_equal(const struct roaring_bitmap *x,
+    const struct roaring_bitmap *y)
+{
+
+        assert(x->count == y->count && x->n_chunks == y->n_chunks);
+        for (size_t i = 0; i < x->n_chunks; i++) {
+                const struct roaring_container *a = &x->chunks[i];
+                const struct roaring_container *b = &y->chunks[i];
+
+                assert(a->kind == b->kind && a->n == b->n);
+                switch (a->kind) {
+                case ROARING_EMPTY:
+                        break;
+                case ROARING_ARRAY:
+                        assert(memcmp(a->positions, b->positions,
+                            a->n * sizeof(a->positions[0])) == 0);
+                        break;
+                case ROARING_RUN:
+                        assert(memcmp(a->runs, b->runs,
+                            a->n * sizeof(a->runs[0])) == 0);
+                        break;
+                case ROARING_DENSE:
+                        assert(memcmp(a->bits, b->bits,
+                            ROARING_CHUNK_VECS * sizeof(__m256i)) == 0);
+                        break;
+                }
+        }
+
+        return;
+}
+
+enum { chunk_bits = ROARING_CHUNK_BITS };
+
+/* Sorted by start, each list ends with a zero `last`. */
+static const struct roaring_interval interval_cases[][6] = {
+        { { 0, 16383 } },
+        { { 0, chunk_bits + 4464 }, { 10, 20 } },
+        {
+                { 5, 2 * chunk_bits + 100 },
+                { chunk_bits - 10, chunk_bits + 10 },
+                { chunk_bits + 50, chunk_bits + 60 },
+                { 2 * chunk_bits + 50, 2 * chunk_bits + 300 },
+        },
+        {
+                { chunk_bits - 1, chunk_bits },
+                { chunk_bits - 1, chunk_bits - 1 },
+                { chunk_bits, 3 * chunk_bits },
+                { chunk_bits + 5, chunk_bits + 6 },
+                { 2 * chunk_bits + 7, 3 * chunk_bits + 9 },
+        },
+};
+
+static const size_t n_interval_cases =
+    sizeof(interval_cases) / sizeof(interval_cases[0]);
+
+/**
+ * Builds the same bits from positions and from runs, and checks that
+ * both match the encoding of the dense bitmap.
+ */
+static void
+test_roaring_constructors(size_t count)
+{
+        uint64_t *positions = calloc(256 * count + 1, sizeof(uint64_t));
+        struct roaring_interval *runs = calloc(256 * count + 1, sizeof(runs[0]));
+
+        assert(positions != NULL && runs != NULL);
+        for (unsigned kind = 0; kind < 4; kind++) {
+                __m256i *vecs = roaring_test_vec(count, kind);
+                const uint64_t *words = (const uint64_t *)vecs;
+                struct roaring_bitmap *dense, *from_positions, *from_runs;
+                size_t n_positions = 0, n_runs = 0;
+
+                for (size_t bit = 0; bit < 256 * count; bit++) {
+                        if (((words[bit / 64] >> (bit % 64)) & 1) == 0)
+                                continue;
+
+                        positions[n_positions++] = bit;
+                        /* Split runs, with an overlap, every 1000 bits. */
+                        if (n_runs > 0 && runs[n_runs - 1].last + 1 == bit &&
+                            bit % 1000 != 0) {
+                                runs[n_runs - 1].last = bit;
+                        } else {
+                                runs[n_runs++] = (struct roaring_interval) {
+                                        .start = (bit % 1000 == 0 && bit > 0 &&
+                                            runs[n_runs - 1].last + 1 == bit)
+                                            ? bit - 1 : bit,
+                                        .last = bit,
+                                };
+                        }
+                }
+
+                /* Duplicate positions are fine. */
+                if (n_positions > 0) {
+                        positions[n_positions] = positions[n_positions - 1];
+                        n_positions++;
+                }
+
+                dense = roaring_from_dense(vecs, count);
+                from_positions = roaring_from_positions(positions, n_positions,
+                    count);
+                from_runs = roaring_from_runs(runs, n_runs, count);
+                assert_roaring_equal(dense, from_positions);
+                assert_roaring_equal(dense, from_runs);
+                roaring_destroy(dense);
+                roaring_destroy(from_positions);
+                roaring_destroy(from_runs);
+                free(vecs);
+        }
+
+        /* Overlapping and nested intervals, across chunks. */
+        for (size_t i = 0; i < n_interval_cases; i++) {
+                const struct roaring_interval *intervals = interval_cases[i];
+                size_t n = 0;
+                __m256i *vecs = random_vec(count);
+                uint64_t *words = (uint64_t *)vecs;
+                struct roaring_bitmap *dense, *from_runs;
+
+                memset(vecs, 0, count * sizeof(__m256i));
+                for (; intervals[n].last != 0; n++) {
+                        if (intervals[n].last >= 256 * count)
+                                break;
+
+                        for (uint64_t bit = intervals[n].start;
+                             bit <= intervals[n].last; bit++)
+                                words[bit / 64] |= 1ULL << (bit % 64);
+                }
+
+                /* Only cases that fit entirely. */
+                if (intervals[n].last == 0) {
+                        dense = roaring_from_dense(vecs, count);
+                        from_runs = roaring_from_runs(intervals, n, count);
+                        assert_roaring_equal(dense, from_runs);
+                        roaring_destroy(dense);
+                        roaring_destroy(from_runs);
+                }
+
+                free(vecs);
+        }
+
+        free(runs);
+        free(positions);
+        return;
+}
+
+static void
+test_roaring(size_t count)
+{
+
+        test_roaring_constructors(count);
+        test_roaring_query(toy_query, blocking, count);
+        test_roaring_query(toy_query, fused_blocking, count);
+        test_roaring_query(toy_query, NULL, count);
+        test_roaring_query("(and x0 (or x1 neg_x) (not y0))", NULL, count);
+        test_roaring_query("(or (and x0 neg_y) (xor x1 neg_x))", NULL, count);
+        test_roaring_query("(not (or x0 x1 neg_x))", NULL, count);
+        return;
+}
+
+static size_t
+count_insns(const char *src, unsigned flags)
+{
+        struct expr *expr = expr_parse(src, NULL, 0);
+        struct query_program *program;
+        size_t ret;
+
+        assert(expr != NULL);
+        program = query_compile(expr, flags);
+        assert(program != NULL);
+        ret = program->n_insns;
+        query_program_destroy(program);
+        expr_destroy(expr);
+        return ret;
+}
+
+/**
+ * Check that repeated terms are computed once, and compile a batch of
+ * queries with shared terms into one program.
+ */
+static void
+test_cse(size_t count)
+{
+        static const char *const srcs[] = {
+                "(and (or 1 2) (xor 3 4))",
+                "(or (xor 4 3) (not (or 2 1)))",
+                "(and (xor 3 4) (or 1 2) 5)",
+        };
+        static const char shared[] = "(and (or 1 2) (xor 3 (or 2 1)) (or 4 (or 1 2)))";
+        enum { n_queries = sizeof(srcs) / sizeof(srcs[0]), n_inputs = 5 };
+        const struct expr *exprs[n_queries];
+        size_t dsts[n_queries];
+        __m256i *expected[n_queries];
+        struct filter_state *state;
+        struct query_program *program;
+        struct stitched_query *stitched;
+        int r;
+
+        /* (or 1 2) is load, load, or once, then spill and two fills. */
+        assert(count_insns(shared, QUERY_NO_SUPERINSTRUCTIONS) + 3 ==
+            count_insns(shared, QUERY_NO_SUPERINSTRUCTIONS | QUERY_NO_CSE));
+
+        r = posix_memalign((void **)&state, 32, sizeof(*state));
+        assert(r == 0);
+        state->count = count;
+        for (size_t i = 1; i <= n_inputs; i++)
+                state->ptrs[i] = random_vec(count);
+
+        for (size_t i = 0; i < n_queries; i++) {
+                struct expr *expr = expr_parse(srcs[i], NULL, 0);
+
+                assert(expr != NULL);
+                exprs[i] = expr;
+                dsts[i] = n_inputs + 1 + i;
+                expected[i] = random_vec(count);
+                state->dst = expected[i];
+                expr_eval(expr, state);
+                state->ptrs[dsts[i]] = random_vec(count);
+        }
+
+        program = query_compile_batch(exprs, dsts, n_queries, 0);
+        assert(program != NULL);
+        query_run(program, state);
+        for (size_t i = 0; i < n_queries; i++) {
+                assert(memcmp(state->ptrs[dsts[i]], expected[i],
+                    sizeof(__m256i) * count) == 0);
+                memset(state->ptrs[dsts[i]], 0, sizeof(__m256i) * count);
+        }
+
+        stitched = stitch_query(program);
+        assert(stitched != NULL);
+        stitch_run(stitched, state);
+        for (size_t i = 0; i < n_queries; i++) {
+                assert(memcmp(state->ptrs[dsts[i]], expected[i],
+                    sizeof(__m256i) * count) == 0);
+                free(state->ptrs[dsts[i]]);
+                free(expected[i]);
+                expr_destroy((struct expr *)exprs[i]);
+        }
+
+        stitched_query_destroy(stitched);
+        query_program_destroy(program);
+        for (size_t i = 1; i <= n_inputs; i++)
+                free(state->ptrs[i]);
+        free(state);
+        return;
+}
+
+/**
+ * Evaluate `src` over the sample query's inputs through `cache`, and
+ * compare with the reference evaluator.
+ */
+static void
+test_cached(struct query_cache *cache, const char *src, size_t count)
+{
+        size_t vec_size = sizeof(__m256i) * count;
+        struct filter_state *state;
+        struct query_plan plan;
+        struct expr *expr;
+        __m256i *expected;
+        bool ok;
+        int r;
+
+        expr = expr_parse(src, toy_names,
+            sizeof(toy_names) / sizeof(toy_names[0]));
+        assert(expr != NULL);
+        ok = query_cache_lookup(cache, expr, &plan);
+        assert(ok);
+
+        r = posix_memalign((void **)&state, 32, sizeof(*state));
+        assert(r == 0);
+        state->count = count;
+        for (size_t i = 0; i < 6; i++)
+                state->ptrs[i] = random_vec(count);
+
+        query_plan_run(&plan, state);
+        expected = state->dst;
+        state->dst = random_vec(count);
+        expr_eval(expr, state);
+        assert(memcmp(state->dst, expected, vec_size) == 0);
+
+        free(expected);
+        for (size_t i = 0; i < 6; i++)
+                free(state->ptrs[i]);
+        free(state);
+        expr_destroy(expr);
+        return;
+}
+
+/**
+ * Distinct queries over shared inputs 1 .. 13, each with its own
+ * destination, in one shared scan.
+ */
+static void
+test_shared_scan(size_t count)
+{
+        static const char *const srcs[] = {
+                "(and (xor 1 (or 2 3)) (xor 4 5))",
+                "(or 1 2 3 4 5 6 7 8 9 10 11 12 13)",
+                "(and 3 (not 7))",
+                "(xor (and 1 13) (or 2 (not 12)))",
+                "(and (or (xor (and 1 2) (and 3 4)) (xor (and 5 6) (and 7 8)))"
+                " (or (xor (and 9 10) (and 11 12))"
+                " (xor (and 13 1) (and 2 (not (or 3 4))))))",
+        };
+        enum { n_queries = sizeof(srcs) / sizeof(srcs[0]), n_inputs = 13 };
+        struct shared_scan_query queries[n_queries];
+        struct query_program *programs[n_queries];
+        struct filter_state *states[n_queries];
+        __m256i *expected[n_queries];
+        __m256i *inputs[n_inputs + 1];
+
+        for (size_t i = 1; i <= n_inputs; i++)
+                inputs[i] = random_vec(count);
+
+        for (size_t i = 0; i < n_queries; i++) {
+                struct expr *expr = expr_parse(srcs[i], NULL, 0);
+                int r;
+
+                assert(expr != NULL);
+                programs[i] = query_compile(expr, 0);
+                assert(programs[i] != NULL);
+
+                r = posix_memalign((void **)&states[i], 32, sizeof(*states[i]));
+                assert(r == 0);
+                states[i]->count = count;
+                for (size_t j = 1; j <= n_inputs; j++)
+                        states[i]->ptrs[j] = inputs[j];
+
+                expected[i] = random_vec(count);
+                states[i]->dst = expected[i];
+                expr_eval(expr, states[i]);
+                states[i]->dst = random_vec(count);
+                expr_destroy(expr);
+
+                queries[i] = (struct shared_scan_query) {
+                        .program = programs[i],
+                        .state = states[i],
+                };
+        }
+
+        shared_scan_run(queries, n_queries);
+        for (size_t i = 0; i < n_queries; i++) {
+                assert(memcmp(states[i]->dst, expected[i],
+                    sizeof(__m256i) * count) == 0);
+                free(states[i]->dst);
+                free(states[i]);
+                free(expected[i]);
+                query_program_destroy(programs[i]);
+        }
+
+        for (size_t i = 1; i <= n_inputs; i++)
+                free(inputs[i]);
+        return;
+}
+
+static void
+test_cache(size_t count)
+{
+        struct query_cache *cache;
+        struct query_cache_stats stats;
+
+        cache = query_cache_create(2, 0, QUERY_CACHE_STITCH);
+        test_cached(cache, "(and (xor neg_x (or x0 x1)) (xor neg_y y0))", count);
+        test_cached(cache, "(and (xor y0 neg_y) (xor (or x1 x0) neg_x))", count);
+        test_cached(cache, "(and (xor x0 (or y0 neg_y)) (xor x1 neg_x))", count);
+        test_cached(cache, "(and (and (xor neg_x (or x0 (or x1 x1))))"
+                    " (not (not (xor neg_y y0))))", count);
+        stats = query_cache_stats(cache);
+        assert(stats.misses == 1 && stats.hits == 3);
+
+        test_cached(cache, "(or x0 (or x1 y0))", count);
+        test_cached(cache, "(or (or neg_y x0) x1)", count);
+        test_cached(cache, "(and x0 (not x1))", count);
+        stats = query_cache_stats(cache);
+        assert(stats.misses == 3 && stats.hits == 4 && stats.evictions == 1);
+
+        /* Same spelling over other inputs, then a new spelling. */
+        test_cached(cache, "(and y0 (not x0))", count);
+        test_cached(cache, "(and (not neg_x) y0)", count);
+        test_cached(cache, "(and x0 (not x1))", count);
+        stats = query_cache_stats(cache);
+        assert(stats.misses == 3 && stats.hits == 7);
+
+        /* Evicted shapes take their spellings with them. */
+        test_cached(cache, "(xor x0 x1)", count);
+        test_cached(cache, "(or x0 (or x1 y0))", count);
+        stats = query_cache_stats(cache);
+        assert(stats.misses == 5 && stats.hits == 7 && stats.evictions == 3);
+
+        query_cache_destroy(cache);
+        return;
+}
+
+/**
+ * Run the parallel methods on pools of a few sizes, even if we only
+ * have one CPU.
+ */
+static void
+test_pool(size_t count)
+{
+        static const size_t sizes[] = { 1, 2, 3, 8 };
+        struct filter_pool *saved = toy_pool;
+        struct vecs vecs;
+
+        for (size_t i = 0; i < 6; i++)
+                vecs.vecs[i] = random_vec(count);
+
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                toy_pool = filter_pool_create(sizes[i]);
+                assert(filter_pool_size(toy_pool) == sizes[i]);
+                assert(compare(baseline, baseline_parallel, count, vecs) == 0);
+                assert(compare(baseline, fused_blocking_parallel, count, vecs) == 0);
+                filter_pool_destroy(toy_pool);
+        }
+
+        toy_pool = saved;
+        for (size_t i = 0; i < 6; i++)
+                free(vecs.vecs[i]);
+        return;
+}
+
+/**
+ * A batch of toy queries of varied sizes, split between two
+ * evaluators, against serial baseline results.
+ */
+static void
+test_batch(size_t n_threads)
+{
+        static const size_t counts[] = {
+                16, 1024 * 1024, 32, 4096, 0, 48, 300 * 1024, 16, 64 * 1024,
+        };
+        enum { n_jobs = sizeof(counts) / sizeof(counts[0]) };
+        bv_fn_t *const fns[] = { fused_blocking, threaded_inreg_fused };
+        struct filter_pool *pool = filter_pool_create(n_threads);
+        struct filter_state *expected[n_jobs], *actual[n_jobs];
+        struct filter_job jobs[n_jobs];
+
+        for (size_t i = 0; i < n_jobs; i++) {
+                struct vecs vecs;
+
+                for (size_t j = 0; j < 6; j++)
+                        vecs.vecs[j] = random_vec(counts[i]);
+
+                expected[i] = filter(baseline, counts[i], vecs);
+                actual[i] = filter(noop, counts[i], vecs);
+                jobs[i] = (struct filter_job) {
+                        .fn = fns[i % 2],
+                        .state = actual[i],
+                };
+
+                for (size_t j = 0; j < 6; j++)
+                        free(vecs.vecs[j]);
+        }
+
+        filter_pool_run_batch(pool, jobs, n_jobs);
+        for (size_t i = 0; i < n_jobs; i++) {
+                assert(memcmp(actual[i]->dst, expected[i]->dst,
+                    sizeof(__m256i) * counts[i]) == 0);
+                release(actual[i]);
+                release(expected[i]);
+        }
+
+        filter_pool_destroy(pool);
+        return;
+}
+
+static uint64_t
+popcount_vecs(const __m256i *vecs, size_t count)
+{
+        const uint64_t *words = (const uint64_t *)vecs;
+        uint64_t ret = 0;
+
+        for (size_t i = 0; i < 4 * count; i++)
+                ret += __builtin_popcountll(words[i]);
+
+        return ret;
+}
+
+static __attribute__((target("avx2"))) void
+test_popcount(void)
+{
+        __m256i *block = random_vec(16);
+        struct popcount_acc acc = popcount_acc_init();
+        uint64_t expected = popcount_vecs(block, 16);
+
+        for (size_t i = 0; i < 16; i++) {
+                assert(popcount_hsum(popcount_lanes_pshufb(block[i])) ==
+                    popcount_vecs(&block[i], 1));
+                assert(popcount_hsum(popcount_lanes(block[i])) ==
+                    popcount_vecs(&block[i], 1));
+        }
+
+        /* Twice, so the residues carry over. */
+        popcount_harley_seal16(&acc, block);
+        popcount_harley_seal16(&acc, block);
+        assert(popcount_acc_sum(&acc) == 2 * expected);
+
+        memset(block, 0xff, 16 * sizeof(__m256i));
+        popcount_harley_seal16(&acc, block);
+        assert(popcount_acc_sum(&acc) == 2 * expected + 16 * 256);
+        free(block);
+        return;
+}
+
+/**
+ * Count-only methods must match the popcount of baseline's result,
+ * without a `dst`.
+ */
+static void
+test_counts(size_t count)
+{
+        static bv_fn_t *const fns[] = {
+                baseline_count,
+                fused_blocking_count,
+                threaded_inreg_fused_count,
+                wired_inreg_fused_count,
+        };
+        struct filter_state *state;
+        struct vecs vecs;
+        __m256i *dst;
+        uint64_t expected;
+
+        for (size_t i = 0; i < 6; i++)
+                vecs.vecs[i] = random_vec(count);
+
+        state = filter(baseline, count, vecs);
+        expected = popcount_vecs(state->dst, count);
+        dst = state->dst;
+        state->dst = NULL;
+        for (size_t i = 0; i < sizeof(fns) / sizeof(fns[0]); i++) {
+                state->popcount = ~0ULL;
+                fns[i](state);
+                assert(state->popcount == expected);
+        }
+
+        state->dst = dst;
+        release(state);
+        for (size_t i = 0; i < 6; i++)
+                free(vecs.vecs[i]);
+        return;
+}
+
+struct index_list {
+        size_t n;
+        size_t capacity;
+        uint32_t *indices;
+};
+
+static void
+append_indices(void *ctx, const uint32_t *indices, size_t n)
+{
+        struct index_list *list = ctx;
+
+        assert(n > 0 && n <= FILTER_SINK_CAPACITY);
+        if (list->n + n > list->capacity) {
+                list->capacity = 2 * (list->n + n);
+                list->indices = realloc(list->indices,
+                    list->capacity * sizeof(list->indices[0]));
+                assert(list->indices != NULL);
+        }
+
+        memcpy(list->indices + list->n, indices, n * sizeof(indices[0]));
+        list->n += n;
+        return;
+}
+
+/**
+ * The emitted indices must be exactly the set bits of baseline's
+ * `dst`, in order.
+ */
+static void
+check_sink(const struct index_list *list, const __m256i *dst, size_t count)
+{
+        const uint64_t *words = (const uint64_t *)dst;
+        size_t n = 0;
+
+        for (size_t bit = 0; bit < 256 * count; bit++) {
+                if (!((words[bit / 64] >> (bit % 64)) & 1))
+                        continue;
+
+                assert(n < list->n && list->indices[n] == bit);
+                n++;
+        }
+
+        assert(n == list->n);
+        return;
+}
+
+/**
+ * Two standing queries on shared inputs must match a full evaluation
+ * after every batch of updates, while only re-evaluating the blocks
+ * that changed.
+ */
+static void
+test_incremental(size_t count)
+{
+        struct tracked_bitmap *inputs[FILTER_MAX_PTRS] = { NULL };
+        struct standing_query *fused, *stitched;
+        struct filter_state *expected;
+        struct vecs vecs;
+        size_t vec_bits = 8 * sizeof(__m256i);
+        size_t n_blocks = count / BLOCK_SIZE;
+
+        for (size_t i = 0; i < 6; i++)
+                vecs.vecs[i] = random_vec(count);
+        for (size_t i = 1; i < 6; i++)
+                inputs[i] = tracked_bitmap_create(vecs.vecs[i], count);
+
+        fused = standing_query_create(fused_blocking, inputs);
+        stitched = standing_query_create(stitched_fused, inputs);
+        assert(standing_query_count(fused) == count);
+
+        for (size_t round = 0; round < 4; round++) {
+                size_t dirty = 0;
+
+                expected = filter(baseline, count, vecs);
+                assert(memcmp(standing_query_result(fused), expected->dst,
+                    count * sizeof(__m256i)) == 0);
+                assert(memcmp(standing_query_result(stitched), expected->dst,
+                    count * sizeof(__m256i)) == 0);
+                assert(standing_query_popcount(fused) ==
+                    popcount_vecs(expected->dst, count));
+                assert(standing_query_popcount(stitched) ==
+                    popcount_vecs(expected->dst, count));
+                release(expected);
+
+                if (round == 3)
+                        break;
+
+                /* A bit in the first and last blocks, and a run of vectors. */
+                tracked_bitmap_set_bit(inputs[1], random() % vec_bits,
+                    random() % 2);
+                tracked_bitmap_set_bit(inputs[4],
+                    (count - 1) * vec_bits + random() % vec_bits, random() % 2);
+                dirty = (n_blocks > 1) ? 2 : 1;
+                if (round > 0 && n_blocks > 3) {
+                        __m256i *neg_x = tracked_bitmap_vecs(inputs[3]);
+
+                        for (size_t i = BLOCK_SIZE; i < 3 * BLOCK_SIZE; i++)
+                                neg_x[i] = ~neg_x[i];
+                        tracked_bitmap_touch(inputs[3], BLOCK_SIZE, 3 * BLOCK_SIZE);
+                        dirty += 2;
+                }
+
+                assert(standing_query_refresh(fused) == dirty);
+                assert(standing_query_refresh(stitched) == dirty);
+                assert(standing_query_refresh(fused) == 0);
+        }
+
+        standing_query_destroy(fused);
+        standing_query_destroy(stitched);
+        for (size_t i = 1; i < 6; i++)
+                tracked_bitmap_destroy(inputs[i]);
+        for (size_t i = 0; i < 6; i++)
+                free(vecs.vecs[i]);
+        return;
+}
+
+/**
+ * Evaluates `src` through `cache`, and compares with the reference
+ * evaluator.  Returns the number of results substituted.
+ */
+static size_t
+check_rewrite(struct subexpr_cache *cache, const char *src,
+    struct filter_state *state, struct tracked_bitmap *const *inputs)
+{
+        size_t vec_size = sizeof(__m256i) * state->count;
+        struct query_program *program;
+        struct expr *expr, *rewritten;
+        __m256i *expected, *actual;
+        size_t ret = 0;
+
+        expr = expr_parse(src, toy_names,
+            sizeof(toy_names) / sizeof(toy_names[0]));
+        assert(expr != NULL);
+        expected = random_vec(state->count);
+        actual = random_vec(state->count);
+        state->dst = expected;
+        expr_eval(expr, state);
+
+        rewritten = subexpr_cache_rewrite(cache, expr, state, inputs);
+        state->dst = actual;
+        program = query_compile(rewritten, 0);
+        assert(program != NULL);
+        query_run(program, state);
+        assert(memcmp(actual, expected, vec_size) == 0);
+
+        for (size_t i = 6; i < FILTER_MAX_PTRS; i++) {
+                ret += (state->ptrs[i] != NULL);
+                state->ptrs[i] = NULL;
+        }
+
+        query_program_destroy(program);
+        expr_destroy(rewritten);
+        expr_destroy(expr);
+        free(expected);
+        free(actual);
+        return ret;
+}
+
+static void
+test_subexpr_cache(size_t count)
+{
+        static const char *const srcs[] = {
+                "(and (xor neg_x (or x0 x1)) y0)",
+                "(and (xor neg_x (or x0 x1)) (not neg_y))",
+                "(or (xor neg_x (or x0 x1)) (xor neg_y y0))",
+        };
+        size_t n_srcs = sizeof(srcs) / sizeof(srcs[0]);
+        size_t vec_size = sizeof(__m256i) * count;
+        struct tracked_bitmap *inputs[FILTER_MAX_PTRS] = { NULL };
+        struct subexpr_cache_stats stats;
+        struct subexpr_cache *cache;
+        struct filter_state *state;
+        int r;
+
+        r = posix_memalign((void **)&state, 64, sizeof(*state));
+        assert(r == 0);
+        memset(state, 0, sizeof(*state));
+        state->count = count;
+        for (size_t i = 1; i < 6; i++) {
+                state->ptrs[i] = random_vec(count);
+                inputs[i] = tracked_bitmap_create(state->ptrs[i], count);
+        }
+
+        /* The shared subexpression is materialised on its second use. */
+        cache = subexpr_cache_create(4 * vec_size, 2);
+        assert(check_rewrite(cache, srcs[0], state, inputs) == 0);
+        for (size_t i = 1; i < n_srcs; i++)
+                assert(check_rewrite(cache, srcs[i], state, inputs) == 1);
+
+        stats = subexpr_cache_stats(cache);
+        assert(stats.materialisations == 1);
+        assert(stats.hits == 1);
+        assert(subexpr_cache_size(cache) == vec_size);
+
+        /* Results follow their inputs' versions. */
+        for (size_t i = 0; i < count; i++)
+                state->ptrs[1][i] = ~state->ptrs[1][i];
+        tracked_bitmap_touch(inputs[1], 0, count);
+        assert(check_rewrite(cache, "(and (xor neg_x (or x0 x1)) neg_y)",
+            state, inputs) == 1);
+        assert(check_rewrite(cache, "(or (xor neg_x (or x0 x1)) y0)",
+            state, inputs) == 1);
+        stats = subexpr_cache_stats(cache);
+        assert(stats.refreshes == 1);
+        assert(stats.hits == 3);
+
+        /*
+         * A new bitmap gets a new id, even at the old address; the
+         * same subexpression with its arguments reordered shares an
+         * entry.
+         */
+        tracked_bitmap_destroy(inputs[2]);
+        for (size_t i = 0; i < count; i++)
+                state->ptrs[2][i] = ~state->ptrs[2][i];
+        inputs[2] = tracked_bitmap_create(state->ptrs[2], count);
+        assert(check_rewrite(cache, srcs[0], state, inputs) == 0);
+        assert(check_rewrite(cache, "(and y0 (xor (or x1 x0) neg_x))",
+            state, inputs) == 1);
+        stats = subexpr_cache_stats(cache);
+        assert(stats.materialisations == 2);
+        assert(stats.hits == 3);
+        subexpr_cache_destroy(cache);
+
+        /* Results stand in for subsets of n-ary nodes' arguments. */
+        cache = subexpr_cache_create(4 * vec_size, 2);
+        assert(check_rewrite(cache, "(and x0 neg_x)", state, inputs) == 0);
+        assert(check_rewrite(cache, "(and x0 neg_x)", state, inputs) == 1);
+        assert(check_rewrite(cache, "(and y0 neg_x x0)", state, inputs) == 1);
+        assert(check_rewrite(cache, "(or y0 neg_x x0)", state, inputs) == 0);
+        stats = subexpr_cache_stats(cache);
+        assert(stats.materialisations == 1);
+        assert(stats.hits == 1);
+        subexpr_cache_destroy(cache);
+
+        /* Room for one result: each query evicts the previous one. */
+        cache = subexpr_cache_create(vec_size, 1);
+        for (size_t i = 0; i < n_srcs; i++)
+                assert(check_rewrite(cache, srcs[i], state, inputs) == 1);
+        stats = subexpr_cache_stats(cache);
+        assert(stats.materialisations == n_srcs);
+        assert(stats.evictions == n_srcs - 1);
+        assert(subexpr_cache_size(cache) == vec_size);
+        subexpr_cache_destroy(cache);
+
+        /* Results that don't fit are never materialised. */
+        cache = subexpr_cache_create(vec_size - 1, 1);
+        for (size_t i = 0; i < n_srcs; i++)
+                assert(check_rewrite(cache, srcs[i], state, inputs) == 0);
+        assert(subexpr_cache_size(cache) == 0);
+        subexpr_cache_destroy(cache);
+
+        for (size_t i = 1; i < 6; i++) {
+                tracked_bitmap_destroy(inputs[i]);
+                free(state->ptrs[i]);
+        }
+
+        free(state);
+        return;
+}
+
+/**
+ * Queries compiled with a cache share their hot subexpression through
+ * the planner, and follow their inputs' writes.
+ */
+static void
+test_planned_cached(size_t count)
+{
+        static const char *const srcs[] = {
+                "(and (xor neg_x (or x0 x1)) y0)",
+                "(and (xor neg_x (or x0 x1)) (not neg_y))",
+        };
+        enum { n_srcs = sizeof(srcs) / sizeof(srcs[0]) };
+        struct tracked_bitmap *inputs[FILTER_MAX_PTRS] = { NULL };
+        struct planned_query *queries[n_srcs];
+        struct expr *exprs[n_srcs];
+        struct subexpr_cache_stats stats;
+        struct subexpr_cache *cache;
+        struct filter_state *state;
+        __m256i *expected, *actual;
+        int r;
+
+        r = posix_memalign((void **)&state, 64, sizeof(*state));
+        assert(r == 0);
+        memset(state, 0, sizeof(*state));
+        state->count = count;
+        for (size_t i = 1; i < 6; i++)
+                inputs[i] = tracked_bitmap_create(random_vec(count), count);
+
+        cache = subexpr_cache_create(4 * sizeof(__m256i) * count, 2);
+        for (size_t i = 0; i < n_srcs; i++) {
+                exprs[i] = expr_parse(srcs[i], toy_names,
+                    sizeof(toy_names) / sizeof(toy_names[0]));
+                assert(exprs[i] != NULL);
+                queries[i] = planner_compile_cached(toy_planner, exprs[i],
+                    100, NULL, cache);
+                assert(queries[i] != NULL);
+        }
+
+        expected = random_vec(count);
+        actual = random_vec(count);
+        for (size_t round = 0; round < 4; round++) {
+                /* Write to an input of the cached result. */
+                if (round == 2) {
+                        tracked_bitmap_set_bit(inputs[1], 0, 1);
+                        tracked_bitmap_set_bit(inputs[1],
+                            256 * count - 1, 0);
+                }
+
+                for (size_t i = 0; i < n_srcs; i++) {
+                        for (size_t j = 1; j < 6; j++)
+                                state->ptrs[j] = tracked_bitmap_vecs(inputs[j]);
+                        state->dst = expected;
+                        expr_eval(exprs[i], state);
+
+                        state->dst = actual;
+                        planned_query_run_tracked(queries[i], state, inputs);
+                        assert(memcmp(actual, expected,
+                            count * sizeof(__m256i)) == 0);
+                        for (size_t j = 6; j < FILTER_MAX_PTRS; j++)
+                                assert(state->ptrs[j] == NULL);
+                }
+        }
+
+        /*
+         * The shared term on its second use, then each whole query on
+         * its second run, and those are refreshed once after the write.
+         */
+        stats = subexpr_cache_stats(cache);
+        assert(stats.materialisations == 1 + n_srcs);
+        assert(stats.refreshes == n_srcs);
+        assert(stats.hits == 2 * n_srcs);
+
+        for (size_t i = 0; i < n_srcs; i++) {
+                planned_query_destroy(queries[i]);
+                expr_destroy(exprs[i]);
+        }
+
+        subexpr_cache_destroy(cache);
+        for (size_t i = 1; i < 6; i++) {
+                free(tracked_bitmap_vecs(inputs[i]));
+                tracked_bitmap_destroy(inputs[i]);
+        }
+
+        free(actual);
+        free(expected);
+        free(state);
+        return;
+}
+
+static void
+test_sink(size_t count, bool dense)
+{
+        struct filter_state *state;
+        struct vecs vecs;
+        __m256i *dst;
+
+        for (size_t i = 0; i < 6; i++)
+                vecs.vecs[i] = random_vec(count);
+
+        /* x0 = ~0, neg_x = neg_y = 0: the result is y0. */
+        if (dense) {
+                memset(vecs.vecs[1], 0xff, count * sizeof(__m256i));
+                memset(vecs.vecs[3], 0, count * sizeof(__m256i));
+                memset(vecs.vecs[5], 0, count * sizeof(__m256i));
+                memset(vecs.vecs[4], 0xff, count * sizeof(__m256i) / 2);
+        }
+
+        state = filter(baseline, count, vecs);
+        dst = state->dst;
+        state->dst = NULL;
+        for (size_t i = 0; i < 4; i++) {
+                struct index_list list = { 0 };
+                struct filter_sink *sink;
+
+                sink = filter_sink_create(append_indices, &list);
+                state->sink = sink;
+                switch (i) {
+                case 0:
+                        baseline_emit(state);
+                        break;
+                case 1:
+                        fused_blocking_emit(state);
+                        break;
+                case 2:
+                        filter_sink_run(sink, fused_blocking, state);
+                        break;
+                case 3:
+                        filter_sink_run(sink, stitched_fused, state);
+                        break;
+                }
+
+                assert(sink->n_emitted == list.n);
+                filter_sink_destroy(sink);
+                check_sink(&list, dst, count);
+                free(list.indices);
+        }
+
+        state->dst = dst;
+        release(state);
+        for (size_t i = 0; i < 6; i++)
+                free(vecs.vecs[i]);
+        return;
+}
+
+static void
+test_policy(void)
+{
+        size_t llc = filter_llc_size();
+
+        assert(llc > 0);
+        assert(!filter_policy_streaming(32, 6));
+        assert(filter_policy_streaming(llc / sizeof(__m256i), 6));
+        return;
+}
+
+static pthread_key_t arena_user_key;
+
+static void
+use_thread_arena(void *value)
+{
+        struct filter_arena *arena = filter_arena_thread();
+
+        (void)value;
+        filter_arena_state_release(arena, filter_arena_state(arena));
+        return;
+}
+
+static void *
+arena_thread(void *arg)
+{
+        struct filter_arena *arena = filter_arena_thread();
+
+        filter_arena_state_release(arena, filter_arena_state(arena));
+        pthread_setspecific(arena_user_key, arena);
+        return arg;
+}
+
+static void
+test_arena(void)
+{
+        struct filter_arena *arena = filter_arena_create();
+        size_t huge = FILTER_ARENA_HUGE / sizeof(__m256i);
+        struct filter_state *state;
+        __m256i *small, *large, *scratch;
+        pthread_t thread;
+        int r;
+
+        state = filter_arena_state(arena);
+        assert(state->count == 0 && state->ptrs[FILTER_MAX_PTRS - 1] == NULL);
+        state->count = 42;
+        filter_arena_state_release(arena, state);
+        assert(filter_arena_state(arena) == state);
+        assert(state->count == 0);
+        filter_arena_state_release(arena, state);
+
+        /* 2 blocks and a vector round up to 4 blocks; 4 blocks and a vector don't. */
+        small = filter_arena_vecs(arena, 2 * BLOCK_SIZE + 1);
+        assert((uintptr_t)small % 64 == 0);
+        filter_arena_vecs_release(arena, small, 2 * BLOCK_SIZE + 1);
+        assert(filter_arena_vecs(arena, 4 * BLOCK_SIZE) == small);
+        assert(filter_arena_vecs(arena, 4 * BLOCK_SIZE + 1) != small);
+        assert(filter_arena_stats(arena).fresh == 2);
+        assert(filter_arena_stats(arena).recycled == 1);
+
+        large = filter_arena_vecs(arena, huge + 1);
+        assert((uintptr_t)large % FILTER_ARENA_HUGE == 0);
+        memset(large, 1, (huge + 1) * sizeof(__m256i));
+        filter_arena_vecs_release(arena, large, huge + 1);
+        assert(filter_arena_vecs(arena, 2 * huge) == large);
+
+        for (size_t i = 0; i < 3; i++) {
+                scratch = filter_arena_scratch(arena, 3);
+                assert((uintptr_t)scratch % 64 == 0);
+                memset(scratch, 0, 3 * sizeof(__m256i));
+                scratch = filter_arena_scratch(arena, 4 * huge);
+                memset(scratch, 0, 4 * huge * sizeof(__m256i));
+                filter_arena_reset(arena);
+        }
+
+        /* Checked-out states and bitmaps are freed too. */
+        state = filter_arena_state(arena);
+        small = filter_arena_vecs(arena, BLOCK_SIZE);
+        filter_arena_destroy(arena);
+
+        /* A thread's arena, asked for again while the thread exits. */
+        r = pthread_key_create(&arena_user_key, use_thread_arena);
+        assert(r == 0);
+        r = pthread_create(&thread, NULL, arena_thread, NULL);
+        assert(r == 0);
+        r = pthread_join(thread, NULL);
+        assert(r == 0);
+        pthread_key_delete(arena_user_key);
+
+        return;
+}
+
+static void
+test_blocked_shape(void)
+{
+        struct blocked_shape shape;
+
+        /* The sample query (6 streams) in a 32 KiB L1D: 16 KiB / 192 B. */
+        shape = blocked_choose_shape(6, 32 << 10, 1 << 20);
+        assert(shape.block <= 85 && 2 * shape.block > 85 &&
+            shape.tile == shape.block);
+        shape = blocked_choose_shape(1, 1 << 20, 1 << 20);
+        assert(shape.block == 8 * BLOCK_SIZE && shape.tile == shape.block);
+        /* 80 streams don't fit a block in half of L1: tile for L2. */
+        shape = blocked_choose_shape(80, 32 << 10, 1 << 20);
+        assert(shape.block == BLOCK_SIZE &&
+            shape.tile == 204 - 204 % BLOCK_SIZE);
+        return;
+}
+
+/**
+ * A query over every input, nested so that each level needs another
+ * temporary: too deep for L1 blocks, so it takes the tiled path, in
+ * several segments.  The last tile is a single block.
+ */
+static void
+test_blocked_deep(void)
+{
+        static const enum expr_kind kinds[] = { EXPR_AND, EXPR_OR, EXPR_XOR };
+        enum { n_inputs = FILTER_MAX_PTRS - 1 };
+        struct blocked_query *blocked;
+        struct blocked_shape shape;
+        struct filter_state *state;
+        struct expr *expr;
+        __m256i *expected;
+        size_t count;
+        int r;
+
+        expr = expr_var(n_inputs);
+        for (size_t i = n_inputs - 1; i >= 1; i--) {
+                struct expr *args[2] = { expr_var(i), expr };
+
+                if (i % 5 == 0)
+                        args[0] = expr_not(args[0]);
+                expr = expr_nary(kinds[i % 3], 2, args);
+        }
+
+        blocked = blocked_compile(expr, NULL);
+        shape = blocked_query_shape(blocked);
+        assert(blocked_query_n_temps(blocked) >= n_inputs / 2);
+        assert(shape.tile > shape.block);
+        assert(blocked_query_n_segments(blocked) > 1);
+
+        count = 2 * shape.tile + shape.block;
+        r = posix_memalign((void **)&state, 32, sizeof(*state));
+        assert(r == 0);
+        memset(state, 0, sizeof(*state));
+        state->count = count;
+        for (size_t i = 0; i <= n_inputs; i++)
+                state->ptrs[i] = random_vec(count);
+
+        blocked_run(blocked, state);
+        expected = state->dst;
+        state->dst = random_vec(count);
+        expr_eval(expr, state);
+        assert(memcmp(state->dst, expected, sizeof(__m256i) * count) == 0);
+
+        free(expected);
+        for (size_t i = 0; i <= n_inputs; i++)
+                free(state->ptrs[i]);
+        free(state);
+        blocked_destroy(blocked);
+        expr_destroy(expr);
+        return;
+}
+
+/**
+ * With made-up costs: threaded is cheap to call, stitched is fast per
+ * vector but expensive to build, and blocked is in between.
+ */
+static void
+test_planner(void)
+{
+        const struct planner_costs costs = {
+                .build = { 0, 1000, 0, 0, 0, 0 },
+                .call = { 10, 5, 40, 10, 1e6, 1e6 },
+                .vector = { 1, 0.5, 0.6, 1, 10, 10 },
+        };
+        struct planner *planner = planner_create_with(&costs);
+        struct planned_query *once, *often;
+        double estimates[PLANNER_N_STRATEGIES];
+        struct filter_state *state;
+        int r;
+
+        once = planner_compile(planner, toy_expr, 1, NULL);
+        often = planner_compile(planner, toy_expr, 1000, NULL);
+        assert(planned_query_choose(once, 16, estimates) == PLANNER_THREADED);
+        assert(estimates[PLANNER_STITCHED] > estimates[PLANNER_THREADED]);
+        assert(planned_query_choose(once, 1 << 20, estimates) == PLANNER_STITCHED);
+        assert(planned_query_choose(often, 1 << 10, estimates) == PLANNER_STITCHED);
+        assert(planned_query_choose(once, 1 << 10, estimates) == PLANNER_BLOCKED);
+
+        /* Once stitched, there's no build cost left to amortise. */
+        r = posix_memalign((void **)&state, 64, sizeof(*state));
+        assert(r == 0);
+        memset(state, 0, sizeof(*state));
+        for (size_t i = 0; i < 6; i++)
+                state->ptrs[i] = random_vec(BLOCK_SIZE);
+        state->count = BLOCK_SIZE;
+        planned_query_run_with(once, PLANNER_STITCHED, state);
+        assert(planned_query_choose(once, 16, estimates) == PLANNER_STITCHED);
+
+        for (size_t i = 0; i < 6; i++)
+                free(state->ptrs[i]);
+        free(state);
+        planned_query_destroy(once);
+        planned_query_destroy(often);
+        planner_destroy(planner);
+        return;
+}
+
+/**
+ * The same costs rank strategies differently for different shapes:
+ * blocked ops against threaded instructions, short-circuiting sparse
+ * conjunctions, and the sample query's hand-written kernels.
+ */
+static void
+test_planner_shapes(void)
+{
+        const struct planner_costs costs = {
+                .call = { 10, 1e6, 10, 10, 10, 1e6 },
+                .vector = { 1, 1, 0.65, 1, 2, 1 },
+        };
+        /* 3 instructions and 4 ops, 4 instructions and 7 ops. */
+        static const char *const shallow = "(and (xor 3 (or 1 2)) (xor 5 4))";
+        static const char *const wide = "(or 1 2 3 4 5 6 7 8)";
+        static const char *const conjunction = "(and (xor 1 2) (xor 3 4) (xor 5 6))";
+        static const char *const renamed = "(and (xor 7 (or 2 9)) (xor 4 3))";
+        struct planner *planner = planner_create_with(&costs);
+        double estimates[PLANNER_N_STRATEGIES];
+        double sparse[FILTER_MAX_PTRS];
+        struct planned_query *query;
+        struct filter_state *state;
+        __m256i *expected;
+        struct expr *expr;
+        size_t count = 1 << 12;
+        int r;
+
+        expr = expr_parse(shallow, NULL, 0);
+        query = planner_compile(planner, expr, 1, NULL);
+        planned_query_choose(query, count, estimates);
+        assert(estimates[PLANNER_BLOCKED] < estimates[PLANNER_THREADED]);
+        planned_query_destroy(query);
+        expr_destroy(expr);
+
+        expr = expr_parse(wide, NULL, 0);
+        query = planner_compile(planner, expr, 1, NULL);
+        planned_query_choose(query, count, estimates);
+        assert(estimates[PLANNER_BLOCKED] > estimates[PLANNER_THREADED]);
+        assert(estimates[PLANNER_SHORT_CIRCUIT] == INFINITY);
+        assert(estimates[PLANNER_BASELINE] == INFINITY);
+        planned_query_destroy(query);
+        expr_destroy(expr);
+
+        /* Blocks of sparse conjunctions die after the first conjunct. */
+        for (size_t i = 0; i < FILTER_MAX_PTRS; i++)
+                sparse[i] = 1e-5;
+        expr = expr_parse(conjunction, NULL, 0);
+        query = planner_compile(planner, expr, 1, NULL);
+        planned_query_choose(query, count, estimates);
+        assert(estimates[PLANNER_SHORT_CIRCUIT] > estimates[PLANNER_THREADED]);
+        planned_query_destroy(query);
+        query = planner_compile(planner, expr, 1, sparse);
+        planned_query_choose(query, count, estimates);
+        assert(estimates[PLANNER_SHORT_CIRCUIT] < estimates[PLANNER_THREADED]);
+        planned_query_destroy(query);
+        expr_destroy(expr);
+
+        /* baseline runs the sample query on any inputs. */
+        expr = expr_parse(renamed, NULL, 0);
+        query = planner_compile(planner, expr, 1, NULL);
+        assert(planned_query_choose(query, 4 * count, estimates) ==
+            PLANNER_BASELINE);
+
+        r = posix_memalign((void **)&state, 64, sizeof(*state));
+        assert(r == 0);
+        memset(state, 0, sizeof(*state));
+        state->count = 64;
+        for (size_t i = 0; i < 10; i++)
+                state->ptrs[i] = random_vec(state->count);
+        expr_eval(expr, state);
+        expected = state->dst;
+        for (size_t s = PLANNER_BASELINE; s <= PLANNER_FUSED_BLOCKING; s++) {
+                state->dst = random_vec(state->count);
+                planned_query_run_with(query, s, state);
+                assert(memcmp(state->dst, expected,
+                    state->count * sizeof(__m256i)) == 0);
+                free(state->dst);
+        }
+
+        state->dst = expected;
+        for (size_t i = 0; i < 10; i++)
+                free(state->ptrs[i]);
+        free(state);
+        planned_query_destroy(query);
+        expr_destroy(expr);
+        planner_destroy(planner);
+        return;
+}
+
+/**
+ * Counts the bits of (not x0): unlike the sample query's, they're set
+ * where every input is 0.
+ */
+static void
+not_x0_count(struct filter_state *state)
+{
+        const uint64_t *words = (const uint64_t *)state->x0;
+        uint64_t ret = 0;
+
+        for (size_t i = 0; i < 4 * state->count; i++)
+                ret += __builtin_popcountll(~words[i]);
+
+        state->popcount = ret;
+        return;
+}
+
+/**
+ * Evaluates the sample query on bits [begin, end) of `count` vectors
+ * with `fn`, and checks that the rest of dst is left alone, and that
+ * counts only cover the range.
+ */
+static void
+test_range(filter_fn_t *fn, size_t count, size_t begin, size_t end)
+{
+        struct filter_state *expected, *state;
+        const uint64_t *want, *before, *got, *x0;
+        uint64_t want_count = 0, not_x0 = 0;
+        struct vecs vecs;
+        int r;
+
+        for (size_t i = 0; i < 6; i++)
+                vecs.vecs[i] = random_vec(count);
+
+        expected = filter(baseline, count, vecs);
+        r = posix_memalign((void **)&state, 64, sizeof(*state));
+        assert(r == 0);
+        memset(state, 0, sizeof(*state));
+        for (size_t i = 1; i < 6; i++)
+                state->ptrs[i] = expected->ptrs[i];
+
+        state->dst = random_vec(count);
+        before = (const uint64_t *)random_vec(count);
+        memcpy(state->dst, before, count * sizeof(__m256i));
+        filter_run_range(fn, state, begin, end);
+
+        want = (const uint64_t *)expected->dst;
+        got = (const uint64_t *)state->dst;
+        for (size_t bit = 0; bit < count * 8 * sizeof(__m256i); bit++) {
+                const uint64_t *src = (bit >= begin && bit < end) ? want : before;
+
+                assert(((got[bit / 64] ^ src[bit / 64]) >> (bit % 64) & 1) == 0);
+        }
+
+        x0 = (const uint64_t *)state->x0;
+        for (size_t bit = begin; bit < end; bit++) {
+                want_count += (want[bit / 64] >> (bit % 64)) & 1;
+                not_x0 += (~x0[bit / 64] >> (bit % 64)) & 1;
+        }
+
+        filter_run_range(baseline_count, state, begin, end);
+        assert(state->popcount == want_count);
+        filter_run_range(fused_blocking_count, state, begin, end);
+        assert(state->popcount == want_count);
+        filter_run_range(not_x0_count, state, begin, end);
+        assert(state->popcount == not_x0);
+
+        /* Count-only methods don't need a dst. */
+        got = (const uint64_t *)state->dst;
+        state->dst = NULL;
+        filter_run_range(fused_blocking_count, state, begin, end);
+        assert(state->popcount == want_count);
+        state->dst = (__m256i *)got;
+
+        for (size_t i = 0; i < 6; i++)
+                free(vecs.vecs[i]);
+
+        free((void *)before);
+        free(state->dst);
+        free(state);
+        release(expected);
+        return;
+}
+
+static void
+test_ranges(size_t count)
+{
+        filter_fn_t *const fns[] = {
+                baseline, fused_blocking, wired_inreg_fused, compiled_inreg,
+                stitched_fused, blocked_adaptive,
+        };
+        const size_t bits = count * 8 * sizeof(__m256i);
+        const size_t ranges[][2] = {
+                { 0, bits },
+                { 0, bits - 1 },
+                { 1, bits },
+                { 3, 7 },
+                { 60, 70 },
+                { 64, 64 + 256 },
+                { 100, bits - 300 },
+                { 256 * BLOCK_SIZE, bits - 256 * BLOCK_SIZE + 1 },
+                { 5, 5 },
+        };
+
+        for (size_t i = 0; i < sizeof(fns) / sizeof(fns[0]); i++) {
+                for (size_t j = 0; j < sizeof(ranges) / sizeof(ranges[0]); j++)
+                        test_range(fns[i], count, ranges[j][0], ranges[j][1]);
+        }
+
+        return;
+}
+
+static void
+test_bench(void)
+{
+        const struct bench_options options = {
+                .format = BENCH_CSV,
+                .caches = (1U << BENCH_COLD) | (1U << BENCH_WARM),
+                .reps = 20,
+                .out = tmpfile(),
+        };
+        struct bench_clock clock = bench_clock();
+        struct filter_state *state = setup_empty_filter(64);
+        struct bench_result result;
+        struct bench *bench;
+        char line[1024];
+        size_t lines = 0;
+
+        assert(clock.tsc_ghz > 0 && clock.core_ghz > 0);
+        assert(options.out != NULL);
+        bench = bench_create(&options);
+        bench_calibrate(bench, noop, state);
+        result = bench_measure(bench, BENCH_WARM, baseline, state);
+        assert(result.p1 <= result.p50 && result.p50 <= result.p99);
+        assert(result.stddev >= 0);
+        for (size_t i = 0; i < BENCH_N_COUNTERS; i++)
+                assert(isnan(result.counters[i]) || result.counters[i] >= 0);
+
+        bench_run(bench, "baseline", baseline, state);
+        bench_destroy(bench);
+
+        /* A header, and a line per cache scenario. */
+        rewind(options.out);
+        while (fgets(line, sizeof(line), options.out) != NULL)
+                lines++;
+        assert(lines == 3);
+        assert(strncmp(line, "baseline,2048,warm,", strlen("baseline,2048,warm,")) == 0);
+
+        fclose(options.out);
+        destroy(state);
+        return;
+}
+
+static void
+test_ternlog(void)
+{
+        struct ternlog_program *program = ternlog_partition(toy_expr);
+
+        /* (xor neg_x (or x0 x1)), then (and acc (xor neg_y y0)). */
+        assert(program->n_nodes == 2);
+        assert(program->nodes[0].imm == (TERNLOG_A ^ (TERNLOG_B | TERNLOG_C)));
+        if (__builtin_cpu_supports("avx512f")) {
+                struct ternlog_threaded *threaded = ternlog_thread(program);
+
+                assert(threaded != NULL);
+                ternlog_threaded_destroy(threaded);
+        }
+
+        ternlog_program_destroy(program);
+        return;
+}
+
+static void
+time_fn(struct bench *bench, struct filter_state *state, bv_fn_t *fn,
+    const char *name)
+{
+
+        bench_run(bench, name, fn, state);
+        return;
+}
+
+/**
+ * Times every engine for arbitrary queries on each generated query
+ * and input density, as `<shape>/<density>:<engine>`.
+ */
+static void
+time_shapes(struct bench *bench, size_t count)
+{
+        struct query_engines engines;
+
+        fflush(NULL);
+        fprintf(stderr, "==== shapes n: %zu ====\n", count);
+        for (size_t i = 0; i < shape_suite_count; i++) {
+                for (size_t j = 0; j < shape_densities_count; j++) {
+                        double densities[FILTER_MAX_PTRS];
+                        struct filter_state *state;
+                        struct expr *expr;
+
+                        state = setup_shape(&expr, &shape_suite[i],
+                            &shape_densities[j], count);
+                        shape_densities_for(&shape_densities[j], densities);
+                        query_engines_compile(&engines, expr, toy_planner,
+                            1000, densities);
+                        query_engines_current = &engines;
+
+                        bench_calibrate(bench, noop, state);
+                        for (size_t k = 0; k < query_engine_count; k++) {
+                                const struct query_engine *engine =
+                                    &query_engine_table[k];
+                                char name[128];
+
+                                if (!query_engine_available(engine))
+                                        continue;
+
+                                snprintf(name, sizeof(name), "%s/%s:%s",
+                                    shape_suite[i].name, shape_densities[j].name,
+                                    engine->name);
+                                engine->fn(state);
+                                time_fn(bench, state, engine->fn, name);
+                        }
+
+                        query_engines_current = &toy_engines;
+                        query_engines_destroy(&engines);
+                        destroy_shape(expr, state);
+                }
+        }
+
+        return;
+}
+
+static void
+time_all(struct bench *bench, size_t count)
+{
+        struct filter_state *state;
+
+        state = setup_empty_filter(count);
+
+        if (vector_avx2_supported()) {
+                baseline(state);
+                blocking(state);
+                fused_blocking(state);
+                specialised_widget(state);
+                fully_specialised_widget(state);
+                threaded_inreg(state);
+                threaded_inreg_fused(state);
+                compiled_inreg(state);
+                compiled_inreg_fused(state);
+                stitched_fused(state);
+                cached_stitched(state);
+                fused_blocking_short_circuit(state);
+                compiled_short_circuit(state);
+                stitched_fused_x4(state);
+                shared_scan_x4(state);
+                baseline_parallel(state);
+                fused_blocking_parallel(state);
+                baseline_count(state);
+                fused_blocking_count(state);
+                threaded_inreg_fused_count(state);
+                wired_inreg_fused_count(state);
+                baseline_malloc_dst(state);
+                baseline_arena_dst(state);
+                baseline_nt(state);
+                fused_blocking_nt(state);
+                wired_inreg_fused_nt(state);
+                baseline_emit_toy(state);
+                fused_blocking_emit_toy(state);
+                stitched_fused_sink(state);
+        }
+
+        blocked_adaptive(state);
+        planned(state);
+
+        fflush(NULL);
+        fprintf(stderr, "==== n: %zu ====\n", count);
+        bench_calibrate(bench, noop, state);
+        if (vector_avx2_supported()) {
+                time_fn(bench, state, baseline, "baseline");
+                time_fn(bench, state, blocking, "blocking");
+                time_fn(bench, state, fused_blocking, "fused_blocking");
+                time_fn(bench, state, fused_blocking_short_circuit, "fused_blocking_short_circuit");
+                time_fn(bench, state, specialised_widget, "specialised_widget");
+                time_fn(bench, state, fully_specialised_widget, "fully_specialised_widget");
+                time_fn(bench, state, threaded_inreg, "threaded_inreg");
+                time_fn(bench, state, threaded_inreg_fused, "threaded_inreg_fused");
+                time_fn(bench, state, wired_inreg_fused, "wired_inreg_fused");
+                time_fn(bench, state, baseline_count, "baseline_count");
+                time_fn(bench, state, fused_blocking_count, "fused_blocking_count");
+                time_fn(bench, state, threaded_inreg_fused_count, "threaded_inreg_fused_count");
+                time_fn(bench, state, wired_inreg_fused_count, "wired_inreg_fused_count");
+                time_fn(bench, state, baseline_malloc_dst, "baseline_malloc_dst");
+                time_fn(bench, state, baseline_arena_dst, "baseline_arena_dst");
+                time_fn(bench, state, baseline_nt, "baseline_nt");
+                time_fn(bench, state, fused_blocking_nt, "fused_blocking_nt");
+                time_fn(bench, state, wired_inreg_fused_nt, "wired_inreg_fused_nt");
+                time_fn(bench, state, baseline_emit_toy, "baseline_emit");
+                time_fn(bench, state, fused_blocking_emit_toy, "fused_blocking_emit");
+                time_fn(bench, state, stitched_fused_sink, "stitched_fused_sink");
+                time_fn(bench, state, compiled_inreg, "compiled_inreg");
+                time_fn(bench, state, compiled_inreg_fused, "compiled_inreg_fused");
+                time_fn(bench, state, stitched_fused, "stitched_fused");
+                time_fn(bench, state, cached_stitched, "cached_stitched");
+                time_fn(bench, state, compiled_short_circuit, "compiled_short_circuit");
+                time_fn(bench, state, stitched_fused_x4, "stitched_fused_x4");
+                time_fn(bench, state, shared_scan_x4, "shared_scan_x4");
+                time_fn(bench, state, baseline_parallel, "baseline_parallel");
+                time_fn(bench, state, fused_blocking_parallel, "fused_blocking_parallel");
+        }
+
+        time_fn(bench, state, blocked_adaptive, "blocked_adaptive");
+        time_fn(bench, state, planned, "planned");
+        if (vector_avx2_supported() && __builtin_cpu_supports("avx512f")) {
+                time_fn(bench, state, baseline_avx512, "baseline_avx512");
+                time_fn(bench, state, fused_blocking_avx512, "fused_blocking_avx512");
+                time_fn(bench, state, threaded_ternlog, "threaded_ternlog");
+        }
+
+        time_fn(bench, state, baseline_vec, "baseline_vec");
+        time_fn(bench, state, fused_blocking_vec, "fused_blocking_vec");
+        for (size_t i = 0; i < vector_kernels_count; i++) {
+                const struct vector_kernels *kernels = &vector_kernels[i];
+                char name[64];
+
+                if (!vector_kernels_supported(kernels))
+                        continue;
+
+                snprintf(name, sizeof(name), "baseline_vec_%s", kernels->name);
+                time_fn(bench, state, kernels->baseline, name);
+                snprintf(name, sizeof(name), "fused_blocking_vec_%s", kernels->name);
+                time_fn(bench, state, kernels->fused_blocking, name);
+        }
+
+        destroy(state);
+        return;
+}
+
+/**
+ * Everything but the vector_kernels and the blocked and planned
+ * engines, which are all that validate runs on hosts without AVX2.
+ */
+static void
+test_avx2_methods(void)
+{
+
+        test_queries(32);
+        test_queries(1024);
+        test_cache(64);
+        test_cse(32);
+        test_cse(1024);
+        test_short_circuits(64);
+        test_short_circuits(64 * 1024 + 16);
+        test_roaring(64);
+        test_roaring(6 * ROARING_CHUNK_VECS + 48);
+        test_segment(64);
+        test_segment(6 * ROARING_CHUNK_VECS + 48);
+        test_shared_scan(32);
+        test_shared_scan(64 * 1024 + 16);
+        test_ternlog();
+        test_popcount();
+        test_planner();
+        test_planner_shapes();
+        test_bench();
+        test_shapes(32);
+        test_shapes(1024 + 16);
+        test_ranges(32);
+        test_ranges(5 * BLOCK_SIZE);
+        test_counts(32);
+        test_counts(1024 + 16);
+        test_incremental(BLOCK_SIZE);
+        test_incremental(1024);
+        test_incremental(64 * 1024 + 16);
+        test_subexpr_cache(32);
+        test_subexpr_cache(1024 + 16);
+        test_planned_cached(32);
+        test_planned_cached(1024 + 16);
+        test_sink(32, false);
+        test_sink(1024 + 16, false);
+        test_sink(1024 + 16, true);
+        test_pool(32);
+        test_pool(1024);
+        test_pool(1024 * 1024 + 16);
+        test_batch(1);
+        test_batch(3);
+        test_batch(8);
+        return;
+}
+
+int
+main()
+{
+        struct bench_options bench_options = bench_options_from_env();
+        struct bench *bench;
+
+        toy_expr = expr_parse(toy_query, toy_names,
+            sizeof(toy_names) / sizeof(toy_names[0]));
+        assert(toy_expr != NULL);
+        toy_planner = planner_create();
+        query_engines_compile(&toy_engines, toy_expr, toy_planner, 1000, NULL);
+        query_engines_current = &toy_engines;
+        toy_pool = filter_pool_create(0);
+        if (vector_avx2_supported()) {
+                toy_cache = query_cache_create(16, 0, QUERY_CACHE_STITCH);
+                toy_sink = filter_sink_create(discard_indices, NULL);
+        }
+
+        bench_clear_caches();
 
-        clear_caches();
+        if (vector_avx2_supported())
+                test_avx2_methods();
+        test_policy();
+        test_arena();
+        test_blocked_shape();
+        test_blocked_deep();
 
         test_all(32);
         test_all(64);
         test_all(128);
         test_all(1024 * 1024);
 
-        time_all(32);
-        time_all(128);
-        time_all(1024);
-        time_all(8 * 1024);
-        time_all(16 * 1024);
-        time_all(32 * 1024);
-        time_all(64 * 1024);
-        time_all(128 * 1024);
-        time_all(256 * 1024);
-        time_all(512 * 1024);
-        time_all(1024 * 1024);
-        time_all(8 * 1024 * 1024);
+        bench = bench_create(&bench_options);
+        time_all(bench, 32);
+        time_all(bench, 128);
+        time_all(bench, 1024);
+        time_all(bench, 8 * 1024);
+        time_all(bench, 16 * 1024);
+        time_all(bench, 32 * 1024);
+        time_all(bench, 64 * 1024);
+        time_all(bench, 128 * 1024);
+        time_all(bench, 256 * 1024);
+        time_all(bench, 512 * 1024);
+        time_all(bench, 1024 * 1024);
+        time_all(bench, 8 * 1024 * 1024);
+        time_shapes(bench, 1024);
+        time_shapes(bench, 64 * 1024);
+        bench_destroy(bench);
         return 0;
 }
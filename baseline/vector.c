@@ -0,0 +1,140 @@
+#include "vector.h"
+
+#include <stdint.h>
+
+/*
+ * The scalar fallback works on one uint64_t at a time, and GCC isn't
+ * allowed to vectorise it behind our back.  "arch=x86-64" resets any
+ * -march flag to the SSE2 baseline every x86-64 CPU supports.
+ */
+#define VEC_BYTES 8
+#define VEC_SUFFIX vec64
+#define VEC_TARGET "arch=x86-64"
+#define VEC_NO_VECTORIZE
+#include "vector_kernels.inc"
+#undef VEC_NO_VECTORIZE
+#undef VEC_TARGET
+#undef VEC_SUFFIX
+#undef VEC_BYTES
+
+#define VEC_BYTES 16
+#define VEC_SUFFIX vec128
+#define VEC_TARGET "arch=x86-64"
+#include "vector_kernels.inc"
+#undef VEC_TARGET
+#undef VEC_SUFFIX
+#undef VEC_BYTES
+
+#define VEC_BYTES 32
+#define VEC_SUFFIX vec256
+#define VEC_TARGET "arch=x86-64-v3"
+#include "vector_kernels.inc"
+#undef VEC_TARGET
+#undef VEC_SUFFIX
+#undef VEC_BYTES
+
+#define VEC_BYTES 64
+#define VEC_SUFFIX vec512
+#define VEC_TARGET "arch=x86-64-v4"
+#include "vector_kernels.inc"
+#undef VEC_TARGET
+#undef VEC_SUFFIX
+#undef VEC_BYTES
+
+/*
+ * The table and dispatchers must run on any x86-64 CPU, so keep them
+ * to the baseline ISA whatever the command line's -march.
+ */
+#pragma GCC push_options
+#pragma GCC target("arch=x86-64")
+
+#define BLOCKED_SCALE(suffix, scale) {                                  \
+                blocked_copy_x##scale##_##suffix,                       \
+                blocked_not_x##scale##_##suffix,                        \
+                blocked_and_x##scale##_##suffix,                        \
+                blocked_or_x##scale##_##suffix,                         \
+                blocked_xor_x##scale##_##suffix,                        \
+        }
+
+#define BLOCKED(suffix) {                                               \
+                BLOCKED_SCALE(suffix, 1),                               \
+                BLOCKED_SCALE(suffix, 2),                               \
+                BLOCKED_SCALE(suffix, 4),                               \
+                BLOCKED_SCALE(suffix, 8),                               \
+        }
+
+const struct vector_kernels vector_kernels[] = {
+        { "scalar", 8, baseline_vec64, fused_blocking_vec64, BLOCKED(vec64) },
+        { "sse2", 16, baseline_vec128, fused_blocking_vec128, BLOCKED(vec128) },
+        { "avx2", 32, baseline_vec256, fused_blocking_vec256, BLOCKED(vec256) },
+        { "avx512", 64, baseline_vec512, fused_blocking_vec512, BLOCKED(vec512) },
+};
+
+#undef BLOCKED
+#undef BLOCKED_SCALE
+
+const size_t vector_kernels_count =
+    sizeof(vector_kernels) / sizeof(vector_kernels[0]);
+
+bool
+vector_kernels_supported(const struct vector_kernels *kernels)
+{
+
+        __builtin_cpu_init();
+        switch (kernels->width) {
+        case 32:
+                return __builtin_cpu_supports("x86-64-v3");
+        case 64:
+                return __builtin_cpu_supports("x86-64-v4");
+        default:
+                return true;
+        }
+}
+
+const struct vector_kernels *
+vector_kernels_widest(void)
+{
+        size_t i = vector_kernels_count;
+
+        while (i-- > 1) {
+                if (vector_kernels_supported(&vector_kernels[i]))
+                        break;
+        }
+
+        return &vector_kernels[i];
+}
+
+bool
+vector_avx2_supported(void)
+{
+
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") &&
+            __builtin_cpu_supports("popcnt");
+}
+
+/*
+ * Resolve each dispatcher on first call.  Racing threads all store
+ * the same pointer.
+ */
+#define DISPATCH(NAME)                                                  \
+        void                                                            \
+        NAME##_vec(struct filter_state *state)                          \
+        {                                                               \
+                static void (*fn)(struct filter_state *);               \
+                void (*impl)(struct filter_state *);                    \
+                                                                        \
+                impl = __atomic_load_n(&fn, __ATOMIC_RELAXED);          \
+                if (impl == NULL) {                                     \
+                        impl = vector_kernels_widest()->NAME;           \
+                        __atomic_store_n(&fn, impl, __ATOMIC_RELAXED);  \
+                }                                                       \
+                                                                        \
+                impl(state);                                            \
+                return;                                                 \
+        }
+
+DISPATCH(baseline)
+DISPATCH(fused_blocking)
+
+#pragma GCC pop_options
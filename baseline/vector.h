@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "interface.h"
+
+/**
+ * `baseline`, `fused_blocking` and the blocked engine's kernels
+ * (blocked.c), written once against a width-parametric vector type
+ * (vector_kernels.inc) and instantiated for each x86-64 vector
+ * extension.  Every instantiation carries its own target attribute,
+ * and the dispatcher is pinned to the x86-64 baseline, so this code
+ * only needs an x86-64 compiler, whatever the -march flags, and only
+ * calls instantiations the CPU supports.  `validate` and `fuzz` build
+ * vector.c, blocked.c, the planner and engine wrappers on top, the
+ * plain C they call, and themselves for the x86-64 baseline.
+ *
+ * Everything else assumes AVX2, and is built with an explicit
+ * `-mavx2 -mpopcnt` target instead of -march=native:
+ *  - the compiled VM, threaded and superinstruction handlers keep
+ *    their operands in __m256i registers, one set per handler;
+ *  - stitch.c copies AVX2 machine code from stitch_templates.S;
+ *  - the hand-written kernels, short-circuit, shared scan, roaring,
+ *    sink, range, incremental and subexpression cache code all run
+ *    kernels over __m256i streams and scratch;
+ *  - the ternlog methods also need AVX-512, and check for it at run
+ *    time;
+ *  - filter_state's ptrs[] and scratch are __m256i, so widening it
+ *    would touch every method at once.
+ * Code that may run elsewhere checks vector_avx2_supported() before
+ * calling into any of it: the engine table (query_engine_available)
+ * and the planner, whose only strategies there are blocked and the
+ * `*_vec` sample kernels.  Porting the rest means a copy of each
+ * handler, template or kernel per width.
+ *
+ * Kernels only see `count` as a length in bytes (32 * count), so the
+ * filter_state layout is the same for all widths.
+ */
+
+enum vector_blocked_op {
+        VECTOR_BLOCKED_COPY = 0,
+        VECTOR_BLOCKED_NOT,
+        VECTOR_BLOCKED_AND,
+        VECTOR_BLOCKED_OR,
+        VECTOR_BLOCKED_XOR,
+        VECTOR_BLOCKED_N_OPS
+};
+
+/* Blocks of 1, 2, 4 or 8 times BLOCK_SIZE. */
+#define VECTOR_BLOCKED_N_SCALES 4
+
+/* dst = x op y, for n __m256i; dst may be x. */
+typedef void vector_blocked_kernel_t(__m256i *dst, const __m256i *x,
+    const __m256i *y, size_t n);
+
+struct vector_kernels {
+        const char *name;
+        /* Vector width, in bytes. */
+        size_t width;
+        void (*baseline)(struct filter_state *);
+        void (*fused_blocking)(struct filter_state *);
+        /*
+         * Indexed by log2(block / BLOCK_SIZE) and op: unrolled for
+         * blocks of that many vectors.
+         */
+        vector_blocked_kernel_t *blocked[VECTOR_BLOCKED_N_SCALES][VECTOR_BLOCKED_N_OPS];
+};
+
+/*
+ * Sorted by increasing width: scalar, SSE2, AVX2 (x86-64-v3) and
+ * AVX-512 (x86-64-v4).
+ */
+extern const struct vector_kernels vector_kernels[];
+
+extern const size_t vector_kernels_count;
+
+bool vector_kernels_supported(const struct vector_kernels *);
+
+/**
+ * The widest instantiation the CPU supports.
+ */
+const struct vector_kernels *vector_kernels_widest(void);
+
+/**
+ * Whether the CPU runs the code built for AVX2 hosts, i.e., everything
+ * but the above.
+ */
+bool vector_avx2_supported(void);